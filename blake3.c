@@ -0,0 +1,276 @@
+/*
+ * blake3 -- the BLAKE3 hash. See blake3.h.
+ *
+ * After the reference implementation (github.com/BLAKE3-team/BLAKE3,
+ * reference_impl), without the SIMD kernels: one compression at a time.
+ */
+
+#include <string.h>
+#include "blake3.h"
+
+#define CHUNK_START 1
+#define CHUNK_END   2
+#define PARENT      4
+#define ROOT        8
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+/* the message words each round takes, in order: the permutation applied r times */
+static const uint8_t SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+/* what the last compression of a node takes; the CV or digest comes out of it */
+typedef struct
+{
+    uint32_t cv[8];
+    uint32_t m[16];
+    uint64_t counter;
+    uint32_t len;
+    uint32_t flags;
+} Node;
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+#define G(a, b, c, d, x, y) do { \
+    s[a] = s[a] + s[b] + (x); s[d] = rotr(s[d] ^ s[a], 16); \
+    s[c] = s[c] + s[d];       s[b] = rotr(s[b] ^ s[c], 12); \
+    s[a] = s[a] + s[b] + (y); s[d] = rotr(s[d] ^ s[a], 8);  \
+    s[c] = s[c] + s[d];       s[b] = rotr(s[b] ^ s[c], 7);  \
+} while (0)
+
+/* The first 8 words of the compression of m into cv. */
+static void compress(const uint32_t cv[8], const uint32_t m[16], uint64_t counter,
+                     uint32_t len, uint32_t flags, uint32_t out[8])
+{
+    uint32_t s[16];
+    const uint8_t *w;
+    int r, i;
+
+    memcpy(s, cv, 32);
+    memcpy(s + 8, IV, 16);
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = len;
+    s[15] = flags;
+    for (r = 0; r < 7; r++) {
+        w = SCHEDULE[r];
+        G(0, 4, 8, 12, m[w[0]], m[w[1]]);
+        G(1, 5, 9, 13, m[w[2]], m[w[3]]);
+        G(2, 6, 10, 14, m[w[4]], m[w[5]]);
+        G(3, 7, 11, 15, m[w[6]], m[w[7]]);
+        G(0, 5, 10, 15, m[w[8]], m[w[9]]);
+        G(1, 6, 11, 12, m[w[10]], m[w[11]]);
+        G(2, 7, 8, 13, m[w[12]], m[w[13]]);
+        G(3, 4, 9, 14, m[w[14]], m[w[15]]);
+    }
+    for (i = 0; i < 8; i++)
+        out[i] = s[i] ^ s[i + 8];
+}
+
+static void load_block(const uint8_t *b, uint32_t m[16])
+{
+    int i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = (uint32_t)b[4*i] | (uint32_t)b[4*i + 1] << 8 |
+               (uint32_t)b[4*i + 2] << 16 | (uint32_t)b[4*i + 3] << 24;
+}
+
+static void store_cv(const uint32_t w[8], uint8_t out[BLAKE3_OUT_LEN])
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        out[4*i] = (uint8_t)w[i];
+        out[4*i + 1] = (uint8_t)(w[i] >> 8);
+        out[4*i + 2] = (uint8_t)(w[i] >> 16);
+        out[4*i + 3] = (uint8_t)(w[i] >> 24);
+    }
+}
+
+static void parent_node(const uint32_t left[8], const uint32_t right[8], Node *n)
+{
+    memcpy(n->cv, IV, 32);
+    memcpy(n->m, left, 32);
+    memcpy(n->m + 8, right, 32);
+    n->counter = 0;
+    n->len = BLAKE3_BLOCK_LEN;
+    n->flags = PARENT;
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t out[8])
+{
+    Node n;
+
+    parent_node(left, right, &n);
+    compress(n.cv, n.m, n.counter, n.len, n.flags, out);
+}
+
+static size_t chunk_len(const Blake3 *h)
+{
+    return (size_t)h->blocks * BLAKE3_BLOCK_LEN + h->block_len;
+}
+
+static void chunk_start(Blake3 *h, uint64_t chunk)
+{
+    memcpy(h->cv, IV, 32);
+    h->chunk = chunk;
+    h->block_len = 0;
+    h->blocks = 0;
+}
+
+/* The last block of the chunk being hashed. */
+static void chunk_node(const Blake3 *h, Node *n)
+{
+    uint8_t block[BLAKE3_BLOCK_LEN];
+
+    memcpy(n->cv, h->cv, 32);
+    memset(block, 0, sizeof(block));
+    memcpy(block, h->block, h->block_len);
+    load_block(block, n->m);
+    n->counter = h->chunk;
+    n->len = h->block_len;
+    n->flags = CHUNK_END | (h->blocks == 0 ? CHUNK_START : 0);
+}
+
+/* Push the CV of a subtree that ends at chunk total (in units of its own
+ * size), merging it with the ones before it while they make a pair. */
+static void push(Blake3 *h, uint32_t cv[8], uint64_t total)
+{
+    while ((total & 1) == 0) {
+        parent_cv(h->stack[--h->stack_len], cv, cv);
+        total >>= 1;
+    }
+    memcpy(h->stack[h->stack_len++], cv, 32);
+}
+
+/* A full chunk, with more input to come: onto the stack with it. */
+static void chunk_done(Blake3 *h)
+{
+    uint32_t cv[8];
+    Node n;
+
+    chunk_node(h, &n);
+    compress(n.cv, n.m, n.counter, n.len, n.flags, cv);
+    push(h, cv, h->chunk + 1);
+    chunk_start(h, h->chunk + 1);
+}
+
+void blake3_init_at(Blake3 *h, uint64_t chunk)
+{
+    chunk_start(h, chunk);
+    h->stack_len = 0;
+}
+
+void blake3_init(Blake3 *h)
+{
+    blake3_init_at(h, 0);
+}
+
+void blake3_update(Blake3 *h, const void *in, size_t n)
+{
+    const uint8_t *p = in;
+    uint32_t m[16];
+    size_t take;
+
+    while (n > 0) {
+        if (chunk_len(h) == BLAKE3_CHUNK_LEN)
+            chunk_done(h);
+        if (h->block_len == BLAKE3_BLOCK_LEN) {
+            load_block(h->block, m);
+            compress(h->cv, m, h->chunk, BLAKE3_BLOCK_LEN, h->blocks == 0 ? CHUNK_START : 0, h->cv);
+            h->blocks++;
+            h->block_len = 0;
+        }
+        // whole blocks straight from the input, but never the chunk's last
+        while (h->block_len == 0 && n > BLAKE3_BLOCK_LEN && h->blocks < BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN - 1) {
+            load_block(p, m);
+            compress(h->cv, m, h->chunk, BLAKE3_BLOCK_LEN, h->blocks == 0 ? CHUNK_START : 0, h->cv);
+            h->blocks++;
+            p += BLAKE3_BLOCK_LEN;
+            n -= BLAKE3_BLOCK_LEN;
+        }
+        take = BLAKE3_BLOCK_LEN - h->block_len;
+        if (take > n)
+            take = n;
+        memcpy(h->block + h->block_len, p, take);
+        h->block_len += take;
+        p += take;
+        n -= take;
+    }
+}
+
+/* The node at the top of the tree: the chunk, then the stack folded onto it. */
+static void top_node(const Blake3 *h, Node *n)
+{
+    uint32_t cv[8];
+    int i;
+
+    chunk_node(h, n);
+    for (i = h->stack_len - 1; i >= 0; i--) {
+        compress(n->cv, n->m, n->counter, n->len, n->flags, cv);
+        parent_node(h->stack[i], cv, n);
+    }
+}
+
+void blake3_final(const Blake3 *h, uint8_t out[BLAKE3_OUT_LEN])
+{
+    uint32_t w[8];
+    Node n;
+
+    top_node(h, &n);
+    compress(n.cv, n.m, 0, n.len, n.flags | ROOT, w);
+    store_cv(w, out);
+}
+
+void blake3_cv(const Blake3 *h, uint8_t cv[BLAKE3_OUT_LEN])
+{
+    uint32_t w[8];
+    Node n;
+
+    top_node(h, &n);
+    compress(n.cv, n.m, n.counter, n.len, n.flags, w);
+    store_cv(w, cv);
+}
+
+void blake3_push_cv(Blake3 *h, const uint8_t cv[BLAKE3_OUT_LEN], uint64_t n)
+{
+    uint32_t w[8];
+    uint64_t next, total;
+    int i;
+
+    if (chunk_len(h) == BLAKE3_CHUNK_LEN)
+        chunk_done(h);
+    for (i = 0; i < 8; i++)
+        w[i] = (uint32_t)cv[4*i] | (uint32_t)cv[4*i + 1] << 8 |
+               (uint32_t)cv[4*i + 2] << 16 | (uint32_t)cv[4*i + 3] << 24;
+    next = h->chunk + n;
+    for (total = next; n > 1; n >>= 1)
+        total >>= 1;
+    push(h, w, total);
+    chunk_start(h, next);
+}
+
+uint64_t blake3_subtree_len(uint64_t chunk, uint64_t max)
+{
+    uint64_t n = 1;
+
+    if (max == 0)
+        return 0;
+    while (n <= max / 2 && (chunk & n) == 0)
+        n <<= 1;
+    return n;
+}
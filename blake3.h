@@ -0,0 +1,61 @@
+/*
+ * blake3 -- the BLAKE3 hash (256-bit output), portable C, with the pieces
+ * needed to hash one file on several threads.
+ *
+ * BLAKE3 splits its input into 1KB chunks and hashes them as the leaves of
+ * a binary tree, so any aligned run of chunks (2^k chunks starting at a
+ * multiple of 2^k) can be hashed on its own into a chaining value (CV), and
+ * the CVs put back together in order give the same digest as hashing the
+ * whole input in one go. To hash a file on n threads: hash the subtrees
+ * blake3_subtree_len() cuts the file into, each with
+ *   blake3_init_at(&h, first_chunk); blake3_update(...); blake3_cv(&h, cv);
+ * then, on one hasher in file order, blake3_push_cv() each CV and
+ * blake3_update() the rest; at least the last byte of the file has to go
+ * in through blake3_update(), for blake3_final() to see the root.
+ */
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_BLOCK_LEN 64
+
+typedef struct
+{
+    uint32_t cv[8];
+    uint64_t chunk;             /* the chunk being hashed */
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks;             /* blocks of the chunk already compressed */
+    uint8_t stack_len;
+    uint32_t stack[54][8];      /* CVs of the finished subtrees, largest first */
+} Blake3;
+
+void blake3_init(Blake3 *h);
+
+/* Start a subtree at chunk (for blake3_cv); chunk must be a multiple of
+ * the number of chunks it will cover. */
+void blake3_init_at(Blake3 *h, uint64_t chunk);
+
+void blake3_update(Blake3 *h, const void *in, size_t n);
+
+/* The digest of everything given to h. */
+void blake3_final(const Blake3 *h, uint8_t out[BLAKE3_OUT_LEN]);
+
+/* The CV of a subtree started with blake3_init_at() and given all of its
+ * (a power of two) chunks. */
+void blake3_cv(const Blake3 *h, uint8_t cv[BLAKE3_OUT_LEN]);
+
+/* Add the CV of the next n chunks (a power of two, aligned as for
+ * blake3_init_at) to h, which must be at a chunk boundary. More input must
+ * follow it. */
+void blake3_push_cv(Blake3 *h, const uint8_t cv[BLAKE3_OUT_LEN], uint64_t n);
+
+/* The most chunks, no more than max, a subtree starting at chunk can
+ * cover: the largest power of two that divides chunk and is <= max. */
+uint64_t blake3_subtree_len(uint64_t chunk, uint64_t max);
+
+#endif
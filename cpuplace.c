@@ -0,0 +1,235 @@
+/*
+ * cpuplace -- thread and buffer placement. See cpuplace.h.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "cpuplace.h"
+
+#define NODE_MAX 64
+#define PLACE_MAX 256
+
+typedef struct
+{
+    char role[16];
+    int index;
+    int pinned;             /* CPU, or -1 */
+    int first, last;        /* CPUs it was first and last seen on */
+    unsigned long seen, moves;
+} Place;
+
+static Place places[PLACE_MAX];
+static int n_places;
+static pthread_mutex_t place_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Place *mine;
+
+/* Add "0-3,8" to l. */
+static int parse_list(const char *s, CpuList *l)
+{
+    char *end;
+    long a, b;
+
+    while (*s != '\0' && *s != '\n') {
+        a = strtol(s, &end, 10);
+        if (end == s || a < 0)
+            return -1;
+        b = a;
+        s = end;
+        if (*s == '-') {
+            b = strtol(s + 1, &end, 10);
+            if (end == s + 1 || b < a)
+                return -1;
+            s = end;
+        }
+        for (; a <= b && l->n < CPU_LIST_MAX; a++)
+            l->cpu[l->n++] = (int)a;
+        if (*s == ',')
+            s++;
+        else if (*s != '\0' && *s != '\n')
+            return -1;
+    }
+    return 0;
+}
+
+static int node_cpus(int node, CpuList *l)
+{
+    char name[64], line[4096];
+    FILE *f;
+    int r;
+
+    snprintf(name, sizeof(name), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(name, "r");
+    if (f == NULL)
+        return -1;
+    r = fgets(line, sizeof(line), f) != NULL ? parse_list(line, l) : -1;
+    fclose(f);
+    return r;
+}
+
+static int cpu_node(int cpu)
+{
+    CpuList l;
+    int node, i;
+
+    if (cpu < 0)
+        return -1;
+    for (node = 0; node < NODE_MAX; node++) {
+        l.n = 0;
+        if (node_cpus(node, &l) < 0)
+            continue;
+        for (i = 0; i < l.n; i++)
+            if (l.cpu[i] == cpu)
+                return node;
+    }
+    return -1;
+}
+
+int cpu_dev_node(int fd)
+{
+    char name[64], path[PATH_MAX], *slash;
+    struct stat st;
+    FILE *f;
+    int node;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    snprintf(name, sizeof(name), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+    if (realpath(name, path) == NULL)
+        return -1;
+    // up from the partition or disk to the first device that knows its node
+    while ((slash = strrchr(path, '/')) != NULL && slash != path) {
+        if (strlen(path) + sizeof("/numa_node") <= sizeof(path)) {
+            strcat(path, "/numa_node");
+            f = fopen(path, "r");
+            *strrchr(path, '/') = '\0';
+            if (f != NULL) {
+                if (fscanf(f, "%d", &node) != 1)
+                    node = -1;
+                fclose(f);
+                if (node >= 0)
+                    return node;
+            }
+        }
+        *slash = '\0';
+    }
+    return -1;
+}
+
+int cpu_parse(const char *spec, int fd, CpuList *l)
+{
+    int node;
+
+    l->n = 0;
+    if (strcmp(spec, "hba") == 0) {
+        node = cpu_dev_node(fd);
+        if (node < 0) {
+            fprintf(stderr, "No NUMA node known for the archive's device; not pinning to it\n");
+            return 0;
+        }
+        return node_cpus(node, l);
+    }
+    if (strncmp(spec, "node", 4) == 0) {
+        node = atoi(spec + 4);
+        if (node_cpus(node, l) < 0) {
+            l->n = 0;
+            return -1;
+        }
+        return 0;
+    }
+    if (parse_list(spec, l) < 0) {
+        l->n = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int cpu_pin(const CpuList *l, const char *role, int i)
+{
+    cpu_set_t set;
+    Place *p = NULL;
+    int cpu = -1;
+
+    if (l != NULL && l->n > 0) {
+        cpu = l->cpu[i % l->n];
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Cannot pin %s %d to CPU %d\n", role, i, cpu);
+            cpu = -1;
+        }
+    }
+    pthread_mutex_lock(&place_lock);
+    if (n_places < PLACE_MAX)
+        p = &places[n_places++];
+    pthread_mutex_unlock(&place_lock);
+    if (p != NULL) {
+        snprintf(p->role, sizeof(p->role), "%s", role);
+        p->index = i;
+        p->pinned = cpu;
+        p->first = p->last = sched_getcpu();
+        p->seen = 1;
+        p->moves = 0;
+    }
+    mine = p;
+    return cpu;
+}
+
+void cpu_seen(void)
+{
+    int cpu;
+
+    if (mine == NULL)
+        return;
+    cpu = sched_getcpu();
+    mine->seen++;
+    if (cpu != mine->last) {
+        mine->moves++;
+        mine->last = cpu;
+    }
+}
+
+void *cpu_alloc_local(size_t n)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    char *p;
+    size_t i;
+
+    p = malloc(n);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i += page)
+        p[i] = 0;
+    return p;
+}
+
+void cpu_report(FILE *f)
+{
+    Place *p;
+    int i;
+
+    pthread_mutex_lock(&place_lock);
+    for (i = 0; i < n_places; i++) {
+        p = &places[i];
+        if (p->pinned >= 0)
+            fprintf(f, "placement: %s %d cpu %d node %d", p->role, p->index, p->pinned, cpu_node(p->pinned));
+        else
+            fprintf(f, "placement: %s %d unpinned", p->role, p->index);
+        fprintf(f, " (first cpu %d node %d, last cpu %d node %d, %lu moves in %lu samples)\n",
+                p->first, cpu_node(p->first), p->last, cpu_node(p->last), p->moves, p->seen);
+    }
+    pthread_mutex_unlock(&place_lock);
+}
@@ -0,0 +1,49 @@
+/*
+ * cpuplace -- which CPUs the threads of a fixity tool run on.
+ *
+ * A CPU list is given as
+ *   0-7,16-23     CPU numbers and ranges
+ *   node1         the CPUs of a NUMA node
+ *   hba           the CPUs of the node the archive's device is attached to
+ * Threads that register with cpu_pin() are pinned round-robin to the CPUs
+ * of a list (or left alone with an empty one). Memory a thread gets from
+ * cpu_alloc_local() is touched by that thread first, so the kernel puts it
+ * on that thread's node. cpu_report() prints where each registered thread
+ * ran and how often it was seen to move, for comparing runs with and
+ * without pinning.
+ */
+#ifndef CPUPLACE_H
+#define CPUPLACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define CPU_LIST_MAX 1024
+
+typedef struct
+{
+    int n;                  /* 0: do not pin */
+    int cpu[CPU_LIST_MAX];
+} CpuList;
+
+/* Fill l from spec; fd is the archive, for "hba". -1 if spec is bad, or
+ * names a node that cannot be found (l is then empty). */
+int cpu_parse(const char *spec, int fd, CpuList *l);
+
+/* NUMA node of the adapter behind fd's block device, or -1. */
+int cpu_dev_node(int fd);
+
+/* Register the calling thread as role number i and pin it to the i-th CPU
+ * of l (mod l->n). Returns the CPU, or -1 if it was not pinned. */
+int cpu_pin(const CpuList *l, const char *role, int i);
+
+/* Note the CPU the calling thread is on now (counts moves). */
+void cpu_seen(void);
+
+/* n bytes, first touched by the calling thread. */
+void *cpu_alloc_local(size_t n);
+
+/* One line per registered thread: role, pinned CPU, node, CPUs seen on. */
+void cpu_report(FILE *f);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * fixity_compare -- check the members read back from one archive file
+ * against the inode inventory.
+ *
+ * gcc -o fixity_compare fixity_compare.c fixity_table.c ledger.c outfmt.c
+ *
+ * Usage: fixity_compare [-c 1|2|3] [-a archive] [-m algo] [-g ledger] <prefix> <inventory-rows> [archive-rows]
+ *
+ * inventory-rows: print_csum_*_from_sls rows of the files in this archive
+ *                 file; -c is the copy whose offset column is used (default 1).
+ * archive-rows:   print_offset_cksum_from_tar output for it (default stdin).
+ *
+ * The two are joined on offset and the results appended to
+ *   <prefix>_data.txt               master.type|master.offset|master.md5|calc.md5|master.filename|calc.filename
+ *   <prefix>_calc.txt               the archive rows, under a "------------archive algo---" line
+ *   <prefix>_links.txt              inventory rows of symbolic links
+ *   <prefix>_emptyfiles.txt         inventory rows of zero length files
+ *   <prefix>_missing_checksums.txt  files with NO_CKSUM_IN_INODE
+ *   <prefix>_missing_files.txt      files not found in the archive file
+ *   <prefix>_bad_checksums.txt      filename|stored|calculated
+ *   <prefix>_renamed_files.txt      inode name -> archived name, NO_CKSUM_IN_INODE rows too
+ * (the last four under a "------------archive---------------" line), the
+ * same files runfixity_vsn.sh used to build with join, sort and diff.
+ * print_offset_cksum_from_tar -x writes the last six while it reads.
+ * -g also appends the result of each file to a ledger (ledger.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "outfmt.h"
+#include "fixity_table.h"
+
+FixReport report;
+OutBuf data_out;
+int data_fd;
+const char *archive = "";
+Ledger ledger;
+
+/* A field of the data table; join -e NULL stands in for empty ones. */
+static void data_field(const char *s, size_t n, int last)
+{
+    if (n == 0)
+        out_raw(&data_out, "NULL", 4);
+    else
+        out_raw(&data_out, s, n);
+    out_raw(&data_out, last ? "\n" : "|", 1);
+}
+
+static void compare(FixTable *master, FixTable *arc)
+{
+    size_t i;
+    FixRow *m, *c;
+    char num[24], *end;
+
+    for (i = 0; i < master->n; i++) {
+        m = &master->rows[i];
+        c = fix_find(arc, m->offset);
+        if (c != NULL)
+            c->seen = 1;
+
+        end = out_fmt_u64(num, m->offset);
+        data_field(m->line, 1, 0);
+        data_field(num, end - num, 0);
+        data_field(m->csum, m->csum_len, 0);
+        data_field(c ? c->csum : "", c ? c->csum_len : 0, 0);
+        data_field(m->name, m->name_len, 0);
+        data_field(c ? c->name : "", c ? c->name_len : 0, 1);
+
+        fix_report_row(&report, m, c);
+    }
+}
+
+/* Append-only text output for <prefix>_<what>.txt */
+static int open_list(OutBuf *ob, const char *prefix, const char *what)
+{
+    char name[4096];
+    int fd;
+
+    snprintf(name, sizeof(name), "%s_%s.txt", prefix, what);
+    fd = open(name, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    out_init_size(ob, fd, OUT_TEXT, 65536);
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, copy = 1, fd;
+    const char *algo = "";
+    const char *prefix;
+    const char *ledger_path = NULL;
+    FixTable master, arc;
+    OutBuf calc_out;
+    static const int kinds[4] = {FIX_DK, FIX_DK, FIX_LI2, FIX_LI3};
+
+    while ((opt = getopt(argc, argv, "c:a:m:g:")) != -1) {
+        switch (opt) {
+            case 'c':
+                copy = atoi(optarg);
+                if (copy < 1 || copy > 3) {
+                    fprintf(stderr, "Copy \"%s\" is out of range [1-3]\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                archive = optarg;
+                break;
+            case 'm':
+                algo = optarg;
+                break;
+            case 'g':
+                ledger_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c 1|2|3] [-a archive] [-m algo] [-g ledger] <prefix> <inventory-rows> [archive-rows]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-c 1|2|3] [-a archive] [-m algo] [-g ledger] <prefix> <inventory-rows> [archive-rows]\n", argv[0]);
+        exit(1);
+    }
+    prefix = argv[optind];
+
+    fix_init(&master, kinds[copy]);
+    fd = open(argv[optind+1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", argv[optind+1], strerror(errno));
+        exit(1);
+    }
+    fix_load(&master, fd, argv[optind+1]);
+    close(fd);
+
+    fix_init(&arc, FIX_TAR);
+    fd = STDIN_FILENO;
+    if (argc - optind > 2 && strcmp(argv[optind+2], "-") != 0) {
+        fd = open(argv[optind+2], O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[optind+2], strerror(errno));
+            exit(1);
+        }
+    }
+    fix_load(&arc, fd, "archive rows");
+
+    /* the archive rows as they were read, for reference */
+    fd = open_list(&calc_out, prefix, "calc");
+    out_raw(&calc_out, "------------", 12);
+    out_raw(&calc_out, archive, strlen(archive));
+    out_raw(&calc_out, " ", 1);
+    out_raw(&calc_out, algo, strlen(algo));
+    out_raw(&calc_out, "-----------------\n", 18);
+    out_raw(&calc_out, arc.text, arc.text_len);
+    if (arc.text_len == 0 || arc.text[arc.text_len-1] != '\n')
+        out_raw(&calc_out, "\n", 1);
+    out_free(&calc_out);
+    close(fd);
+
+    data_fd = open_list(&data_out, prefix, "data");
+    fix_report_open(&report, prefix, archive);
+    if (ledger_path != NULL) {
+        ledger_open(&ledger, ledger_path);
+        fix_report_ledger(&report, &ledger, kinds[copy], algo);
+    }
+    fix_sort(&master);
+    fix_index(&arc);
+    compare(&master, &arc);
+    fix_report_close(&report);
+    if (ledger_path != NULL)
+        ledger_close(&ledger);
+    out_free(&data_out);
+    close(data_fd);
+
+    fix_free(&master);
+    fix_free(&arc);
+    return 0;
+}
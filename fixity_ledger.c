@@ -0,0 +1,369 @@
+/*
+ * fixity_ledger -- what the fixity ledger says about each file copy.
+ *
+ * gcc -o fixity_ledger fixity_ledger.c ledger.c
+ *
+ * Usage: fixity_ledger [-c 1|2|3] [-v vsn] [-p path] [-s days] [-H] <ledger>
+ *        fixity_ledger -X 2|3 [-p path] [-t since] <ledger>
+ *        fixity_ledger -C <ledger>
+ *
+ * One line for each file copy in the ledger (ledger.h), by copy, VSN,
+ * archive file and offset:
+ *   copy|vsn|archive|offset|size|last checked|result|last good|algo|checksum|filename
+ * archive is the disk archive file (d2/f11) or the hex tape position, the
+ * times are local (YYYY-MM-DD HH:MM:SS; "never" if it was never found good)
+ * and the checksum is the one worked out at the last check.
+ *
+ * -c, -v and -p (the start of the file name) choose which copies; -s only
+ * those fixity_plan -s would read again: not checked in the last <days>
+ * days, or not found good (or, with no inode checksum, read whole) at the
+ * last check.
+ * -H lists every check of them instead, in the order they were made:
+ *   copy|vsn|archive|offset|size|checked|result|algo|checksum|filename
+ * -C rewrites the ledger with only the last check and the last good check
+ * of each file copy, which is all -s and fixity_plan look at.
+ *
+ * -X compares copy 1 of each file with its copy 2 (or 3): the last check of
+ * each, joined on the file name, for the files checked (either copy) since
+ * <since> (seconds since the epoch; runfixity.sh -x gives the start of the
+ * run). One line for each file whose copies do not agree:
+ *   what|filename|copy 1 checksum|copy N checksum
+ * what is "copy N bad" (copy 1 matched the inode and copy N did not, or the
+ * other way round), "copies differ" (neither matched, or the inode has no
+ * checksum), "inode differs" (the copies agree with each other but not with
+ * the inode), "copy N missing" ("copies missing"), "copy N not checked" or
+ * "not comparable" (checked with different algorithms); a checksum is "-"
+ * if there is none. The counts go to stderr.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include "ledger.h"
+
+int copy, xcopy;
+const char *vsn, *path;
+size_t path_len;
+double days = -1;
+time_t good_since;
+
+static const char *when(int64_t t, char *buf, size_t n)
+{
+    time_t tt = t;
+    struct tm tm;
+
+    localtime_r(&tt, &tm);
+    strftime(buf, n, "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
+}
+
+static void print_md(const LedgerRec *r)
+{
+    int i;
+
+    for (i = 0; i < r->md_len; i++)
+        printf("%02x", r->md[i]);
+}
+
+static int wanted(const LedgerRec *r)
+{
+    if (copy != 0 && r->copy != copy)
+        return 0;
+    if (vsn != NULL && strcmp(r->vsn, vsn) != 0)
+        return 0;
+    if (path != NULL && (r->name_len < path_len || memcmp(ledger_name(r), path, path_len) != 0))
+        return 0;
+    return 1;
+}
+
+/* Copy, VSN, archive file (tape positions as numbers), offset. */
+static int entry_compare(const void *a, const void *b)
+{
+    const LedgerRec *ra = (*(const LedgerEntry **)a)->last, *rb = (*(const LedgerEntry **)b)->last;
+    uint64_t pa, pb;
+    int d;
+
+    if (ra->copy != rb->copy)
+        return ra->copy - rb->copy;
+    if ((d = strcmp(ra->vsn, rb->vsn)) != 0)
+        return d;
+    if (ra->copy == 1) {
+        if ((d = strverscmp(ra->arc, rb->arc)) != 0)
+            return d;
+    }
+    else {
+        pa = strtoull(ra->arc, NULL, 16);
+        pb = strtoull(rb->arc, NULL, 16);
+        if (pa != pb)
+            return (pa > pb) - (pa < pb);
+    }
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+static void list_last(LedgerMap *m)
+{
+    const LedgerEntry **list;
+    const LedgerRec *r;
+    size_t i, n = 0;
+    char t1[32], t2[32];
+
+    list = malloc(sizeof(LedgerEntry *)*(m->n_keys + 1));
+    if (list == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; m->slots != NULL && i <= m->mask; i++) {
+        if (m->slots[i].last == NULL || !wanted(m->slots[i].last))
+            continue;
+        if (days >= 0 && ledger_fresh(&m->slots[i], good_since))
+            continue;
+        list[n++] = &m->slots[i];
+    }
+    qsort(list, n, sizeof(LedgerEntry *), entry_compare);
+    for (i = 0; i < n; i++) {
+        r = list[i]->last;
+        printf("%d|%s|%s|%" PRIu64 "|%" PRIu64 "|%s|%s|%s|%s|", r->copy, r->vsn, r->arc, r->offset, r->size,
+               when(r->when, t1, sizeof(t1)), ledger_result_name(r->result),
+               list[i]->good ? when(list[i]->good->when, t2, sizeof(t2)) : "never", r->algo);
+        print_md(r);
+        printf("|%.*s\n", (int)r->name_len, ledger_name(r));
+    }
+    free(list);
+}
+
+static void list_all(LedgerMap *m)
+{
+    const LedgerRec *r;
+    const LedgerEntry *e;
+    char t[32];
+
+    for (r = ledger_next(m, NULL); r != NULL; r = ledger_next(m, r)) {
+        if (!wanted(r))
+            continue;
+        if (days >= 0) {
+            e = ledger_find(m, r->copy, r->vsn, r->arc, r->offset, r->size);
+            if (ledger_fresh(e, good_since))
+                continue;
+        }
+        printf("%d|%s|%s|%" PRIu64 "|%" PRIu64 "|%s|%s|%s|", r->copy, r->vsn, r->arc, r->offset, r->size,
+               when(r->when, t, sizeof(t)), ledger_result_name(r->result), r->algo);
+        print_md(r);
+        printf("|%.*s\n", (int)r->name_len, ledger_name(r));
+    }
+}
+
+/* File name, then copy, then oldest first. */
+static int cross_compare(const void *a, const void *b)
+{
+    const LedgerRec *ra = *(const LedgerRec **)a, *rb = *(const LedgerRec **)b;
+    size_t n = ra->name_len < rb->name_len ? ra->name_len : rb->name_len;
+    int d;
+
+    if ((d = memcmp(ledger_name(ra), ledger_name(rb), n)) != 0)
+        return d;
+    if (ra->name_len != rb->name_len)
+        return (ra->name_len > rb->name_len) - (ra->name_len < rb->name_len);
+    if (ra->copy != rb->copy)
+        return ra->copy - rb->copy;
+    return (ra->when > rb->when) - (ra->when < rb->when);
+}
+
+static int same_name(const LedgerRec *a, const LedgerRec *b)
+{
+    return a->name_len == b->name_len && memcmp(ledger_name(a), ledger_name(b), a->name_len) == 0;
+}
+
+/* Whether the two copies' digests can be told apart at all. */
+static int comparable(const LedgerRec *a, const LedgerRec *b)
+{
+    return a->md_len > 0 && b->md_len > 0 && strncmp(a->algo, b->algo, sizeof(a->algo)) == 0;
+}
+
+/* What is wrong between copy 1 (a) and copy N (b) of a file, or NULL if nothing. */
+static const char *disagreement(const LedgerRec *a, const LedgerRec *b, char *buf, size_t n)
+{
+    if (a == NULL || b == NULL) {
+        snprintf(buf, n, "copy %d not checked", a == NULL ? 1 : xcopy);
+        return buf;
+    }
+    if (a->result == LEDGER_MISSING || b->result == LEDGER_MISSING) {
+        if (a->result == b->result)
+            snprintf(buf, n, "copies missing");
+        else
+            snprintf(buf, n, "copy %d missing", a->result == LEDGER_MISSING ? 1 : xcopy);
+        return buf;
+    }
+    if (a->result == LEDGER_GOOD && b->result == LEDGER_GOOD)
+        return NULL;
+    if (a->result == LEDGER_GOOD || b->result == LEDGER_GOOD) {
+        snprintf(buf, n, "copy %d bad", a->result == LEDGER_GOOD ? xcopy : 1);
+        return buf;
+    }
+    // both BAD, or no inode checksum: only the digests can say
+    if (!comparable(a, b))
+        return "not comparable";
+    if (a->md_len != b->md_len || memcmp(a->md, b->md, a->md_len) != 0)
+        return "copies differ";
+    return (a->result == LEDGER_BAD) ? "inode differs" : NULL;
+}
+
+static void print_cross(const char *what, const LedgerRec *a, const LedgerRec *b)
+{
+    const LedgerRec *r = a ? a : b;
+
+    printf("%s|%.*s|", what, (int)r->name_len, ledger_name(r));
+    if (a != NULL && a->md_len > 0)
+        print_md(a);
+    else
+        printf("-");
+    printf("|");
+    if (b != NULL && b->md_len > 0)
+        print_md(b);
+    else
+        printf("-");
+    printf("\n");
+}
+
+static void cross_check(const LedgerMap *m, time_t since)
+{
+    const LedgerRec **list, *r, *a, *b;
+    size_t i, j, n = 0;
+    unsigned long both = 0, agree = 0, uncomparable = 0, one = 0;
+    const char *what;
+    char buf[32];
+    int recent;
+
+    for (r = ledger_next(m, NULL); r != NULL; r = ledger_next(m, r))
+        n++;
+    list = malloc(sizeof(LedgerRec *)*(n + 1));
+    if (list == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    n = 0;
+    for (r = ledger_next(m, NULL); r != NULL; r = ledger_next(m, r))
+        if ((r->copy == 1 || r->copy == xcopy) && wanted(r))
+            list[n++] = r;
+    qsort(list, n, sizeof(LedgerRec *), cross_compare);
+
+    for (i = 0; i < n; i = j) {
+        a = b = NULL;
+        recent = 0;
+        for (j = i; j < n && same_name(list[j], list[i]); j++) {
+            // oldest first: the last one of each copy wins
+            if (list[j]->copy == 1)
+                a = list[j];
+            else
+                b = list[j];
+            if (list[j]->when >= since)
+                recent = 1;
+        }
+        if (!recent)
+            continue;
+        if (a != NULL && b != NULL)
+            both++;
+        else
+            one++;
+        what = disagreement(a, b, buf, sizeof(buf));
+        if (what == NULL)
+            agree++;
+        else {
+            if (strcmp(what, "not comparable") == 0)
+                uncomparable++;
+            print_cross(what, a, b);
+        }
+    }
+    fprintf(stderr, "%lu files checked on both copies, %lu of them agree, %lu not comparable;"
+            " %lu checked on one copy only (copy not checked)\n",
+            both, agree, uncomparable, one);
+    free(list);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c 1|2|3] [-v vsn] [-p path] [-s days] [-H] <ledger>\n", prog);
+    fprintf(stderr, "       %s -X 2|3 [-p path] [-t since] <ledger>\n", prog);
+    fprintf(stderr, "       %s -C <ledger>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, history = 0, compact = 0;
+    unsigned long kept, total;
+    time_t since = 0;
+    LedgerMap m;
+
+    while ((opt = getopt(argc, argv, "c:v:p:s:HCX:t:")) != -1) {
+        switch (opt) {
+            case 'c':
+                copy = atoi(optarg);
+                if (copy < 1 || copy > 3) {
+                    fprintf(stderr, "Copy \"%s\" is out of range [1-3]\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'v':
+                vsn = optarg;
+                break;
+            case 'p':
+                path = optarg;
+                path_len = strlen(path);
+                break;
+            case 's':
+                days = atof(optarg);
+                if (days < 0) {
+                    fprintf(stderr, "Days (%s) must not be negative\n", optarg);
+                    exit(1);
+                }
+                good_since = time(NULL) - (time_t)(days*86400);
+                break;
+            case 'H':
+                history = 1;
+                break;
+            case 'C':
+                compact = 1;
+                break;
+            case 'X':
+                xcopy = atoi(optarg);
+                if (xcopy < 2 || xcopy > 3) {
+                    fprintf(stderr, "Copy \"%s\" is out of range [2-3]\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                since = strtoll(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    if (compact) {
+        kept = ledger_compact(argv[optind], &total);
+        fprintf(stderr, "%s: kept %lu of %lu records\n", argv[optind], kept, total);
+        return 0;
+    }
+
+    ledger_map(&m, argv[optind]);
+    if (xcopy != 0) {
+        cross_check(&m, since);
+        ledger_unmap(&m);
+        return 0;
+    }
+    ledger_index(&m);
+    if (history)
+        list_all(&m);
+    else
+        list_last(&m);
+    ledger_unmap(&m);
+    return 0;
+}
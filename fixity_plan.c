@@ -0,0 +1,548 @@
+/*
+ * fixity_plan -- read archive_audit output once and plan the fixity jobs.
+ *
+ * gcc -o fixity_plan fixity_plan.c ledger.c -L /opt/vsm/lib -lsam -lvsm
+ *
+ * Usage: fixity_plan [-d logdir] [-v vsn] [-j dk-parts] [-c media:MBps:secs]... [-a algo[:MBps]] [-w workers] [-g ledger -s days] <all_archive_audit.txt>
+ *
+ * For each VSN it writes <logdir>/<vsn>-positions.txt, one line per archive
+ * file in position order:
+ *   count hexpos dkpath bytes
+ * (dkpath is the disk archive file, e.g. d2/f11, or for tape the decimal
+ * position), and one line per job to <logdir>/plan.txt, costliest first:
+ *   vsn part nfiles narcs bytes cost positions-file
+ * A disk VSN with more than one archive file is split into up to -j parts
+ * (default 1) of about equal bytes, each with its own positions file
+ * (<vsn>-positions.txt.<part>); part is "-" for a job that was not split.
+ *
+ * cost is the predicted run time in seconds: bytes at the media's read rate
+ * plus a fixed time per archive file (open, or tape request and position)
+ * plus a little per file. -c sets the rate and the per-archive time:
+ *   -c dk:400:0.1 -c li:250:45      (the defaults)
+ * If hashing is slower than reading, the bytes take the hash time instead:
+ * -w workers (default 4, as print_offset_cksum_from_tar -j) at the rate of
+ * one core for the algorithm -a (md5, sha1, sha256, sha512 or blake3;
+ * default md5), or the MB/s given with it. MD5 and the SHAs hash each file
+ * on one worker, so a job's biggest file takes at least its size at one
+ * core's rate; BLAKE3 shares a file out among all of them.
+ *
+ * -g ledger -s days leaves out each archive file whose every file the
+ * ledger (ledger.h) has as checked, this copy, in the last <days> days and
+ * found good (or read whole, for a file with no inode checksum) at its last
+ * check, and says how much that was on stderr.
+ *
+ * archive_audit fields used: 1 media, 2 vsn, 3 copy, 6 hexpos.hexoffset, 7 size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include "vsm/stat.h"
+#include <vsm/diskvols.h>
+#include "/opt/vsm/include/lib.h"
+#include "ledger.h"
+
+#define FILE_SECS 0.001
+#define WORKERS 4
+
+typedef struct
+{
+    uint64_t pos;
+    uint64_t bytes;
+    uint64_t biggest;       /* largest file */
+    unsigned long count;
+    int part;
+    int fresh;              /* ledger_fresh() since fresh_since */
+} Pos;
+
+typedef struct
+{
+    char media[8];
+    char vsn[32];
+    Pos *files;             /* one per audit line, then one per position */
+    size_t n;
+    size_t cap;
+    unsigned long nfiles;
+    uint64_t bytes;
+    uint64_t biggest;
+} Vsn;
+
+typedef struct
+{
+    Vsn *v;
+    int part;               /* -1: not split */
+    unsigned long nfiles;
+    unsigned long narcs;
+    uint64_t bytes;
+    uint64_t biggest;
+    double cost;
+} Job;
+
+typedef struct
+{
+    char media[8];
+    double mbps;
+    double arc_secs;
+} Media;
+
+Vsn *vsns;
+size_t n_vsns, vsns_cap;
+Media medias[8] = {{"dk", 400, 0.1}, {"li", 250, 45}};
+int n_medias = 2;
+
+typedef struct
+{
+    const char *name;
+    double mbps;            /* one core */
+    int tree;               /* a file is hashed on all the workers */
+} Algo;
+
+Algo algos[] = {{"md5", 600, 0}, {"sha1", 800, 0}, {"sha256", 300, 0}, {"sha512", 500, 0}, {"blake3", 250, 1}};
+Algo *algo = &algos[0];
+int workers = WORKERS;
+
+/* -g, -s */
+LedgerMap ledger;
+const char *ledger_path;
+time_t fresh_since;
+unsigned long skipped_arcs, skipped_files;
+uint64_t skipped_bytes;
+
+static Vsn *find_vsn(const char *media, const char *vsn)
+{
+    size_t i;
+
+    /* archive_audit lists a VSN's files together: try the last one first */
+    if (n_vsns > 0 && strcmp(vsns[n_vsns-1].vsn, vsn) == 0 && strcmp(vsns[n_vsns-1].media, media) == 0)
+        return &vsns[n_vsns-1];
+    for (i = 0; i < n_vsns; i++)
+        if (strcmp(vsns[i].vsn, vsn) == 0 && strcmp(vsns[i].media, media) == 0)
+            return &vsns[i];
+
+    if (n_vsns == vsns_cap) {
+        vsns_cap = vsns_cap ? vsns_cap*2 : 64;
+        vsns = realloc(vsns, sizeof(Vsn)*vsns_cap);
+        if (vsns == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memset(&vsns[n_vsns], 0, sizeof(Vsn));
+    snprintf(vsns[n_vsns].media, sizeof(vsns[0].media), "%s", media);
+    snprintf(vsns[n_vsns].vsn, sizeof(vsns[0].vsn), "%s", vsn);
+    return &vsns[n_vsns++];
+}
+
+static Media *find_media(const char *media)
+{
+    int i;
+
+    for (i = 0; i < n_medias; i++)
+        if (strcmp(medias[i].media, media) == 0)
+            return &medias[i];
+    return &medias[0];
+}
+
+/* media:MBps:secs */
+static void set_media(const char *arg)
+{
+    char name[8];
+    double mbps, secs;
+    Media *m;
+
+    if (sscanf(arg, "%7[^:]:%lf:%lf", name, &mbps, &secs) != 3 || mbps <= 0) {
+        fprintf(stderr, "Expected media:MBps:secs, got '%s'\n", arg);
+        exit(1);
+    }
+    for (m = medias; m < medias + n_medias; m++)
+        if (strcmp(m->media, name) == 0)
+            break;
+    if (m == medias + n_medias) {
+        if (n_medias == 8) {
+            fprintf(stderr, "Too many media types\n");
+            exit(1);
+        }
+        n_medias++;
+    }
+    strcpy(m->media, name);
+    m->mbps = mbps;
+    m->arc_secs = secs;
+}
+
+/* algo[:MBps] */
+static void set_algo(const char *arg)
+{
+    char name[16];
+    double mbps = 0;
+    size_t i;
+
+    if (sscanf(arg, "%15[^:]:%lf", name, &mbps) < 1 || mbps < 0) {
+        fprintf(stderr, "Expected algo[:MBps], got '%s'\n", arg);
+        exit(1);
+    }
+    for (i = 0; i < sizeof(algos)/sizeof(algos[0]); i++)
+        if (strcasecmp(algos[i].name, name) == 0)
+            break;
+    if (i == sizeof(algos)/sizeof(algos[0])) {
+        fprintf(stderr, "Unknown algorithm '%s' (md5|sha1|sha256|sha512|blake3)\n", name);
+        exit(1);
+    }
+    algo = &algos[i];
+    if (mbps > 0)
+        algo->mbps = mbps;
+}
+
+/* Seconds to read and hash a job's bytes: whichever is slower. */
+static double data_secs(const Job *j, const Media *m)
+{
+    double read = j->bytes/(m->mbps*1e6);
+    double hash = j->bytes/(algo->mbps*1e6*workers);
+
+    if (!algo->tree && j->biggest/(algo->mbps*1e6) > hash)
+        hash = j->biggest/(algo->mbps*1e6);
+    return (read > hash) ? read : hash;
+}
+
+static int pos_compare(const void *a, const void *b)
+{
+    const Pos *pa = a, *pb = b;
+
+    return (pa->pos > pb->pos) - (pa->pos < pb->pos);
+}
+
+static int bytes_compare(const void *a, const void *b)
+{
+    const Pos *pa = a, *pb = b;
+
+    return (pa->bytes < pb->bytes) - (pa->bytes > pb->bytes);
+}
+
+static int job_compare(const void *a, const void *b)
+{
+    const Job *ja = a, *jb = b;
+
+    return (ja->cost < jb->cost) - (ja->cost > jb->cost);
+}
+
+/* Whether the ledger has the file at p (its one audit line) as fresh
+ * (ledger_fresh) since fresh_since. posoff is the audit's hexpos.hexoffset. */
+static int is_fresh(const Vsn *v, int copy, const char *posoff, const Pos *p)
+{
+    const LedgerEntry *e;
+    const char *dot;
+    char arc[256];
+    uint64_t offset = 0;
+
+    if (ledger_path == NULL)
+        return 0;
+    dot = strchr(posoff, '.');
+    if (dot != NULL)
+        offset = strtoull(dot + 1, NULL, 16);
+    if (strcmp(v->media, "dk") == 0)
+        DiskVolsGenFileName(p->pos, arc, sizeof(arc));
+    else
+        snprintf(arc, sizeof(arc), "%" PRIx64, p->pos);
+    e = ledger_find(&ledger, copy, v->vsn, arc, offset, p->bytes);
+    return ledger_fresh(e, fresh_since);
+}
+
+/* Read the audit, one Pos per line. */
+static void read_audit(const char *name, const char *only)
+{
+    FILE *f;
+    char *line = NULL, *field[7], *p, *save;
+    size_t len = 0;
+    int k;
+    Vsn *v;
+
+    f = fopen(name, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    while (getline(&line, &len, f) > 0) {
+        for (k = 0, p = strtok_r(line, " \t\n", &save); p != NULL && k < 7; p = strtok_r(NULL, " \t\n", &save))
+            field[k++] = p;
+        if (k < 7)
+            continue;
+        if (only != NULL && strcmp(field[1], only) != 0)
+            continue;
+
+        v = find_vsn(field[0], field[1]);
+        if (v->n == v->cap) {
+            v->cap = v->cap ? v->cap*2 : 1024;
+            v->files = realloc(v->files, sizeof(Pos)*v->cap);
+            if (v->files == NULL) {
+                fprintf(stderr, "Out of memory reading %s\n", name);
+                exit(1);
+            }
+        }
+        v->files[v->n].pos = strtoull(field[5], NULL, 16);
+        v->files[v->n].bytes = strtoull(field[6], NULL, 10);
+        v->files[v->n].biggest = v->files[v->n].bytes;
+        v->files[v->n].count = 1;
+        v->files[v->n].part = 0;
+        v->files[v->n].fresh = is_fresh(v, atoi(field[2]), field[5], &v->files[v->n]);
+        v->nfiles++;
+        v->bytes += v->files[v->n].bytes;
+        if (v->files[v->n].bytes > v->biggest)
+            v->biggest = v->files[v->n].bytes;
+        v->n++;
+    }
+    free(line);
+    fclose(f);
+}
+
+/* Sort a VSN's files by position and fold them into one Pos per archive file. */
+static void fold_positions(Vsn *v)
+{
+    size_t i, n = 0;
+
+    qsort(v->files, v->n, sizeof(Pos), pos_compare);
+    for (i = 0; i < v->n; i++) {
+        if (n > 0 && v->files[n-1].pos == v->files[i].pos) {
+            v->files[n-1].count++;
+            v->files[n-1].bytes += v->files[i].bytes;
+            if (v->files[i].biggest > v->files[n-1].biggest)
+                v->files[n-1].biggest = v->files[i].biggest;
+            v->files[n-1].fresh &= v->files[i].fresh;
+        }
+        else
+            v->files[n++] = v->files[i];
+    }
+    v->n = n;
+}
+
+/* Leave out the archive files the ledger has as good throughout. */
+static void drop_fresh(Vsn *v)
+{
+    size_t i, n = 0;
+
+    v->nfiles = 0;
+    v->bytes = 0;
+    v->biggest = 0;
+    for (i = 0; i < v->n; i++) {
+        if (v->files[i].fresh) {
+            skipped_arcs++;
+            skipped_files += v->files[i].count;
+            skipped_bytes += v->files[i].bytes;
+            continue;
+        }
+        v->files[n++] = v->files[i];
+        v->nfiles += v->files[i].count;
+        v->bytes += v->files[i].bytes;
+        if (v->files[i].biggest > v->biggest)
+            v->biggest = v->files[i].biggest;
+    }
+    v->n = n;
+}
+
+static void write_positions(Vsn *v, const char *dir, int part, char *name, size_t name_sz)
+{
+    FILE *f;
+    size_t i;
+    char dkname[256];
+
+    if (part < 0)
+        snprintf(name, name_sz, "%s/%s-positions.txt", dir, v->vsn);
+    else
+        snprintf(name, name_sz, "%s/%s-positions.txt.%d", dir, v->vsn, part);
+    f = fopen(name, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < v->n; i++) {
+        if (part >= 0 && v->files[i].part != part)
+            continue;
+        if (strcmp(v->media, "dk") == 0)
+            DiskVolsGenFileName(v->files[i].pos, dkname, sizeof(dkname));
+        else
+            snprintf(dkname, sizeof(dkname), "%" PRIu64, v->files[i].pos);
+        fprintf(f, "%lu %" PRIx64 " %s %" PRIu64 "\n",
+                v->files[i].count, v->files[i].pos, dkname, v->files[i].bytes);
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * Deal a VSN's archive files out to parts, largest first, each to the part
+ * with the fewest bytes so far.
+ */
+static int split(Vsn *v, int max_parts, Job *jobs)
+{
+    int parts = (v->n < (size_t)max_parts) ? (int)v->n : max_parts;
+    size_t i;
+    int p, best;
+
+    qsort(v->files, v->n, sizeof(Pos), bytes_compare);
+    for (p = 0; p < parts; p++) {
+        memset(&jobs[p], 0, sizeof(Job));
+        jobs[p].v = v;
+        jobs[p].part = p;
+    }
+    for (i = 0; i < v->n; i++) {
+        for (best = 0, p = 1; p < parts; p++)
+            if (jobs[p].bytes < jobs[best].bytes)
+                best = p;
+        v->files[i].part = best;
+        jobs[best].bytes += v->files[i].bytes;
+        jobs[best].nfiles += v->files[i].count;
+        jobs[best].narcs++;
+        if (v->files[i].biggest > jobs[best].biggest)
+            jobs[best].biggest = v->files[i].biggest;
+    }
+    qsort(v->files, v->n, sizeof(Pos), pos_compare);
+    return parts;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, max_parts = 1, parts, p;
+    double days = -1;
+    const char *dir = ".", *only = NULL;
+    size_t i, n_jobs = 0;
+    Job *jobs;
+    Media *m;
+    FILE *plan;
+    char name[PATH_MAX];
+
+    while ((opt = getopt(argc, argv, "d:v:j:c:a:w:g:s:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'v':
+                only = optarg;
+                break;
+            case 'j':
+                max_parts = atoi(optarg);
+                if (max_parts < 1) {
+                    fprintf(stderr, "Number of parts (%s) must be at least 1\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                set_media(optarg);
+                break;
+            case 'a':
+                set_algo(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    fprintf(stderr, "Number of hash workers (%s) must be at least 1\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'g':
+                ledger_path = optarg;
+                break;
+            case 's':
+                days = atof(optarg);
+                if (days < 0) {
+                    fprintf(stderr, "Days (%s) must not be negative\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d logdir] [-v vsn] [-j dk-parts] [-c media:MBps:secs]... [-a algo[:MBps]] [-w workers] [-g ledger -s days] <all_archive_audit.txt>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-d logdir] [-v vsn] [-j dk-parts] [-c media:MBps:secs]... [-a algo[:MBps]] [-w workers] [-g ledger -s days] <all_archive_audit.txt>\n", argv[0]);
+        exit(1);
+    }
+    if ((ledger_path == NULL) != (days < 0)) {
+        fprintf(stderr, "-g ledger and -s days go together\n");
+        exit(1);
+    }
+    if (ledger_path != NULL) {
+        ledger_map(&ledger, ledger_path);
+        ledger_index(&ledger);
+        fresh_since = time(NULL) - (time_t)(days*86400);
+    }
+    read_audit(argv[optind], only);
+
+    jobs = calloc(n_vsns*max_parts + 1, sizeof(Job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n_vsns; i++) {
+        Vsn *v = &vsns[i];
+
+        fold_positions(v);
+        if (ledger_path != NULL) {
+            drop_fresh(v);
+            if (v->n == 0)
+                continue;
+        }
+        /* the whole VSN's list is written either way */
+        write_positions(v, dir, -1, name, sizeof(name));
+        if (strcmp(v->media, "dk") == 0 && max_parts > 1 && v->n > 1) {
+            parts = split(v, max_parts, jobs + n_jobs);
+            for (p = 0; p < parts; p++)
+                write_positions(v, dir, p, name, sizeof(name));
+            n_jobs += parts;
+        }
+        else {
+            jobs[n_jobs].v = v;
+            jobs[n_jobs].part = -1;
+            jobs[n_jobs].nfiles = v->nfiles;
+            jobs[n_jobs].narcs = v->n;
+            jobs[n_jobs].bytes = v->bytes;
+            jobs[n_jobs].biggest = v->biggest;
+            n_jobs++;
+        }
+    }
+
+    for (i = 0; i < n_jobs; i++) {
+        m = find_media(jobs[i].v->media);
+        jobs[i].cost = data_secs(&jobs[i], m) + jobs[i].narcs*m->arc_secs + jobs[i].nfiles*FILE_SECS;
+    }
+    qsort(jobs, n_jobs, sizeof(Job), job_compare);
+
+    snprintf(name, sizeof(name), "%s/plan.txt", dir);
+    plan = fopen(name, "w");
+    if (plan == NULL) {
+        fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < n_jobs; i++) {
+        Vsn *v = jobs[i].v;
+
+        if (jobs[i].part < 0)
+            fprintf(plan, "%s - %lu %lu %" PRIu64 " %.1f %s/%s-positions.txt\n", v->vsn,
+                    jobs[i].nfiles, jobs[i].narcs, jobs[i].bytes, jobs[i].cost, dir, v->vsn);
+        else
+            fprintf(plan, "%s %d %lu %lu %" PRIu64 " %.1f %s/%s-positions.txt.%d\n", v->vsn, jobs[i].part,
+                    jobs[i].nfiles, jobs[i].narcs, jobs[i].bytes, jobs[i].cost, dir, v->vsn, jobs[i].part);
+    }
+    if (fclose(plan) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+
+    if (ledger_path != NULL) {
+        fprintf(stderr, "Left out %lu archive files (%lu files, %.1f GB) checked good in the last %g days\n",
+                skipped_arcs, skipped_files, skipped_bytes/1e9, days);
+        ledger_unmap(&ledger);
+    }
+
+    for (i = 0; i < n_vsns; i++)
+        free(vsns[i].files);
+    free(vsns);
+    free(jobs);
+    return 0;
+}
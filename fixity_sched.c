@@ -0,0 +1,279 @@
+/*
+ * fixity_sched -- run the per-VSN fixity jobs within per-class and
+ * per-device limits.
+ *
+ * gcc -o fixity_sched fixity_sched.c
+ *
+ * Usage: fixity_sched [-v] [-c class=N]... [-p class=N]... <jobs-file>
+ *
+ * Each line of jobs-file is one job:
+ *   class device cost command...
+ * e.g.
+ *   dk 64768 5 runfixity_vsn.sh /sam2/temp/20240101 DKARC03 1 ...
+ *   li tape.A00041 430 runfixity_vsn.sh /sam2/temp/20240101 A00041 2 ...
+ * -c class=N  at most N jobs of that class at once (default 1)
+ * -p class=N  at most N jobs of that class on any one device (default: no limit
+ *             beyond the class one)
+ * -v          log each start and finish on stdout
+ *
+ * Jobs are started largest cost first, whenever a slot is free: the
+ * scheduler sleeps in waitpid() until a job ends and starts the next one
+ * at once. Commands run under /bin/sh -c. The exit status is 1 if any job
+ * failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_CLASSES 16
+
+typedef struct
+{
+    char *cmd;
+    int class;
+    int device;
+    double cost;
+    pid_t pid;
+    int state;          /* 0 waiting, 1 running, 2 done */
+    time_t start;
+} Job;
+
+typedef struct
+{
+    char name[32];
+    int limit;
+    int dev_limit;      /* 0: none */
+    int running;
+} Class;
+
+typedef struct
+{
+    char *name;
+    int class;
+    int running;
+} Device;
+
+Job *jobs;
+int n_jobs;
+Class classes[MAX_CLASSES];
+int n_classes;
+Device *devices;
+int n_devices;
+int verbose = 0;
+
+static int class_id(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < n_classes; i++)
+        if (strlen(classes[i].name) == len && strncmp(classes[i].name, name, len) == 0)
+            return i;
+    if (n_classes == MAX_CLASSES || len >= sizeof(classes[0].name)) {
+        fprintf(stderr, "Too many job classes (or class name too long): %.*s\n", (int)len, name);
+        exit(1);
+    }
+    memcpy(classes[n_classes].name, name, len);
+    classes[n_classes].name[len] = '\0';
+    classes[n_classes].limit = 1;
+    return n_classes++;
+}
+
+static int device_id(const char *name, int class)
+{
+    int i;
+
+    for (i = 0; i < n_devices; i++)
+        if (devices[i].class == class && strcmp(devices[i].name, name) == 0)
+            return i;
+    devices = realloc(devices, sizeof(Device)*(n_devices + 1));
+    if (devices == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    devices[n_devices].name = strdup(name);
+    devices[n_devices].class = class;
+    devices[n_devices].running = 0;
+    return n_devices++;
+}
+
+/* class=N */
+static void set_limit(const char *arg, int dev)
+{
+    const char *eq = strchr(arg, '=');
+    int c, n;
+
+    if (eq == NULL || (n = atoi(eq + 1)) < 1) {
+        fprintf(stderr, "Expected class=N, got '%s'\n", arg);
+        exit(1);
+    }
+    c = class_id(arg, eq - arg);
+    if (dev)
+        classes[c].dev_limit = n;
+    else
+        classes[c].limit = n;
+}
+
+static void read_jobs(const char *name)
+{
+    FILE *f;
+    char line[65536], class[64], device[256];
+    int cap = 0, n;
+    double cost;
+
+    f = fopen(name, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || sscanf(line, "%63s %255s %lf %n", class, device, &cost, &n) < 3)
+            continue;
+        if (line[n] == '\0') {
+            fprintf(stderr, "No command in job line: %s\n", line);
+            exit(1);
+        }
+        if (n_jobs == cap) {
+            cap = cap ? cap*2 : 64;
+            jobs = realloc(jobs, sizeof(Job)*cap);
+            if (jobs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        jobs[n_jobs].cmd = strdup(line + n);
+        jobs[n_jobs].class = class_id(class, strlen(class));
+        jobs[n_jobs].device = device_id(device, jobs[n_jobs].class);
+        jobs[n_jobs].cost = cost;
+        jobs[n_jobs].pid = 0;
+        jobs[n_jobs].state = 0;
+        n_jobs++;
+    }
+    fclose(f);
+}
+
+/* Largest first (longest-processing-time order keeps the tail short). */
+static int job_compare(const void *a, const void *b)
+{
+    const Job *ja = a, *jb = b;
+
+    return (ja->cost < jb->cost) - (ja->cost > jb->cost);
+}
+
+static void logjob(const char *what, Job *j, int status)
+{
+    char stamp[32];
+    time_t now = time(NULL);
+
+    if (!verbose)
+        return;
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+    printf("%s %s [%s %s, running %d/%d] %s", stamp, what,
+           classes[j->class].name, devices[j->device].name,
+           classes[j->class].running, classes[j->class].limit, j->cmd);
+    if (j->state == 2)
+        printf(" (%lds, status %d)", (long)(now - j->start), status);
+    printf("\n");
+    fflush(stdout);
+}
+
+static int startable(Job *j)
+{
+    Class *c = &classes[j->class];
+
+    if (j->state != 0 || c->running >= c->limit)
+        return 0;
+    return c->dev_limit == 0 || devices[j->device].running < c->dev_limit;
+}
+
+static void start(Job *j)
+{
+    fflush(stdout);
+    j->pid = fork();
+    if (j->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (j->pid == 0) {
+        execl("/bin/sh", "sh", "-c", j->cmd, (char *)NULL);
+        perror("exec /bin/sh");
+        _exit(127);
+    }
+    j->state = 1;
+    j->start = time(NULL);
+    classes[j->class].running++;
+    devices[j->device].running++;
+    logjob("start", j, 0);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, running = 0, done = 0, failed = 0, status;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "vc:p:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'c':
+                set_limit(optarg, 0);
+                break;
+            case 'p':
+                set_limit(optarg, 1);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-v] [-c class=N]... [-p class=N]... <jobs-file>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-v] [-c class=N]... [-p class=N]... <jobs-file>\n", argv[0]);
+        exit(1);
+    }
+    read_jobs(argv[optind]);
+    qsort(jobs, n_jobs, sizeof(Job), job_compare);
+
+    while (done < n_jobs) {
+        for (i = 0; i < n_jobs; i++)
+            if (startable(&jobs[i])) {
+                start(&jobs[i]);
+                running++;
+            }
+        if (running == 0) {
+            fprintf(stderr, "No job can be started (check the limits)\n");
+            exit(1);
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
+            exit(1);
+        }
+        for (i = 0; i < n_jobs && jobs[i].pid != pid; i++)
+            ;
+        if (i == n_jobs)
+            continue;
+
+        jobs[i].state = 2;
+        classes[jobs[i].class].running--;
+        devices[jobs[i].device].running--;
+        running--;
+        done++;
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (status != 0) {
+            failed++;
+            fprintf(stderr, "Job failed (status %d): %s\n", status, jobs[i].cmd);
+        }
+        logjob("done ", &jobs[i], status);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,433 @@
+/*
+ * fixity_table -- rows of an archive file keyed by offset. See fixity_table.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fixity_table.h"
+
+#define NO_CKSUM "NO_CKSUM_IN_INODE"
+
+static const char *list_names[FIX_N_LISTS] = {
+    "links", "emptyfiles", "missing_checksums", "missing_files", "bad_checksums", "renamed_files"
+};
+
+void
+fix_init(FixTable *t, int kind)
+{
+    memset(t, 0, sizeof(*t));
+    t->kind = kind;
+}
+
+/* Start of field k (0 = typeflag). */
+static const char *
+field(const char *p, const char *end, int k)
+{
+    while (k > 0 && p < end) {
+        if (*p++ == '|')
+            k--;
+    }
+    return p;
+}
+
+static const char *
+field_end(const char *p, const char *end)
+{
+    const char *q = memchr(p, '|', end - p);
+
+    return q ? q : end;
+}
+
+static uint64_t
+number(const char *p, const char *end, int base)
+{
+    uint64_t v = 0;
+    int d;
+
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9')
+            d = *p - '0';
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+            d = *p - 'a' + 10;
+        else if (base == 16 && *p >= 'A' && *p <= 'F')
+            d = *p - 'A' + 10;
+        else
+            break;
+        v = v*base + d;
+    }
+    return v;
+}
+
+/*
+ * Column of each field (the typeflag is always column 0), and the base the
+ * offset is written in:
+ *            offset size csum name  base
+ *   tar      1      2    3    4     10
+ *   dk       4      5    1    6     10
+ *   li 2     4      8    1    9     16
+ *   li 3     7      8    1    9     16
+ */
+int
+fix_parse(int kind, const char *line, const char *end, FixRow *r)
+{
+    static const int cols[4][5] = {
+        {1, 2, 3, 4, 10},
+        {4, 5, 1, 6, 10},
+        {4, 8, 1, 9, 16},
+        {7, 8, 1, 9, 16},
+    };
+    const int *c = cols[kind];
+    const char *p;
+
+    if (line + 1 >= end || *line < '0' || *line > '9' || line[1] != '|')
+        return 0;
+    r->type = *line - '0';
+    p = field(line, end, c[0]);
+    if (p >= end)
+        return 0;
+    r->offset = number(p, end, c[4]);
+    r->size = number(field(line, end, c[1]), end, 10);
+    r->csum = field(line, end, c[2]);
+    r->csum_len = field_end(r->csum, end) - r->csum;
+    /* the name is the rest of the line: it may contain '|' */
+    r->name = field(line, end, c[3]);
+    r->name_len = end - r->name;
+    r->line = line;
+    r->line_len = end - line + 1;
+    r->seen = 0;
+    return 1;
+}
+
+void
+fix_load(FixTable *t, int fd, const char *what)
+{
+    size_t cap = 1048576;
+    ssize_t n;
+    const char *p, *e, *end;
+
+    t->text = malloc(cap);
+    t->text_len = 0;
+    while (t->text != NULL) {
+        if (t->text_len == cap) {
+            cap *= 2;
+            t->text = realloc(t->text, cap);
+            if (t->text == NULL)
+                break;
+        }
+        n = read(fd, t->text + t->text_len, cap - t->text_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Cannot read %s: %s\n", what, strerror(errno));
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        t->text_len += n;
+    }
+    if (t->text == NULL) {
+        fprintf(stderr, "Out of memory reading %s\n", what);
+        exit(1);
+    }
+
+    end = t->text + t->text_len;
+    for (p = t->text; p < end; p = e + 1) {
+        e = memchr(p, '\n', end - p);
+        if (e == NULL)
+            e = end;
+        if (t->n == t->cap) {
+            t->cap = t->cap ? t->cap*2 : 1024;
+            t->rows = realloc(t->rows, sizeof(FixRow)*t->cap);
+            if (t->rows == NULL) {
+                fprintf(stderr, "Out of memory reading %s\n", what);
+                exit(1);
+            }
+        }
+        if (fix_parse(t->kind, p, e, &t->rows[t->n])) {
+            /* a last line without a newline */
+            if (e == end)
+                t->rows[t->n].line_len--;
+            t->n++;
+        }
+    }
+}
+
+static int
+offset_compare(const void *a, const void *b)
+{
+    const FixRow *ra = a, *rb = b;
+
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+void
+fix_sort(FixTable *t)
+{
+    qsort(t->rows, t->n, sizeof(FixRow), offset_compare);
+}
+
+static size_t
+slot(uint64_t offset, size_t mask)
+{
+    offset *= 0x9e3779b97f4a7c15ULL;
+    return (size_t)(offset >> 32) & mask;
+}
+
+void
+fix_index(FixTable *t)
+{
+    size_t cap, i, j;
+
+    for (cap = 64; cap < 2*t->n; cap *= 2)
+        ;
+    free(t->slots);
+    t->slots = calloc(cap, sizeof(size_t));
+    if (t->slots == NULL) {
+        fprintf(stderr, "Out of memory indexing %lu rows\n", (unsigned long)t->n);
+        exit(1);
+    }
+    t->mask = cap - 1;
+    for (i = 0; i < t->n; i++) {
+        j = slot(t->rows[i].offset, t->mask);
+        while (t->slots[j] != 0) {
+            /* keep the first row for an offset, as join(1) would list it first */
+            if (t->rows[t->slots[j] - 1].offset == t->rows[i].offset)
+                break;
+            j = (j + 1) & t->mask;
+        }
+        if (t->slots[j] == 0)
+            t->slots[j] = i + 1;
+    }
+}
+
+FixRow *
+fix_find(FixTable *t, uint64_t offset)
+{
+    size_t j;
+
+    if (t->slots == NULL)
+        return NULL;
+    for (j = slot(offset, t->mask); t->slots[j] != 0; j = (j + 1) & t->mask) {
+        if (t->rows[t->slots[j] - 1].offset == offset)
+            return &t->rows[t->slots[j] - 1];
+    }
+    return NULL;
+}
+
+void
+fix_free(FixTable *t)
+{
+    free(t->text);
+    free(t->rows);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+void
+fix_report_open(FixReport *r, const char *prefix, const char *archive)
+{
+    char name[4096];
+    int i;
+
+    memset(r, 0, sizeof(*r));
+    r->archive = archive;
+    for (i = 0; i < FIX_N_LISTS; i++) {
+        snprintf(name, sizeof(name), "%s_%s.txt", prefix, list_names[i]);
+        r->fd[i] = open(name, O_WRONLY|O_CREAT|O_APPEND, 0644);
+        if (r->fd[i] < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+            exit(1);
+        }
+        out_init_size(&r->out[i], r->fd[i], OUT_TEXT, 65536);
+    }
+}
+
+void
+fix_report_close(FixReport *r)
+{
+    int i;
+
+    for (i = 0; i < FIX_N_LISTS; i++) {
+        out_free(&r->out[i]);
+        close(r->fd[i]);
+    }
+}
+
+const char *
+fix_list_name(int l)
+{
+    return list_names[l];
+}
+
+/* Start an entry in one of the lists that are split up by archive file. */
+static OutBuf *
+listed(FixReport *r, int l)
+{
+    OutBuf *ob = &r->out[l];
+
+    if (!r->headed[l]) {
+        out_raw(ob, "------------", 12);
+        out_raw(ob, r->archive, strlen(r->archive));
+        out_raw(ob, "---------------\n", 16);
+        r->headed[l] = 1;
+    }
+    r->n[l]++;
+    return ob;
+}
+
+void
+fix_report_ledger(FixReport *r, Ledger *ledger, int kind, const char *algo)
+{
+    r->ledger = ledger;
+    r->kind = kind;
+    r->algo = algo;
+    r->when = time(NULL);
+}
+
+/*
+ * The VSN and archive file of an inventory row, as the ledger keys them:
+ *   dk    DKARC19/d2/f4            -> DKARC19, d2/f4
+ *   li 2  li.A00041|228879         -> A00041, 228879
+ *   li 3  li.B00049|35452 (cols 5, 6)
+ */
+static int
+row_where(int kind, const FixRow *m, LedgerRec *lr)
+{
+    const char *end = m->line + m->line_len - 1;
+    const char *a, *b, *sep;
+    int k = (kind == FIX_LI3) ? 5 : 2;
+
+    if (kind == FIX_TAR)
+        return 0;
+    a = field(m->line, end, k);
+    b = field_end(a, end);
+    sep = memchr(a, kind == FIX_DK ? '/' : '.', b - a);
+    if (sep == NULL)
+        return 0;
+    if (kind == FIX_DK) {
+        snprintf(lr->vsn, sizeof(lr->vsn), "%.*s", (int)(sep - a), a);
+        snprintf(lr->arc, sizeof(lr->arc), "%.*s", (int)(b - sep - 1), sep + 1);
+    }
+    else {
+        snprintf(lr->vsn, sizeof(lr->vsn), "%.*s", (int)(b - sep - 1), sep + 1);
+        snprintf(lr->arc, sizeof(lr->arc), "%" PRIx64, number(field(m->line, end, k + 1), end, 16));
+    }
+    return lr->vsn[0] != '\0' && lr->arc[0] != '\0';
+}
+
+static int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Add the check of inventory row m against archive row c to the ledger. */
+static void
+ledgered(FixReport *r, const FixRow *m, const FixRow *c, int result)
+{
+    LedgerRec lr;
+    size_t i;
+    int hi, lo;
+
+    if (r->ledger == NULL)
+        return;
+    memset(&lr, 0, sizeof(lr));
+    if (!row_where(r->kind, m, &lr))
+        return;
+    lr.when = r->when;
+    lr.offset = m->offset;
+    lr.size = m->size;
+    lr.copy = (r->kind == FIX_DK) ? 1 : (r->kind == FIX_LI2) ? 2 : 3;
+    lr.result = result;
+    snprintf(lr.algo, sizeof(lr.algo), "%s", r->algo ? r->algo : "");
+    for (i = 0; c != NULL && 2*i + 1 < c->csum_len && i < sizeof(lr.md); i++) {
+        hi = hex_digit(c->csum[2*i]);
+        lo = hex_digit(c->csum[2*i + 1]);
+        if (hi < 0 || lo < 0)
+            break;
+        lr.md[i] = hi << 4 | lo;
+    }
+    lr.md_len = i;
+    ledger_add(r->ledger, &lr, m->name, m->name_len);
+}
+
+static int
+same(const char *a, size_t la, const char *b, size_t lb)
+{
+    return la == lb && memcmp(a, b, la) == 0;
+}
+
+/* The rules runfixity_vsn.sh applied to its join output. */
+void
+fix_report_row(FixReport *r, FixRow *m, FixRow *c)
+{
+    OutBuf *ob;
+    int no_cksum;
+
+    r->checked++;
+    if (m->type == 2) {
+        out_raw(&r->out[FIX_LINKS], m->line, m->line_len);
+        r->n[FIX_LINKS]++;
+    }
+    if (m->size == 0) {
+        out_raw(&r->out[FIX_EMPTY], m->line, m->line_len);
+        r->n[FIX_EMPTY]++;
+    }
+
+    if (c == NULL || c->name_len == 0) {
+        ob = listed(r, FIX_MISSING);
+        out_raw(ob, m->name, m->name_len);
+        out_raw(ob, "\n", 1);
+    }
+    if (m->type != 0)
+        return;
+    if (c == NULL || c->name_len == 0)
+        ledgered(r, m, NULL, LEDGER_MISSING);
+    no_cksum = same(m->csum, m->csum_len, NO_CKSUM, strlen(NO_CKSUM));
+    if (no_cksum) {
+        ob = listed(r, FIX_NO_CKSUM);
+        out_raw(ob, m->name, m->name_len);
+        out_raw(ob, "\n", 1);
+        // read whole, if nothing to check it against: fixity_plan -s counts it
+        if (c != NULL && c->name_len > 0 && c->csum_len > 0)
+            ledgered(r, m, c, LEDGER_NO_CKSUM);
+    }
+    if (c == NULL || c->name_len == 0 || m->name_len == 0)
+        return;
+    // a rename is reported with or without an inode checksum, as the join did
+    if (!no_cksum && m->csum_len > 0 && c->csum_len > 0) {
+        if (same(m->csum, m->csum_len, c->csum, c->csum_len)) {
+            r->ok++;
+            ledgered(r, m, c, LEDGER_GOOD);
+        }
+        else {
+            ledgered(r, m, c, LEDGER_BAD);
+            ob = listed(r, FIX_BAD);
+            out_raw(ob, m->name, m->name_len);
+            out_raw(ob, "|", 1);
+            out_raw(ob, m->csum, m->csum_len);
+            out_raw(ob, "|", 1);
+            out_raw(ob, c->csum, c->csum_len);
+            out_raw(ob, "\n", 1);
+        }
+    }
+    if (!same(m->name, m->name_len, c->name, c->name_len)) {
+        ob = listed(r, FIX_RENAMED);
+        out_raw(ob, m->name, m->name_len);
+        out_raw(ob, " -> ", 4);
+        out_raw(ob, c->name, c->name_len);
+        out_raw(ob, "\n", 1);
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * fixity_table -- rows of an archive file keyed by their offset in it.
+ *
+ * Two kinds of row end up here:
+ *   inventory rows from print_csum_*_from_sls (FIX_DK, FIX_LI2, FIX_LI3 say
+ *   which copy's columns hold the offset), and
+ *   archive rows from print_offset_cksum_from_tar (FIX_TAR):
+ *     type|offset|size|checksum|filename
+ * A table keeps the text it was loaded from; rows point into it.
+ */
+#ifndef FIXITY_TABLE_H
+#define FIXITY_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "outfmt.h"
+#include "ledger.h"
+
+enum fix_kind{FIX_TAR, FIX_DK, FIX_LI2, FIX_LI3};
+
+typedef struct
+{
+    uint64_t offset;        /* 512-byte blocks into the archive file */
+    uint64_t size;
+    short type;             /* 0 file, 2 link */
+    const char *csum;       /* hex, NO_CKSUM_IN_INODE or empty */
+    size_t csum_len;
+    const char *name;
+    size_t name_len;
+    const char *line;       /* the whole row, with its newline */
+    size_t line_len;
+    int seen;
+} FixRow;
+
+typedef struct
+{
+    int kind;
+    char *text;
+    size_t text_len;
+    FixRow *rows;
+    size_t n;
+    size_t cap;
+    size_t *slots;          /* row index + 1, 0 if empty */
+    size_t mask;
+} FixTable;
+
+void fix_init(FixTable *t, int kind);
+/* Parse one row; returns 0 for lines that are not rows (banners, headers). */
+int fix_parse(int kind, const char *line, const char *end, FixRow *r);
+/* Read every row from fd. */
+void fix_load(FixTable *t, int fd, const char *what);
+/* Sort the rows by offset, then hash them for fix_find(). */
+void fix_sort(FixTable *t);
+void fix_index(FixTable *t);
+FixRow *fix_find(FixTable *t, uint64_t offset);
+void fix_free(FixTable *t);
+
+/*
+ * Results of checking archive rows against inventory rows, appended to
+ *   <prefix>_links.txt              inventory rows of symbolic links
+ *   <prefix>_emptyfiles.txt         inventory rows of zero length files
+ *   <prefix>_missing_checksums.txt  files with NO_CKSUM_IN_INODE
+ *   <prefix>_missing_files.txt      files not found in the archive file
+ *   <prefix>_bad_checksums.txt      filename|stored|calculated
+ *   <prefix>_renamed_files.txt      inode name -> archived name
+ * The last four get a "------------archive---------------" line before the
+ * first entry for an archive file.
+ *
+ * With fix_report_ledger(), each file checked is also added to a ledger
+ * (ledger.h): good or BAD if it has a checksum in the inode, MISSING if it
+ * is not in the archive file.
+ */
+enum fix_list{FIX_LINKS, FIX_EMPTY, FIX_NO_CKSUM, FIX_MISSING, FIX_BAD, FIX_RENAMED, FIX_N_LISTS};
+
+typedef struct
+{
+    OutBuf out[FIX_N_LISTS];
+    int fd[FIX_N_LISTS];
+    int headed[FIX_N_LISTS];
+    unsigned long n[FIX_N_LISTS];
+    unsigned long checked;  /* inventory rows */
+    unsigned long ok;       /* files whose checksum matched */
+    const char *archive;
+    Ledger *ledger;
+    int kind;               /* of the inventory rows */
+    const char *algo;
+    time_t when;
+} FixReport;
+
+void fix_report_open(FixReport *r, const char *prefix, const char *archive);
+/* One inventory row and the archive row at its offset (NULL if none). */
+void fix_report_row(FixReport *r, FixRow *m, FixRow *c);
+/* Add the rows checked from here on, of inventory kind and hashed with
+ * algo, to ledger. */
+void fix_report_ledger(FixReport *r, Ledger *ledger, int kind, const char *algo);
+void fix_report_close(FixReport *r);
+/* "links", "emptyfiles", ...: the <what> in <prefix>_<what>.txt */
+const char *fix_list_name(int l);
+
+#endif
@@ -0,0 +1,649 @@
+/*
+ * fixity_tape -- read the archive files of one tape VSN back to back and
+ * check them, keeping the drive streaming.
+ *
+ * gcc -o fixity_tape fixity_tape.c fixity_table.c ledger.c outfmt.c iogov.c iolat.c -lpthread -lrt
+ *
+ * Usage: fixity_tape [-d depth] [-m MB] [-c 2|3] [-l] [-L ms] -r <prefix> [-g ledger] [-s shard] [-I inventory] <vsn> <positions-file> <logdir>
+ *
+ * positions-file is the fixity_plan list (count hexpos decimal bytes). For
+ * each position this does what runfixity_vsn.sh did one step at a time:
+ *   request -m li -v <vsn> -p 0x<pos> <logdir>/REQUEST_<vsn>_<pos>
+ *   print_offset_cksum_from_tar -x <rows> -c <copy> -r <prefix> <file> <algo> TAPE
+ *   rm -f <file>
+ * but as a pipeline:
+ *   - a stager thread issues the requests up to depth (-d, default 2)
+ *     positions ahead of the one being read;
+ *   - the main thread reads each archive file into memory (at most -m MB,
+ *     default 256, at once) and opens the next one as soon as the last one
+ *     is drained;
+ *   - each archive file is hashed and checked by its own
+ *     print_offset_cksum_from_tar, fed from memory through a pipe, so the
+ *     checking of one position overlaps the reading of the next (at most
+ *     depth of them at once).
+ * The rows for each position come from the shard (-s, print_csum_*_from_sls
+ * -P) through its index, or else from the whole inventory (-I). The
+ * checkers write to <prefix>.tape.<pos>_*.txt, which are appended to
+ * <prefix>_*.txt in position order at the end, so the results are the same
+ * as those of the sequential loop. The checkers' lines of counts go to
+ * stdout. The exit status is 1 if a request or a check failed. -g has the
+ * checkers add their results to a ledger (ledger.h).
+ *
+ * The reads are held to the limit iogov.h finds for the VSN, if any (the
+ * checkers read from pipes and are not limited again). -l reports their
+ * latencies for the VSN (iolat.h), with the slowest as <pos>+<offset>, to
+ * stderr at the end; -L also flags the VSN as SLOW if its p99 is above ms,
+ * e.g. a drive that keeps retrying.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "fixity_table.h"
+#include "iogov.h"
+#include "iolat.h"
+
+// tape block multiple, as print_offset_cksum_from_tar reads it
+#define BLOCK_SZ 4194304
+
+typedef struct Block
+{
+    struct Block *next;
+    size_t len;
+    unsigned char data[];
+} Block;
+
+typedef struct
+{
+    char pos[32];               /* hex position */
+    char path[PATH_MAX];        /* request file */
+    char prefix[PATH_MAX];      /* this checker's result files */
+    int requested;              /* 0 not yet, 1 done, -1 failed */
+    Block *head, *tail;         /* read but not yet fed to the checker */
+    int eof;
+    int fd;                     /* pipe to the checker */
+    pid_t pid;
+    int started;
+    int status;
+    pthread_t feeder;
+} Position;
+
+Position *positions;
+int n_positions;
+int depth = 2;
+size_t max_buffered = 256UL*1048576;
+size_t buffered;
+int copy = 2;
+int next_read;                  /* position being read */
+int checking;                   /* checkers running */
+const char *vsn, *logdir, *prefix;
+const char *ledger_path;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+/* mmap'd shard and its index, or the whole inventory */
+const char *shard, *idx, *inventory;
+size_t shard_len, idx_len, inventory_len;
+char algo[8] = "MD5";
+/* read limit for the VSN (iogov.h) */
+IoGov *gov;
+/* read latencies for the VSN (-l) */
+IoLat *lat;
+
+static const char *map_file(const char *name, size_t *len)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    *len = 0;
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    *len = st.st_size;
+    return p;
+}
+
+static void read_positions(const char *name)
+{
+    FILE *f;
+    char line[1024], pos[32];
+    int cap = 0;
+
+    f = fopen(name, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%*s %31s", pos) != 1)
+            continue;
+        if (n_positions == cap) {
+            cap = cap ? cap*2 : 64;
+            positions = realloc(positions, sizeof(Position)*cap);
+            if (positions == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        memset(&positions[n_positions], 0, sizeof(Position));
+        strcpy(positions[n_positions].pos, pos);
+        if (snprintf(positions[n_positions].path, PATH_MAX, "%s/REQUEST_%s_%s", logdir, vsn, pos) >= PATH_MAX ||
+                snprintf(positions[n_positions].prefix, PATH_MAX, "%s.tape.%s", prefix, pos) >= PATH_MAX) {
+            fprintf(stderr, "Path length exceeds PATH_MAX for position %s\n", pos);
+            exit(1);
+        }
+        positions[n_positions].fd = -1;
+        n_positions++;
+    }
+    fclose(f);
+}
+
+/*
+ * Run a command and wait for it; returns its exit status. A checker (child
+ * != NULL) is left running, reading in on stdin and out as /dev/fd/3, its
+ * stderr discarded as runfixity_vsn.sh did.
+ */
+static int run(char *const argv[], int in, int out, pid_t *child)
+{
+    pid_t pid;
+    int status, null;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (in >= 0)
+            dup2(in, STDIN_FILENO);
+        // dup2 onto itself would leave close-on-exec set
+        if (out == 3)
+            fcntl(3, F_SETFD, 0);
+        else if (out >= 0)
+            dup2(out, 3);
+        if (child != NULL && (null = open("/dev/null", O_WRONLY)) >= 0)
+            dup2(null, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (child != NULL) {
+        *child = pid;
+        return 0;
+    }
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return 127;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Issue the requests, at most depth positions ahead of the one being read. */
+static void *stager(void *arg)
+{
+    char *argv[9];
+    char p[40];
+    int i, rc;
+
+    (void)arg;
+
+    for (i = 0; i < n_positions; i++) {
+        pthread_mutex_lock(&lock);
+        while (i >= next_read + depth)
+            pthread_cond_wait(&changed, &lock);
+        pthread_mutex_unlock(&lock);
+
+        snprintf(p, sizeof(p), "0x%s", positions[i].pos);
+        argv[0] = "request";
+        argv[1] = "-m";
+        argv[2] = "li";
+        argv[3] = "-v";
+        argv[4] = (char *)vsn;
+        argv[5] = "-p";
+        argv[6] = p;
+        argv[7] = positions[i].path;
+        argv[8] = NULL;
+        rc = run(argv, -1, -1, NULL);
+        if (rc != 0)
+            fprintf(stderr, "request %s %s failed (status %d)\n", vsn, p, rc);
+
+        pthread_mutex_lock(&lock);
+        positions[i].requested = (rc == 0) ? 1 : -1;
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/* A line of the inventory that is on this VSN and position (runfixity_vsn.sh's egrep). */
+static int on_position(const char *p, const char *end, const char *pos)
+{
+    size_t vl = strlen(vsn), pl = strlen(pos);
+    const char *q;
+
+    for (q = p; q + 4 + vl + pl < end; q++) {
+        q = memchr(q, '|', end - q);
+        if (q == NULL || q + 5 + vl + pl >= end)
+            return 0;
+        if (q[1] == 'l' && q[2] == 'i' && memcmp(q + 4, vsn, vl) == 0 && q[4 + vl] == '|'
+            && memcmp(q + 5 + vl, pos, pl) == 0 && q[5 + vl + pl] == '|')
+            return 1;
+    }
+    return 0;
+}
+
+static void write_all(int fd, const char *p, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0) {
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+/*
+ * The inventory rows of one position, in an unlinked temp file; sets algo
+ * from the length of the first row's checksum.
+ */
+static int position_rows(const char *pos)
+{
+    char name[PATH_MAX], hex[32];
+    const char *p, *e, *line = NULL, *start = NULL, *end = NULL, *c;
+    unsigned long off, nrows;
+    int fd;
+    size_t n;
+
+    snprintf(name, sizeof(name), "%s/fixity_tape.XXXXXX", logdir);
+    fd = mkostemp(name, O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create temp file in %s: %s\n", logdir, strerror(errno));
+        exit(1);
+    }
+    unlink(name);
+
+    if (idx != NULL) {
+        for (p = idx; p < idx + idx_len; p = e + 1) {
+            e = memchr(p, '\n', idx + idx_len - p);
+            if (e == NULL)
+                e = idx + idx_len;
+            if (sscanf(p, "%31s %lu %lu", hex, &off, &nrows) == 3 && strcmp(hex, pos) == 0) {
+                if (off > shard_len)
+                    break;
+                start = shard + off;
+                for (end = start; nrows > 0 && end < shard + shard_len; nrows--) {
+                    c = memchr(end, '\n', shard + shard_len - end);
+                    end = c ? c + 1 : shard + shard_len;
+                }
+                write_all(fd, start, end - start);
+                line = start;
+                break;
+            }
+        }
+    }
+    else if (inventory != NULL) {
+        for (p = inventory; p < inventory + inventory_len; p = e + 1) {
+            e = memchr(p, '\n', inventory + inventory_len - p);
+            if (e == NULL)
+                e = inventory + inventory_len;
+            if (on_position(p, e, pos)) {
+                write_all(fd, p, e - p);
+                write_all(fd, "\n", 1);
+                if (line == NULL)
+                    line = p;
+            }
+        }
+    }
+
+    // md5 - 32, sha1 - 40, sha256 - 64, sha512 - 128; as before, a
+    // position without rows keeps the last one's
+    if (line != NULL && (c = memchr(line, '|', 4)) != NULL) {
+        for (n = 0, c++; c[n] != '|' && c[n] != '\n'; n++)
+            ;
+        if (n == 32)
+            strcpy(algo, "MD5");
+        else if (n == 40)
+            strcpy(algo, "SHA1");
+        else if (n == 64)
+            strcpy(algo, "SHA256");
+        else if (n == 128)
+            strcpy(algo, "SHA512");
+    }
+    return fd;
+}
+
+/* Feed one position's blocks to its checker, then wait for it. */
+static void *feeder(void *arg)
+{
+    Position *p = arg;
+    Block *b;
+    int status;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (p->head == NULL && !p->eof)
+            pthread_cond_wait(&changed, &lock);
+        b = p->head;
+        if (b != NULL) {
+            p->head = b->next;
+            if (p->head == NULL)
+                p->tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        if (b == NULL)
+            break;
+
+        // a checker that died just stops taking data
+        if (p->fd >= 0 && b->len > 0) {
+            const unsigned char *q = b->data;
+            size_t n = b->len;
+            ssize_t w;
+
+            while (n > 0) {
+                w = write(p->fd, q, n);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w < 0) {
+                    close(p->fd);
+                    p->fd = -1;
+                    break;
+                }
+                q += w;
+                n -= w;
+            }
+        }
+        pthread_mutex_lock(&lock);
+        buffered -= b->len + sizeof(Block);
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+        free(b);
+    }
+    if (p->fd >= 0)
+        close(p->fd);
+
+    while (waitpid(p->pid, &status, 0) < 0)
+        if (errno != EINTR) {
+            status = 127 << 8;
+            break;
+        }
+    pthread_mutex_lock(&lock);
+    p->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    checking--;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Start the checker of a position, reading from a pipe. */
+static void start_checker(Position *p)
+{
+    int fds[2], rows;
+    char c[4];
+    char *argv[16];
+    int k;
+
+    rows = position_rows(p->pos);
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    snprintf(c, sizeof(c), "%d", copy);
+    argv[0] = "print_offset_cksum_from_tar";
+    argv[1] = "-x";
+    argv[2] = "/dev/fd/3";
+    argv[3] = "-c";
+    argv[4] = c;
+    argv[5] = "-r";
+    argv[6] = p->prefix;
+    argv[7] = "-n";
+    argv[8] = p->path;
+    k = 9;
+    if (ledger_path != NULL) {
+        argv[k++] = "-g";
+        argv[k++] = (char *)ledger_path;
+    }
+    argv[k++] = "-";
+    argv[k++] = algo;
+    argv[k++] = "TAPE";
+    argv[k] = NULL;
+    run(argv, fds[0], rows, &p->pid);
+    close(fds[0]);
+    close(rows);
+    p->fd = fds[1];
+    p->started = 1;
+    pthread_create(&p->feeder, NULL, feeder, p);
+}
+
+/* Read one archive file into its checker's queue. */
+static void read_position(Position *p)
+{
+    Block *b;
+    unsigned long long t_lat, off = 0;
+    ssize_t r;
+    size_t got;
+    int fd;
+
+    fd = open(p->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", p->path, strerror(errno));
+        return;
+    }
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (buffered > 0 && buffered + BLOCK_SZ + sizeof(Block) > max_buffered)
+            pthread_cond_wait(&changed, &lock);
+        buffered += BLOCK_SZ + sizeof(Block);
+        pthread_mutex_unlock(&lock);
+
+        b = malloc(sizeof(Block) + BLOCK_SZ);
+        if (b == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (got = 0; got < BLOCK_SZ; got += r) {
+            t_lat = iolat_start(lat);
+            r = read(fd, b->data + got, BLOCK_SZ - got);
+            iolat_end(lat, t_lat, p->pos, off + got, r > 0 ? r : 0);
+            if (r < 0 && errno == EINTR) {
+                r = 0;
+                continue;
+            }
+            if (r < 0)
+                fprintf(stderr, "Read error on %s: %s\n", p->path, strerror(errno));
+            if (r <= 0)
+                break;
+            iogov_take(gov, r);
+        }
+        b->len = got;
+        b->next = NULL;
+        off += got;
+
+        pthread_mutex_lock(&lock);
+        buffered -= BLOCK_SZ - got;
+        if (p->tail != NULL)
+            p->tail->next = b;
+        else
+            p->head = b;
+        p->tail = b;
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+        if (got < BLOCK_SZ)
+            break;
+    }
+    close(fd);
+}
+
+/* <prefix>_<list>.txt into buf (PATH_MAX) */
+static void list_path(char *buf, const char *pfx, int l)
+{
+    if (snprintf(buf, PATH_MAX, "%s_%s.txt", pfx, fix_list_name(l)) >= PATH_MAX) {
+        fprintf(stderr, "Path length exceeds PATH_MAX: %s_%s.txt\n", pfx, fix_list_name(l));
+        exit(1);
+    }
+}
+
+/* Append each of a checker's result files to <prefix>_*.txt */
+static void collect(Position *p)
+{
+    char from[PATH_MAX], to[PATH_MAX], buf[65536];
+    int l, in, out;
+    ssize_t n;
+
+    for (l = 0; l < FIX_N_LISTS; l++) {
+        list_path(from, p->prefix, l);
+        list_path(to, prefix, l);
+        in = open(from, O_RDONLY);
+        if (in < 0)
+            continue;
+        out = open(to, O_WRONLY|O_CREAT|O_APPEND, 0644);
+        if (out < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", to, strerror(errno));
+            exit(1);
+        }
+        while ((n = read(in, buf, sizeof(buf))) > 0)
+            write_all(out, buf, n);
+        close(in);
+        close(out);
+        unlink(from);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, failed = 0, latency = 0;
+    double lat_flag = 0;
+    const char *shard_name = NULL, *inventory_name = NULL;
+    char name[PATH_MAX];
+    pthread_t stage;
+
+    while ((opt = getopt(argc, argv, "d:m:c:r:g:s:I:lL:")) != -1) {
+        switch (opt) {
+            case 'd':
+                depth = atoi(optarg);
+                if (depth < 1) {
+                    fprintf(stderr, "Depth (%s) must be at least 1\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                max_buffered = strtoul(optarg, NULL, 10)*1048576;
+                break;
+            case 'c':
+                copy = atoi(optarg);
+                if (copy < 2 || copy > 3) {
+                    fprintf(stderr, "Copy \"%s\" is not a tape copy [2-3]\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                prefix = optarg;
+                break;
+            case 'g':
+                ledger_path = optarg;
+                break;
+            case 's':
+                shard_name = optarg;
+                break;
+            case 'I':
+                inventory_name = optarg;
+                break;
+            case 'l':
+                latency = 1;
+                break;
+            case 'L':
+                lat_flag = atof(optarg);
+                latency = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d depth] [-m MB] [-c 2|3] [-l] [-L ms] -r <prefix> [-g ledger] [-s shard] [-I inventory] <vsn> <positions-file> <logdir>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind < 3 || prefix == NULL) {
+        fprintf(stderr, "Usage: %s [-d depth] [-m MB] [-c 2|3] [-l] [-L ms] -r <prefix> [-g ledger] [-s shard] [-I inventory] <vsn> <positions-file> <logdir>\n", argv[0]);
+        exit(1);
+    }
+    vsn = argv[optind];
+    logdir = argv[optind+2];
+    read_positions(argv[optind+1]);
+    gov = iogov_open(-1, vsn);
+    if (latency)
+        lat = iolat_open(-1, vsn);
+
+    if (shard_name != NULL) {
+        snprintf(name, sizeof(name), "%s.idx", shard_name);
+        idx = map_file(name, &idx_len);
+        if (idx != NULL)
+            shard = map_file(shard_name, &shard_len);
+        if (shard == NULL)
+            idx = NULL;
+    }
+    if (idx == NULL && inventory_name != NULL)
+        inventory = map_file(inventory_name, &inventory_len);
+
+    // a checker that dies is seen as a failed write, and in its status
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&stage, NULL, stager, NULL);
+    for (i = 0; i < n_positions; i++) {
+        Position *p = &positions[i];
+
+        pthread_mutex_lock(&lock);
+        while (p->requested == 0 || (p->requested > 0 && checking >= depth))
+            pthread_cond_wait(&changed, &lock);
+        if (p->requested > 0)
+            checking++;
+        pthread_mutex_unlock(&lock);
+
+        if (p->requested > 0) {
+            start_checker(p);
+            read_position(p);
+            unlink(p->path);
+        }
+        else
+            failed++;
+
+        pthread_mutex_lock(&lock);
+        p->eof = 1;
+        next_read = i + 1;
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+    pthread_join(stage, NULL);
+
+    for (i = 0; i < n_positions; i++) {
+        if (!positions[i].started)
+            continue;
+        pthread_join(positions[i].feeder, NULL);
+        if (positions[i].status != 0) {
+            fprintf(stderr, "Check of %s failed (status %d)\n", positions[i].path, positions[i].status);
+            failed++;
+        }
+        collect(&positions[i]);
+    }
+    iolat_report(stderr, lat_flag);
+    return failed ? 1 : 0;
+}
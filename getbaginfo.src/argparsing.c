@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "./argparsing.h"
+#include "../outfmt.h"
 #include "./boringssl/include/openssl/nid.h"
 
 const char *argp_program_version = "mtbagcheck 0.1a";
@@ -60,6 +61,11 @@ parse_opt (int key, char *arg, struct argp_state *state)
 	}
         break;
     case 't':
+	// 0: auto, see tpool_tune()
+	if (strcmp(arg,"auto") == 0) {
+	    arguments->n_threads = 0;
+	    break;
+	}
 	arguments->n_threads = (int)strtol(arg,NULL,10);
 	if ( (arguments->n_threads < 1) || (arguments->n_threads > 20) ) {
 	    printf("Number of threads (%d) is out of range (1-20).\n", arguments->n_threads);
@@ -75,9 +81,53 @@ parse_opt (int key, char *arg, struct argp_state *state)
           arguments->algo = SN_sha256;
       else if (strcasecmp(arg,SN_sha512) == 0)
           arguments->algo = SN_sha512;
+      else if (strcasecmp(arg,SN_blake3) == 0)
+          arguments->algo = SN_blake3;
       else
           argp_usage (state);
       break;
+    case 'C':
+      arguments->cpus = arg;
+      break;
+    case 'p':
+      arguments->placement = true;
+      break;
+    case 'l':
+      arguments->latency = true;
+      break;
+    case 'L':
+      arguments->lat_flag = strtod(arg,NULL);
+      arguments->latency = true;
+      break;
+    case 'M':
+	arguments->mem_limit = (size_t)strtoul(arg,NULL,10);
+	if (arguments->mem_limit < 16) {
+	    printf("Memory limit (%s MB) is too small; 16 MB at least.\n", arg);
+	    exit(1);
+	}
+	arguments->mem_limit *= 1048576;
+        break;
+    case 'F':
+      arguments->fingerprint = arg;
+      break;
+    case 'K':
+      arguments->chunks = arg;
+      break;
+    case 'r':
+      arguments->resume = true;
+      break;
+    case 'R':
+      if (sscanf(arg,"%llu-%llu",&arguments->range_from,&arguments->range_to) != 2 ||
+          arguments->range_to <= arguments->range_from) {
+	  printf("Range (%s) must be FROM-TO, in bytes of the archive.\n", arg);
+	  exit(1);
+      }
+      break;
+    case 'o':
+      arguments->format = out_parse_format(arg);
+      if (arguments->format < 0)
+          argp_usage (state);
+      break;
 
     case ARGP_KEY_ARG:
       if (state->arg_num >= 1) /* Too many arguments. */
@@ -109,8 +159,19 @@ void parse_arguments(int argc, char **argv, struct arguments *arguments)
 	arguments->verbose = false;
 	arguments->empties = false;
 	arguments->sam_copy = 0;
+	arguments->format = OUT_TEXT;
 	arguments->offset = 0;
 	arguments->wrapped = false;
+	arguments->cpus = NULL;
+	arguments->placement = false;
+	arguments->mem_limit = 0;
+	arguments->latency = false;
+	arguments->lat_flag = 0;
+	arguments->fingerprint = NULL;
+	arguments->chunks = NULL;
+	arguments->resume = false;
+	arguments->range_from = 0;
+	arguments->range_to = ~0ULL;
 
 	/* Parse our CLI arguments; every option seen by parse_opt will
          * be reflected in arguments.
@@ -127,5 +188,10 @@ void parse_arguments(int argc, char **argv, struct arguments *arguments)
 	    exit(1);
 	}
 
+	if ( (arguments->fingerprint != NULL) && (arguments->chunks != NULL) ) {
+	    printf("-F (--fingerprint) and -K (--verify-chunks) cannot be used together.\n\n");
+	    exit(1);
+	}
+
         //printf ("File: %s\nMODE: %s\nAlgo: %s\nGet: %s\nN_Threads: %d\n", arguments->file, arguments->mode, arguments->algo, arguments->get,arguments->n_threads);
 }
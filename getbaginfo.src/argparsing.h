@@ -9,6 +9,8 @@
 #define ALGORITHM "algorithm"
 #define BAGINFO "baginfo"
 #define BAGIT "bagit"
+/* boringssl has no BLAKE3; ../blake3.c does it */
+#define SN_blake3 "BLAKE3"
 
 /* Program documentation. */
 static char doc[] =
@@ -22,13 +24,23 @@ static char args_doc[] = "FILE";
 static struct argp_option options[] = {
   {"mode",   'm', "MODE", 0, "tar | bag" },
   {"sam",   's', "SAM", 0, "SAM copy number to work with. Currently, only copy 1 is supported." },
-  {"threads",   't', "NUM_THREADS", 0, "Number of threads to use in checksum processing." },
+  {"threads",   't', "NUM_THREADS", 0, "Number of threads to use in checksum processing (1-20), or auto to have it find the number that reads fastest." },
   {"wrapped",  'w', "OFFSET", 0, "Tar file we're after is wrapped in another tar at specified offset." },
   {"fast",  'f', 0, 0,  "If this is a bag, do a fast verify based only on payload-oxum." },
   {"verbose",  'v', 0, 0,  "If this is a bag, print out file details while comparing checksums." },
   {"empties",  'e', 0, 0,  "If this is a bag, print out list of empty files if there are any." },
-  {"algo",   'a', "ALGORITHM", 0, "md5 | sha1 | sha256 | sha512" },
+  {"algo",   'a', "ALGORITHM", 0, "md5 | sha1 | sha256 | sha512 | blake3 (big files hashed on all the threads)" },
   {"get",   'g', "BAG-FILE", 0, "manifest | tagmanifest | algorithm | baginfo" },
+  {"output",   'o', "FORMAT", 0, "text | json | bin -- format of per-file output lines (default text)" },
+  {"cpus",   'C', "CPUS", 0, "Pin the checksum threads to these CPUs: a list (0-7,16-23), nodeN, or hba (the node of the archive's disk adapter)." },
+  {"placement",  'p', 0, 0,  "Report where the checksum threads ran (to stderr)." },
+  {"latency",  'l', 0, 0,  "Report the read latencies of the archive's device (p50/p99/p999, slowest offsets) to stderr." },
+  {"slow",   'L', "MS", 0, "Flag the device as SLOW if its p99 read latency is above MS milliseconds (implies -l)." },
+  {"mem-limit",   'M', "MB", 0, "Keep memory use near MB megabytes, spilling file records to $TMPDIR (for archives with very many members)." },
+  {"fingerprint",   'F', "FILE", 0, "Also write a SHA-256 of each 64MB of each file hashed to FILE, for --verify-chunks (blake3 files, already hashed on all the threads, are left out)." },
+  {"verify-chunks",   'K', "FILE", 0, "Check the files FILE (from --fingerprint) has by their chunks, on all the threads; a file's digest is worked out again only if a chunk is bad." },
+  {"resume",  'r', 0, 0,  "With -K, skip the chunks that an earlier run, since stopped, found good." },
+  {"range",   'R', "FROM-TO", 0, "With -K, check only the chunks in bytes FROM-TO of the archive (e.g. around a slow read from -l); the rest are taken as good." },
   { 0 }
 };
 
@@ -45,7 +57,17 @@ struct arguments
   bool empties;
   int n_threads;
   int sam_copy;
+  int format;
   size_t offset;
+  char *cpus;
+  bool placement;
+  size_t mem_limit;
+  bool latency;
+  double lat_flag;
+  char *fingerprint;
+  char *chunks;
+  bool resume;
+  unsigned long long range_from, range_to;
 };
 
 error_t parse_opt (int key, char *arg, struct argp_state *state);
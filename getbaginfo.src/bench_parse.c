@@ -0,0 +1,484 @@
+/*
+ * bench_parse -- microbenchmarks of getbaginfo's tar and bag parsing.
+ *
+ * To compile (as getbaginfo, with bench_parse.c in place of getbaginfo.c):
+ * gcc -O2 -o bench_parse bench_parse.c argparsing.c spill.c fprint.c ../outfmt.c ../iogov.c ../cpuplace.c ../trace.c ../iolat.c ../blake3.c -lm -lpthread -lrt -I ./boringssl/include -L ./boringssl/build/crypto -L ./boringssl/build/ssl -lssl -lcrypto -lvsm
+ *
+ * Usage:  ./bench_parse [-s scale] [-r runs] [-f filter] [-c earlier-output]
+ *
+ * getbaginfo.c is compiled in whole (its main renamed), so what is timed
+ * is the static functions getbaginfo itself runs: parseFileSize (octal,
+ * base-256 and hex sizes), verify_checksum, is_end_of_archive,
+ * set_filename / set_link_filename, parse_manifest (per manifest line) and
+ * calc_fname_hash (per record), each over generated inputs shaped like
+ * those of a real bag. Each is run -r times (default 5) over scale times
+ * its usual number of inputs (default 1), and the best run is reported,
+ * one line each:
+ *   <name> <ns/op> <allocs/op> <ops>
+ * where allocs are calls to malloc, calloc and realloc, counted by
+ * wrapping glibc's. Only the benchmarks whose names contain -f are run.
+ *
+ * To compare two builds, save the output of one and give it to the other
+ * with -c, which adds the old ns/op and the change:
+ *   ./bench_parse > before.txt
+ *   (change getbaginfo.c, rebuild)
+ *   ./bench_parse -c before.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define main getbaginfo_main
+#include "getbaginfo.c"
+#undef main
+
+#define MAX_BENCH 32
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t m);
+extern void *__libc_realloc(void *p, size_t n);
+
+static unsigned long long allocs;
+
+void *malloc(size_t n)
+{
+    allocs++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t m)
+{
+    allocs++;
+    return __libc_calloc(n, m);
+}
+
+void *realloc(void *p, size_t n)
+{
+    allocs++;
+    return __libc_realloc(p, n);
+}
+
+/* generated inputs */
+#define N_SIZES 4096
+#define N_HEADERS 4096
+#define N_NAMES 4096
+#define N_LINES 100000
+
+static unsigned char sizes[3][N_SIZES][12];     /* octal, base-256, hex */
+static char headers[N_HEADERS][TAR_BLK_SZ];
+static char zeros[TAR_BLK_SZ];
+static char *names[N_NAMES];
+static char bagname[] = "jhu-2024-000123";
+static volatile unsigned long long sink;
+
+typedef struct
+{
+    const char *name;
+    long ops;               /* per run, at scale 1 */
+    void (*setup)(void);
+    void (*run)(long ops);
+    void (*teardown)(void);
+} Bench;
+
+typedef struct
+{
+    char name[64];
+    double ns;
+} Earlier;
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* A payload path as a bag has them: <bag>/data/<box>/<folder>/<item>.<ext>,
+ * about one in eight too long for a plain ustar name. */
+static char *
+gen_name(int i)
+{
+    static const char *ext[] = { "tif", "jpg", "xml", "pdf", "wav", "txt" };
+    char name[TAR_BLK_SZ];
+
+    if (i % 8 == 7)
+        snprintf(name, sizeof(name), "%s/data/Series_%02d_Correspondence_and_Subject_Files/Box%03d/Folder%02d/Digitized_Surrogates/%s_%06d_master.%s",
+                 bagname, i % 5, i % 300, i % 40, bagname, i, ext[i % 6]);
+    else
+        snprintf(name, sizeof(name), "%s/data/Box%03d/Folder%02d/%06d.%s", bagname, i % 300, i % 40, i, ext[i % 6]);
+    return strdup(name);
+}
+
+/* A ustar header for name, with prefix split off if it needs one. */
+static void
+gen_header(char *h, const char *name, size_t size)
+{
+    const char *slash;
+    size_t len = strlen(name);
+    unsigned int sum = 0;
+    int i;
+
+    memset(h, '\0', TAR_BLK_SZ);
+    if (len > 100) {
+        // the last '/' that leaves at most 100 for the name
+        for (slash = name + len - 101; *slash != '/'; slash++)
+            ;
+        memcpy(h + 345, name, slash - name);
+        name = slash + 1;
+    }
+    memcpy(h, name, strlen(name) > 100 ? 100 : strlen(name));
+    memcpy(h + 100, "0000644", 8);
+    memcpy(h + 108, "0001750", 8);
+    memcpy(h + 116, "0001750", 8);
+    snprintf(h + 124, 12, "%011lo", (unsigned long)size);
+    snprintf(h + 136, 12, "%011lo", 1700000000UL);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 265, "fixity", 6);
+    memcpy(h + 297, "fixity", 6);
+    memset(h + 148, ' ', 8);
+    for (i = 0; i < TAR_BLK_SZ; i++)
+        sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+}
+
+static void
+gen_inputs(void)
+{
+    unsigned long long v;
+    char hex[16];
+    int i, j;
+
+    srandom(1);
+    for (i = 0; i < N_NAMES; i++)
+        names[i] = gen_name(i);
+    for (i = 0; i < N_SIZES; i++) {
+        // mostly small files, a few large ones
+        v = (i % 16) ? (unsigned long long)(random() % 10000000) : (unsigned long long)random() * 4096;
+        snprintf((char *)sizes[0][i], 12, "%011llo", v % 077777777777ULL);
+        v += 8589934592ULL;
+        sizes[1][i][0] = 0x80;
+        for (j = 11; j > 0; j--, v >>= 8)
+            sizes[1][i][j] = v & 0xff;
+        snprintf(hex, sizeof(hex), "x%011llx", v & 0xfffffffffffULL);
+        memcpy(sizes[2][i], hex, 12);
+    }
+    for (i = 0; i < N_HEADERS; i++)
+        gen_header(headers[i], names[i % N_NAMES], i * 1000);
+}
+
+static void
+run_size_octal(long ops)
+{
+    size_t filesize;
+    long i;
+
+    for (i = 0; i < ops; i++) {
+        parseFileSize(&filesize, sizes[0][i % N_SIZES], 12);
+        sink += filesize;
+    }
+}
+
+static void
+run_size_base256(long ops)
+{
+    size_t filesize;
+    long i;
+
+    for (i = 0; i < ops; i++) {
+        parseFileSize(&filesize, sizes[1][i % N_SIZES], 12);
+        sink += filesize;
+    }
+}
+
+static void
+run_size_hex(long ops)
+{
+    size_t filesize;
+    long i;
+
+    for (i = 0; i < ops; i++) {
+        parseFileSize(&filesize, sizes[2][i % N_SIZES], 12);
+        sink += filesize;
+    }
+}
+
+static void
+run_verify_checksum(long ops)
+{
+    long i;
+
+    for (i = 0; i < ops; i++)
+        sink += verify_checksum(headers[i % N_HEADERS]);
+}
+
+static void
+run_end_header(long ops)
+{
+    long i;
+
+    for (i = 0; i < ops; i++)
+        sink += is_end_of_archive(headers[i % N_HEADERS]);
+}
+
+static void
+run_end_zeros(long ops)
+{
+    long i;
+
+    for (i = 0; i < ops; i++)
+        sink += is_end_of_archive(zeros);
+}
+
+static NamePool bench_np;
+
+static void
+setup_np(void)
+{
+    init_np(&bench_np);
+}
+
+static void
+teardown_np(void)
+{
+    int i;
+
+    for (i = 0; i <= bench_np.n_pools; i++)
+        free(bench_np.pools[i]);
+    free(bench_np.pools);
+}
+
+static void
+run_set_filename(long ops)
+{
+    GnuTarHeader *h;
+    Record rec;
+    long i;
+
+    for (i = 0; i < ops; i++) {
+        h = (GnuTarHeader *)headers[i % N_HEADERS];
+        set_filename(h->name, h->prefix, &rec, &bench_np, false);
+        sink += (size_t)rec.filename;
+    }
+}
+
+static void
+run_set_filename_ext(long ops)
+{
+    Record rec;
+    long i;
+
+    for (i = 0; i < ops; i++) {
+        set_filename(names[i % N_NAMES], NULL, &rec, &bench_np, true);
+        sink += (size_t)rec.filename;
+    }
+}
+
+static void
+run_set_link_filename(long ops)
+{
+    Record rec;
+    long i;
+
+    for (i = 0; i < ops; i++) {
+        set_link_filename(names[i % N_NAMES], names[(i + 1) % N_NAMES], &rec, &bench_np);
+        sink += (size_t)rec.filename;
+    }
+}
+
+/* parse_manifest() reads the manifest and tagmanifest from fd, and matches
+ * them to the records of the archive: a temp file stands in for the tar. */
+static TarFile bench_tar;
+static BagFile bench_bag;
+static Record bench_manifest, bench_tagmanifest;
+static char bench_path[64];
+
+static void
+setup_manifest(void)
+{
+    FILE *f;
+    size_t n;
+    int i, mfd;
+
+    // made once, and kept for the other runs
+    if (bench_tar.recs != NULL)
+        return;
+    snprintf(bench_path, sizeof(bench_path), "/tmp/bench_parse.XXXXXX");
+    mfd = mkstemp(bench_path);
+    if (mfd < 0) {
+        perror(bench_path);
+        exit(1);
+    }
+    unlink(bench_path);
+    f = fdopen(dup(mfd), "w");
+    bench_tar.recs = __libc_malloc(sizeof(Record)*(N_LINES+1));
+    bench_tar.n_recs = N_LINES;
+    for (i = 0, n = 0; i < N_LINES; i++) {
+        memset(&bench_tar.recs[i], '\0', sizeof(Record));
+        bench_tar.recs[i].type = 0;
+        bench_tar.recs[i].filename = (i < N_NAMES) ? names[i] : gen_name(i);
+        // manifest lines are not in archive order
+        n += fprintf(f, "%032x  %s\n", (unsigned int)random(), gen_name((i * 7919) % N_LINES) + strlen(bagname) + 1);
+    }
+    fflush(f);
+    bench_manifest.offset = 0;
+    bench_manifest.filesize = n;
+    bench_tagmanifest.offset = (n + TAR_BLK_SZ - 1) / TAR_BLK_SZ;
+    fseek(f, bench_tagmanifest.offset * TAR_BLK_SZ, SEEK_SET);
+    n = fprintf(f, "%032x  bagit.txt\n%032x  bag-info.txt\n%032x  manifest-md5.txt\n", 1, 2, 3);
+    bench_tagmanifest.filesize = n;
+    fclose(f);
+    calc_fname_hash(bench_tar.recs, bench_tar.n_recs);
+
+    fd = mfd;
+    bench_bag.tarFile = &bench_tar;
+    bench_bag.bagname = bagname;
+    bench_bag.manifest = &bench_manifest;
+    bench_bag.tagmanifest = &bench_tagmanifest;
+}
+
+static void
+run_parse_manifest(long ops)
+{
+    long i;
+
+    // ops is a multiple of the lines in the manifest
+    for (i = 0; i < ops; i += N_LINES)
+        parse_manifest(&bench_bag);
+}
+
+static Record *fname_recs;
+
+static void
+setup_fname(void)
+{
+    int i;
+
+    if (fname_recs != NULL)
+        return;
+    fname_recs = __libc_calloc(N_NAMES, sizeof(Record));
+    for (i = 0; i < N_NAMES; i++)
+        fname_recs[i].filename = names[i];
+}
+
+static void
+run_calc_fname_hash(long ops)
+{
+    long i;
+
+    for (i = 0; i < ops; i += N_NAMES)
+        calc_fname_hash(fname_recs, N_NAMES);
+}
+
+static Bench benches[] = {
+    { "parseFileSize/octal",      4000000, NULL, run_size_octal, NULL },
+    { "parseFileSize/base256",    4000000, NULL, run_size_base256, NULL },
+    { "parseFileSize/hex",        1000000, NULL, run_size_hex, NULL },
+    { "verify_checksum",          1000000, NULL, run_verify_checksum, NULL },
+    { "is_end_of_archive/header", 4000000, NULL, run_end_header, NULL },
+    { "is_end_of_archive/zeros",  1000000, NULL, run_end_zeros, NULL },
+    { "set_filename/ustar",       1000000, setup_np, run_set_filename, teardown_np },
+    { "set_filename/extended",    1000000, setup_np, run_set_filename_ext, teardown_np },
+    { "set_link_filename",        1000000, setup_np, run_set_link_filename, teardown_np },
+    { "parse_manifest/line",      N_LINES*2, setup_manifest, run_parse_manifest, NULL },
+    { "calc_fname_hash/record",   N_NAMES*64, setup_fname, run_calc_fname_hash, NULL },
+};
+
+static int
+load_earlier(const char *name, Earlier *e)
+{
+    char line[256];
+    FILE *f;
+    int n = 0;
+
+    f = fopen(name, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open %s\n", name);
+        exit(1);
+    }
+    while (n < MAX_BENCH && fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "%63s %lf", e[n].name, &e[n].ns) == 2)
+            n++;
+    fclose(f);
+    return n;
+}
+
+int
+main(int argc, char **argv)
+{
+    Earlier earlier[MAX_BENCH];
+    const char *filter = NULL, *compare = NULL;
+    double t, best, best_allocs;
+    unsigned long long a;
+    int opt, runs = 5, n_earlier = 0, b, r, i;
+    long ops, scale = 1;
+
+    while ((opt = getopt(argc, argv, "s:r:f:c:")) != -1) {
+        switch (opt) {
+            case 's':
+                scale = atol(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'c':
+                compare = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s scale] [-r runs] [-f filter] [-c earlier-output]\n", argv[0]);
+                return (1);
+        }
+    }
+    if (scale < 1 || runs < 1) {
+        fprintf(stderr, "Scale and runs must be at least 1\n");
+        return (1);
+    }
+    if (compare != NULL)
+        n_earlier = load_earlier(compare, earlier);
+
+    CRYPTO_library_init();
+    algo = strdup(SN_md5);
+    gen_inputs();
+
+    for (b = 0; b < (int)(sizeof(benches)/sizeof(benches[0])); b++) {
+        if (filter != NULL && strstr(benches[b].name, filter) == NULL)
+            continue;
+        ops = benches[b].ops * scale;
+        best = 0;
+        best_allocs = 0;
+        for (r = 0; r < runs; r++) {
+            if (benches[b].setup != NULL)
+                benches[b].setup();
+            a = allocs;
+            t = now_ns();
+            benches[b].run(ops);
+            t = now_ns() - t;
+            a = allocs - a;
+            if (benches[b].teardown != NULL)
+                benches[b].teardown();
+            if (r == 0 || t < best) {
+                best = t;
+                best_allocs = (double)a / ops;
+            }
+        }
+        printf("%-26s %10.2f %8.3f %10ld", benches[b].name, best / ops, best_allocs, ops);
+        for (i = 0; i < n_earlier; i++) {
+            if (strcmp(earlier[i].name, benches[b].name) == 0 && earlier[i].ns > 0) {
+                printf("   was %10.2f  %+6.1f%%", earlier[i].ns, (best / ops - earlier[i].ns) * 100 / earlier[i].ns);
+                break;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    return (0);
+}
@@ -0,0 +1,284 @@
+/*
+ * fprint -- fingerprint files and their journals. See fprint.h.
+ *
+ * The file is a header (FP_MAGIC, the archive's size, FP_CHUNK_SZ) and then
+ * the members, each an FpRec and its chunk digests, in the order they were
+ * hashed. The journal is the archive offsets of the chunks checked good, 8
+ * bytes each, appended one write at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "./fprint.h"
+
+#define FP_MAGIC "FIXFP1\n"
+
+typedef struct
+{
+    char magic[8];
+    uint64_t archive_size;
+    uint64_t chunk_sz;
+} FpHead;
+
+struct FpFile
+{
+    char path[PATH_MAX];
+    int fd;
+    int jfd;                /* journal */
+    pthread_mutex_t lock;
+    /* read */
+    unsigned char *data;
+    const FpRec **recs;     /* by offset */
+    size_t n;
+    uint64_t *done;         /* journal, sorted */
+    size_t n_done;
+};
+
+static void *
+xmalloc(size_t n)
+{
+    void *p = malloc(n);
+
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void
+write_all(FpFile *f, int fd, const void *buf, size_t n)
+{
+    const unsigned char *p = buf;
+    ssize_t w;
+
+    while (n > 0) {
+        w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            fprintf(stderr, "Cannot write %s: %s\n", f->path, strerror(errno));
+            exit(1);
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static FpFile *
+fp_new(const char *path)
+{
+    FpFile *f = xmalloc(sizeof(FpFile));
+
+    memset(f, 0, sizeof(FpFile));
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    f->fd = f->jfd = -1;
+    pthread_mutex_init(&f->lock, NULL);
+    return f;
+}
+
+FpFile *
+fp_create(const char *path, uint64_t archive_size)
+{
+    FpFile *f = fp_new(path);
+    FpHead h;
+
+    f->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (f->fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FP_MAGIC, sizeof(FP_MAGIC));
+    h.archive_size = archive_size;
+    h.chunk_sz = FP_CHUNK_SZ;
+    write_all(f, f->fd, &h, sizeof(h));
+    return f;
+}
+
+void
+fp_add(FpFile *f, const FpRec *r, const uint8_t *chunks)
+{
+    pthread_mutex_lock(&f->lock);
+    write_all(f, f->fd, r, sizeof(FpRec));
+    write_all(f, f->fd, chunks, (size_t)r->n_chunks * FP_CHUNK_MD);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static int
+rec_compare(const void *a, const void *b)
+{
+    const FpRec *ra = *(const FpRec **)a, *rb = *(const FpRec **)b;
+
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+static int
+u64_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* All of fd, from where it is. */
+static unsigned char *
+read_all(int fd, const char *name, size_t *len)
+{
+    struct stat st;
+    unsigned char *buf;
+    ssize_t r;
+    size_t n = 0;
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    buf = xmalloc(st.st_size + 1);
+    while ((r = read(fd, buf + n, st.st_size - n)) > 0)
+        n += r;
+    if (r < 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    *len = n;
+    return buf;
+}
+
+static void
+load_journal(FpFile *f, int resume)
+{
+    char jname[PATH_MAX + 8];
+    unsigned char *buf;
+    size_t len;
+
+    snprintf(jname, sizeof(jname), "%s.done", f->path);
+    f->jfd = open(jname, O_RDWR|O_CREAT|O_APPEND|(resume ? 0 : O_TRUNC), 0644);
+    if (f->jfd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", jname, strerror(errno));
+        exit(1);
+    }
+    if (!resume)
+        return;
+    buf = read_all(f->jfd, jname, &len);
+    // a write cut short by a crash leaves a piece of an offset: not counted
+    f->n_done = len / sizeof(uint64_t);
+    f->done = (uint64_t *)buf;
+    qsort(f->done, f->n_done, sizeof(uint64_t), u64_compare);
+    if (f->n_done > 0)
+        fprintf(stderr, "Resuming from %s: %zu chunks already checked\n", jname, f->n_done);
+}
+
+FpFile *
+fp_load(const char *path, uint64_t archive_size, int resume)
+{
+    FpFile *f = fp_new(path);
+    const FpHead *h;
+    const FpRec *r;
+    size_t len, at, cap = 0;
+
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    f->data = read_all(f->fd, path, &len);
+    h = (const FpHead *)f->data;
+    if (len < sizeof(FpHead) || memcmp(h->magic, FP_MAGIC, sizeof(FP_MAGIC)) != 0 || h->chunk_sz != FP_CHUNK_SZ) {
+        fprintf(stderr, "%s is not a fingerprint file\n", path);
+        exit(1);
+    }
+    if (h->archive_size != archive_size) {
+        fprintf(stderr, "%s is of an archive of %llu bytes, not this one (%llu)\n", path,
+                (unsigned long long)h->archive_size, (unsigned long long)archive_size);
+        exit(1);
+    }
+    for (at = sizeof(FpHead); at + sizeof(FpRec) <= len; at += sizeof(FpRec) + (size_t)r->n_chunks * FP_CHUNK_MD) {
+        r = (const FpRec *)(f->data + at);
+        if (at + sizeof(FpRec) + (size_t)r->n_chunks * FP_CHUNK_MD > len)
+            break;
+        if (f->n == cap) {
+            cap = cap ? cap*2 : 1024;
+            f->recs = realloc(f->recs, sizeof(FpRec *)*cap);
+            if (f->recs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        f->recs[f->n++] = r;
+    }
+    if (at != len)
+        fprintf(stderr, "%s ends in a partial record; the members before it are used\n", path);
+    qsort(f->recs, f->n, sizeof(FpRec *), rec_compare);
+    load_journal(f, resume);
+    return f;
+}
+
+const FpRec *
+fp_find(FpFile *f, uint64_t offset, uint64_t size)
+{
+    size_t lo = 0, hi = f->n, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (f->recs[mid]->offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < f->n && f->recs[lo]->offset == offset && f->recs[lo]->size == size)
+        return f->recs[lo];
+    return NULL;
+}
+
+const uint8_t *
+fp_chunk(const FpRec *r, uint32_t i)
+{
+    return (const uint8_t *)(r + 1) + (size_t)i * FP_CHUNK_MD;
+}
+
+int
+fp_done(FpFile *f, uint64_t offset)
+{
+    return f->n_done > 0 && bsearch(&offset, f->done, f->n_done, sizeof(uint64_t), u64_compare) != NULL;
+}
+
+void
+fp_mark(FpFile *f, uint64_t offset)
+{
+    // O_APPEND: each 8 bytes lands whole, whatever the other threads do
+    write_all(f, f->jfd, &offset, sizeof(offset));
+}
+
+void
+fp_close(FpFile *f, int complete)
+{
+    char jname[PATH_MAX + 8];
+
+    if (f == NULL)
+        return;
+    if (f->data == NULL && close(f->fd) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", f->path, strerror(errno));
+        exit(1);
+    }
+    if (f->jfd >= 0) {
+        close(f->jfd);
+        snprintf(jname, sizeof(jname), "%s.done", f->path);
+        if (complete)
+            unlink(jname);
+    }
+    if (f->data != NULL)
+        close(f->fd);
+    free(f->data);
+    free(f->recs);
+    free(f->done);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
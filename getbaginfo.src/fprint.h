@@ -0,0 +1,61 @@
+/*
+ * fprint -- chunk digests of an archive's members (getbaginfo
+ * --fingerprint, --verify-chunks).
+ *
+ * A fingerprint file has, for each member a run hashed, its digest in the
+ * run's algorithm and a SHA-256 of each FP_CHUNK_SZ of it. A later run can
+ * check a member against its chunks instead: on all its threads at once,
+ * where the whole-file MD5 or SHA can only be done on one, and only as much
+ * of it as is wanted. The member's digest is taken from the file when every
+ * chunk checked is good, and worked out again from the data only when one
+ * is not.
+ *
+ * Each chunk found good is added to a journal beside the file (<file>.done)
+ * as soon as it is; a run that is stopped, or kept to a --range, can be
+ * resumed from it, and one that checks every chunk removes it.
+ */
+#ifndef FPRINT_H
+#define FPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FP_CHUNK_SZ 67108864
+#define FP_CHUNK_MD 32      /* SHA-256 */
+
+/* One member; n_chunks chunk digests follow it in the file. */
+typedef struct
+{
+    uint64_t offset;        /* of its data, in bytes into the archive */
+    uint64_t size;
+    uint32_t n_chunks;
+    uint8_t md_len;
+    char algo[11];          /* of md, as getbaginfo names it (MD5, SHA256...) */
+    uint8_t md[64];
+} FpRec;
+
+typedef struct FpFile FpFile;
+
+/* A new fingerprint file for an archive of archive_size bytes. */
+FpFile *fp_create(const char *path, uint64_t archive_size);
+/* Add a member (from any thread). */
+void fp_add(FpFile *f, const FpRec *r, const uint8_t *chunks);
+
+/* Read a fingerprint file, which must be of an archive of archive_size
+ * bytes. With resume, the chunks its journal has are taken as good;
+ * without, the journal is started again. */
+FpFile *fp_load(const char *path, uint64_t archive_size, int resume);
+/* The member whose data is at offset, if it has that size. */
+const FpRec *fp_find(FpFile *f, uint64_t offset, uint64_t size);
+/* Chunk i's digest. */
+const uint8_t *fp_chunk(const FpRec *r, uint32_t i);
+/* Whether the chunk at offset (into the archive) is in the journal. */
+int fp_done(FpFile *f, uint64_t offset);
+/* Put it there (from any thread). */
+void fp_mark(FpFile *f, uint64_t offset);
+
+/* Write out or let go of f; complete: every chunk of the archive is now
+ * checked, so its journal goes. */
+void fp_close(FpFile *f, int complete);
+
+#endif
@@ -1,6 +1,8 @@
 /*
  * To compile:
- * gcc -o getbaginfo getbaginfo.c argparsing.c -lm -lpthread -I ./boringssl/include -L ./boringssl/build/crypto -L ./boringssl/build/ssl -lssl -lcrypto -lvsm
+ * gcc -o getbaginfo getbaginfo.c argparsing.c spill.c fprint.c ../outfmt.c ../iogov.c ../cpuplace.c ../trace.c ../iolat.c ../blake3.c -lm -lpthread -lrt -I ./boringssl/include -L ./boringssl/build/crypto -L ./boringssl/build/ssl -lssl -lcrypto -lvsm
+ *
+ * Add -DFIXITY_TRACE for the spans of ../trace.h (FIXITY_TRACE=<file> at run time).
  *
  * Usage:  ./getbaginfo -m bag <archive>
  */
@@ -14,11 +16,20 @@
 #include <string.h>
 #include <math.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <stdbool.h>
 #include "vsm/stat.h"
 #include <vsm/diskvols.h>
 #include "/opt/vsm/include/lib.h"
 #include "./argparsing.h"
+#include "./spill.h"
+#include "./fprint.h"
+#include "../outfmt.h"
+#include "../iogov.h"
+#include "../cpuplace.h"
+#include "../trace.h"
+#include "../iolat.h"
+#include "../blake3.h"
 #include "./boringssl/include/openssl/evp.h"
 #include "./boringssl/include/openssl/digest.h"
 #include "./boringssl/include/openssl/nid.h"
@@ -51,6 +62,7 @@ typedef enum {
     NAME_POOL = 1048576, /* Each string pool is 1MB */
     RECORDS_CHUNK = 20000,
     MD_BUF_SZ = 4194304,
+    B3_PART_SZ = 67108864, /* BLAKE3: a file is hashed on all the threads in parts of this much */
     PREFETCH = 8388608 
 } MyEnum;
 // 8388608
@@ -221,15 +233,57 @@ typedef struct tpool {
          pthread_cond_t queue_empty;
          int queue_closed;
          int shutdown;
+         int started;     /* threads that have taken their CPU */
+         int active;      /* jobs being worked on */
+         int limit;       /* threads that may take jobs (-t auto) */
+         bool tuning;
+         pthread_t tuner;
 } *tpool_t;
 
+/* -t auto: the pool starts TUNE_START threads working, and every
+ * TUNE_SECS seconds tpool_tune() moves the number up or down a thread at a
+ * time, keeping a move only if it paid off. */
+#define TUNE_MAX 20
+#define TUNE_START 2
+#define TUNE_SECS 2
+#define TUNE_GAIN 1.05      /* a move up has to add 5% to be kept */
+#define TUNE_LOSS 0.95      /* a move down may cost up to 5% */
+#define TUNE_IOWAIT 0.40    /* iowait share above which a steady level is tried lower first */
+#define TUNE_PROBE 5        /* steady intervals before trying a move again */
+
+/* what -t auto settled on, for the summary */
+typedef struct
+{
+    int level;
+    int lo, hi;             /* fewest and most threads tried */
+    double rate;            /* bytes/s at level, when last measured */
+} Tuned;
+
 // 5MB
 //const int MAX_MANIFEST = 5242880;
 const int MAX_MANIFEST = 104857600;
 const char TAR_MAGIC[] = "ustar";
 int fd;
+// read limit for the archive's device or VSN (../iogov.h), shared by the md_calc threads
+IoGov *gov;
+// read latencies of the archive's device (-l), from the md_calc threads
+IoLat *lat;
+// CPUs the checksum threads are pinned to (-C); each keeps its read buffer
+CpuList cpus;
+static __thread unsigned char *md_buf;
+// bytes read by md_calc so far, for -t auto
+unsigned long long hashed;
+Tuned tuned;
+// --fingerprint: chunk digests written as files are hashed; --verify-chunks: read
+FpFile *fp_out, *fp_in;
+// --range: the archive bytes whose chunks --verify-chunks checks
+unsigned long long fp_from, fp_to;
+// chunks checked, found bad, and not checked (journal, --range)
+unsigned long long chunks_checked, chunks_bad, chunks_skipped;
+unsigned long long chunks_outside;     /* of chunks_skipped, outside --range */
 unsigned char *f_mmap;
 char *algo = NULL;
+OutBuf out;
 
 extern int errno;
 
@@ -237,8 +291,12 @@ extern int errno;
 void tpool_init(tpool_t *tpoolp, int num_worker_threads);
 int tpool_add_work(tpool_t tpool, void *routine, void *arg);
 int tpool_destroy(tpool_t tpoolp, int finish);
+void tpool_wait(tpool_t tpool);
 void *tpool_thread(void *tpoolvar);
+void *tpool_tune(void *tpoolvar);
 static void md_calc(Record *rec);
+static void add_md_work(tpool_t tpool, Record *rec);
+static void fp_end(void);
 static void calc_fname_hash(Record *recs, int num_recs);
 static void calc_fname_hash_from_manifest_bits(char *bagname, char *filename, unsigned char *hash, unsigned int *mdLen);
 static bool get_next_tar_header(GnuTarHeader *tarHeader, TarFile *tarFile, TarFileBuffer *tarBuf, int *flag);
@@ -377,7 +435,6 @@ static void
 check_np_space(NamePool *np, short int len, int *offset)
 {
     int remaining = 0;
-    int i;
 
     if (len > TAR_BLK_SZ) {
         fprintf(stderr, "check_np_space :: filename length is greater than %d. Something is wrong.\n", TAR_BLK_SZ);
@@ -542,38 +599,34 @@ check_recs(TarFile *tarFile, Record **recs)
     return retval;
 }
 
+// how far behind the header walk the mapped archive is let go
+#define MAP_DROP 8388608
+
+/* Call fn with the Record of each member, in archive order. Names go into
+ * np and are left there; what to keep of them is up to fn. */
 static void
-get_headers_from_tar(TarFile *tarFile, Record **recs)
+each_header(TarFile *tarFile, NamePool *np, void (*fn)(Record *rec, void *arg), void *arg)
 {
 	TarFileBuffer tarBuf;
         GnuTarHeader tarHeader;
-	NamePool *np;
+	Record rec;
 	int flag;
 	size_t filesize;
-
-	tarFile->np = malloc(sizeof(NamePool));
-	np = tarFile->np;
-	// initialize NamePool
-	init_np(np);
+	size_t dropped = 0, pos;
 
 	// set up memory map for file (this is the entire TAR file)
 	f_mmap = mmap(NULL, tarFile->size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-	// spin up thread pool of one thread to build Records
-        // Now spin up a thread pool and work queue and start adding jobs to the queue
-        // one job is the file descriptor, the file offset, size
-
 	tarBuf.do_prefetch = true;
 	tarBuf.prefetch = 0;
 	tarBuf.bufsize = 0;
 	tarBuf.buf_bytes_read = 0;
 	tarBuf.total_bytes_read = 0;
-	tarFile->n_recs = 0;
+	memset(&rec, '\0', sizeof(rec));
 
 	// each time through this loop, a new tar record will be processed
 	// there are not multiple iterations for, e.g. an extended ('L') header
 	while (get_next_tar_header(&tarHeader, tarFile, &tarBuf, &flag)) {
-	    //printf("%d\n", tarFile->n_recs);
 	    switch(flag) {
 		case EMPTY:
 		    // do nothing
@@ -582,52 +635,40 @@ get_headers_from_tar(TarFile *tarFile, Record **recs)
 		    //printf("EXTENDED!\n");
 		    // get the extended name
 		    get_next_tar_header(&tarHeader, tarFile, &tarBuf, &flag);
-		    set_name_in_rec(&tarHeader, &(*recs)[tarFile->n_recs], np, 'L');
-		    //printf("recs[%d].filename = %s\n", tarFile->n_recs, (*recs)[tarFile->n_recs].filename);
+		    set_name_in_rec(&tarHeader, &rec, np, 'L');
 
 		    // read next 512-bytes into tarHeader
 		    get_next_tar_header(&tarHeader, tarFile, &tarBuf, &flag);
-		    (*recs)[tarFile->n_recs].type = strtol(&tarHeader.typeflag,NULL,10);
+		    rec.type = strtol(&tarHeader.typeflag,NULL,10);
 
 		    parseFileSize(&filesize, tarHeader.size, 12);
-		    (*recs)[tarFile->n_recs].filesize = filesize;
-		    (*recs)[tarFile->n_recs].offset = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes)/TAR_BLK_SZ;
+		    rec.filesize = filesize;
+		    rec.offset = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes)/TAR_BLK_SZ;
 
 	            advance_tar_buffer(&tarBuf, filesize);
-		    tarFile->n_recs++;
-		    if (check_recs(tarFile, recs)) {
-		        //printf("%d - %s\n", tarFile->n_recs-1, (*recs)[tarFile->n_recs-1].filename);
-		    }
+		    fn(&rec, arg);
 		    break;
 		case NORMAL:
 		    //printf("NORMAL!\n");
-		    set_name_in_rec(&tarHeader, &(*recs)[tarFile->n_recs], np, tarHeader.typeflag);
-		    //printf("recs[%d].filename = %s\n", tarFile->n_recs, (*recs)[tarFile->n_recs].filename);
-		    (*recs)[tarFile->n_recs].type = strtol(&tarHeader.typeflag,NULL,10);
+		    set_name_in_rec(&tarHeader, &rec, np, tarHeader.typeflag);
+		    rec.type = strtol(&tarHeader.typeflag,NULL,10);
 
 		    parseFileSize(&filesize, tarHeader.size, 12);
-		    (*recs)[tarFile->n_recs].filesize = filesize;
-		    (*recs)[tarFile->n_recs].offset = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes)/TAR_BLK_SZ;
+		    rec.filesize = filesize;
+		    rec.offset = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes)/TAR_BLK_SZ;
 
 	            advance_tar_buffer(&tarBuf, filesize);
-		    tarFile->n_recs++;
-		    if (check_recs(tarFile, recs)) {
-		        //printf("%d - %s\n", tarFile->n_recs-1, (*recs)[tarFile->n_recs-1].filename);
-		    }
+		    fn(&rec, arg);
 		    break;
 		case NONFILE:
 		    //printf("NONFILE!\n");
-		    set_name_in_rec(&tarHeader, &(*recs)[tarFile->n_recs], np, tarHeader.typeflag);
-		    //printf("recs[%d].filename = %s\n", tarFile->n_recs, (*recs)[tarFile->n_recs].filename);
-		    (*recs)[tarFile->n_recs].type = strtol(&tarHeader.typeflag,NULL,10);
+		    set_name_in_rec(&tarHeader, &rec, np, tarHeader.typeflag);
+		    rec.type = strtol(&tarHeader.typeflag,NULL,10);
 
-		    (*recs)[tarFile->n_recs].filesize = 0;
-		    (*recs)[tarFile->n_recs].offset = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes)/TAR_BLK_SZ;
+		    rec.filesize = 0;
+		    rec.offset = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes)/TAR_BLK_SZ;
 
-		    tarFile->n_recs++;
-		    if (check_recs(tarFile, recs)) {
-		        //printf("%d - %s\n", tarFile->n_recs-1, (*recs)[tarFile->n_recs-1].filename);
-		    }
+		    fn(&rec, arg);
 		    break;
 		case BADMAGIC:
 		    fprintf(stderr, "Encountered bad magic in tar header.\n");
@@ -639,10 +680,49 @@ get_headers_from_tar(TarFile *tarFile, Record **recs)
 		    printf("WTF. The flag = %c\n", flag);
 		    break;
 	    }
+	    // pages of headers already read (and of payload read around them)
+	    // would otherwise stay mapped, and count, to the end of the walk
+	    pos = (tarBuf.total_bytes_read + tarFile->sam_offset_bytes) & ~(size_t)(PAGE_SZ-1);
+	    if (pos > dropped + MAP_DROP && pos <= tarFile->size) {
+	        madvise(f_mmap + dropped, pos - dropped, MADV_DONTNEED);
+		dropped = pos;
+	    }
 	}
         munmap(f_mmap,tarFile->size);
 }
 
+typedef struct
+{
+    TarFile *tarFile;
+    Record **recs;
+} RecList;
+
+/* each_header() callback: add the Record to the array. */
+static void
+append_rec(Record *rec, void *arg)
+{
+    RecList *l = arg;
+
+    (*l->recs)[l->tarFile->n_recs] = *rec;
+    l->tarFile->n_recs++;
+    check_recs(l->tarFile, l->recs);
+}
+
+static void
+get_headers_from_tar(TarFile *tarFile, Record **recs)
+{
+	RecList l;
+
+	tarFile->np = malloc(sizeof(NamePool));
+	// initialize NamePool
+	init_np(tarFile->np);
+
+	tarFile->n_recs = 0;
+	l.tarFile = tarFile;
+	l.recs = recs;
+	each_header(tarFile, tarFile->np, append_rec, &l);
+}
+
 static void
 check_prefetch(TarFileBuffer *tarBuf, size_t offset, size_t tar_size)
 {
@@ -834,6 +914,21 @@ verify_bag_payload_oxum(BagFile *bagFile)
     return false;
 }
 
+/* Order of preference among a bag's manifests: the strongest SHA over the
+ * weaker ones, and BLAKE3 over them all, as its big files are hashed on all
+ * the threads. */
+static int
+algo_rank(const char *a)
+{
+    static const char *order[] = {SN_md5, SN_sha1, SN_sha256, SN_sha512, SN_blake3};
+    int i;
+
+    for (i = 0; i < 5; i++)
+        if (strcasecmp(a, order[i]) == 0)
+            return i;
+    return -1;
+}
+
 static void
 init_bag(BagFile *bagFile)
 {
@@ -871,9 +966,9 @@ init_bag(BagFile *bagFile)
     // EXAMPLE:
     // name-of-bag/bag-info.txt
     // name-of-bag/bagit.txt
-    // name-of-bag/manifest-md5.txt (OR manifest-sha1.txt ; manifest-sha256.txt ; manifest-sha512.txt)
+    // name-of-bag/manifest-md5.txt (OR manifest-sha1.txt ; manifest-sha256.txt ; manifest-sha512.txt ; manifest-blake3.txt)
     // name-of-bag/tagmanifest-md5.txt
-    // algos: md5, sha1, sha256, sha512
+    // algos: md5, sha1, sha256, sha512, blake3
 
     // Review all the records looking for bag metadata files
     // First record should be the top-level bag directory: "bagname/" -- this is NOT the case for files created on Windows by DMS using the PackageTool!!!
@@ -909,26 +1004,16 @@ init_bag(BagFile *bagFile)
                 tmpalgo = SN_sha256;
             else if (strcmp(test,"sha512.txt") == 0)
                 tmpalgo = SN_sha512;
+            else if (strcmp(test,"blake3.txt") == 0)
+                tmpalgo = SN_blake3;
+            else
+                continue;
 
-	    if (algo == NULL) {
+	    // Choose the strongest algorithm 
+	    if (algo == NULL || algo_rank(tmpalgo) > algo_rank(algo)) {
 	        algo = strdup(tmpalgo);
                 bagFile->manifest = &recs[i];
 	    }
-	    // Choose the strongest algorithm 
-	    else if ( (strcmp(algo, SN_sha512) != 0) && (tmpalgo != SN_md5) ) {
-	        if (strcmp(algo, SN_md5) == 0) {
-		    algo = strdup(tmpalgo);
-		    bagFile->manifest = &recs[i];
-		}
-		else if (tmpalgo == SN_sha512) {
-		    algo = strdup(tmpalgo);
-		    bagFile->manifest = &recs[i];
-		}
-		else if ( (strcmp(algo, SN_sha1) == 0) && (tmpalgo == SN_sha256) ) {
-		    algo = strdup(tmpalgo);
-		    bagFile->manifest = &recs[i];
-		}
-	    }
         }
     }
     // Now get everything else; Assume that tagmanifest has same algo as main manifest
@@ -1032,7 +1117,6 @@ parse_manifest(BagFile *bagFile)
     Record *recs;
     unsigned char *buffer;
     char *line;
-    char *tmp;
     char csum[130];
     char fname[512];
     int i,j,len;
@@ -1182,7 +1266,7 @@ get_dk_info(TarFile *tarFile)
 {
     struct sam_stat sb;
     char dk_name[256];
-    const char *DKROOT = "/dkarcs/";
+    const char *DKROOT = getenv("DKROOT");
     int64_t dknum;
     int len = 0;
 
@@ -1193,6 +1277,10 @@ get_dk_info(TarFile *tarFile)
             exit(1);
     }
 
+    // $DKROOT: where the disk archives are mounted, if not /dkarcs (a testbed)
+    if (DKROOT == NULL || *DKROOT == '\0')
+        DKROOT = "/dkarcs";
+
     if (S_ISREG(sb.st_mode)) {
         if (sb.copy[0].flags & CF_ARCHIVED) {
 	    //printf("media: %s\nvsn: %s\noffset: %lu\nposition: %lu\n", sb.copy[0].media, sb.copy[0].vsn, sb.copy[0].offset, sb.copy[0].position);
@@ -1201,10 +1289,11 @@ get_dk_info(TarFile *tarFile)
 	    len += strlen(DKROOT);
 	    len += strlen(sb.copy[0].vsn);
 	    len += strlen(dk_name);
-	    len += 2; // '/' + '\0'
+	    len += 3; // '/' + '/' + '\0'
 
 	    tarFile->name = malloc(sizeof(char)*len);
 	    strcpy(tarFile->name,DKROOT);
+	    strcat(tarFile->name,"/");
 	    strcat(tarFile->name,sb.copy[0].vsn);
 	    strcat(tarFile->name,"/");
 	    strcat(tarFile->name,dk_name);
@@ -1225,6 +1314,518 @@ get_dk_info(TarFile *tarFile)
     }
 }
 
+/* tar mode: type|offset|size|checksum|filename */
+static void
+print_tar_rec(Record *rec)
+{
+	out_begin(&out);
+	out_u64(&out, "type", rec->type);
+	out_u64(&out, "offset", rec->offset);
+	out_u64(&out, "size", rec->filesize);
+	out_str(&out, "checksum", rec->calc_csum);
+	out_str(&out, "filename", rec->filename);
+	out_end(&out);
+}
+
+/* bag mode with -o json|bin: status|calculated|manifest|size|filename */
+static void
+print_verify_rec(Record *rec, const char *status)
+{
+	out_begin(&out);
+	out_str(&out, "status", status);
+	out_str(&out, "calculated", rec->calc_csum);
+	out_str(&out, "manifest", rec->manifest_csum);
+	out_u64(&out, "size", rec->filesize);
+	out_str(&out, "filename", rec->filename);
+	out_end(&out);
+}
+
+/* bag mode: compare one file's checksums, count it and print it */
+static void
+verify_rec(Record *rec, struct arguments *arguments, int *good, int *bad, int *empty)
+{
+	const char *status;
+
+	if (rec->filesize == 0) {
+	    (*empty)++;
+	    status = "EMPTY";
+	}
+	// don't verify checksums for empty files
+	else if (strcmp(rec->calc_csum, rec->manifest_csum) == 0) {
+	    (*good)++;
+	    status = "GOOD";
+	}
+	else {
+	    (*bad)++;
+	    status = "BAD";
+	}
+
+	if (arguments->format != OUT_TEXT)
+	    print_verify_rec(rec, status);
+	else if (rec->filesize == 0) {
+	    if (arguments->verbose)
+		printf("EMPTY-FILE:  %s\n",rec->filename);
+	}
+	else if (status[0] == 'G') {
+	    if (arguments->verbose)
+		printf("INFO  %s: calculated(%s) manifest(%s) - GOOD!\n",rec->filename,rec->calc_csum, rec->manifest_csum);
+	}
+	else
+	    printf("ERROR  %s: calculated(%s) manifest(%s) - BAD!\n",rec->filename,rec->calc_csum, rec->manifest_csum);
+}
+
+/* -t auto: the number of threads it settled on */
+static void
+print_tuned(FILE *f)
+{
+	if (tuned.rate > 0)
+	    fprintf(f, "Threads (auto): %d, %.1f MB/s (tried %d-%d)\n", tuned.level, tuned.rate/1048576, tuned.lo, tuned.hi);
+	else
+	    fprintf(f, "Threads (auto): %d (too little to measure)\n", tuned.level);
+}
+
+static void
+print_summary(struct arguments *arguments, int good, int bad, int empty)
+{
+	// keep the machine-readable stream clean; the summary goes to stderr
+	FILE *summary = (arguments->format == OUT_TEXT) ? stdout : stderr;
+
+	fprintf(summary, "\nFixity is good for %d out of %d files.\n", good, (good+bad+empty));
+	fprintf(summary, "     Diff: %d\n", bad+empty);
+	if (empty > 0)
+	    fprintf(summary, "\nEmpty (zero-length) files: %d\n", empty);
+	fprintf(summary, "Bad checksums: %d\n", bad);
+	if (arguments->n_threads == 0)
+	    print_tuned(summary);
+	fprintf(summary, "\n");
+}
+
+/*
+ * --mem-limit: the same results, without holding every Record.
+ *
+ * The headers are walked in batches that fit the budget: each batch is
+ * hashed by the thread pool and then either printed (tar mode) or, for a
+ * bag, spilled as SpillRecs sorted by filename hash. The manifest entries
+ * are spilled the same way, the two are merge-joined, and the joined
+ * records are sorted back into archive order to be verified and printed.
+ * Each of the batch, the two spills and the joined spill gets a quarter
+ * of the budget; the threads' read buffers come on top.
+ */
+typedef struct
+{
+    unsigned char fname_hash[16];
+    size_t seq;             /* place in the archive */
+    size_t offset;
+    size_t filesize;
+    char calc_csum[129];
+    char manifest_csum[129];
+    char filename[];
+} SpillRec;
+
+typedef struct
+{
+    unsigned char fname_hash[16];
+    char csum[129];
+} SpillMan;
+
+typedef struct
+{
+    char csum[130];
+    char fname[512];
+    bool used;
+} TagLine;
+
+typedef struct
+{
+    struct arguments *arguments;
+    size_t budget;
+    bool bag;
+    const char *skip;       /* "<bag>/tagmanifest-": not checked */
+    NamePool np;
+    Record *batch;
+    int n, alloc;
+    size_t seq;
+    tpool_t pool;
+    Spill recs;
+    SpillRec *tmp;
+    /* bag metadata, from the first walk */
+    Record *keep;
+    int n_keep, keep_alloc;
+    NamePool keep_np;
+    bool have_data_dir;
+    BagFile *bagFile;
+    char *baginfo_search, *bagit_search, *data_search;
+    int empty;
+} Bounded;
+
+static int
+spill_rec_by_hash(const void *a, const void *b)
+{
+    const SpillRec *x = a, *y = b;
+    int c = memcmp(x->fname_hash, y->fname_hash, 16);
+
+    if (c != 0)
+        return c;
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+static int
+spill_rec_by_seq(const void *a, const void *b)
+{
+    const SpillRec *x = a, *y = b;
+
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+static int
+spill_man_by_hash(const void *a, const void *b)
+{
+    return memcmp(((const SpillMan *)a)->fname_hash, ((const SpillMan *)b)->fname_hash, 16);
+}
+
+/* Empty a NamePool for the next batch, keeping its first pool. */
+static void
+reset_np(NamePool *np)
+{
+	int i;
+
+	for (i=1; i<=np->n_pools; i++)
+	    free(np->pools[i]);
+	np->n_pools = 0;
+	np->current_pool = np->pools[0];
+	np->current_pool_bytes = 0;
+	np->total_bytes = 0;
+}
+
+/* each_header() callback of the first walk: keep what init_bag() looks at. */
+static void
+keep_bag_rec(Record *rec, void *arg)
+{
+    Bounded *b = arg;
+    bool data_dir = (rec->type == 5 && !b->have_data_dir && strstr(rec->filename, "/data/") != NULL);
+
+    if (data_dir || strstr(rec->filename, "/manifest-") != NULL || strstr(rec->filename, "/tagmanifest-") != NULL ||
+        strstr(rec->filename, "/bag-info.txt") != NULL || strstr(rec->filename, "/bagit.txt") != NULL) {
+        if (b->n_keep == b->keep_alloc) {
+            b->keep_alloc = b->keep_alloc ? b->keep_alloc*2 : 64;
+            b->keep = realloc(b->keep, sizeof(Record)*b->keep_alloc);
+        }
+        b->keep[b->n_keep] = *rec;
+        set_filename(rec->filename, NULL, &b->keep[b->n_keep], &b->keep_np, true);
+        b->n_keep++;
+        if (data_dir)
+            b->have_data_dir = true;
+    }
+    reset_np(&b->np);
+}
+
+/* each_header() callback for -f: count the payload like init_bag() does. */
+static void
+count_bag_rec(Record *rec, void *arg)
+{
+    Bounded *b = arg;
+
+    if (strstr(rec->filename, b->baginfo_search) == NULL && strstr(rec->filename, b->bagit_search) == NULL &&
+        strstr(rec->filename, b->skip) == NULL && rec->type == 0 && strstr(rec->filename, b->data_search) != NULL) {
+        b->bagFile->octetcount += rec->filesize;
+        b->bagFile->streamcount++;
+    }
+    reset_np(&b->np);
+}
+
+/* each_header() callback for -e. */
+static void
+print_empty_rec(Record *rec, void *arg)
+{
+    Bounded *b = arg;
+
+    if (rec->type == 0 && rec->filesize == 0 && (b->skip == NULL || strstr(rec->filename, b->skip) == NULL)) {
+        printf("EMPTY-FILE:  %s\n",rec->filename);
+        b->empty++;
+    }
+    reset_np(&b->np);
+}
+
+/* Hash the batch, then print it or spill it. */
+static void
+flush_batch(Bounded *b)
+{
+    SpillRec *t = b->tmp;
+    size_t len;
+    int i;
+
+    TRACE_BEGIN(t_batch);
+    for (i=0; i<b->n; i++)
+        add_md_work(b->pool, &b->batch[i]);
+    tpool_wait(b->pool);
+    TRACE_END(t_batch, "checksums (batch)");
+    if (!b->bag) {
+        for (i=0; i<b->n; i++)
+            print_tar_rec(&b->batch[i]);
+    }
+    else {
+        calc_fname_hash(b->batch, b->n);
+        for (i=0; i<b->n; i++) {
+            len = strlen(b->batch[i].filename);
+            memcpy(t->fname_hash, b->batch[i].fname_hash, 16);
+            t->seq = b->seq++;
+            t->offset = b->batch[i].offset;
+            t->filesize = b->batch[i].filesize;
+            strcpy(t->calc_csum, b->batch[i].calc_csum);
+            memset(t->manifest_csum, '\0', sizeof(t->manifest_csum));
+            memcpy(t->filename, b->batch[i].filename, len+1);
+            spill_add(&b->recs, t, sizeof(SpillRec)+len+1);
+        }
+    }
+    b->n = 0;
+    reset_np(&b->np);
+}
+
+/* each_header() callback of the main walk: batch the files to check. */
+static void
+collect_rec(Record *rec, void *arg)
+{
+    Bounded *b = arg;
+
+    if (rec->type != 0 || (b->skip != NULL && strstr(rec->filename, b->skip) != NULL))
+        return;
+    b->batch[b->n++] = *rec;
+    if (b->n == b->alloc || sizeof(Record)*b->n + NAME_POOL*(b->np.n_pools+1) >= b->budget)
+        flush_batch(b);
+}
+
+/* Manifest lines as SpillMans, read a piece at a time. */
+static void
+spill_manifest(Bounded *b, Spill *mans)
+{
+    Record *m = b->bagFile->manifest;
+    size_t chunk = 1048576, have = 0, done = 0, n;
+    char *buffer, *line, *nl;
+    char fname[513];
+    unsigned int mdLen;
+    SpillMan e;
+
+    buffer = malloc(chunk + TAR_BLK_SZ*4 + 1);
+    while (done < m->filesize || have > 0) {
+        n = m->filesize - done;
+        if (n > chunk)
+            n = chunk;
+        if (n > 0) {
+            pread(fd, buffer + have, n, m->offset*TAR_BLK_SZ + done);
+            done += n;
+            have += n;
+        }
+        buffer[have] = '\0';
+        line = buffer;
+        // whole lines only, until the last piece
+        while ((nl = strchr(line, '\n')) != NULL || (done == m->filesize && *line != '\0')) {
+            if (nl != NULL)
+                *nl = '\0';
+            else
+                nl = line + strlen(line) - 1;
+            // remove windows control character, if it exists
+            char *p = strchr(line, '\r');
+            if (p != NULL)
+                *p = '\0';
+            if (*line != '\0') {
+                memset(&e, '\0', sizeof(e));
+                memset(fname, '\0', sizeof(fname));
+                sscanf(line,"%128s  %511c",e.csum,fname);
+                calc_fname_hash_from_manifest_bits(b->bagFile->bagname,fname,e.fname_hash,&mdLen);
+                spill_add(mans, &e, sizeof(e));
+            }
+            line = nl + 1;
+        }
+        have -= line - buffer;
+        if (have > TAR_BLK_SZ*4) {
+            fprintf(stderr, "Manifest line too long at byte %lu\n", done - have);
+            exit(1);
+        }
+        memmove(buffer, line, have);
+        if (done == m->filesize)
+            break;
+    }
+    free(buffer);
+}
+
+/* tagmanifest lines, with the bag name in front as parse_manifest() has it. */
+static TagLine *
+read_tagmanifest(BagFile *bagFile, int *n_tags)
+{
+    Record *t = bagFile->tagmanifest;
+    TagLine *tags = NULL;
+    char *buffer, *line;
+    char fname[512];
+    int n = 0;
+
+    *n_tags = 0;
+    if (t == NULL)
+        return NULL;
+    buffer = malloc( sizeof(char)*(t->filesize)+1 );
+    pread(fd, buffer, t->filesize, t->offset*TAR_BLK_SZ);
+    buffer[t->filesize] = 0;
+
+    line = strtok(buffer, "\n");
+    while(line) {
+	char *p = strchr(line, '\r');
+	if (p != NULL)
+	    *p = '\0';
+	tags = realloc(tags, sizeof(TagLine)*(n+1));
+	memset(&tags[n], '\0', sizeof(TagLine));
+	memset(fname, '\0', sizeof(fname));
+        sscanf(line,"%129s  %511c",tags[n].csum,fname);
+	if (strlen(fname) == 0)
+	    break;
+	if (snprintf(tags[n].fname, sizeof(tags[n].fname), "%s/%s", bagFile->bagname, fname)
+	    >= (int)sizeof(tags[n].fname)) {
+	    fprintf(stderr, "Tagmanifest name too long, skipped: %s/%s\n", bagFile->bagname, fname);
+	} else {
+	    n++;
+	}
+	line = strtok(NULL, "\n");
+    }
+    free(buffer);
+    *n_tags = n;
+    return tags;
+}
+
+static int
+bounded_main(struct arguments *arguments, TarFile *tarFile)
+{
+	Bounded b;
+	BagFile bagFile;
+	TarFile kept;
+	Spill mans, joined;
+	const SpillRec *r;
+	const SpillMan *m;
+	TagLine *tags = NULL;
+	char *skip = NULL;
+	Record rec;
+	size_t len, mlen;
+	int i, n_tags = 0, good=0, bad=0, empty=0;
+
+	memset(&b, '\0', sizeof(b));
+	b.arguments = arguments;
+	b.budget = arguments->mem_limit / 4;
+	b.bag = (strcmp(arguments->mode,BAG) == 0);
+	init_np(&b.np);
+
+	if (b.bag) {
+	    // what init_bag() needs is a handful of the members: find those first
+	    init_np(&b.keep_np);
+	    each_header(tarFile, &b.np, keep_bag_rec, &b);
+	    kept = *tarFile;
+	    kept.recs = b.keep;
+	    kept.n_recs = b.n_keep;
+	    bagFile.tarFile = &kept;
+	    bagFile.manifest = bagFile.tagmanifest = bagFile.baginfo = bagFile.bagit = NULL;
+	    init_bag(&bagFile);
+	    b.bagFile = &bagFile;
+	    skip = malloc(strlen(bagFile.bagname) + strlen("/tagmanifest-") + 1);
+	    sprintf(skip, "%s/tagmanifest-", bagFile.bagname);
+	    b.skip = skip;
+
+	    if (arguments->fast) {
+	        b.baginfo_search = malloc(strlen(bagFile.bagname) + strlen("/bag-info.txt") + 1);
+	        sprintf(b.baginfo_search, "%s/bag-info.txt", bagFile.bagname);
+	        b.bagit_search = malloc(strlen(bagFile.bagname) + strlen("/bagit.txt") + 1);
+	        sprintf(b.bagit_search, "%s/bagit.txt", bagFile.bagname);
+	        b.data_search = malloc(strlen(bagFile.bagname) + strlen("/data/") + 1);
+	        sprintf(b.data_search, "%s/data/", bagFile.bagname);
+	        bagFile.octetcount = 0;
+	        bagFile.streamcount = 0;
+	        each_header(tarFile, &b.np, count_bag_rec, &b);
+	        if (verify_bag_payload_oxum(&bagFile))
+	            printf("INFO - GOOD - %s  %s\n", bagFile.bagname,bagFile.payloadOxum);
+	        else
+	            printf("ERROR - BAD - %s  Expected|Calculated   %s|%s\n", bagFile.bagname,bagFile.payloadOxum,bagFile.calc_payloadOxum);
+	        return (0);
+	    }
+	    else if (arguments->empties) {
+	        each_header(tarFile, &b.np, print_empty_rec, &b);
+		printf("\nEmpty files: %d\n\n", b.empty);
+	        return (0);
+	    }
+	    else if (arguments->get != NULL) {
+	        print_bag_file(arguments->get,&bagFile);
+	        return (0);
+	    }
+	    if (bagFile.manifest == NULL) {
+	        fprintf(stderr, "There is no manifest file!\n");
+		exit(1);
+	    }
+	    TRACE_BEGIN(t_manifest);
+	    spill_init(&mans, b.budget, spill_man_by_hash);
+	    spill_manifest(&b, &mans);
+	    spill_finish(&mans);
+	    TRACE_END(t_manifest, "spill_manifest");
+	    tags = read_tagmanifest(&bagFile, &n_tags);
+	}
+
+	out_init(&out, STDOUT_FILENO, arguments->format);
+	spill_init(&b.recs, b.budget, spill_rec_by_hash);
+	b.tmp = malloc(sizeof(SpillRec) + TAR_BLK_SZ*2);
+	b.alloc = b.budget / sizeof(Record);
+	b.batch = malloc(sizeof(Record)*b.alloc);
+	tpool_init(&b.pool, arguments->n_threads);
+	each_header(tarFile, &b.np, collect_rec, &b);
+	flush_batch(&b);
+        tpool_destroy(b.pool, 1);
+	free(b.batch);
+	if (arguments->placement)
+	    cpu_report(stderr);
+	if (arguments->n_threads == 0 && !b.bag)
+	    print_tuned(stderr);
+	iolat_report(stderr, arguments->lat_flag);
+
+	if (b.bag) {
+	    // merge-join on the filename hash, into archive order again
+	    TRACE_BEGIN(t_join);
+	    spill_finish(&b.recs);
+	    spill_init(&joined, b.budget, spill_rec_by_seq);
+	    m = spill_next(&mans, &mlen);
+	    while ((r = spill_next(&b.recs, &len)) != NULL) {
+	        memcpy(b.tmp, r, len);
+		while (m != NULL && memcmp(m->fname_hash, r->fname_hash, 16) < 0)
+		    m = spill_next(&mans, &mlen);
+		if (m != NULL && memcmp(m->fname_hash, r->fname_hash, 16) == 0)
+		    strcpy(b.tmp->manifest_csum, m->csum);
+		spill_add(&joined, b.tmp, len);
+	    }
+	    spill_free(&b.recs);
+	    spill_free(&mans);
+	    spill_finish(&joined);
+	    TRACE_END(t_join, "merge-join");
+
+	    while ((r = spill_next(&joined, &len)) != NULL) {
+	        rec.filename = (char *)r->filename;
+		rec.filesize = r->filesize;
+		rec.offset = r->offset;
+		strcpy(rec.calc_csum, r->calc_csum);
+		strcpy(rec.manifest_csum, r->manifest_csum);
+		// the tag files are matched in archive order, as parse_manifest() does
+		for (i=0; i<n_tags; i++) {
+		    if (!tags[i].used && strstr(rec.filename, tags[i].fname) != NULL) {
+		        strcpy(rec.manifest_csum, tags[i].csum);
+			tags[i].used = true;
+			break;
+		    }
+		}
+		verify_rec(&rec, arguments, &good, &bad, &empty);
+	    }
+	    spill_free(&joined);
+	}
+	else
+	    spill_free(&b.recs);
+	out_free(&out);
+	if (b.bag)
+	    print_summary(arguments, good, bad, empty);
+	free(tags);
+	free(skip);
+	free(b.tmp);
+	return (0);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1242,6 +1843,7 @@ main(int argc, char **argv)
 	//printf("size of Record: %d\n", sizeof(Record));
 	parse_arguments(argc, argv, &arguments);
 	algo = strdup(arguments.algo);
+	TRACE_INIT();
 
 	tarFile.sam_offset_bytes = 0;
 	tarFile.is_sam = false;
@@ -1288,6 +1890,26 @@ main(int argc, char **argv)
 	        fprintf(stderr, "Unable to open %s\n", tarFile.name);
 		return (1);
 	}
+	gov = iogov_open(fd, tarFile.name);
+	if (arguments.latency)
+	    lat = iolat_open(fd, tarFile.name);
+	if (arguments.cpus != NULL && cpu_parse(arguments.cpus, fd, &cpus) < 0) {
+	        fprintf(stderr, "Bad CPU list %s\n", arguments.cpus);
+		return (1);
+	}
+	if (arguments.fingerprint != NULL)
+	    fp_out = fp_create(arguments.fingerprint, tarFile.size);
+	if (arguments.chunks != NULL)
+	    fp_in = fp_load(arguments.chunks, tarFile.size, arguments.resume);
+	fp_from = arguments.range_from;
+	fp_to = arguments.range_to;
+	if (arguments.mem_limit > 0) {
+	    bounded_main(&arguments, &tarFile);
+	    fp_end();
+	    TRACE_DUMP();
+	    close(fd);
+	    return (0);
+	}
 
 	// report tar file we're reading and its size
         //printf("file: %s ; size = %lu\n", tarFile.name,tarFile.size);
@@ -1296,11 +1918,15 @@ main(int argc, char **argv)
 	recs = malloc(sizeof(Record)*RECORDS_CHUNK);
 	tarFile.recs_allocation = RECORDS_CHUNK;
 
+	TRACE_BEGIN(t_index);
 	get_headers_from_index(&tarFile,&recs);
+	TRACE_END(t_index, "get_headers_from_index");
         if (recs == NULL) {
 	    //printf("Aw hay, INDEX is null\n");
 	    recs = malloc(sizeof(Record)*RECORDS_CHUNK);
+	    TRACE_BEGIN(t_headers);
   	    get_headers_from_tar(&tarFile,&recs);
+	    TRACE_END(t_headers, "get_headers_from_tar");
         }
 
         // printf("Finished getting records.\n");
@@ -1314,12 +1940,16 @@ print_recs(recs,tarFile.n_recs);
 exit(0);
 */
 
+	TRACE_BEGIN(t_fname);
 	calc_fname_hash(recs, tarFile.n_recs);
+	TRACE_END(t_fname, "calc_fname_hash");
 
 	// If expecting a BagIT "bag", do some more processing.
 	if (strcmp(arguments.mode,BAG) == 0) {
 	    bagFile.tarFile = &tarFile;
+	    TRACE_BEGIN(t_bag);
 	    init_bag(&bagFile);
+	    TRACE_END(t_bag, "init_bag");
 
 	    if (arguments.fast) {
 	        if (verify_bag_payload_oxum(&bagFile)) {
@@ -1354,58 +1984,50 @@ exit(0);
 	        exit(0);
 	    }
 
+	    TRACE_BEGIN(t_manifest);
 	    parse_manifest(&bagFile);
+	    TRACE_END(t_manifest, "parse_manifest");
 	}
 
         // Now spin up a thread pool and work queue and start adding jobs to the queue
         // one job is the file descriptor, the file offset, size
 
+        TRACE_BEGIN(t_pool);
         tpool_init(&csum_thread_pool, arguments.n_threads);
 
         // Add work
 	for (i=0; i<tarFile.n_recs; i++) {
             if (recs[i].type == 0) {
 		//printf("adding work for %s\n", recs[i].filename);
-                tpool_add_work(csum_thread_pool, md_calc, (void *)&recs[i]);
+                add_md_work(csum_thread_pool, &recs[i]);
             }
         }
         tpool_destroy(csum_thread_pool, 1);
+        TRACE_END(t_pool, "checksums");
+        fp_end();
         //printf("Destroyed thread pool\n");
+	if (arguments.placement)
+	    cpu_report(stderr);
+	if (arguments.n_threads == 0 && strcmp(arguments.mode,BAG) != 0)
+	    print_tuned(stderr);
+	iolat_report(stderr, arguments.lat_flag);
 
         // Now print out all the records & verify checksums
+	TRACE_BEGIN(t_out);
+	out_init(&out, STDOUT_FILENO, arguments.format);
 	for (i=0; i<tarFile.n_recs; i++) {
 	    if (recs[i].type == 0) {
-		if (strcmp(arguments.mode,BAG) == 0) {
-		    if (recs[i].filesize == 0) {
-		        empty++;
-			if (arguments.verbose)
-			    printf("EMPTY-FILE:  %s\n",recs[i].filename);
-		    }
-		    else { // don't verify checksums for empty files
-		        if (strcmp(recs[i].calc_csum, recs[i].manifest_csum) == 0) {
-		            good++;
-			    if (arguments.verbose)
-			        printf("INFO  %s: calculated(%s) manifest(%s) - GOOD!\n",recs[i].filename,recs[i].calc_csum, recs[i].manifest_csum);
-		        }
-		        else {
-		            bad++;
-			    printf("ERROR  %s: calculated(%s) manifest(%s) - BAD!\n",recs[i].filename,recs[i].calc_csum, recs[i].manifest_csum);
-		        }
-		    }
-		}
-		else {
-	            printf("%d|%lu|%lu|%s|%s\n",recs[i].type,recs[i].offset,recs[i].filesize,recs[i].calc_csum,recs[i].filename);
-	        }
+		if (strcmp(arguments.mode,BAG) == 0)
+		    verify_rec(&recs[i], &arguments, &good, &bad, &empty);
+		else
+		    print_tar_rec(&recs[i]);
 	    }
         }
-	if (strcmp(arguments.mode,BAG) == 0) {
-	    printf("\nFixity is good for %d out of %d files.\n", good, (good+bad+empty));
-	    printf("     Diff: %d\n", bad+empty);
-	    if (empty > 0)
-	        printf("\nEmpty (zero-length) files: %d\n", empty);
-	        printf("Bad checksums: %d\n", bad);
-	    printf("\n");
-	}
+	out_free(&out);
+	if (strcmp(arguments.mode,BAG) == 0)
+	    print_summary(&arguments, good, bad, empty);
+	TRACE_END(t_out, "output");
+	TRACE_DUMP();
 
 	free(recs);
 	// free NamePool resources?
@@ -1413,6 +2035,327 @@ exit(0);
 	return (0);
 }
 
+/*
+ * BLAKE3 (../blake3.h). A file of more than 2 * B3_PART_SZ is not one job
+ * but one per part: each part, a subtree of the file's 1KB chunks, is read
+ * and hashed by whichever thread takes it, and the last one to finish puts
+ * them together with the file's last chunk. A single big file is then read
+ * and hashed by all the threads, not one.
+ */
+typedef struct B3Split B3Split;
+
+typedef struct
+{
+    B3Split *split;
+    uint64_t chunk;         /* first chunk of the part */
+    uint64_t chunks;
+    uint8_t cv[BLAKE3_OUT_LEN];
+} B3Part;
+
+struct B3Split
+{
+    Record *rec;
+    size_t n;
+    size_t left;            /* parts not yet done */
+    B3Part parts[];
+};
+
+/* Hash n bytes of rec, from its byte at, into b3 or ctx. */
+static void
+read_part(Blake3 *b3, EVP_MD_CTX *ctx, Record *rec, size_t at, size_t n)
+{
+        unsigned long int offset = rec->offset*TAR_BLK_SZ + at;
+        unsigned long long t_lat;
+        size_t bytes_read;
+
+        // allocated by this thread, so on its node; kept for its next record
+        if (md_buf == NULL)
+            md_buf = cpu_alloc_local(sizeof(unsigned char)*MD_BUF_SZ);
+        while (n > 0) {
+                TRACE_BEGIN(t_read);
+                if (n > (MD_BUF_SZ*2))
+                    posix_fadvise64(fd,offset+MD_BUF_SZ,MD_BUF_SZ*2,POSIX_FADV_WILLNEED);
+                t_lat = iolat_start(lat);
+                if ((bytes_read = pread(fd,md_buf,(n < MD_BUF_SZ) ? n : MD_BUF_SZ,offset)) == (size_t)-1)
+                    perror("pread"), exit(-1);
+                iolat_end(lat,t_lat,NULL,offset,bytes_read);
+                iogov_take(gov,bytes_read);
+                TRACE_END(t_read, "pread");
+                if (bytes_read == 0) {
+                    fprintf(stderr, "Unexpected end of archive in %s\n", rec->filename);
+                    exit(1);
+                }
+                offset += bytes_read;
+                n -= bytes_read;
+                __sync_fetch_and_add(&hashed, bytes_read);
+                cpu_seen();
+                TRACE_BEGIN(t_hash);
+                if (b3 != NULL)
+                    blake3_update(b3, md_buf, bytes_read);
+                else
+                    EVP_DigestUpdate(ctx, md_buf, bytes_read);
+                TRACE_END(t_hash, (b3 != NULL) ? "blake3_update" : "EVP_DigestUpdate");
+        }
+}
+
+/* A whole file, on this thread. */
+static void
+b3_calc(Record *rec)
+{
+        Blake3 h;
+        uint8_t calc_csum[BLAKE3_OUT_LEN];
+
+        blake3_init(&h);
+        read_part(&h, NULL, rec, 0, rec->filesize);
+        blake3_final(&h, calc_csum);
+        out_fmt_hex(rec->calc_csum, calc_csum, BLAKE3_OUT_LEN);
+}
+
+/* tpool job: one part; the last part done puts the file's digest together. */
+static void
+b3_part(B3Part *p)
+{
+        B3Split *s = p->split;
+        Record *rec = s->rec;
+        Blake3 h;
+        uint8_t calc_csum[BLAKE3_OUT_LEN];
+        size_t end, i;
+
+        blake3_init_at(&h, p->chunk);
+        read_part(&h, NULL, rec, p->chunk*BLAKE3_CHUNK_LEN, p->chunks*BLAKE3_CHUNK_LEN);
+        blake3_cv(&h, p->cv);
+        if (__sync_sub_and_fetch(&s->left, 1) > 0)
+            return;
+
+        blake3_init(&h);
+        for (i = 0; i < s->n; i++)
+            blake3_push_cv(&h, s->parts[i].cv, s->parts[i].chunks);
+        end = (s->parts[s->n-1].chunk + s->parts[s->n-1].chunks)*BLAKE3_CHUNK_LEN;
+        read_part(&h, NULL, rec, end, rec->filesize - end);
+        blake3_final(&h, calc_csum);
+        out_fmt_hex(rec->calc_csum, calc_csum, BLAKE3_OUT_LEN);
+        free(s);
+}
+
+/*
+ * --fingerprint (./fprint.h): md_calc hashes each FP_CHUNK_SZ of a file
+ * with SHA-256 as well, as it reads it.
+ */
+typedef struct
+{
+    EVP_MD_CTX *ctx;
+    uint8_t *chunks;
+    uint32_t n;
+    size_t fill;            /* bytes of the chunk being hashed */
+} FpCalc;
+
+static void
+fpc_init(FpCalc *c, Record *rec)
+{
+        c->ctx = EVP_MD_CTX_create();
+        EVP_DigestInit(c->ctx, EVP_get_digestbyname(SN_sha256));
+        c->chunks = malloc(((rec->filesize + FP_CHUNK_SZ - 1) / FP_CHUNK_SZ + 1) * FP_CHUNK_MD);
+        if (c->chunks == NULL)
+            perror("malloc"), exit(-1);
+        c->n = 0;
+        c->fill = 0;
+}
+
+static void
+fpc_update(FpCalc *c, const unsigned char *p, size_t n)
+{
+        size_t take;
+
+        while (n > 0) {
+            take = (n < FP_CHUNK_SZ - c->fill) ? n : FP_CHUNK_SZ - c->fill;
+            EVP_DigestUpdate(c->ctx, p, take);
+            c->fill += take;
+            p += take;
+            n -= take;
+            if (c->fill == FP_CHUNK_SZ) {
+                EVP_DigestFinal(c->ctx, c->chunks + (size_t)c->n++ * FP_CHUNK_MD, NULL);
+                EVP_DigestInit(c->ctx, EVP_get_digestbyname(SN_sha256));
+                c->fill = 0;
+            }
+        }
+}
+
+/* The file is done: into the fingerprint file with it. */
+static void
+fpc_done(FpCalc *c, Record *rec, const unsigned char *md, int md_len)
+{
+        FpRec r;
+
+        if (c->fill > 0)
+            EVP_DigestFinal(c->ctx, c->chunks + (size_t)c->n++ * FP_CHUNK_MD, NULL);
+        memset(&r, 0, sizeof(r));
+        r.offset = rec->offset*TAR_BLK_SZ;
+        r.size = rec->filesize;
+        r.n_chunks = c->n;
+        r.md_len = md_len;
+        snprintf(r.algo, sizeof(r.algo), "%s", algo);
+        memcpy(r.md, md, md_len);
+        fp_add(fp_out, &r, c->chunks);
+        EVP_MD_CTX_destroy(c->ctx);
+        free(c->chunks);
+}
+
+/*
+ * --verify-chunks. A file the fingerprint file has is queued as a job per
+ * chunk to check, which any thread may take. The last to finish gives the
+ * file the digest from the fingerprint file if they were all good, or has
+ * md_calc work it out from the data if one was not, for the report.
+ */
+typedef struct FpCheck FpCheck;
+
+typedef struct
+{
+    FpCheck *check;
+    uint32_t i;
+} FpPart;
+
+struct FpCheck
+{
+    Record *rec;
+    const FpRec *fr;
+    size_t left;            /* chunks not yet checked */
+    int bad;
+    FpPart parts[];
+};
+
+static void
+fp_result(Record *rec, const FpRec *fr, int bad)
+{
+        if (bad)
+            md_calc(rec);
+        else
+            out_fmt_hex(rec->calc_csum, fr->md, fr->md_len);
+}
+
+/* tpool job: one chunk. */
+static void
+fp_part(FpPart *p)
+{
+        FpCheck *s = p->check;
+        Record *rec = s->rec;
+        size_t at = (size_t)p->i * FP_CHUNK_SZ;
+        size_t n = (rec->filesize - at < FP_CHUNK_SZ) ? rec->filesize - at : FP_CHUNK_SZ;
+        unsigned long long base = rec->offset*TAR_BLK_SZ;
+        unsigned char md[EVP_MAX_MD_SIZE];
+        EVP_MD_CTX *ctx;
+
+        ctx = EVP_MD_CTX_create();
+        EVP_DigestInit(ctx, EVP_get_digestbyname(SN_sha256));
+        read_part(NULL, ctx, rec, at, n);
+        EVP_DigestFinal(ctx, md, NULL);
+        EVP_MD_CTX_destroy(ctx);
+        __sync_fetch_and_add(&chunks_checked, 1);
+        if (memcmp(md, fp_chunk(s->fr, p->i), FP_CHUNK_MD) == 0)
+            fp_mark(fp_in, base + at);
+        else {
+            fprintf(stderr, "BAD-CHUNK:  %s bytes %zu-%zu (archive bytes %llu-%llu)\n",
+                    rec->filename, at, at + n, base + at, base + at + n);
+            __sync_fetch_and_add(&chunks_bad, 1);
+            __sync_fetch_and_or(&s->bad, 1);
+        }
+        if (__sync_sub_and_fetch(&s->left, 1) > 0)
+            return;
+        fp_result(rec, s->fr, s->bad);
+        free(s);
+}
+
+/* Queue the chunks of rec to check: not those in the journal or outside --range. */
+static void
+add_chunk_work(tpool_t tpool, Record *rec, const FpRec *fr)
+{
+        unsigned long long base = rec->offset*TAR_BLK_SZ, from, to;
+        FpCheck *s;
+        uint32_t i;
+        size_t n = 0, outside = 0;
+
+        for (i = 0; i < fr->n_chunks; i++) {
+            from = base + (unsigned long long)i*FP_CHUNK_SZ;
+            to = (from + FP_CHUNK_SZ < base + rec->filesize) ? from + FP_CHUNK_SZ : base + rec->filesize;
+            if (to <= fp_from || from >= fp_to)
+                outside++;
+            else if (!fp_done(fp_in, from))
+                n++;
+        }
+        __sync_fetch_and_add(&chunks_skipped, fr->n_chunks - n);
+        __sync_fetch_and_add(&chunks_outside, outside);
+        if (n == 0) {
+            fp_result(rec, fr, 0);
+            return;
+        }
+        if ((s = malloc(sizeof(FpCheck) + sizeof(FpPart)*n)) == NULL)
+            perror("malloc"), exit(-1);
+        s->rec = rec;
+        s->fr = fr;
+        s->left = n;
+        s->bad = 0;
+        for (n = 0, i = 0; i < fr->n_chunks; i++) {
+            from = base + (unsigned long long)i*FP_CHUNK_SZ;
+            to = (from + FP_CHUNK_SZ < base + rec->filesize) ? from + FP_CHUNK_SZ : base + rec->filesize;
+            if (!fp_done(fp_in, from) && to > fp_from && from < fp_to) {
+                s->parts[n].check = s;
+                s->parts[n].i = i;
+                n++;
+            }
+        }
+        for (i = 0; i < n; i++)
+            tpool_add_work(tpool, fp_part, (void *)&s->parts[i]);
+}
+
+/* The fingerprint files are done with; report the chunks checked. The
+ * journal is kept for a --resume unless every chunk has now been checked. */
+static void
+fp_end(void)
+{
+        fp_close(fp_out, 1);
+        if (fp_in != NULL) {
+            fprintf(stderr, "Chunks: %llu checked, %llu bad, %llu not checked (already done or outside --range)\n",
+                    chunks_checked, chunks_bad, chunks_skipped);
+            fp_close(fp_in, chunks_outside == 0);
+        }
+}
+
+/* Queue rec's checksum: one job, for a big BLAKE3 file one per part, or
+ * with --verify-chunks one per chunk. */
+static void
+add_md_work(tpool_t tpool, Record *rec)
+{
+        B3Split *s;
+        const FpRec *fr;
+        uint64_t c, k, last, n;
+
+        if (fp_in != NULL && (fr = fp_find(fp_in, rec->offset*TAR_BLK_SZ, rec->filesize)) != NULL &&
+            strcasecmp(fr->algo, algo) == 0) {
+            add_chunk_work(tpool, rec, fr);
+            return;
+        }
+
+        if (strcmp(algo, SN_blake3) != 0 || rec->filesize <= B3_PART_SZ*2) {
+            tpool_add_work(tpool, md_calc, (void *)rec);
+            return;
+        }
+        // every chunk but the last, in the biggest subtrees up to B3_PART_SZ
+        last = (rec->filesize - 1) / BLAKE3_CHUNK_LEN;
+        for (n = 0, c = 0; c < last; c += k, n++)
+            k = blake3_subtree_len(c, (last - c < B3_PART_SZ/BLAKE3_CHUNK_LEN) ? last - c : B3_PART_SZ/BLAKE3_CHUNK_LEN);
+        if ((s = malloc(sizeof(B3Split) + sizeof(B3Part)*n)) == NULL)
+            perror("malloc"), exit(-1);
+        s->rec = rec;
+        s->n = s->left = n;
+        for (n = 0, c = 0; c < last; c += k, n++) {
+            k = blake3_subtree_len(c, (last - c < B3_PART_SZ/BLAKE3_CHUNK_LEN) ? last - c : B3_PART_SZ/BLAKE3_CHUNK_LEN);
+            s->parts[n].split = s;
+            s->parts[n].chunk = c;
+            s->parts[n].chunks = k;
+        }
+        for (n = 0; n < s->n; n++)
+            tpool_add_work(tpool, b3_part, (void *)&s->parts[n]);
+}
+
 static void
 md_calc(Record *rec)
 {
@@ -1420,6 +2363,7 @@ md_calc(Record *rec)
         unsigned long int total_bytes_read = 0;
         unsigned long int size;
         unsigned long int offset;
+        unsigned long long t_lat;
         unsigned char *buffer;
         size_t bytes_read;
         size_t current_byte = 0;
@@ -1429,8 +2373,14 @@ md_calc(Record *rec)
         EVP_MD_CTX *ctx;
         unsigned char calc_csum[EVP_MAX_MD_SIZE];
         char tmp[8];
-        int mdLen;
+        unsigned int mdLen;
         int i = 0;
+        FpCalc fpc = {0};
+
+        if (strcmp(algo, SN_blake3) == 0) {
+            b3_calc(rec);
+            return;
+        }
 
         //printf("md_calc :: Trying to initialize openssl EVP stuff...\n");
         // initialize openssl message digest stuff
@@ -1452,29 +2402,49 @@ md_calc(Record *rec)
 
         ctx = EVP_MD_CTX_create();
         EVP_DigestInit(ctx,md);
+        if (fp_out != NULL)
+            fpc_init(&fpc, rec);
 
-        buffer = (unsigned char *) malloc(sizeof(unsigned char)*MD_BUF_SZ);
+        // zero-length member: nothing to read, but still a well-defined digest
+        if (size == 0)
+                EVP_DigestFinal(ctx, calc_csum, &mdLen);
+
+        // allocated by this thread, so on its node; kept for its next record
+        if (md_buf == NULL)
+            md_buf = cpu_alloc_local(sizeof(unsigned char)*MD_BUF_SZ);
+        buffer = md_buf;
         total_bytes_read = 0;
 
 
         while (size > 0)
         {
+                TRACE_BEGIN(t_read);
                 if (size >= MD_BUF_SZ) {
                     if (size > (MD_BUF_SZ*2))
                         posix_fadvise64(fd,offset,MD_BUF_SZ*2,POSIX_FADV_WILLNEED);
+                    t_lat = iolat_start(lat);
                     if ((bytes_read = pread(fd,buffer,MD_BUF_SZ,offset)) == -1)
                         perror("pread"), exit(-1);
+                    iolat_end(lat,t_lat,NULL,offset,bytes_read);
+                    iogov_take(gov,bytes_read);
                     offset += bytes_read;
                 }
                 else {
+                    t_lat = iolat_start(lat);
                     if ((bytes_read = pread(fd,buffer,size,offset)) == -1)
                         perror("pread"), exit(-1);
+                    iolat_end(lat,t_lat,NULL,offset,bytes_read);
+                    iogov_take(gov,bytes_read);
                     offset += bytes_read;
                 }
+                TRACE_END(t_read, "pread");
 
                 total_bytes_read += bytes_read;
+                __sync_fetch_and_add(&hashed, bytes_read);
+                cpu_seen();
                 current_byte = 0;
                 remaining_bytes = bytes_read;
+                TRACE_BEGIN(t_hash);
                 // LOOP 2
                 while (current_byte < bytes_read) {
                   if (size <= WRK_SZ) {
@@ -1504,17 +2474,18 @@ md_calc(Record *rec)
                         }
                   }
                 }
+                TRACE_END(t_hash, "EVP_DigestUpdate");
+                if (fp_out != NULL)
+                    fpc_update(&fpc, buffer, bytes_read);
                 memset(buffer, '\0', MD_BUF_SZ);
                 //posix_fadvise64(fd,(total_bytes_read+MD_BUF_SZ),MD_BUF_SZ*2,POSIX_FADV_WILLNEED);
                 //posix_fadvise64(fd,(offset-MD_BUF_SZ),MD_BUF_SZ,POSIX_FADV_DONTNEED);
         }
-        free(buffer);
 
-        for (i=0; i<mdLen; i++) {
-            sprintf(tmp,"%02x", calc_csum[i]);
-            strcat(rec->calc_csum,tmp);
-        }
-        memset(calc_csum, '\0', 128);
+        out_fmt_hex(rec->calc_csum, calc_csum, mdLen);
+        if (fp_out != NULL)
+            fpc_done(&fpc, rec, calc_csum, mdLen);
+        memset(calc_csum, '\0', sizeof(calc_csum));
 //printf("calculated chksum for %s\n",rec->filename);
 
         EVP_MD_CTX_destroy(ctx);
@@ -1532,7 +2503,12 @@ void tpool_init(tpool_t   *tpoolp,
 
    /* initialize the fields */
    //printf("Initializing thread pool with %d worker threads.\n", num_worker_threads);
+   // 0: -t auto; all the threads there may be, but only some of them working
+   tpool->tuning = (num_worker_threads == 0);
+   if (tpool->tuning)
+        num_worker_threads = TUNE_MAX;
    tpool->num_threads = num_worker_threads;
+   tpool->limit = tpool->tuning ? TUNE_START : num_worker_threads;
 
    if ((tpool->threads = (pthread_t *)malloc(sizeof(pthread_t)*num_worker_threads)) == NULL)
      perror("malloc"), exit(-1);
@@ -1542,6 +2518,8 @@ void tpool_init(tpool_t   *tpoolp,
    tpool->queue_tail = NULL;
    tpool->queue_closed = 0;
    tpool->shutdown = 0;
+   tpool->started = 0;
+   tpool->active = 0;
 
    if ((rtn = pthread_mutex_init(&(tpool->queue_lock), NULL)) != 0)
         fprintf(stderr,"pthread_mutex_init %s",strerror(rtn)), exit(-1);
@@ -1559,6 +2537,8 @@ void tpool_init(tpool_t   *tpoolp,
                         (void *)tpool)) != 0)
            fprintf(stderr,"pthread_create %d",rtn), exit(-1);
    }
+   if (tpool->tuning && (rtn = pthread_create(&(tpool->tuner), NULL, tpool_tune, (void *)tpool)) != 0)
+           fprintf(stderr,"pthread_create %d",rtn), exit(-1);
 
    *tpoolp = tpool;
 }
@@ -1567,12 +2547,20 @@ void *tpool_thread(void *tpoolvar)
 {
    tpool_work_t *my_workp;
    tpool_t tpool = tpoolvar;
+   int id;
+
+   pthread_mutex_lock(&(tpool->queue_lock));
+   id = tpool->started++;
+   pthread_mutex_unlock(&(tpool->queue_lock));
+   cpu_pin(&cpus, "md_calc", id);
+   TRACE_THREAD("md_calc", id);
 
    //printf("tpool_thread :: top; queue size = %d\n", tpool->cur_queue_size);
    for (;;) {
 
+            TRACE_BEGIN(t_wait);
             pthread_mutex_lock(&(tpool->queue_lock));
-            while ( (tpool->cur_queue_size == 0) && (!tpool->shutdown)) {
+            while ( (tpool->cur_queue_size == 0 || id >= tpool->limit) && (!tpool->shutdown)) {
 		      //printf("tpool_thread :: Queue not empty (%d)!!\n",tpool->cur_queue_size);
                       pthread_cond_wait(&(tpool->queue_not_empty),
                       &(tpool->queue_lock));
@@ -1593,10 +2581,161 @@ void *tpool_thread(void *tpoolvar)
 
             if (tpool->cur_queue_size == 0)
                       pthread_cond_signal(&(tpool->queue_empty));
+            tpool->active++;
             pthread_mutex_unlock(&(tpool->queue_lock));
+            TRACE_END(t_wait, "queue wait");
+            TRACE_BEGIN(t_job);
             (*(my_workp->routine))(my_workp->arg);
+            TRACE_END(t_job, "md_calc");
             free(my_workp);
+
+            pthread_mutex_lock(&(tpool->queue_lock));
+            tpool->active--;
+            if ((tpool->cur_queue_size == 0) && (tpool->active == 0))
+                      pthread_cond_broadcast(&(tpool->queue_empty));
+            pthread_mutex_unlock(&(tpool->queue_lock));
+   }
+}
+
+/* Wait until every job added so far is done; the pool stays open. */
+void tpool_wait(tpool_t tpool)
+{
+   pthread_mutex_lock(&(tpool->queue_lock));
+   while ((tpool->cur_queue_size != 0) || (tpool->active != 0))
+         pthread_cond_wait(&(tpool->queue_empty), &(tpool->queue_lock));
+   pthread_mutex_unlock(&(tpool->queue_lock));
+}
+
+/* Time spent in iowait, and in all, across the CPUs (in ticks). */
+static void
+cpu_ticks(unsigned long long *iowait, unsigned long long *total)
+{
+   unsigned long long v[8] = {0};
+   FILE *f = fopen("/proc/stat", "r");
+   int i;
+
+   *iowait = *total = 0;
+   if (f == NULL)
+        return;
+   if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+              &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) >= 5) {
+        for (i = 0; i < 8; i++)
+             *total += v[i];
+        *iowait = v[4];
+   }
+   fclose(f);
+}
+
+static double
+tune_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+tune_set(tpool_t tpool, int level)
+{
+   pthread_mutex_lock(&(tpool->queue_lock));
+   tpool->limit = level;
+   pthread_cond_broadcast(&(tpool->queue_not_empty));
+   pthread_mutex_unlock(&(tpool->queue_lock));
+   if (level < tuned.lo)
+        tuned.lo = level;
+   if (level > tuned.hi)
+        tuned.hi = level;
+}
+
+/*
+ * The -t auto controller: hill-climbing on the bytes/s md_calc reads.
+ *
+ * Each interval is measured against the one before the last move. A move
+ * up is kept if it bought TUNE_GAIN, and then tried again; one down is kept
+ * if it cost no more than TUNE_LOSS (the same with fewer threads is better:
+ * a single spindle or a staged file only seeks more with more readers).
+ * A move that does not pay is undone, and the level then holds for
+ * TUNE_PROBE intervals before it is tried again, downwards first if the
+ * CPUs spent much of that time waiting on I/O. Intervals that end with
+ * nothing queued are not counted; the pool was short of work, not threads.
+ */
+void *tpool_tune(void *tpoolvar)
+{
+   tpool_t tpool = tpoolvar;
+   unsigned long long bytes, last_bytes, wait, last_wait, total, last_total;
+   double t, last_t, rate, base = 0, iowait;
+   int level = tpool->limit, base_level = level, moved = 0, probe = 1, hold = 1, held = 0, ticks = 0;
+   bool starved;
+
+   tuned.level = tuned.lo = tuned.hi = level;
+   tuned.rate = 0;
+   last_bytes = hashed;
+   last_t = tune_now();
+   cpu_ticks(&last_wait, &last_total);
+   for (;;) {
+        usleep(100000);
+        pthread_mutex_lock(&(tpool->queue_lock));
+        if (tpool->shutdown) {
+             pthread_mutex_unlock(&(tpool->queue_lock));
+             break;
+        }
+        starved = (tpool->cur_queue_size == 0);
+        pthread_mutex_unlock(&(tpool->queue_lock));
+        if (++ticks < TUNE_SECS*10)
+             continue;
+        ticks = 0;
+
+        bytes = hashed;
+        t = tune_now();
+        cpu_ticks(&wait, &total);
+        rate = (bytes - last_bytes) / (t - last_t);
+        iowait = (total > last_total) ? (double)(wait - last_wait) / (total - last_total) : 0;
+        last_bytes = bytes;
+        last_t = t;
+        last_wait = wait;
+        last_total = total;
+        if (starved || rate == 0)
+             continue;
+
+        if (moved == 0) {
+             // holding: this is the level's rate now
+             base = rate;
+             base_level = level;
+             if (++held < hold)
+                  continue;
+             held = 0;
+             moved = (iowait > TUNE_IOWAIT && level > 1) ? -1 : probe;
+        }
+        else if ((moved > 0 && rate >= base * TUNE_GAIN) || (moved < 0 && rate >= base * TUNE_LOSS)) {
+             // it paid: keep it, and go on the same way
+             base = rate;
+             base_level = level;
+        }
+        else {
+             // it did not: back to where it was, and hold there a while
+             level = base_level;
+             tune_set(tpool, level);
+             probe = -moved;
+             moved = 0;
+             hold = TUNE_PROBE;
+             continue;
+        }
+
+        if (level + moved < 1 || level + moved > tpool->num_threads) {
+             probe = -moved;
+             moved = 0;
+             hold = TUNE_PROBE;
+        }
+        else {
+             level += moved;
+             tune_set(tpool, level);
+        }
    }
+   // a move still being measured does not count
+   tuned.level = base_level;
+   tuned.rate = base;
+   return NULL;
 }
 
 //
@@ -1679,6 +2818,8 @@ int tpool_destroy(tpool_t     tpool,
         if ((rtn = pthread_join(tpool->threads[i],NULL)) != 0)
             fprintf(stderr,"pthread_join  %d",rtn), exit(-1);
    }
+   if (tpool->tuning && (rtn = pthread_join(tpool->tuner,NULL)) != 0)
+        fprintf(stderr,"pthread_join  %d",rtn), exit(-1);
 
    /* Now free pool structures */
    free(tpool->threads);
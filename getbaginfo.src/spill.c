@@ -0,0 +1,320 @@
+/*
+ * spill -- sorted runs and their merge. See spill.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include "./spill.h"
+
+// read buffer per run while merging
+#define RUN_BUF 1048576
+// entries start on this boundary in memory, so they can be read as structs
+#define ALIGN 8
+
+static spill_cmp sort_cmp;
+static unsigned char *sort_base;
+
+static void *
+xrealloc(void *p, size_t n)
+{
+    p = realloc(p, n);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int
+offs_compare(const void *a, const void *b)
+{
+    return sort_cmp(sort_base + *(const size_t *)a + sizeof(size_t),
+                    sort_base + *(const size_t *)b + sizeof(size_t));
+}
+
+/* An unlinked temp file for a run. */
+static int
+run_tmpfile(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char tmpname[PATH_MAX];
+    int fd;
+
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    snprintf(tmpname, PATH_MAX, "%s/getbaginfo.XXXXXX", tmpdir);
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create temp file in %s: %s\n", tmpdir, strerror(errno));
+        exit(1);
+    }
+    unlink(tmpname);
+    return fd;
+}
+
+static void
+add_run(Spill *s, int fd)
+{
+    s->runs = xrealloc(s->runs, sizeof(int)*(s->n_runs+1));
+    s->runs[s->n_runs++] = fd;
+}
+
+static void
+put_entry(FILE *f, const void *entry, size_t len)
+{
+    if (fwrite(&len, sizeof(len), 1, f) != 1 || fwrite(entry, 1, len, f) != len) {
+        fprintf(stderr, "Cannot write a spill run: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* Sort what is in memory and write it out as a run. */
+static void
+write_run(Spill *s)
+{
+    FILE *f;
+    size_t i, len;
+    int fd;
+
+    sort_cmp = s->cmp;
+    sort_base = s->buf;
+    qsort(s->offs, s->n, sizeof(size_t), offs_compare);
+
+    fd = run_tmpfile();
+    f = fdopen(dup(fd), "w");
+    setvbuf(f, NULL, _IOFBF, RUN_BUF);
+    for (i = 0; i < s->n; i++) {
+        memcpy(&len, s->buf + s->offs[i], sizeof(len));
+        put_entry(f, s->buf + s->offs[i] + sizeof(len), len);
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Cannot write a spill run: %s\n", strerror(errno));
+        exit(1);
+    }
+    add_run(s, fd);
+    s->len = 0;
+    s->n = 0;
+}
+
+void
+spill_init(Spill *s, size_t limit, spill_cmp cmp)
+{
+    memset(s, 0, sizeof(Spill));
+    s->limit = limit;
+    s->cmp = cmp;
+}
+
+void
+spill_add(Spill *s, const void *entry, size_t len)
+{
+    size_t need = (sizeof(size_t) + len + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+    if (s->n > 0 && s->len + need + sizeof(size_t)*(s->n+1) > s->limit)
+        write_run(s);
+    if (s->len + need > s->cap) {
+        s->cap = (s->len + need) * 2;
+        s->buf = xrealloc(s->buf, s->cap);
+    }
+    if (s->n == s->n_cap) {
+        s->n_cap = s->n_cap ? s->n_cap * 2 : 1024;
+        s->offs = xrealloc(s->offs, sizeof(size_t)*s->n_cap);
+    }
+    s->offs[s->n++] = s->len;
+    memcpy(s->buf + s->len, &len, sizeof(len));
+    memcpy(s->buf + s->len + sizeof(len), entry, len);
+    s->len += need;
+    s->total++;
+}
+
+/* Read the next entry of a run; 0 at its end. */
+static int
+read_entry(SpillRun *r)
+{
+    if (fread(&r->len, sizeof(r->len), 1, r->f) != 1)
+        return 0;
+    if (r->len > r->cap) {
+        r->cap = r->len;
+        r->entry = xrealloc(r->entry, r->cap);
+    }
+    if (fread(r->entry, 1, r->len, r->f) != r->len) {
+        fprintf(stderr, "Short spill run\n");
+        exit(1);
+    }
+    return 1;
+}
+
+static int
+heap_less(Spill *s, int a, int b)
+{
+    int c = s->cmp(s->in[a].entry, s->in[b].entry);
+
+    return c < 0 || (c == 0 && a < b);
+}
+
+static void
+heap_down(Spill *s, int i)
+{
+    int c, t;
+
+    for (;;) {
+        c = 2*i + 1;
+        if (c >= s->n_heap)
+            break;
+        if (c + 1 < s->n_heap && heap_less(s, s->heap[c+1], s->heap[c]))
+            c++;
+        if (!heap_less(s, s->heap[c], s->heap[i]))
+            break;
+        t = s->heap[c];
+        s->heap[c] = s->heap[i];
+        s->heap[i] = t;
+        i = c;
+    }
+}
+
+/* Start merging the first k runs. */
+static void
+merge_open(Spill *s, int k)
+{
+    int i;
+
+    s->in = xrealloc(NULL, sizeof(SpillRun)*k);
+    s->heap = xrealloc(NULL, sizeof(int)*k);
+    s->n_heap = 0;
+    for (i = 0; i < k; i++) {
+        lseek(s->runs[i], 0, SEEK_SET);
+        s->in[i].f = fdopen(s->runs[i], "r");
+        setvbuf(s->in[i].f, NULL, _IOFBF, RUN_BUF);
+        s->in[i].entry = NULL;
+        s->in[i].cap = 0;
+        if (read_entry(&s->in[i]))
+            s->heap[s->n_heap++] = i;
+    }
+    for (i = s->n_heap/2 - 1; i >= 0; i--)
+        heap_down(s, i);
+}
+
+/* Done with the first k runs (their files are closed). */
+static void
+merge_close(Spill *s, int k)
+{
+    int i;
+
+    for (i = 0; i < k; i++) {
+        fclose(s->in[i].f);
+        free(s->in[i].entry);
+    }
+    free(s->in);
+    free(s->heap);
+    s->in = NULL;
+    s->heap = NULL;
+    memmove(s->runs, s->runs + k, sizeof(int)*(s->n_runs - k));
+    s->n_runs -= k;
+}
+
+/* Entry at the top of the merge; the one before it is read past. */
+static const void *
+merge_next(Spill *s, size_t *len, int *last)
+{
+    SpillRun *r;
+
+    if (*last >= 0) {
+        if (!read_entry(&s->in[*last]))
+            s->heap[0] = s->heap[--s->n_heap];
+        if (s->n_heap > 0)
+            heap_down(s, 0);
+        *last = -1;
+    }
+    if (s->n_heap == 0)
+        return NULL;
+    *last = s->heap[0];
+    r = &s->in[*last];
+    *len = r->len;
+    return r->entry;
+}
+
+void
+spill_finish(Spill *s)
+{
+    const void *e;
+    size_t len;
+    FILE *f;
+    int fan, k, fd, last;
+
+    s->next = 0;
+    s->n_heap = 0;
+    if (s->n_runs == 0) {
+        sort_cmp = s->cmp;
+        sort_base = s->buf;
+        qsort(s->offs, s->n, sizeof(size_t), offs_compare);
+        return;
+    }
+    if (s->n > 0)
+        write_run(s);
+    free(s->buf);
+    free(s->offs);
+    s->buf = NULL;
+    s->offs = NULL;
+    s->cap = s->n_cap = 0;
+
+    // no more runs at once than there are read buffers in the budget
+    fan = s->limit / RUN_BUF;
+    if (fan < 2)
+        fan = 2;
+    while (s->n_runs > fan) {
+        k = fan;
+        merge_open(s, k);
+        fd = run_tmpfile();
+        f = fdopen(dup(fd), "w");
+        setvbuf(f, NULL, _IOFBF, RUN_BUF);
+        last = -1;
+        while ((e = merge_next(s, &len, &last)) != NULL)
+            put_entry(f, e, len);
+        if (fclose(f) != 0) {
+            fprintf(stderr, "Cannot write a spill run: %s\n", strerror(errno));
+            exit(1);
+        }
+        merge_close(s, k);
+        add_run(s, fd);
+    }
+    merge_open(s, s->n_runs);
+    s->next = (size_t)-1;
+}
+
+const void *
+spill_next(Spill *s, size_t *len)
+{
+    const unsigned char *e;
+    int last;
+
+    if (s->in == NULL) {
+        if (s->next >= s->n)
+            return NULL;
+        e = s->buf + s->offs[s->next++];
+        memcpy(len, e, sizeof(size_t));
+        return e + sizeof(size_t);
+    }
+    // s->next remembers the run of the entry handed out last
+    last = (s->next == (size_t)-1) ? -1 : (int)s->next;
+    e = merge_next(s, len, &last);
+    s->next = (last < 0) ? (size_t)-1 : (size_t)last;
+    return e;
+}
+
+void
+spill_free(Spill *s)
+{
+    int i;
+
+    if (s->in != NULL)
+        merge_close(s, s->n_runs);
+    for (i = 0; i < s->n_runs; i++)
+        close(s->runs[i]);
+    free(s->runs);
+    free(s->buf);
+    free(s->offs);
+    memset(s, 0, sizeof(Spill));
+}
@@ -0,0 +1,51 @@
+/*
+ * spill -- entries sorted within a memory budget (getbaginfo --mem-limit).
+ *
+ * Entries (any bytes) are added to a Spill. While they fit in its budget
+ * they are kept in memory; past that, each budget's worth is sorted and
+ * written as a run to an unlinked file under $TMPDIR. spill_finish() merges
+ * the runs down to as many as can be read at once within the budget, and
+ * spill_next() then returns the entries in order, from memory or from a
+ * merge of the runs.
+ */
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef int (*spill_cmp)(const void *a, const void *b);
+
+typedef struct
+{
+    FILE *f;
+    unsigned char *entry;
+    size_t len, cap;
+} SpillRun;
+
+typedef struct
+{
+    size_t limit;           /* bytes of entries held before a run is written */
+    spill_cmp cmp;
+    unsigned char *buf;     /* entries, each a size_t length and its bytes */
+    size_t len, cap;
+    size_t *offs;           /* where each entry starts in buf */
+    size_t n, n_cap;
+    int *runs;              /* unlinked temp files */
+    int n_runs;
+    unsigned long long total;
+    /* reading */
+    size_t next;
+    SpillRun *in;
+    int *heap, n_heap;
+} Spill;
+
+void spill_init(Spill *s, size_t limit, spill_cmp cmp);
+void spill_add(Spill *s, const void *entry, size_t len);
+/* No more entries: get ready to read them back in order. */
+void spill_finish(Spill *s);
+/* The next entry, valid until the next call; NULL after the last. */
+const void *spill_next(Spill *s, size_t *len);
+void spill_free(Spill *s);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * iogov -- token buckets for fixity reads. See iogov.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "iogov.h"
+
+#define IOGOV_CONF "/etc/opt/vsm/fixity_iogov"
+/* Bucket's layout is part of the segment's: a new one gets a new name */
+#define IOGOV_SHM "/fixity_iogov2"
+#define IOGOV_MAGIC 0x696f6777
+#define IOGOV_SLOTS 128
+/* a bucket's key, "vsn:<VSN>" or "dev:<st_dev>", and its NUL */
+#define IOGOV_KEY_MAX 64
+
+typedef struct
+{
+    char key[IOGOV_KEY_MAX];
+    double rate;            /* bytes per second */
+    double tokens;          /* at most a second's worth; below 0 while readers wait */
+    double last;            /* when tokens was last brought up to date */
+} Bucket;
+
+typedef struct
+{
+    volatile unsigned magic;
+    pthread_mutex_t mutex;
+    int n;
+    Bucket b[IOGOV_SLOTS];
+} Shared;
+
+struct IoGov
+{
+    Shared *shm;
+    Bucket *bucket;
+    int from, to;           /* hours the limit applies; -1: always */
+};
+
+static Shared *shared = NULL;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void shm_lock(Shared *s)
+{
+    // a reader that died holding it leaves nothing half done worth undoing
+    if (pthread_mutex_lock(&s->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&s->mutex);
+}
+
+static void shm_init(Shared *s, int pshared)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    if (pshared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(&s->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    s->n = 0;
+    __sync_synchronize();
+    s->magic = IOGOV_MAGIC;
+}
+
+/* Map the segment, creating it if this is the first process to get here.
+ * If it cannot be had, the buckets are only shared within this process. */
+static Shared *shm_attach(void)
+{
+    Shared *s;
+    struct stat st;
+    int fd, created = 0, i;
+
+    fd = shm_open(IOGOV_SHM, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+        created = 1;
+    else if (errno == EEXIST)
+        fd = shm_open(IOGOV_SHM, O_RDWR, 0600);
+    if (fd >= 0 && created && ftruncate(fd, sizeof(Shared)) < 0) {
+        close(fd);
+        shm_unlink(IOGOV_SHM);
+        fd = -1;
+    }
+    // a creator that has not sized it yet
+    for (i = 0; fd >= 0 && !created && i < 100; i++) {
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Shared))
+            break;
+        usleep(10000);
+    }
+    s = MAP_FAILED;
+    if (fd >= 0) {
+        s = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (s == MAP_FAILED) {
+        fprintf(stderr, "iogov: cannot map %s (%s); limits are per process\n", IOGOV_SHM, strerror(errno));
+        s = calloc(1, sizeof(Shared));
+        if (s == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        shm_init(s, 0);
+        return s;
+    }
+    if (created)
+        shm_init(s, 1);
+    for (i = 0; s->magic != IOGOV_MAGIC && i < 100; i++)
+        usleep(10000);
+    if (s->magic != IOGOV_MAGIC) {
+        fprintf(stderr, "iogov: %s was never set up; remove it\n", IOGOV_SHM);
+        exit(1);
+    }
+    return s;
+}
+
+/* The bucket for key, set to rate; a new one starts full. */
+static Bucket *bucket(Shared *s, const char *key, double rate)
+{
+    Bucket *b = NULL;
+    int i;
+
+    shm_lock(s);
+    for (i = 0; i < s->n; i++) {
+        if (strcmp(s->b[i].key, key) == 0) {
+            b = &s->b[i];
+            break;
+        }
+    }
+    if (b == NULL && s->n < IOGOV_SLOTS) {
+        b = &s->b[s->n++];
+        snprintf(b->key, sizeof(b->key), "%s", key);     /* iogov_open() checked its length */
+        b->tokens = rate;
+        b->last = now();
+    }
+    if (b != NULL) {
+        b->rate = rate;
+        if (b->tokens > rate)
+            b->tokens = rate;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    if (b == NULL)
+        fprintf(stderr, "iogov: more than %d devices; %s is not limited\n", IOGOV_SLOTS, key);
+    return b;
+}
+
+/* Is name one of the components of path? */
+static int in_path(const char *path, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = path;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == path || p[-1] == '/') && (p[len] == '\0' || p[len] == '/'))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
+
+IoGov *iogov_open(int fd, const char *name)
+{
+    const char *conf = getenv("FIXITY_IOGOV");
+    char line[1024], key[1024], win[16], best_key[IOGOV_KEY_MAX];
+    double mbps, best_rate = 0;
+    int best = 0, from, to, best_from = -1, best_to = -1;
+    struct stat st, kst;
+    int have_dev;
+    FILE *f;
+    IoGov *g;
+
+    if (conf == NULL)
+        conf = IOGOV_CONF;
+    f = fopen(conf, "r");
+    if (f == NULL)
+        return NULL;
+    have_dev = fd >= 0 && fstat(fd, &st) == 0;
+
+    // best: 3 VSN, 2 device, 1 "*"
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#')
+            continue;
+        win[0] = '\0';
+        if (sscanf(line, "%1023s %lf %15s", key, &mbps, win) < 2 || mbps <= 0)
+            continue;
+        // a path is only stat'ed; a VSN becomes the bucket's key
+        if (key[0] != '/' && strlen("vsn:") + strlen(key) >= IOGOV_KEY_MAX) {
+            fprintf(stderr, "iogov: %s: \"%s\" is too long for a VSN (at most %d characters)\n",
+                    conf, key, (int)(IOGOV_KEY_MAX - strlen("vsn:") - 1));
+            continue;
+        }
+        from = to = -1;
+        if (win[0] != '\0' && sscanf(win, "%d-%d", &from, &to) != 2) {
+            fprintf(stderr, "iogov: %s: bad hours \"%s\" for %s\n", conf, win, key);
+            continue;
+        }
+        if (best < 3 && name != NULL && key[0] != '/' && strcmp(key, "*") != 0 && in_path(name, key)) {
+            best = 3;
+            snprintf(best_key, sizeof(best_key), "vsn:%.*s", IOGOV_KEY_MAX - 5, key);
+        }
+        else if (best < 2 && have_dev && key[0] == '/' && stat(key, &kst) == 0 && kst.st_dev == st.st_dev) {
+            best = 2;
+            snprintf(best_key, sizeof(best_key), "dev:%lu", (unsigned long)st.st_dev);
+        }
+        else if (best < 2 && have_dev && strspn(key, "0123456789") == strlen(key) && strtoul(key, NULL, 10) == st.st_dev) {
+            best = 2;
+            snprintf(best_key, sizeof(best_key), "dev:%lu", (unsigned long)st.st_dev);
+        }
+        else if (best < 1 && strcmp(key, "*") == 0 && have_dev) {
+            best = 1;
+            snprintf(best_key, sizeof(best_key), "dev:%lu", (unsigned long)st.st_dev);
+        }
+        else if (best < 1 && strcmp(key, "*") == 0 && name != NULL) {
+            if ((size_t)snprintf(best_key, sizeof(best_key), "vsn:%s", name) >= sizeof(best_key)) {
+                fprintf(stderr, "iogov: \"%s\" is too long for a bucket of its own; not limited by \"*\"\n", name);
+                continue;
+            }
+            best = 1;
+        }
+        else
+            continue;
+        best_rate = mbps * 1024 * 1024;
+        best_from = from;
+        best_to = to;
+    }
+    fclose(f);
+    if (best == 0)
+        return NULL;
+
+    pthread_mutex_lock(&open_lock);
+    if (shared == NULL)
+        shared = shm_attach();
+    pthread_mutex_unlock(&open_lock);
+
+    g = malloc(sizeof(IoGov));
+    if (g == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    g->shm = shared;
+    g->bucket = bucket(shared, best_key, best_rate);
+    g->from = best_from;
+    g->to = best_to;
+    if (g->bucket == NULL) {
+        free(g);
+        return NULL;
+    }
+    return g;
+}
+
+/* Is the limit in force at this hour? */
+static int in_hours(IoGov *g)
+{
+    struct tm tm;
+    time_t t;
+
+    if (g->from < 0)
+        return 1;
+    t = time(NULL);
+    localtime_r(&t, &tm);
+    if (g->from <= g->to)
+        return tm.tm_hour >= g->from && tm.tm_hour < g->to;
+    return tm.tm_hour >= g->from || tm.tm_hour < g->to;
+}
+
+void iogov_take(IoGov *g, size_t n)
+{
+    Bucket *b;
+    double t, wait = 0;
+    struct timespec ts;
+
+    if (g == NULL || n == 0 || !in_hours(g))
+        return;
+    b = g->bucket;
+    shm_lock(g->shm);
+    t = now();
+    b->tokens += (t - b->last) * b->rate;
+    if (b->tokens > b->rate)
+        b->tokens = b->rate;
+    b->last = t;
+    // take them now and wait for the debt, so readers are served in turn
+    b->tokens -= n;
+    if (b->tokens < 0)
+        wait = -b->tokens / b->rate;
+    pthread_mutex_unlock(&g->shm->mutex);
+
+    if (wait > 0) {
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
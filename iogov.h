@@ -0,0 +1,37 @@
+/*
+ * iogov -- a limit on how fast fixity reads a device.
+ *
+ * Each limited device or VSN has a token bucket in a small POSIX shared
+ * memory segment (/fixity_iogov2), so the limit holds across every reader
+ * thread of a process and across all the fixity processes on the host
+ * (runfixity's parallel VSN jobs). A reader takes the bytes it has just
+ * read; once the bucket is in debt it sleeps until the debt is paid.
+ *
+ * The limits are read from /etc/opt/vsm/fixity_iogov (or the file named by
+ * $FIXITY_IOGOV), one per line:
+ *   <key> <MB/s> [HH-HH]
+ * where key is
+ *   a VSN                 DKARC03, A00041
+ *   a path or a device    /dkarcs/DKARC03 (the device it is on), 64768
+ *   *                     every other device, each with its own bucket
+ * and the optional HH-HH is the time of day the limit applies (e.g. 08-18,
+ * or 20-06 across midnight); outside it reads are not held back. A VSN line
+ * wins over a device line, which wins over "*". With no file, or no line
+ * that applies, nothing is limited.
+ */
+#ifndef IOGOV_H
+#define IOGOV_H
+
+#include <stddef.h>
+
+typedef struct IoGov IoGov;
+
+/* The governor for reads of fd (-1 if there is none yet) of name, a VSN or
+ * a path whose components are tried as VSNs. NULL when it is not limited;
+ * iogov_take() accepts NULL. */
+IoGov *iogov_open(int fd, const char *name);
+
+/* Account for n bytes read, sleeping if the device is over its rate. */
+void iogov_take(IoGov *g, size_t n);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * iolat -- read latency histograms. See iolat.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "iolat.h"
+
+#define SUB_BITS 5
+#define SUBS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUBS)
+#define SLOWEST 5
+#define IOLAT_MAX 64
+
+typedef struct
+{
+    unsigned long long ns, offset;
+    const char *where;
+} Slow;
+
+struct IoLat
+{
+    char key[64];
+    char name[256];
+    unsigned long long count[BUCKETS];
+    unsigned long long n, bytes, max;
+    volatile unsigned long long slow_min;   /* below it a read is not among the slowest */
+    Slow slow[SLOWEST];
+    pthread_mutex_t lock;
+};
+
+static IoLat *hists[IOLAT_MAX];
+static int n_hists;
+static pthread_mutex_t hists_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Bucket of v ns: v itself below SUBS, then SUBS to each power of two. */
+static int bucket(unsigned long long v)
+{
+    int e;
+
+    if (v < SUBS)
+        return (int)v;
+    e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUBS + (int)((v >> (e - SUB_BITS)) & (SUBS - 1));
+}
+
+/* Middle of bucket i, in ns. */
+static double bucket_mid(int i)
+{
+    int e;
+
+    if (i < SUBS)
+        return i;
+    e = i / SUBS + SUB_BITS - 1;
+    return (double)((unsigned long long)(SUBS + i % SUBS) << (e - SUB_BITS)) +
+           (double)(1ULL << (e - SUB_BITS)) / 2;
+}
+
+IoLat *iolat_open(int fd, const char *name)
+{
+    char key[64];
+    struct stat st;
+    IoLat *h = NULL;
+    int i;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+        snprintf(key, sizeof(key), "dev %u:%u", major(st.st_dev), minor(st.st_dev));
+    else if (name != NULL)
+        snprintf(key, sizeof(key), "vsn %s", name);
+    else
+        return NULL;
+
+    pthread_mutex_lock(&hists_lock);
+    for (i = 0; i < n_hists; i++) {
+        if (strcmp(hists[i]->key, key) == 0) {
+            h = hists[i];
+            break;
+        }
+    }
+    if (h == NULL && n_hists < IOLAT_MAX) {
+        h = calloc(1, sizeof(IoLat));
+        if (h == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        snprintf(h->key, sizeof(h->key), "%s", key);
+        snprintf(h->name, sizeof(h->name), "%s", name != NULL ? name : "");
+        pthread_mutex_init(&h->lock, NULL);
+        hists[n_hists++] = h;
+    }
+    pthread_mutex_unlock(&hists_lock);
+    return h;
+}
+
+unsigned long long iolat_start(IoLat *h)
+{
+    return h != NULL ? now() : 0;
+}
+
+void iolat_end(IoLat *h, unsigned long long t0, const char *where, unsigned long long offset, size_t n)
+{
+    unsigned long long ns, m;
+    int i, low;
+
+    if (h == NULL)
+        return;
+    ns = now() - t0;
+    __sync_fetch_and_add(&h->count[bucket(ns)], 1);
+    __sync_fetch_and_add(&h->n, 1);
+    __sync_fetch_and_add(&h->bytes, n);
+    while ((m = h->max) < ns && !__sync_bool_compare_and_swap(&h->max, m, ns))
+        ;
+    if (ns <= h->slow_min)
+        return;
+
+    // replace the fastest of the slowest
+    pthread_mutex_lock(&h->lock);
+    for (i = 1, low = 0; i < SLOWEST; i++)
+        if (h->slow[i].ns < h->slow[low].ns)
+            low = i;
+    if (ns > h->slow[low].ns) {
+        h->slow[low].ns = ns;
+        h->slow[low].offset = offset;
+        h->slow[low].where = where;
+        for (i = 0, m = ns; i < SLOWEST; i++)
+            if (h->slow[i].ns < m)
+                m = h->slow[i].ns;
+        h->slow_min = m;
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* The latency (ms) that q of the reads were within. */
+static double quantile(IoLat *h, double q)
+{
+    unsigned long long want = (unsigned long long)(q * h->n), seen = 0;
+    int i;
+
+    // the rank, rounded up
+    if (want < q * h->n || want < 1)
+        want++;
+    for (i = 0; i < BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= want)
+            return bucket_mid(i) / 1e6;
+    }
+    return h->max / 1e6;
+}
+
+static int slow_cmp(const void *a, const void *b)
+{
+    const Slow *x = a, *y = b;
+
+    return (x->ns < y->ns) - (x->ns > y->ns);
+}
+
+int iolat_report(FILE *f, double flag_ms)
+{
+    double p99;
+    IoLat *h;
+    int i, j, flagged = 0;
+
+    pthread_mutex_lock(&hists_lock);
+    for (i = 0; i < n_hists; i++) {
+        h = hists[i];
+        if (h->n == 0)
+            continue;
+        p99 = quantile(h, 0.99);
+        fprintf(f, "iolat: %s (%s): %llu reads, %.1f MB; p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+                h->key, h->name, h->n, h->bytes / 1048576.0, quantile(h, 0.50), p99, quantile(h, 0.999), h->max / 1e6);
+        qsort(h->slow, SLOWEST, sizeof(Slow), slow_cmp);
+        fprintf(f, "iolat: %s slowest:", h->key);
+        for (j = 0; j < SLOWEST && h->slow[j].ns > 0; j++) {
+            if (h->slow[j].where != NULL)
+                fprintf(f, "%s %.3f ms at %s+%llu", j ? "," : "", h->slow[j].ns / 1e6, h->slow[j].where, h->slow[j].offset);
+            else
+                fprintf(f, "%s %.3f ms at %llu", j ? "," : "", h->slow[j].ns / 1e6, h->slow[j].offset);
+        }
+        fprintf(f, "\n");
+        if (flag_ms > 0 && p99 > flag_ms) {
+            fprintf(f, "iolat: SLOW %s (%s): p99 %.3f ms is above %.3f ms\n", h->key, h->name, p99, flag_ms);
+            flagged++;
+        }
+    }
+    pthread_mutex_unlock(&hists_lock);
+    return flagged;
+}
@@ -0,0 +1,36 @@
+/*
+ * iolat -- read latency histograms per device or VSN, for spotting media
+ * that is going bad (a disk that retries, a drive that repositions) in an
+ * otherwise ordinary fixity run.
+ *
+ * Every timed read goes into the histogram of its device (or, for a tape
+ * read through a staging file or a pipe, of its VSN): log-linear buckets,
+ * 32 to each power of two, so any latency from a microsecond to minutes is
+ * kept to within about 3%, in a fixed 15KB. The five slowest reads are kept
+ * with their offsets. iolat_report() prints p50/p99/p999 and max of each,
+ * the slowest offsets, and a SLOW line for each whose p99 is above the
+ * threshold given.
+ */
+#ifndef IOLAT_H
+#define IOLAT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct IoLat IoLat;
+
+/* The histogram for reads of fd's device (fd < 0, or a pipe: of the VSN
+ * name), shown as name. Reads of the same device share it. */
+IoLat *iolat_open(int fd, const char *name);
+
+/* Time a read: t0 = iolat_start(h); read; iolat_end(h, t0, where, offset, n).
+ * where, if not NULL, says what offset is into (a tape position) and must
+ * last until the report. Both do nothing with h NULL. */
+unsigned long long iolat_start(IoLat *h);
+void iolat_end(IoLat *h, unsigned long long t0, const char *where, unsigned long long offset, size_t n);
+
+/* Report every histogram; flag_ms > 0 adds a SLOW line for each whose p99
+ * is above it. Returns how many were flagged. */
+int iolat_report(FILE *f, double flag_ms);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * ledger -- the results of every fixity check, kept from run to run. See
+ * ledger.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ledger.h"
+
+#define HEAD_LEN (sizeof(LEDGER_MAGIC) - 1)
+
+static const char *result_names[] = {"?", "good", "BAD", "MISSING", "NO_CKSUM"};
+
+static size_t
+rec_len(const LedgerRec *r)
+{
+    return sizeof(LedgerRec) + (((size_t)r->name_len + 7) & ~(size_t)7);
+}
+
+static int
+write_all(int fd, const char *p, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+void
+ledger_open(Ledger *l, const char *path)
+{
+    memset(l, 0, sizeof(*l));
+    l->path = strdup(path);
+    if (l->path == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+void
+ledger_add(Ledger *l, const LedgerRec *r, const char *name, size_t name_len)
+{
+    LedgerRec *dst;
+    size_t need;
+
+    if (name_len > UINT32_MAX)
+        name_len = UINT32_MAX;
+    need = sizeof(LedgerRec) + ((name_len + 7) & ~(size_t)7);
+    if (l->len + need > l->cap) {
+        while (l->len + need > l->cap)
+            l->cap = l->cap ? l->cap*2 : 65536;
+        l->buf = realloc(l->buf, l->cap);
+        if (l->buf == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    dst = (LedgerRec *)(l->buf + l->len);
+    memcpy(dst, r, sizeof(LedgerRec));
+    dst->name_len = name_len;
+    memcpy(dst + 1, name, name_len);
+    memset((char *)(dst + 1) + name_len, 0, need - sizeof(LedgerRec) - name_len);
+    l->len += need;
+    l->n++;
+}
+
+void
+ledger_close(Ledger *l)
+{
+    struct stat a, b;
+    int fd;
+
+    if (l->n > 0) {
+        for (;;) {
+            fd = open(l->path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "Cannot open %s: %s\n", l->path, strerror(errno));
+                exit(1);
+            }
+            flock(fd, LOCK_EX);
+            // fixity_ledger -C may have put a new file in its place while we waited
+            if (fstat(fd, &a) == 0 && stat(l->path, &b) == 0 && a.st_ino == b.st_ino && a.st_dev == b.st_dev)
+                break;
+            close(fd);
+        }
+        if ((a.st_size == 0 && write_all(fd, LEDGER_MAGIC, HEAD_LEN) < 0) || write_all(fd, l->buf, l->len) < 0) {
+            fprintf(stderr, "Cannot write %s: %s\n", l->path, strerror(errno));
+            // no half record for the next run to append after
+            if (ftruncate(fd, a.st_size) < 0)
+                perror("ftruncate");
+            exit(1);
+        }
+        close(fd);
+    }
+    free(l->path);
+    free(l->buf);
+    memset(l, 0, sizeof(*l));
+}
+
+/* Map fd, which the caller has locked. */
+static void
+map_fd(LedgerMap *m, int fd, const char *path)
+{
+    struct stat st;
+    void *p;
+
+    memset(m, 0, sizeof(*m));
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (st.st_size == 0)
+        return;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    m->data = p;
+    m->len = st.st_size;
+    if (m->len < HEAD_LEN || memcmp(m->data, LEDGER_MAGIC, HEAD_LEN) != 0) {
+        fprintf(stderr, "%s is not a fixity ledger\n", path);
+        exit(1);
+    }
+}
+
+void
+ledger_map(LedgerMap *m, const char *path)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT) {
+        memset(m, 0, sizeof(*m));
+        return;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    flock(fd, LOCK_SH);
+    map_fd(m, fd, path);
+    close(fd);
+}
+
+const LedgerRec *
+ledger_next(const LedgerMap *m, const LedgerRec *r)
+{
+    size_t at;
+
+    if (m->data == NULL)
+        return NULL;
+    at = (r == NULL) ? HEAD_LEN : (size_t)((const char *)r - m->data) + rec_len(r);
+    if (at + sizeof(LedgerRec) > m->len)
+        return NULL;
+    r = (const LedgerRec *)(m->data + at);
+    if (at + rec_len(r) > m->len)
+        return NULL;
+    return r;
+}
+
+const char *
+ledger_name(const LedgerRec *r)
+{
+    return (const char *)(r + 1);
+}
+
+static size_t
+key_slot(int copy, const char *vsn, const char *arc, uint64_t offset, uint64_t size, size_t mask)
+{
+    uint64_t h = 1469598103934665603ULL;
+    const char *p;
+
+    for (p = vsn; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    for (p = arc; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ (uint64_t)copy) * 1099511628211ULL;
+    h ^= offset * 0x9e3779b97f4a7c15ULL;
+    h ^= size * 0xc2b2ae3d27d4eb4fULL;
+    return (size_t)(h >> 32 ^ h) & mask;
+}
+
+static int
+key_is(const LedgerRec *r, int copy, const char *vsn, const char *arc, uint64_t offset, uint64_t size)
+{
+    return r->copy == copy && r->offset == offset && r->size == size &&
+           strncmp(r->vsn, vsn, sizeof(r->vsn)) == 0 && strncmp(r->arc, arc, sizeof(r->arc)) == 0;
+}
+
+/* Whether r's VSN and archive file are ended, as ledger_add() leaves them. */
+static int
+key_ok(const LedgerRec *r)
+{
+    return memchr(r->vsn, '\0', sizeof(r->vsn)) != NULL && memchr(r->arc, '\0', sizeof(r->arc)) != NULL;
+}
+
+void
+ledger_index(LedgerMap *m)
+{
+    const LedgerRec *r;
+    LedgerEntry *e;
+    size_t cap, j;
+
+    for (r = ledger_next(m, NULL); r != NULL; r = ledger_next(m, r))
+        m->n_recs++;
+    for (cap = 64; cap < 2*m->n_recs; cap *= 2)
+        ;
+    m->slots = calloc(cap, sizeof(LedgerEntry));
+    if (m->slots == NULL) {
+        fprintf(stderr, "Out of memory indexing %lu ledger records\n", m->n_recs);
+        exit(1);
+    }
+    m->mask = cap - 1;
+    for (r = ledger_next(m, NULL); r != NULL; r = ledger_next(m, r)) {
+        if (!key_ok(r))
+            continue;
+        for (j = key_slot(r->copy, r->vsn, r->arc, r->offset, r->size, m->mask); ; j = (j + 1) & m->mask) {
+            e = &m->slots[j];
+            if (e->last == NULL) {
+                m->n_keys++;
+                break;
+            }
+            if (key_is(e->last, r->copy, r->vsn, r->arc, r->offset, r->size))
+                break;
+        }
+        if (e->last == NULL || r->when >= e->last->when)
+            e->last = r;
+        if (r->result == LEDGER_GOOD && (e->good == NULL || r->when >= e->good->when))
+            e->good = r;
+    }
+}
+
+const LedgerEntry *
+ledger_find(const LedgerMap *m, int copy, const char *vsn, const char *arc, uint64_t offset, uint64_t size)
+{
+    size_t j;
+
+    if (m->slots == NULL)
+        return NULL;
+    for (j = key_slot(copy, vsn, arc, offset, size, m->mask); m->slots[j].last != NULL; j = (j + 1) & m->mask)
+        if (key_is(m->slots[j].last, copy, vsn, arc, offset, size))
+            return &m->slots[j];
+    return NULL;
+}
+
+void
+ledger_unmap(LedgerMap *m)
+{
+    if (m->data != NULL)
+        munmap((void *)m->data, m->len);
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+int
+ledger_fresh(const LedgerEntry *e, time_t since)
+{
+    return e != NULL && e->last != NULL && e->last->when >= since &&
+           (e->last->result == LEDGER_GOOD || e->last->result == LEDGER_NO_CKSUM);
+}
+
+unsigned long
+ledger_compact(const char *path, unsigned long *total)
+{
+    LedgerMap m;
+    const LedgerRec *r;
+    const LedgerEntry *e;
+    char tmp[PATH_MAX];
+    unsigned long kept = 0;
+    int fd, out;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    // held until the new file is in place: writers wait, then append to it
+    flock(fd, LOCK_EX);
+    map_fd(&m, fd, path);
+    ledger_index(&m);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", tmp, strerror(errno));
+        exit(1);
+    }
+    if (write_all(out, LEDGER_MAGIC, HEAD_LEN) < 0)
+        goto failed;
+    for (r = ledger_next(&m, NULL); r != NULL; r = ledger_next(&m, r)) {
+        if (!key_ok(r))
+            continue;
+        e = ledger_find(&m, r->copy, r->vsn, r->arc, r->offset, r->size);
+        if (e == NULL || (e->last != r && e->good != r))
+            continue;
+        if (write_all(out, (const char *)r, rec_len(r)) < 0)
+            goto failed;
+        kept++;
+    }
+    if (fsync(out) < 0 || close(out) < 0)
+        goto failed;
+    if (rename(tmp, path) < 0) {
+        fprintf(stderr, "Cannot rename %s to %s: %s\n", tmp, path, strerror(errno));
+        exit(1);
+    }
+    *total = m.n_recs;
+    ledger_unmap(&m);
+    close(fd);
+    return kept;
+
+failed:
+    fprintf(stderr, "Cannot write %s: %s\n", tmp, strerror(errno));
+    unlink(tmp);
+    exit(1);
+}
+
+const char *
+ledger_result_name(int result)
+{
+    if (result < LEDGER_GOOD || result > LEDGER_NO_CKSUM)
+        return result_names[0];
+    return result_names[result];
+}
@@ -0,0 +1,102 @@
+/*
+ * ledger -- the results of every fixity check, kept from run to run.
+ *
+ * One file (runfixity.sh keeps /<fs>/temp/fixity.ledger) that the checkers
+ * append to: for each file copy checked, keyed by (copy, VSN, disk archive
+ * file or tape position, offset, size), the digest worked out, the
+ * algorithm, when, and whether it matched the inode. fixity_plan -s reads
+ * it to leave out archive files whose every file was found good in the last
+ * so many days; fixity_ledger shows when each copy was last proven good.
+ *
+ * The file is a header (LEDGER_MAGIC) and then records, each a LedgerRec
+ * and the file's name, padded to 8 bytes. It is only ever appended to,
+ * under flock(LOCK_EX), by a whole run's records at once; readers take
+ * LOCK_SH while they map it, and skip a last record that was cut short.
+ * fixity_ledger -C rewrites it keeping the last check and the last good
+ * check of each key.
+ */
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LEDGER_MAGIC "FIXLDG1\n"
+
+/* LEDGER_NO_CKSUM: read, but the inode has no checksum to match */
+enum ledger_result{LEDGER_GOOD = 1, LEDGER_BAD, LEDGER_MISSING, LEDGER_NO_CKSUM};
+
+typedef struct
+{
+    int64_t when;           /* time(2) of the check */
+    uint64_t offset;        /* 512-byte blocks into the archive file */
+    uint64_t size;
+    uint8_t copy;
+    uint8_t result;
+    uint8_t md_len;
+    char algo[9];           /* MD5, SHA1, ... */
+    uint32_t name_len;      /* the name follows the record */
+    char vsn[32];
+    char arc[64];           /* disk archive file (d2/f11) or hex tape position */
+    uint8_t md[64];         /* as calculated */
+} LedgerRec;
+
+/* Records to be appended. */
+typedef struct
+{
+    char *path;
+    char *buf;
+    size_t len;
+    size_t cap;
+    unsigned long n;
+} Ledger;
+
+/* The last check and the last good one of a key. */
+typedef struct
+{
+    const LedgerRec *last;
+    const LedgerRec *good;
+} LedgerEntry;
+
+/* A ledger as read. */
+typedef struct
+{
+    const char *data;
+    size_t len;
+    LedgerEntry *slots;
+    size_t mask;
+    size_t n_keys;
+    unsigned long n_recs;
+} LedgerMap;
+
+void ledger_open(Ledger *l, const char *path);
+/* One check; vsn and arc are NUL-terminated, name is name_len bytes. */
+void ledger_add(Ledger *l, const LedgerRec *r, const char *name, size_t name_len);
+/* Append what was added, if anything. */
+void ledger_close(Ledger *l);
+
+/* Map the ledger at path; a ledger that does not exist yet is empty. */
+void ledger_map(LedgerMap *m, const char *path);
+/* Records in the order they were appended: from NULL, until NULL. */
+const LedgerRec *ledger_next(const LedgerMap *m, const LedgerRec *r);
+const char *ledger_name(const LedgerRec *r);
+/* Hash every key's last and last good check, for ledger_find(). */
+void ledger_index(LedgerMap *m);
+const LedgerEntry *ledger_find(const LedgerMap *m, int copy, const char *vsn, const char *arc,
+                               uint64_t offset, uint64_t size);
+void ledger_unmap(LedgerMap *m);
+
+/* Whether a key's last check, since since, found nothing wrong: good, or
+ * read whole with no inode checksum to match (it cannot do better). A good
+ * check followed by a bad one is not fresh. */
+int ledger_fresh(const LedgerEntry *e, time_t since);
+
+/* Rewrite the ledger with only the records ledger_index() keeps. Returns
+ * how many were kept, of *total. */
+unsigned long ledger_compact(const char *path, unsigned long *total);
+
+/* "good", "BAD", "MISSING", "NO_CKSUM" */
+const char *ledger_result_name(int result);
+
+#endif
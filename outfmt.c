@@ -0,0 +1,417 @@
+/*
+ * outfmt -- buffered record output. See outfmt.h for the formats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include "outfmt.h"
+
+static const char HEX[] = "0123456789abcdef";
+
+/* "00" "01" ... "99": two decimal digits per table lookup. */
+static const char DIGITS2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int
+out_parse_format(const char *name)
+{
+    if (strcasecmp(name, "text") == 0 || strcasecmp(name, "tsv") == 0)
+        return OUT_TEXT;
+    if (strcasecmp(name, "json") == 0)
+        return OUT_JSON;
+    if (strcasecmp(name, "bin") == 0 || strcasecmp(name, "binary") == 0)
+        return OUT_BIN;
+    return -1;
+}
+
+const char *
+out_format_name(int format)
+{
+    switch (format) {
+        case OUT_JSON: return "json";
+        case OUT_BIN:  return "bin";
+        default:       return "text";
+    }
+}
+
+static void
+write_all(int fd, const char *p, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("outfmt write");
+            exit(1);
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void
+init_buf(OutBuf *ob, int fd, int format, size_t cap)
+{
+    ob->fd = fd;
+    ob->format = format;
+    ob->cap = cap;
+    ob->len = 0;
+    ob->rec_start = 0;
+    ob->nfields = -1;
+    ob->n_recs = 0;
+    ob->buf = malloc(cap);
+    if (ob->buf == NULL) {
+        fprintf(stderr, "outfmt: could not allocate %lu byte output buffer\n", (unsigned long)cap);
+        exit(1);
+    }
+}
+
+void
+out_init_size(OutBuf *ob, int fd, int format, size_t cap)
+{
+    init_buf(ob, fd, format, cap);
+    if (format == OUT_BIN)
+        out_raw(ob, OUT_BIN_MAGIC, strlen(OUT_BIN_MAGIC));
+}
+
+void
+out_init_part(OutBuf *ob, int fd, int format)
+{
+    init_buf(ob, fd, format, OUT_BUF_SZ);
+}
+
+void
+out_init(OutBuf *ob, int fd, int format)
+{
+    out_init_size(ob, fd, format, OUT_BUF_SZ);
+}
+
+void
+out_flush(OutBuf *ob)
+{
+    size_t keep = ob->len;
+
+    if (ob->fd < 0)
+        return;
+
+    /* A binary record cannot be split before its length word is patched. */
+    if (ob->format == OUT_BIN && ob->nfields >= 0)
+        keep = ob->rec_start;
+
+    if (keep == 0)
+        return;
+    write_all(ob->fd, ob->buf, keep);
+    memmove(ob->buf, ob->buf + keep, ob->len - keep);
+    ob->len -= keep;
+    if (ob->format == OUT_BIN && ob->nfields >= 0)
+        ob->rec_start = 0;
+}
+
+void
+out_reset(OutBuf *ob)
+{
+    ob->len = 0;
+    ob->rec_start = 0;
+    ob->nfields = -1;
+}
+
+void
+out_free(OutBuf *ob)
+{
+    if (ob->fd >= 0)
+        out_flush(ob);
+    free(ob->buf);
+    ob->buf = NULL;
+    ob->cap = ob->len = 0;
+}
+
+/* Make room for n more bytes, flushing (and if need be growing) the buffer. */
+static inline void
+reserve(OutBuf *ob, size_t n)
+{
+    if (ob->len + n <= ob->cap)
+        return;
+    if (ob->fd >= 0)
+        out_flush(ob);
+    if (ob->len + n > ob->cap) {
+        while (ob->len + n > ob->cap)
+            ob->cap *= 2;
+        ob->buf = realloc(ob->buf, ob->cap);
+        if (ob->buf == NULL) {
+            fprintf(stderr, "outfmt: could not grow output buffer\n");
+            exit(1);
+        }
+    }
+}
+
+static inline void
+put(OutBuf *ob, const char *s, size_t n)
+{
+    reserve(ob, n);
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
+
+static inline void
+put_le(OutBuf *ob, uint64_t v, int bytes)
+{
+    int i;
+
+    reserve(ob, bytes);
+    for (i = 0; i < bytes; i++)
+        ob->buf[ob->len++] = (char)(v >> (8*i));
+}
+
+char *
+out_fmt_u64(char *dst, uint64_t v)
+{
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    size_t n;
+
+    while (v >= 100) {
+        unsigned d = (unsigned)(v % 100) * 2;
+        v /= 100;
+        *--p = DIGITS2[d+1];
+        *--p = DIGITS2[d];
+    }
+    if (v >= 10) {
+        *--p = DIGITS2[v*2+1];
+        *--p = DIGITS2[v*2];
+    }
+    else
+        *--p = '0' + (char)v;
+
+    n = tmp + sizeof(tmp) - p;
+    memcpy(dst, p, n);
+    dst[n] = '\0';
+    return dst + n;
+}
+
+static char *
+fmt_x64(char *dst, uint64_t v)
+{
+    char tmp[16];
+    char *p = tmp + sizeof(tmp);
+    size_t n;
+
+    do {
+        *--p = HEX[v & 0xf];
+        v >>= 4;
+    } while (v);
+
+    n = tmp + sizeof(tmp) - p;
+    memcpy(dst, p, n);
+    dst[n] = '\0';
+    return dst + n;
+}
+
+char *
+out_fmt_hex(char *dst, const unsigned char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        *dst++ = HEX[p[i] >> 4];
+        *dst++ = HEX[p[i] & 0xf];
+    }
+    *dst = '\0';
+    return dst;
+}
+
+void
+out_raw(OutBuf *ob, const char *s, size_t n)
+{
+    put(ob, s, n);
+}
+
+void
+out_begin(OutBuf *ob)
+{
+    ob->nfields = 0;
+    if (ob->format == OUT_JSON)
+        put(ob, "{", 1);
+    else if (ob->format == OUT_BIN) {
+        reserve(ob, 5);
+        ob->rec_start = ob->len;
+        ob->len += 5; /* u32 length + u8 field count, patched by out_end */
+    }
+}
+
+/* Field separator and, for json, the key. */
+static inline void
+field(OutBuf *ob, const char *key)
+{
+    if (ob->format == OUT_TEXT) {
+        if (ob->nfields > 0)
+            put(ob, "|", 1);
+    }
+    else if (ob->format == OUT_JSON) {
+        if (ob->nfields > 0)
+            put(ob, ",", 1);
+        put(ob, "\"", 1);
+        put(ob, key, strlen(key));
+        put(ob, "\":", 2);
+    }
+    ob->nfields++;
+}
+
+static void
+put_json_string(OutBuf *ob, const char *s, size_t n)
+{
+    size_t i, run = 0;
+    char esc[7];
+
+    put(ob, "\"", 1);
+    for (i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        put(ob, s + run, i - run);
+        run = i + 1;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            put(ob, esc, 2);
+        }
+        else {
+            esc[0] = '\\'; esc[1] = 'u'; esc[2] = '0'; esc[3] = '0';
+            esc[4] = HEX[c >> 4];
+            esc[5] = HEX[c & 0xf];
+            put(ob, esc, 6);
+        }
+    }
+    put(ob, s + run, n - run);
+    put(ob, "\"", 1);
+}
+
+void
+out_strn(OutBuf *ob, const char *key, const char *s, size_t n)
+{
+    field(ob, key);
+    switch (ob->format) {
+        case OUT_TEXT:
+            put(ob, s, n);
+            break;
+        case OUT_JSON:
+            put_json_string(ob, s, n);
+            break;
+        case OUT_BIN:
+            if (n > 0xffff)
+                n = 0xffff;
+            put(ob, "s", 1);
+            put_le(ob, n, 2);
+            put(ob, s, n);
+            break;
+    }
+}
+
+void
+out_str(OutBuf *ob, const char *key, const char *s)
+{
+    out_strn(ob, key, s, strlen(s));
+}
+
+/* One string field made of "a<sep>b", e.g. "li.A00041" or "DKARC19/d2/f4". */
+void
+out_join(OutBuf *ob, const char *key, const char *a, char sep, const char *b)
+{
+    size_t la = strlen(a), lb = strlen(b);
+    char stackbuf[512];
+    char *tmp = stackbuf;
+
+    if (la + lb + 1 > sizeof(stackbuf))
+        tmp = malloc(la + lb + 1);
+    memcpy(tmp, a, la);
+    tmp[la] = sep;
+    memcpy(tmp + la + 1, b, lb);
+    out_strn(ob, key, tmp, la + lb + 1);
+    if (tmp != stackbuf)
+        free(tmp);
+}
+
+void
+out_u64(OutBuf *ob, const char *key, uint64_t v)
+{
+    char tmp[24];
+    char *end;
+
+    field(ob, key);
+    if (ob->format == OUT_BIN) {
+        put(ob, "u", 1);
+        put_le(ob, v, 8);
+        return;
+    }
+    end = out_fmt_u64(tmp, v);
+    put(ob, tmp, end - tmp);
+}
+
+/* Hex in text mode (tape positions/offsets); a plain integer otherwise. */
+void
+out_x64(OutBuf *ob, const char *key, uint64_t v)
+{
+    char tmp[24];
+    char *end;
+
+    if (ob->format != OUT_TEXT) {
+        out_u64(ob, key, v);
+        return;
+    }
+    field(ob, key);
+    end = fmt_x64(tmp, v);
+    put(ob, tmp, end - tmp);
+}
+
+void
+out_hex(OutBuf *ob, const char *key, const unsigned char *p, size_t n)
+{
+    field(ob, key);
+    if (ob->format == OUT_BIN) {
+        if (n > 0xff)
+            n = 0xff;
+        put(ob, "h", 1);
+        put_le(ob, n, 1);
+        put(ob, (const char *)p, n);
+        return;
+    }
+    if (ob->format == OUT_JSON)
+        put(ob, "\"", 1);
+    reserve(ob, 2*n + 1);
+    out_fmt_hex(ob->buf + ob->len, p, n);
+    ob->len += 2*n;
+    if (ob->format == OUT_JSON)
+        put(ob, "\"", 1);
+}
+
+void
+out_end(OutBuf *ob)
+{
+    uint32_t body;
+    int i;
+
+    switch (ob->format) {
+        case OUT_TEXT:
+            put(ob, "\n", 1);
+            break;
+        case OUT_JSON:
+            put(ob, "}\n", 2);
+            break;
+        case OUT_BIN:
+            body = (uint32_t)(ob->len - ob->rec_start - 4);
+            for (i = 0; i < 4; i++)
+                ob->buf[ob->rec_start + i] = (char)(body >> (8*i));
+            ob->buf[ob->rec_start + 4] = (char)ob->nfields;
+            break;
+    }
+    ob->nfields = -1;
+    ob->n_recs++;
+}
@@ -0,0 +1,74 @@
+/*
+ * outfmt -- buffered record output shared by print_csum_from_sls,
+ * print_offset_cksum_from_tar and getbaginfo.
+ *
+ * Records are built one field at a time (out_begin, out_str/out_u64/...,
+ * out_end) into a large buffer that is written with write(2) once it fills.
+ * The same calls produce one of three formats:
+ *
+ *   text - the historical pipe-delimited lines, e.g. 0|2|26|73532b...|bag/x.txt
+ *   json - one JSON object per line, keyed by the field names
+ *   bin  - a compact binary stream (see below)
+ *
+ * Binary stream layout (all integers little-endian):
+ *   stream header: "VSMREC1\n"
+ *   record:        u32 body length, u8 field count, fields...
+ *   field:         'u' u64              integer (decimal or hex in text)
+ *                  's' u16 len, bytes   string
+ *                  'h' u8 len, bytes    raw digest bytes
+ * Field names are not stored; the field order of each tool is documented
+ * at the top of that tool's source.
+ */
+#ifndef OUTFMT_H
+#define OUTFMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum out_format{OUT_TEXT, OUT_JSON, OUT_BIN};
+
+#define OUT_BUF_SZ 1048576
+#define OUT_BIN_MAGIC "VSMREC1\n"
+
+typedef struct
+{
+    int fd;
+    int format;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t rec_start;   /* bin: offset of the current record's length word */
+    int nfields;        /* fields written so far in the current record */
+    unsigned long long n_recs;
+} OutBuf;
+
+int out_parse_format(const char *name);
+const char *out_format_name(int format);
+
+void out_init(OutBuf *ob, int fd, int format);
+void out_init_size(OutBuf *ob, int fd, int format, size_t cap);
+/* A piece of a stream that will be appended after another (no bin header).
+ * With fd -1 the buffer is memory only: it grows instead of being written,
+ * the caller reads buf/len and empties it with out_reset(). */
+void out_init_part(OutBuf *ob, int fd, int format);
+void out_flush(OutBuf *ob);
+void out_reset(OutBuf *ob);
+void out_free(OutBuf *ob);
+
+void out_begin(OutBuf *ob);
+void out_str(OutBuf *ob, const char *key, const char *s);
+void out_strn(OutBuf *ob, const char *key, const char *s, size_t n);
+void out_join(OutBuf *ob, const char *key, const char *a, char sep, const char *b);
+void out_u64(OutBuf *ob, const char *key, uint64_t v);
+void out_x64(OutBuf *ob, const char *key, uint64_t v);
+void out_hex(OutBuf *ob, const char *key, const unsigned char *p, size_t n);
+void out_end(OutBuf *ob);
+
+/* Copy bytes through untouched (text banners, pre-formatted lines). */
+void out_raw(OutBuf *ob, const char *s, size_t n);
+
+/* Helpers that do not need an OutBuf. */
+char *out_fmt_u64(char *dst, uint64_t v);
+char *out_fmt_hex(char *dst, const unsigned char *p, size_t n);
+
+#endif
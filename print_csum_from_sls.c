@@ -1,7 +1,37 @@
-/* Taken from
+/* Originally taken from
  * https://www.lemoda.net/c/recursive-directory/
  *
- * gcc -o print_csum_from_sls print_csum_from_sls.c -L /opt/vsm/lib -lsam -lssl -lvsm
+ * gcc -o print_csum_from_sls print_csum_from_sls.c outfmt.c -lpthread -L /opt/vsm/lib -lsam -lssl -lvsm
+ *
+ * Usage: print_csum_dk_from_sls [-o text|json|bin] [-t threads] [-s old.snap] [-S new.snap] [-T] [-P dir] [-X file] <dir>
+ *        print_csum_li_from_sls [-o text|json|bin] [-t threads] [-s old.snap] [-S new.snap] [-T] [-P dir] [-X file] <dir>
+ *
+ * -t runs that many walker threads (default 1). The lines are the same either
+ * way, but their order differs from run to run when more than one is used.
+ *
+ * Incremental inventory:
+ * -S writes a snapshot of the walk to new.snap (via new.snap.tmp).
+ * -s reads the snapshot of an earlier run. A directory whose mtime and ctime
+ *    are unchanged since then is not read again: its files are taken from the
+ *    snapshot and only sam_lstat'ed, and a file whose inode times are also
+ *    unchanged keeps its old checksum. Only rows that are new or differ from
+ *    the old snapshot (checksum, archive copies, size) are printed.
+ * -T also trusts the rows of unchanged directories without any stat at all.
+ * The full inventory is the F lines of the new snapshot:
+ *    grep '^F|' new.snap | cut -d'|' -f4-
+ *
+ * -P dir also writes the full inventory (text) split by archive copy and
+ *    VSN, each piece sorted by position and offset:
+ *      dir/<copy>.<vsn>.txt       rows of copy 1, 2 or 3 on that VSN
+ *      dir/<copy>.<vsn>.txt.idx   "hexpos byte-offset nrows" per position
+ *    so the rows of one archive file are
+ *      tail -c +$((byte-offset + 1)) dir/2.A00041.txt | head -n $nrows
+ *
+ * -X file also writes the inventory the other program would (li rows from
+ *    print_csum_dk_from_sls, dk rows from print_csum_li_from_sls) to file, as
+ *    text, from the same walk; with -P its shards are written too. Both copies
+ *    of a run (runfixity.sh -x) then come from one pass over the inodes. Not
+ *    with -s or -S.
  */
 
 /*
@@ -16,8 +46,18 @@
  * 0 - regular file
  * 1 - directory
  * 2 - link
+ *
+ * -o json writes the same fields as one object per line, keyed
+ *    dk: type, checksum, archive, position, offset, size, path
+ *    li: type, checksum, copy2, position2, offset2, copy3, position3, offset3, size, path
+ * (positions and offsets are plain integers there, not hex).
+ * -o bin writes them in that order as an outfmt.h record stream; the checksum
+ * is raw digest bytes, or the string NO_CKSUM_IN_INODE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 /* #include <sqlite3.h> */
 #include <time.h>
@@ -29,6 +69,12 @@
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 /* "readdir" etc. are defined here. */
 #include <dirent.h>
 /* limits.h defines "PATH_MAX". */
@@ -36,6 +82,7 @@
 #include "vsm/stat.h"
 #include <vsm/diskvols.h>
 #include "/opt/vsm/include/lib.h"
+#include "outfmt.h"
 
 enum vsmcopy{dk,liA,liB,s3};
 enum inotype{file,dir,links,other};
@@ -45,52 +92,722 @@ enum inotype{file,dir,links,other};
 off_t t_size=0; /* bytes */
 int n_inos[4] = {0,0,0,0};
 int copy;
+int xcopy = -1;     /* -X: the other kind of row as well */
+OutBuf out;
 /* Global variables */
 
-static void list_dir (const char * dir_name) {
-    DIR * d;
-    char * subdir;
+/*
+ * Parallel walk. Each walker thread owns a deque of directories still to be
+ * listed: it pushes the subdirectories it finds and pops from the same end
+ * (depth first), while idle walkers steal from the other end, which tends to
+ * hand them the larger, shallower subtrees. Each walker writes to its own
+ * output buffer; with more than one walker those go to unlinked temp files
+ * that main() appends to stdout once the walk is done.
+ */
+#define MAX_WALKERS 64
+#define DENTS_BUF_SZ 262144
+
+/* glibc before 2.30 has no getdents64() wrapper; this is the kernel's record. */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    uint64_t ino;
+    size_t name;        /* offset into Walker.names */
+    unsigned char type; /* DT_* from getdents64 */
+} Dent;
+
+/*
+ * Snapshot file: a "#VSMSNAP1 dk|li" line, then one block per directory
+ *   D|mtime|ctime|<dir path>
+ *   F|mtime|ctime|<text inventory row>     a file or link in it
+ *   S|<name>                               a subdirectory of it
+ * Times are seconds; 0 means "do not trust", written for anything that
+ * changed while the walk was running.
+ */
+#define SNAP_MAGIC "#VSMSNAP1"
+
+typedef struct
+{
+    const char *path;   /* NULL: empty hash slot */
+    size_t len;
+    long mtime;
+    long ctime;
+    const char *start;  /* lines of the block, after the D line */
+    const char *end;
+} SnapDir;
+
+typedef struct
+{
+    const char *name;   /* last component of the row's path */
+    size_t len;
+    const char *line;   /* the F line */
+} OldEnt;
+
+const char *snap_map;       /* old snapshot (-s), mmap'ed */
+size_t snap_size;
+SnapDir *snap_dirs;         /* open addressing on the directory path */
+size_t snap_mask;
+unsigned long snap_files;   /* F lines in the old snapshot */
+int snap_fd = -1;           /* new snapshot (-S) */
+int trust_dirs = 0;         /* -T */
+int incremental = 0;
+char *shard_dir = NULL;     /* -P */
+int shard_fd = -1;          /* -P, opened before the walk moves the cwd */
+int row_text = 0;           /* rows are built as text first (-s/-S/-P) */
+time_t snap_time;           /* when this walk started */
+int n_fields;               /* fields in a text row: 7 dk, 10 li */
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    char **dirs;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    OutBuf out;
+    int tmpfd;
+    OutBuf xout;        /* -X rows */
+    int xtmpfd;
+    int n_inos[4];
+    int relative;       /* sam calls use names relative to our own cwd */
+    char *dents;        /* getdents64 buffer */
+    Dent *ents;         /* entries of the directory being listed */
+    size_t ents_cap;
+    char *names;
+    size_t names_cap;
+    char path[PATH_MAX];
+    /* incremental mode */
+    OutBuf row;         /* current row as text, memory only */
+    OutBuf snap;        /* our part of the new snapshot */
+    int snapfd;
+    OutBuf spool;       /* every row as text, for -P */
+    OutBuf xspool;      /* and every -X row */
+    OldEnt *old;        /* files of the old block, sorted by name */
+    size_t old_cap;
+    unsigned long n_listed, n_reused, n_sums, n_sums_reused, n_changed, n_matched;
+} Walker;
+
+Walker *walkers;
+int n_walkers = 1;
+int start_fd;     /* cwd at startup; directories are opened relative to it */
+long pending = 0; /* directories queued or being listed */
+int n_idle = 0;
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void flush_output(void)
+{
+    out_flush(&out);
+}
+
+static int dent_compare(const void *a, const void *b)
+{
+    const Dent *da = a, *db = b;
+
+    return (da->ino > db->ino) - (da->ino < db->ino);
+}
+
+/* Checksum kept in the inode; cs_nchars is 0 if there is none. */
+static void get_csum(const char *path, struct sam_checksum *csum)
+{
+    // grab checksum struct
+    if (sam_checksum(path, csum, sizeof(*csum)) < 0)
+        csum->cs_nchars = 0;
+}
+
+/* Inode checksum as a hex digest, or NO_CKSUM_IN_INODE. */
+static void print_csum_field(OutBuf *ob, struct sam_checksum *csum)
+{
+    if (csum->cs_nchars == 0)
+        out_str(ob, "checksum", "NO_CKSUM_IN_INODE");
+    else
+        out_hex(ob, "checksum", csum->cs_csum, csum->cs_nchars);
+}
+
+/* Archive copy columns, size and path for one inventory row of kind dk or liA. */
+static void print_copy_fields(OutBuf *ob, int kind, struct sam_stat *sb, const char *path)
+{
+    char dkname[256];
+
+    if (kind == dk) {
+        DiskVolsGenFileName(sb->copy[dk].position, &dkname[0], 256);
+        out_join(ob, "archive", sb->copy[dk].vsn, '/', dkname);
+        out_u64(ob, "position", sb->copy[dk].position);
+        out_u64(ob, "offset", sb->copy[dk].offset/512);
+    }
+    else {
+        out_join(ob, "copy2", sb->copy[liA].media, '.', sb->copy[liA].vsn);
+        out_x64(ob, "position2", sb->copy[liA].position);
+        out_x64(ob, "offset2", sb->copy[liA].offset/512);
+        out_join(ob, "copy3", sb->copy[liB].media, '.', sb->copy[liB].vsn);
+        out_x64(ob, "position3", sb->copy[liB].position);
+        out_x64(ob, "offset3", sb->copy[liB].offset/512);
+    }
+    out_u64(ob, "size", sb->st_size);
+    out_str(ob, "path", path);
+}
+
+/* One inventory row: type 0 (file) or 2 (link, no checksum). */
+static void print_row(OutBuf *ob, int kind, short type, struct sam_checksum *csum,
+                      struct sam_stat *sb, const char *path)
+{
+    out_begin(ob);
+    out_u64(ob, "type", type);
+    if (type == 0)
+        print_csum_field(ob, csum);
+    else
+        out_str(ob, "checksum", "");
+    print_copy_fields(ob, kind, sb, path);
+    out_end(ob);
+}
+
+/* -X: the same file's row as the other inventory has it. */
+static void cross_row(Walker *w, short type, struct sam_checksum *csum, struct sam_stat *sb)
+{
+    out_reset(&w->row);
+    print_row(&w->row, xcopy, type, csum, sb, w->path);
+    out_raw(&w->xout, w->row.buf, w->row.len);
+    if (shard_dir != NULL)
+        out_raw(&w->xspool, w->row.buf, w->row.len);
+}
+
+/* Queue a directory on this walker's deque. */
+static void push_dir (Walker *w, const char *path) {
+    __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap) {
+        w->cap = w->cap ? w->cap*2 : 256;
+        w->dirs = realloc(w->dirs, sizeof(char *)*w->cap);
+        if (w->dirs == NULL) {
+            fprintf (stderr, "Out of memory queueing '%s'\n", path);
+            exit (EXIT_FAILURE);
+        }
+    }
+    w->dirs[w->tail++] = strdup(path);
+    pthread_mutex_unlock(&w->lock);
+
+    if (__atomic_load_n(&n_idle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+/* Newest entry of our own deque. */
+static char *pop_dir (Walker *w) {
+    char *path = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head) {
+        path = w->dirs[--w->tail];
+        if (w->tail == w->head)
+            w->head = w->tail = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return path;
+}
+
+/* Oldest entry of somebody else's deque. */
+static char *steal_dir (Walker *w) {
+    char *path = NULL;
+    int k;
+
+    for (k = 1; k < n_walkers && path == NULL; k++) {
+        Walker *v = &walkers[(w->id + k) % n_walkers];
+
+        pthread_mutex_lock(&v->lock);
+        if (v->tail > v->head) {
+            path = v->dirs[v->head++];
+            if (v->tail == v->head)
+                v->head = v->tail = 0;
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return path;
+}
+
+/* ---- snapshots ---- */
+
+/* Start of field k of a text row (0 = typeflag). */
+static const char *row_field(const char *row, const char *end, int k)
+{
+    while (k > 0 && row < end) {
+        if (*row++ == '|')
+            k--;
+    }
+    return row;
+}
+
+/* Times of a D or F line; returns its payload (path or row). */
+static const char *snap_times(const char *line, long *mtime, long *ctime)
+{
+    const char *p = line + 2;
+
+    for (*mtime = 0; *p >= '0' && *p <= '9'; p++)
+        *mtime = *mtime*10 + (*p - '0');
+    for (*ctime = 0, p++; *p >= '0' && *p <= '9'; p++)
+        *ctime = *ctime*10 + (*p - '0');
+    return p + 1;
+}
+
+static uint64_t snap_hash(const char *s, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+
+    while (n--) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static SnapDir *snap_find(const char *path, size_t len)
+{
+    size_t i = snap_hash(path, len) & snap_mask;
+
+    while (snap_dirs[i].path != NULL) {
+        if (snap_dirs[i].len == len && memcmp(snap_dirs[i].path, path, len) == 0)
+            return &snap_dirs[i];
+        i = (i + 1) & snap_mask;
+    }
+    return NULL;
+}
+
+/* Map the old snapshot and index its directory blocks. */
+static void snap_load(const char *name)
+{
+    int fd;
+    struct stat st;
+    const char *p, *e, *end, *path;
+    char hdr[32];
+    size_t n_dirs = 0, cap, i;
+    long mtime, ctime;
+    SnapDir *d, *prev = NULL;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf (stderr, "Cannot open snapshot '%s': %s\n", name, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    snap_size = st.st_size;
+    snprintf(hdr, sizeof(hdr), "%s %s\n", SNAP_MAGIC, copy == dk ? "dk" : "li");
+    if (snap_size < strlen(hdr)) {
+        fprintf (stderr, "'%s' is not a snapshot\n", name);
+        exit (EXIT_FAILURE);
+    }
+    snap_map = mmap(NULL, snap_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (snap_map == MAP_FAILED) {
+        fprintf (stderr, "Cannot map snapshot '%s': %s\n", name, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    close(fd);
+    end = snap_map + snap_size;
+    if (memcmp(snap_map, hdr, strlen(hdr)) != 0) {
+        fprintf (stderr, "'%s' is not a %s snapshot\n", name, copy == dk ? "dk" : "li");
+        exit (EXIT_FAILURE);
+    }
+    if (end[-1] != '\n') {
+        fprintf (stderr, "Snapshot '%s' is truncated\n", name);
+        exit (EXIT_FAILURE);
+    }
+
+    p = snap_map + strlen(hdr);
+    for (e = p; e < end; e = memchr(e, '\n', end - e) + 1) {
+        if (*e == 'D')
+            n_dirs++;
+        else if (*e == 'F')
+            snap_files++;
+    }
+    for (cap = 1024; cap < 2*n_dirs; cap *= 2)
+        ;
+    snap_dirs = calloc(cap, sizeof(SnapDir));
+    if (snap_dirs == NULL) {
+        fprintf (stderr, "Out of memory loading snapshot '%s'\n", name);
+        exit (EXIT_FAILURE);
+    }
+    snap_mask = cap - 1;
+
+    for (; p < end; p = e + 1) {
+        e = memchr(p, '\n', end - p);
+        if (*p != 'D')
+            continue;
+        if (prev != NULL)
+            prev->end = p;
+        path = snap_times(p, &mtime, &ctime);
+        i = snap_hash(path, e - path) & snap_mask;
+        while (snap_dirs[i].path != NULL)
+            i = (i + 1) & snap_mask;
+        d = &snap_dirs[i];
+        d->path = path;
+        d->len = e - path;
+        d->mtime = mtime;
+        d->ctime = ctime;
+        d->start = e + 1;
+        prev = d;
+    }
+    if (prev != NULL)
+        prev->end = end;
+}
+
+/* Write through to the new snapshot, if there is one. */
+static inline void snap_put(Walker *w, const char *s, size_t n)
+{
+    if (snap_fd >= 0)
+        out_raw(&w->snap, s, n);
+}
+
+/* "X|mtime|ctime|"; times of anything changed since the walk began are not kept. */
+static void snap_head(Walker *w, char tag, long mtime, long ctime)
+{
+    char buf[64], *p = buf;
+
+    if (ctime >= snap_time)
+        mtime = ctime = 0;
+    *p++ = tag;
+    *p++ = '|';
+    p = out_fmt_u64(p, mtime);
+    *p++ = '|';
+    p = out_fmt_u64(p, ctime);
+    *p++ = '|';
+    snap_put(w, buf, p - buf);
+}
+
+static void snap_subdir(Walker *w, const char *name, size_t len)
+{
+    snap_put(w, "S|", 2);
+    snap_put(w, name, len);
+    snap_put(w, "\n", 1);
+}
+
+/* Checksum field of an old row back into binary; 0 if it had none. */
+static int old_csum(const char *row, const char *end, struct sam_checksum *csum)
+{
+    const char *p = row_field(row, end, 1);
+    const char *q = row_field(row, end, 2) - 1;
+    size_t n = (q - p)/2, i;
+    int hi, lo;
+
+    if (q <= p || (q - p) % 2 || n > sizeof(csum->cs_csum))
+        return 0;
+    for (i = 0; i < n; i++) {
+        hi = p[2*i] <= '9' ? p[2*i] - '0' : p[2*i] - 'a' + 10;
+        lo = p[2*i+1] <= '9' ? p[2*i+1] - '0' : p[2*i+1] - 'a' + 10;
+        if (hi < 0 || hi > 15 || lo < 0 || lo > 15)
+            return 0;
+        csum->cs_csum[i] = (hi << 4) | lo;
+    }
+    csum->cs_nchars = n;
+    return 1;
+}
+
+/*
+ * One file or link when rows are built as text. "old" is its F line in the
+ * old snapshot, if any. The checksum is read again only if the inode changed;
+ * the row is printed only if it differs from the old one.
+ */
+static void snap_file (Walker *w, short type, const char *sam_name,
+                       struct sam_stat *sb, const char *old) {
+    struct sam_checksum csum;
+    const char *old_row = NULL, *old_end = NULL;
+    long mtime = 0, ctime = 0;
+
+    csum.cs_nchars = 0;
+    if (old != NULL) {
+        w->n_matched++;
+        old_row = snap_times(old, &mtime, &ctime);
+        old_end = strchr(old_row, '\n') + 1;
+    }
+    if (type == 0) {
+        if (old_row != NULL && mtime != 0 && mtime == (long)sb->st_mtime &&
+                ctime == (long)sb->st_ctime && old_csum(old_row, old_end, &csum))
+            w->n_sums_reused++;
+        else {
+            get_csum(sam_name, &csum);
+            w->n_sums++;
+        }
+    }
+    out_reset(&w->row);
+    print_row(&w->row, copy, type, &csum, sb, w->path);
+    snap_head(w, 'F', sb->st_mtime, sb->st_ctime);
+    snap_put(w, w->row.buf, w->row.len);
+    if (shard_dir != NULL)
+        out_raw(&w->spool, w->row.buf, w->row.len);
+
+    if (old_row != NULL && (size_t)(old_end - old_row) == w->row.len &&
+            memcmp(old_row, w->row.buf, w->row.len) == 0)
+        return;
+    w->n_changed++;
+    if (w->out.format == OUT_TEXT)
+        out_raw(&w->out, w->row.buf, w->row.len);
+    else
+        print_row(&w->out, copy, type, &csum, sb, w->path);
+    /* after the row above: cross_row reuses w->row */
+    if (xcopy >= 0)
+        cross_row(w, type, &csum, sb);
+}
+
+static int old_compare(const void *a, const void *b)
+{
+    const OldEnt *oa = a, *ob = b;
+    int c = memcmp(oa->name, ob->name, oa->len < ob->len ? oa->len : ob->len);
+
+    return c ? c : (oa->len > ob->len) - (oa->len < ob->len);
+}
+
+/* Index the files of an old block by name, for a directory that changed. */
+static size_t load_old (Walker *w, SnapDir *d) {
+    const char *p, *e, *path, *name;
+    size_t n = 0;
+    long mtime, ctime;
+
+    for (p = d->start; p < d->end; p = e + 1) {
+        e = memchr(p, '\n', d->end - p);
+        if (*p != 'F')
+            continue;
+        path = snap_times(p, &mtime, &ctime);
+        path = row_field(path, e, n_fields - 1);
+        for (name = e; name > path && name[-1] != '/'; name--)
+            ;
+        if (n == w->old_cap) {
+            w->old_cap = w->old_cap ? w->old_cap*2 : 1024;
+            w->old = realloc(w->old, sizeof(OldEnt)*w->old_cap);
+            if (w->old == NULL) {
+                fprintf (stderr, "Out of memory reading snapshot block '%.*s'\n",
+                         (int)d->len, d->path);
+                exit (EXIT_FAILURE);
+            }
+        }
+        w->old[n].name = name;
+        w->old[n].len = e - name;
+        w->old[n].line = p;
+        n++;
+    }
+    qsort(w->old, n, sizeof(OldEnt), old_compare);
+    return n;
+}
+
+/*
+ * A directory that has not changed since the old snapshot: its entries are
+ * the ones recorded there. Subdirectories are queued straight from the S
+ * lines; files are only sam_lstat'ed (or, with -T, copied as they were).
+ */
+static void reuse_dir (Walker *w, SnapDir *d) {
+    const char *p, *e, *row, *path;
+    long mtime, ctime;
+    size_t dir_len = strlen (w->path), len;
+    struct sam_stat sb;
+    short int type;
+
+    w->n_reused++;
+    for (p = d->start; p < d->end; p = e + 1) {
+        e = memchr(p, '\n', d->end - p);
+        if (*p == 'S') {
+            len = e - (p + 2);
+            if (dir_len + len >= PATH_MAX) {
+                fprintf (stderr, "Path length exceeds PATH_MAX!\n");
+                exit (EXIT_FAILURE);
+            }
+            memcpy (w->path + dir_len, p + 2, len);
+            w->path[dir_len + len] = '\0';
+            w->n_inos[dir]++;
+            push_dir (w, w->path);
+            snap_put (w, p, e + 1 - p);
+            continue;
+        }
+        if (*p != 'F')
+            continue;
+
+        row = snap_times(p, &mtime, &ctime);
+        if (trust_dirs) {
+            w->n_matched++;
+            w->n_inos[*row == '2' ? links : file]++;
+            snap_put (w, p, e + 1 - p);
+            if (shard_dir != NULL)
+                out_raw (&w->spool, row, e + 1 - row);
+            continue;
+        }
+        path = row_field(row, e, n_fields - 1);
+        if ((size_t)(e - path) >= PATH_MAX) {
+            fprintf (stderr, "Path length exceeds PATH_MAX!\n");
+            exit (EXIT_FAILURE);
+        }
+        memcpy (w->path, path, e - path);
+        w->path[e - path] = '\0';
+
+        if (sam_lstat(w->relative ? w->path + dir_len : w->path, &sb, sizeof(sb)) < 0) {
+            if (errno == ENOENT)
+                continue;
+            perror("sam stat");
+            exit(1);
+        }
+        if (S_ISLNK(sb.st_mode)) {
+            w->n_inos[links]++;
+            type=2;
+        }
+        else if (S_ISREG(sb.st_mode)) {
+            w->n_inos[file]++;
+            type=0;
+        }
+        else
+            continue;
+        snap_file (w, type, w->relative ? w->path + dir_len : w->path, &sb, p);
+    }
+}
+
+/* Read every entry of an open directory with getdents64, sorted by inode. */
+static size_t read_dir (Walker *w, int dfd, const char *dir_name) {
+    long nread, pos;
+    size_t n_ents = 0, n_names = 0, len;
+    struct linux_dirent64 *de;
+
+    while ((nread = syscall (SYS_getdents64, dfd, w->dents, DENTS_BUF_SZ)) > 0) {
+        for (pos = 0; pos < nread; pos += de->d_reclen) {
+            de = (struct linux_dirent64 *)(w->dents + pos);
+            /* skip "d" and d's parent */
+            if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+                    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+                continue;
+
+            len = strlen (de->d_name) + 1;
+            if (n_ents == w->ents_cap) {
+                w->ents_cap = w->ents_cap ? w->ents_cap*2 : 1024;
+                w->ents = realloc (w->ents, sizeof(Dent)*w->ents_cap);
+            }
+            while (n_names + len > w->names_cap) {
+                w->names_cap = w->names_cap ? w->names_cap*2 : 65536;
+                w->names = realloc (w->names, w->names_cap);
+            }
+            if (w->ents == NULL || w->names == NULL) {
+                fprintf (stderr, "Out of memory reading '%s'\n", dir_name);
+                exit (EXIT_FAILURE);
+            }
+            w->ents[n_ents].ino = de->d_ino;
+            w->ents[n_ents].type = de->d_type;
+            w->ents[n_ents].name = n_names;
+            memcpy (w->names + n_names, de->d_name, len);
+            n_names += len;
+            n_ents++;
+        }
+    }
+    if (nread < 0) {
+        fprintf (stderr, "Cannot read directory '%s': %s\n",
+                 dir_name, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+
+    /* inode order keeps the metadata reads that follow close together */
+    qsort (w->ents, n_ents, sizeof(Dent), dent_compare);
+    return n_ents;
+}
+
+static void list_dir (Walker *w, const char * dir_name) {
+    int dfd;
+    size_t n_ents, i, n_old = 0;
+    size_t dir_len, name_len;
+    const char *d_name;
+    const char *sam_name;
+    struct sam_stat sb;
+    struct sam_checksum csum;
+    short int type;
+    SnapDir *d = NULL;
+    OldEnt key, *found;
+    int reuse = 0;
 
-    /* Open the directory specified by "dir_name". */
+    if (incremental) {
+        struct stat st;
+
+        if (fstatat (start_fd, dir_name, &st, 0) < 0) {
+            fprintf (stderr, "Cannot stat directory '%s': %s\n",
+                     dir_name, strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+        if (snap_map != NULL)
+            d = snap_find (dir_name, strlen (dir_name));
+        reuse = (d != NULL && d->mtime != 0 && d->mtime == (long)st.st_mtim.tv_sec &&
+                 d->ctime == (long)st.st_ctim.tv_sec);
+        snap_head (w, 'D', st.st_mtim.tv_sec, st.st_ctim.tv_sec);
+        snap_put (w, dir_name, strlen (dir_name));
+        snap_put (w, "\n", 1);
+    }
 
-    d = opendir (dir_name);
+    /* "dir_name/" stays in w->path; entry names are appended as needed. */
+    dir_len = strlen (dir_name);
+    if (dir_len + 2 > PATH_MAX) {
+        fprintf (stderr, "Path length exceeds PATH_MAX!\n");
+        exit (EXIT_FAILURE);
+    }
+    memcpy (w->path, dir_name, dir_len);
+    w->path[dir_len++] = '/';
+    w->path[dir_len] = '\0';
+
+    if (reuse && trust_dirs) {
+        reuse_dir (w, d);
+        return;
+    }
+
+    /* Open the directory specified by "dir_name" (relative to where we started). */
+    dfd = openat (start_fd, dir_name, O_RDONLY|O_DIRECTORY);
 
     /* Check it was opened. */
-    if (! d) {
+    if (dfd < 0) {
         fprintf (stderr, "Cannot open directory '%s': %s\n",
                  dir_name, strerror (errno));
         exit (EXIT_FAILURE);
     }
-    while (1) {
-        struct dirent * entry;
-        const char * d_name;
-	int path_length;
-	char path[PATH_MAX];
-	int i;
-	struct sam_stat sb;
-	struct sam_checksum csum;
-	char dkname[256];
-	short int type;
-
-        /* "Readdir" gets subsequent entries from "d". */
-        entry = readdir (d);
-        if (! entry) {
-            /* There are no more entries in this directory, so break
-               out of the while loop. */
-            break;
-        }
-        d_name = entry->d_name;
+
+    /*
+     * Per-entry sam calls take a path. With our own cwd set to this directory
+     * they only have to resolve the entry's name, not the whole path again.
+     */
+    if (w->relative && fchdir (dfd) < 0)
+        w->relative = 0;
+
+    if (reuse) {
+        reuse_dir (w, d);
+        close (dfd);
+        return;
+    }
+    n_ents = read_dir (w, dfd, dir_name);
+    if (incremental) {
+        w->n_listed++;
+        if (d != NULL)
+            n_old = load_old (w, d);
+    }
+
+    for (i = 0; i < n_ents; i++) {
+        d_name = w->names + w->ents[i].name;
 
 	//printf("%s/%s\n",dir_name,d_name);
 
 	/* Do we really need to check path length? */
-	path_length = snprintf (path, PATH_MAX, "%s/%s", dir_name, d_name);
-	if (path_length >= PATH_MAX) {
+	name_len = strlen (d_name);
+	if (dir_len + name_len >= PATH_MAX) {
 	    fprintf (stderr, "Path length exceeds PATH_MAX!\n");
 	    exit (EXIT_FAILURE);
 	}
+	memcpy (w->path + dir_len, d_name, name_len + 1);
+	sam_name = w->relative ? d_name : w->path;
+
+	/* getdents already says it's a directory: no need to stat it */
+	if (w->ents[i].type == DT_DIR) {
+	    w->n_inos[dir]++;
+	    push_dir (w, w->path);
+	    snap_subdir (w, d_name, name_len);
+	    continue;
+	}
 
-	if (sam_lstat(path, &sb, sizeof(sb)) < 0 ) {
+	if (sam_lstat(sam_name, &sb, sizeof(sb)) < 0 ) {
 	    perror("sam stat");
 	    exit(1);
 	}
@@ -98,79 +815,412 @@ static void list_dir (const char * dir_name) {
 
 	// If this is a file or link, print out ino metadata
 	if (S_ISLNK(sb.st_mode)) {
-	    n_inos[links]++;
+	    w->n_inos[links]++;
 	    type=2;
 	}
 	else if (S_ISREG(sb.st_mode)) {
-	    n_inos[file]++;
+	    w->n_inos[file]++;
 	    type=0;
         }
         else if (S_ISDIR(sb.st_mode)) {
 	    type=1;
-            /* Check that the directory is not "d" or d's parent. */
-            if (strcmp (d_name, "..") != 0 && strcmp (d_name, ".") != 0) {
-                int path_length;
-                char path[PATH_MAX];
- 
-	        n_inos[dir]++;
-                path_length = snprintf (path, PATH_MAX, "%s/%s", dir_name, d_name);
-                if (path_length >= PATH_MAX) {
-                    fprintf (stderr, "Path length exceeds PATH_MAX!\n");
-                    exit (EXIT_FAILURE);
-                }
-                /* Recursively call "list_dir" with the new path. */
-                list_dir (path);
-            }
+	    w->n_inos[dir]++;
+	    /* Hand the subdirectory to the pool instead of recursing. */
+	    push_dir (w, w->path);
+	    snap_subdir (w, d_name, name_len);
 	}
 	else {
-	    n_inos[other]++;
+	    w->n_inos[other]++;
 	    type=3;
 	}
-	if (type == 0) {
-            // grab checksum struct
-            if (sam_checksum(path, &csum, sizeof(csum)) < 0) {
-                //perror("sam checksum");
-                //exit(1);
-	        printf("%d|",type);
-	        printf("NO_CKSUM_IN_INODE");
-            }
-	    else {
-	        printf("%d|",type);
-	        if (csum.cs_nchars == 0)
-	            printf("NO_CKSUM_IN_INODE");
-	        else
-	            for (i=0; i<csum.cs_nchars; i++) printf("%02x",csum.cs_csum[i]);
-	        csum.cs_nchars = 0;
-            }
-	    if (copy == dk) {
-	        DiskVolsGenFileName(sb.copy[dk].position, &dkname[0], 256);
-	        printf("|%s/%s|%" PRIu64 "|%" PRIu64 "|%ld|%s\n",sb.copy[dk].vsn,dkname,sb.copy[dk].position,sb.copy[dk].offset/512,sb.st_size,path);
-	    }
-	    else {
-	        printf("|%s.%s|%" PRIx64 "|%" PRIx64, sb.copy[liA].media, sb.copy[liA].vsn,sb.copy[liA].position,sb.copy[liA].offset/512);
-	        printf("|%s.%s|%" PRIx64 "|%" PRIx64 "|%ld|%s\n",sb.copy[liB].media, sb.copy[liB].vsn,sb.copy[liB].position,sb.copy[liB].offset/512,sb.st_size,path);
-	    }
+	if ((type == 0 || type == 2) && row_text) {
+	    key.name = d_name;
+	    key.len = name_len;
+	    found = n_old ? bsearch (&key, w->old, n_old, sizeof(OldEnt), old_compare) : NULL;
+	    snap_file (w, type, sam_name, &sb, found ? found->line : NULL);
 	}
-	else if (type == 2) {
-	    printf("%d|",type);
-	    if (copy == dk) {
-	        DiskVolsGenFileName(sb.copy[dk].position, &dkname[0], 256);
-	        printf("|%s/%s|%" PRIu64 "|%" PRIu64 "|%ld|%s\n",sb.copy[dk].vsn,dkname,sb.copy[dk].position,sb.copy[dk].offset/512,sb.st_size,path);
-	    }
-	    else {
-	        printf("|%s.%s|%" PRIx64 "|%" PRIx64, sb.copy[liA].media, sb.copy[liA].vsn,sb.copy[liA].position,sb.copy[liA].offset/512);
-	        printf("|%s.%s|%" PRIx64 "|%" PRIx64 "|%ld|%s\n",sb.copy[liB].media, sb.copy[liB].vsn,sb.copy[liB].position,sb.copy[liB].offset/512,sb.st_size,path);
-	    }
+	else if (type == 0 || type == 2) {
+	    if (type == 0)
+	        get_csum(sam_name, &csum);
+	    print_row(&w->out, copy, type, &csum, &sb, w->path);
+	    if (xcopy >= 0)
+	        cross_row(w, type, &csum, &sb);
 	}
     }
     /* After going through all the entries, close the directory. */
-    if (closedir (d)) {
+    if (close (dfd)) {
         fprintf (stderr, "Could not close '%s': %s\n",
                  dir_name, strerror (errno));
         exit (EXIT_FAILURE);
     }
 }
 
+/* Walker thread: list directories until every deque is empty and nobody is busy. */
+static void *walk (void *arg) {
+    Walker *w = arg;
+    char *dir_name;
+
+    /* Give this thread a cwd of its own so list_dir can fchdir() into each directory. */
+    w->relative = (unshare (CLONE_FS) == 0);
+    w->dents = malloc (DENTS_BUF_SZ);
+    if (w->dents == NULL) {
+        fprintf (stderr, "Out of memory\n");
+        exit (EXIT_FAILURE);
+    }
+
+    while (1) {
+        dir_name = pop_dir (w);
+        if (dir_name == NULL)
+            dir_name = steal_dir (w);
+
+        if (dir_name != NULL) {
+            list_dir (w, dir_name);
+            free (dir_name);
+            if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+
+        /* Nothing to do right now: wait for a push, or for the walk to end. */
+        pthread_mutex_lock(&idle_lock);
+        if (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        else {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            __atomic_add_fetch(&n_idle, 1, __ATOMIC_RELAXED);
+            pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+            __atomic_sub_fetch(&n_idle, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+    out_flush (&w->out);
+    if (xcopy >= 0)
+        out_flush (&w->xout);
+    if (snap_fd >= 0)
+        out_flush (&w->snap);
+    if (shard_dir != NULL)
+        out_flush (&w->spool);
+    if (shard_dir != NULL && xcopy >= 0)
+        out_flush (&w->xspool);
+    free (w->dents);
+    free (w->ents);
+    free (w->names);
+    free (w->old);
+    return NULL;
+}
+
+/* Append a walker's temp file to the real output. */
+static void append_walker_output (int from, int to) {
+    char *buf;
+    ssize_t n, m, done;
+
+    buf = malloc (OUT_BUF_SZ);
+    lseek (from, 0, SEEK_SET);
+    while ((n = read (from, buf, OUT_BUF_SZ)) > 0) {
+        for (done = 0; done < n; done += m) {
+            m = write (to, buf + done, n - done);
+            if (m < 0) {
+                perror ("write");
+                exit (EXIT_FAILURE);
+            }
+        }
+    }
+    if (n < 0) {
+        perror ("read walker output");
+        exit (EXIT_FAILURE);
+    }
+    free (buf);
+    close (from);
+}
+
+/* An unlinked temp file for one walker's output. */
+static int walker_tmpfile (const char *tmpdir) {
+    char tmpname[PATH_MAX];
+    int fd;
+
+    snprintf (tmpname, PATH_MAX, "%s/print_csum.XXXXXX", tmpdir);
+    fd = mkstemp (tmpname);
+    if (fd < 0) {
+        fprintf (stderr, "Cannot create temp file in %s: %s\n", tmpdir, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    unlink (tmpname);
+    return fd;
+}
+
+/* ---- shards (-P) ---- */
+
+typedef struct
+{
+    int copy;           /* 1 dk, 2 or 3 li; 0: empty slot */
+    char vsn[32];
+    int fd;             /* unsorted rows, unlinked once sorted */
+    OutBuf out;
+    char name[PATH_MAX];
+} Shard;
+
+typedef struct
+{
+    uint64_t pos;
+    uint64_t off;
+    const char *line;
+    size_t len;
+} ShardRow;
+
+Shard *shards;
+size_t shards_cap, n_shards;
+
+static uint64_t parse_num(const char *p, const char *end, int base)
+{
+    uint64_t v = 0;
+    int d;
+
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9')
+            d = *p - '0';
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+            d = *p - 'a' + 10;
+        else
+            break;
+        v = v*base + d;
+    }
+    return v;
+}
+
+/*
+ * VSN, position and offset of one archive copy of a text row: copy 1 from
+ * the dk columns, 2 or 3 from the li ones. Returns 0 if there is no copy.
+ */
+static int row_copy(const char *row, const char *end, int c,
+                    const char **vsn, size_t *vlen, uint64_t *pos, uint64_t *off)
+{
+    const char *a, *b;
+    int k = (c == 3) ? 5 : 2;
+
+    a = row_field(row, end, k);
+    b = row_field(row, end, k + 1) - 1;
+    if (c == 1) {
+        /* DKARC19/d2/f4 */
+        const char *slash = memchr(a, '/', b - a);
+
+        *vsn = a;
+        *vlen = (slash ? slash : b) - a;
+    }
+    else {
+        /* li.A00041 */
+        const char *dot = memchr(a, '.', b - a);
+
+        *vsn = dot ? dot + 1 : b;
+        *vlen = b - *vsn;
+    }
+    if (*vlen == 0 || *vlen >= sizeof(shards[0].vsn))
+        return 0;
+    a = row_field(row, end, k + 1);
+    *pos = parse_num(a, end, c == 1 ? 10 : 16);
+    a = row_field(row, end, k + 2);
+    *off = parse_num(a, end, c == 1 ? 10 : 16);
+    return 1;
+}
+
+static Shard *shard_get(int c, const char *vsn, size_t vlen)
+{
+    size_t i;
+    Shard *sh;
+
+    if (2*(n_shards + 1) > shards_cap) {
+        Shard *old = shards;
+        size_t old_cap = shards_cap;
+
+        shards_cap = shards_cap ? shards_cap*2 : 256;
+        shards = calloc(shards_cap, sizeof(Shard));
+        if (shards == NULL) {
+            fprintf (stderr, "Out of memory\n");
+            exit (EXIT_FAILURE);
+        }
+        for (i = 0; i < old_cap; i++) {
+            size_t j;
+
+            if (old[i].copy == 0)
+                continue;
+            j = (snap_hash(old[i].vsn, strlen(old[i].vsn)) + old[i].copy) & (shards_cap - 1);
+            while (shards[j].copy != 0)
+                j = (j + 1) & (shards_cap - 1);
+            shards[j] = old[i];
+        }
+        free(old);
+    }
+
+    i = (snap_hash(vsn, vlen) + c) & (shards_cap - 1);
+    for (; shards[i].copy != 0; i = (i + 1) & (shards_cap - 1)) {
+        sh = &shards[i];
+        if (sh->copy == c && strlen(sh->vsn) == vlen && memcmp(sh->vsn, vsn, vlen) == 0)
+            return sh;
+    }
+    sh = &shards[i];
+    sh->copy = c;
+    memcpy(sh->vsn, vsn, vlen);
+    sh->vsn[vlen] = '\0';
+    snprintf(sh->name, PATH_MAX, ".%d.%s.tmp", c, sh->vsn);
+    sh->fd = openat(shard_fd, sh->name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (sh->fd < 0) {
+        fprintf (stderr, "Cannot create '%s/%s': %s\n", shard_dir, sh->name, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    unlinkat(shard_fd, sh->name, 0);
+    out_init_size(&sh->out, sh->fd, OUT_TEXT, 65536);
+    n_shards++;
+    return sh;
+}
+
+static int shard_row_compare(const void *a, const void *b)
+{
+    const ShardRow *ra = a, *rb = b;
+
+    if (ra->pos != rb->pos)
+        return (ra->pos > rb->pos) ? 1 : -1;
+    return (ra->off > rb->off) - (ra->off < rb->off);
+}
+
+/* Sort one shard by position and offset and write it with its index. */
+static void shard_finish(Shard *sh)
+{
+    struct stat st;
+    const char *map, *p, *e, *end, *vsn;
+    ShardRow *rows = NULL;
+    size_t n = 0, cap = 0, i, vlen, first;
+    uint64_t done = 0;
+    OutBuf txt, idx;
+    int fd;
+    char name[PATH_MAX], line[64], *q;
+
+    out_flush(&sh->out);
+    if (fstat(sh->fd, &st) < 0 || st.st_size == 0) {
+        close(sh->fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sh->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf (stderr, "Cannot map shard %d.%s: %s\n", sh->copy, sh->vsn, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    end = map + st.st_size;
+    for (p = map; p < end; p = e + 1) {
+        e = memchr(p, '\n', end - p);
+        if (n == cap) {
+            cap = cap ? cap*2 : 4096;
+            rows = realloc(rows, sizeof(ShardRow)*cap);
+            if (rows == NULL) {
+                fprintf (stderr, "Out of memory sorting shard %d.%s\n", sh->copy, sh->vsn);
+                exit (EXIT_FAILURE);
+            }
+        }
+        row_copy(p, e, sh->copy, &vsn, &vlen, &rows[n].pos, &rows[n].off);
+        rows[n].line = p;
+        rows[n].len = e + 1 - p;
+        n++;
+    }
+    qsort(rows, n, sizeof(ShardRow), shard_row_compare);
+
+    snprintf(name, PATH_MAX, "%d.%s.txt", sh->copy, sh->vsn);
+    fd = openat(shard_fd, name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf (stderr, "Cannot create '%s/%s': %s\n", shard_dir, name, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    out_init_part(&txt, fd, OUT_TEXT);
+    snprintf(name, PATH_MAX, "%d.%s.txt.idx", sh->copy, sh->vsn);
+    out_init_part(&idx, openat(shard_fd, name, O_WRONLY|O_CREAT|O_TRUNC, 0644), OUT_TEXT);
+    if (idx.fd < 0) {
+        fprintf (stderr, "Cannot create '%s/%s': %s\n", shard_dir, name, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    for (first = 0; first < n; first = i) {
+        for (i = first; i < n && rows[i].pos == rows[first].pos; i++) {
+            out_raw(&txt, rows[i].line, rows[i].len);
+        }
+        /* positions are hex, as archive_audit and the positions files have them */
+        q = line + snprintf(line, sizeof(line), "%" PRIx64 " ", rows[first].pos);
+        q = out_fmt_u64(q, done);
+        *q++ = ' ';
+        q = out_fmt_u64(q, i - first);
+        *q++ = '\n';
+        out_raw(&idx, line, q - line);
+        for (; first < i; first++)
+            done += rows[first].len;
+    }
+    out_free(&txt);
+    out_free(&idx);
+    close(fd);
+    close(idx.fd);
+    munmap((void *)map, st.st_size);
+    close(sh->fd);
+    free(rows);
+}
+
+/* Split one walker's spooled rows of kind dk or liA into shards. */
+static void spool_to_shards(OutBuf *spool, int kind)
+{
+    int c;
+    struct stat st;
+    const char *map, *p, *e, *end, *vsn;
+    size_t vlen;
+    uint64_t pos, off;
+    Shard *sh;
+
+    out_flush(spool);
+    if (fstat(spool->fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, spool->fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf (stderr, "Cannot map walker output: %s\n", strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+        madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+        end = map + st.st_size;
+        for (p = map; p < end; p = e + 1) {
+            e = memchr(p, '\n', end - p);
+            for (c = (kind == dk) ? 1 : 2; c <= ((kind == dk) ? 1 : 3); c++) {
+                if (!row_copy(p, e, c, &vsn, &vlen, &pos, &off))
+                    continue;
+                sh = shard_get(c, vsn, vlen);
+                out_raw(&sh->out, p, e + 1 - p);
+            }
+        }
+        munmap((void *)map, st.st_size);
+    }
+    out_free(spool);
+    close(spool->fd);
+}
+
+/* Split the spooled rows into shards, then sort each one. */
+static void write_shards(void)
+{
+    int i;
+
+    for (i = 0; i < n_walkers; i++) {
+        spool_to_shards(&walkers[i].spool, copy);
+        if (xcopy >= 0)
+            spool_to_shards(&walkers[i].xspool, xcopy);
+    }
+    for (i = 0; (size_t)i < shards_cap; i++)
+        if (shards[i].copy != 0) {
+            shard_finish(&shards[i]);
+            out_free(&shards[i].out);
+        }
+    free(shards);
+}
+
 int main (int argc, char** argv)
 {
     struct stat myFile;
@@ -180,8 +1230,62 @@ int main (int argc, char** argv)
     int i;
     char *endptr;
     char *progname;
+    char banner[PATH_MAX];
+    int format = OUT_TEXT;
+    int opt;
+    const char *tmpdir;
+    char *snap_in = NULL, *snap_out = NULL, *cross_out = NULL;
+    int cross_fd = -1;
+    char snap_tmp[PATH_MAX];
+    struct timespec now;
+    unsigned long n_listed = 0, n_reused = 0, n_sums = 0, n_sums_reused = 0;
+    unsigned long n_changed = 0, n_matched = 0;
+
+    while ((opt = getopt(argc, argv, "o:t:s:S:TP:X:")) != -1) {
+        switch (opt) {
+            case 't':
+                n_walkers = (int)strtol(optarg, NULL, 10);
+                if (n_walkers < 1 || n_walkers > MAX_WALKERS) {
+                    fprintf (stderr, "Number of threads (%s) is out of range (1-%d).\n", optarg, MAX_WALKERS);
+                    exit (EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                format = out_parse_format(optarg);
+                if (format < 0) {
+                    fprintf (stderr, "Unknown output format '%s' (text|json|bin)\n", optarg);
+                    exit (EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                snap_in = optarg;
+                break;
+            case 'S':
+                snap_out = optarg;
+                break;
+            case 'T':
+                trust_dirs = 1;
+                break;
+            case 'P':
+                shard_dir = optarg;
+                break;
+            case 'X':
+                cross_out = optarg;
+                break;
+            default:
+                fprintf (stderr, "Usage: %s [-o text|json|bin] [-t threads] [-s old.snap] [-S new.snap] [-T] [-P dir] [-X file] <dir>\n", argv[0]);
+                exit (EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf (stderr, "Usage: %s [-o text|json|bin] [-t threads] [-s old.snap] [-S new.snap] [-T] [-P dir] [-X file] <dir>\n", argv[0]);
+        exit (EXIT_FAILURE);
+    }
 
-    path_length = snprintf (path, PATH_MAX, "%s", argv[1]);
+    path_length = snprintf (path, PATH_MAX, "%s", argv[optind]);
+
+    out_init(&out, STDOUT_FILENO, format);
+    atexit(flush_output);
 
     copy=dk;
     // Determine how we're called
@@ -192,7 +1296,8 @@ int main (int argc, char** argv)
     }
     else
         progname++;
-printf("progname = %s\n",progname);
+    if (format == OUT_TEXT)
+        out_raw(&out, banner, snprintf(banner, sizeof(banner), "progname = %s\n", progname));
     if (strcmp(progname, "print_csum_li_from_sls") == 0)
         copy=liA;
     else if (strcmp(progname, "print_csum_dk_from_sls") == 0)
@@ -222,8 +1327,154 @@ printf("progname = %s\n",progname);
 
     n_inos[dir]++;
 
+    if (cross_out != NULL) {
+        if (snap_in != NULL || snap_out != NULL) {
+            fprintf (stderr, "-X cannot be used with -s or -S\n");
+            exit (EXIT_FAILURE);
+        }
+        cross_fd = open (cross_out, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (cross_fd < 0) {
+            fprintf (stderr, "Cannot create '%s': %s\n", cross_out, strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+        xcopy = (copy == dk) ? liA : dk;
+        snprintf (banner, sizeof(banner), "progname = %s\n",
+                  xcopy == dk ? "print_csum_dk_from_sls" : "print_csum_li_from_sls");
+        if (write (cross_fd, banner, strlen (banner)) != (ssize_t)strlen (banner)) {
+            fprintf (stderr, "Cannot write '%s': %s\n", cross_out, strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    /* incremental inventory */
+    n_fields = (copy == dk) ? 7 : 10;
+    incremental = (snap_in != NULL || snap_out != NULL);
+    row_text = (incremental || shard_dir != NULL);
+    if (snap_in != NULL)
+        snap_load (snap_in);
+    if (snap_out != NULL) {
+        char hdr[32];
+
+        if (snprintf (snap_tmp, PATH_MAX, "%s.tmp", snap_out) >= PATH_MAX) {
+            fprintf (stderr, "Path length exceeds PATH_MAX!\n");
+            exit (EXIT_FAILURE);
+        }
+        snap_fd = open (snap_tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (snap_fd < 0) {
+            fprintf (stderr, "Cannot create snapshot '%s': %s\n", snap_tmp, strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+        snprintf (hdr, sizeof(hdr), "%s %s\n", SNAP_MAGIC, copy == dk ? "dk" : "li");
+        if (write (snap_fd, hdr, strlen (hdr)) != (ssize_t)strlen (hdr)) {
+            perror ("write snapshot");
+            exit (EXIT_FAILURE);
+        }
+    }
+    clock_gettime (CLOCK_REALTIME, &now);
+    snap_time = now.tv_sec;
+
     /* walk directory and gather info */
-    list_dir (path);
+    out_flush (&out);
+    start_fd = open (".", O_RDONLY|O_DIRECTORY);
+    if (start_fd < 0) {
+        fprintf (stderr, "Cannot open current directory: %s\n", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    if (shard_dir != NULL) {
+        shard_fd = open (shard_dir, O_RDONLY|O_DIRECTORY);
+        if (shard_fd < 0) {
+            fprintf (stderr, "Cannot open '%s': %s\n", shard_dir, strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+    }
+    tmpdir = getenv ("TMPDIR");
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    walkers = calloc (n_walkers, sizeof(Walker));
+    for (i = 0; i < n_walkers; i++) {
+        walkers[i].id = i;
+        pthread_mutex_init (&walkers[i].lock, NULL);
+        walkers[i].tmpfd = STDOUT_FILENO;
+        walkers[i].snapfd = snap_fd;
+        if (n_walkers > 1) {
+            walkers[i].tmpfd = walker_tmpfile (tmpdir);
+            if (snap_fd >= 0)
+                walkers[i].snapfd = walker_tmpfile (tmpdir);
+        }
+        out_init_part (&walkers[i].out, walkers[i].tmpfd, format);
+        if (xcopy >= 0) {
+            walkers[i].xtmpfd = (n_walkers > 1) ? walker_tmpfile (tmpdir) : cross_fd;
+            out_init_part (&walkers[i].xout, walkers[i].xtmpfd, OUT_TEXT);
+        }
+        if (row_text || xcopy >= 0)
+            out_init_size (&walkers[i].row, -1, OUT_TEXT, 4096);
+        if (shard_dir != NULL)
+            out_init_part (&walkers[i].spool, walker_tmpfile (tmpdir), OUT_TEXT);
+        if (shard_dir != NULL && xcopy >= 0)
+            out_init_part (&walkers[i].xspool, walker_tmpfile (tmpdir), OUT_TEXT);
+        if (snap_fd >= 0)
+            out_init_part (&walkers[i].snap, walkers[i].snapfd, OUT_TEXT);
+    }
+    push_dir (&walkers[0], path);
+
+    if (n_walkers == 1)
+        walk (&walkers[0]);
+    else {
+        for (i = 0; i < n_walkers; i++)
+            if (pthread_create (&walkers[i].thread, NULL, walk, &walkers[i]) != 0) {
+                fprintf (stderr, "Cannot start walker thread %d\n", i);
+                exit (EXIT_FAILURE);
+            }
+        for (i = 0; i < n_walkers; i++)
+            pthread_join (walkers[i].thread, NULL);
+        /* merge the per-thread output */
+        for (i = 0; i < n_walkers; i++) {
+            append_walker_output (walkers[i].tmpfd, STDOUT_FILENO);
+            if (xcopy >= 0)
+                append_walker_output (walkers[i].xtmpfd, cross_fd);
+            if (snap_fd >= 0)
+                append_walker_output (walkers[i].snapfd, snap_fd);
+        }
+    }
+
+    for (i = 0; i < n_walkers; i++) {
+        int k;
+        for (k = 0; k < 4; k++)
+            n_inos[k] += walkers[i].n_inos[k];
+        n_listed += walkers[i].n_listed;
+        n_reused += walkers[i].n_reused;
+        n_sums += walkers[i].n_sums;
+        n_sums_reused += walkers[i].n_sums_reused;
+        n_changed += walkers[i].n_changed;
+        n_matched += walkers[i].n_matched;
+        out_free (&walkers[i].out);
+        if (xcopy >= 0)
+            out_free (&walkers[i].xout);
+        if (row_text || xcopy >= 0)
+            out_free (&walkers[i].row);
+        if (snap_fd >= 0)
+            out_free (&walkers[i].snap);
+        free (walkers[i].dirs);
+    }
+
+    if (shard_dir != NULL)
+        write_shards ();
+    if (cross_fd >= 0 && close (cross_fd) < 0) {
+        fprintf (stderr, "Cannot write '%s': %s\n", cross_out, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    if (snap_fd >= 0) {
+        if (fsync (snap_fd) < 0 || close (snap_fd) < 0 || renameat (start_fd, snap_tmp, start_fd, snap_out) < 0) {
+            fprintf (stderr, "Cannot write snapshot '%s': %s\n", snap_out, strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+    }
+    if (incremental) {
+        fprintf (stderr, "%lu directories read, %lu unchanged; %lu checksums read, %lu reused; "
+                 "%lu rows new or changed, %lu gone\n",
+                 n_listed, n_reused, n_sums, n_sums_reused, n_changed,
+                 snap_map ? snap_files - n_matched : 0);
+    }
 
     /* print out report */
 
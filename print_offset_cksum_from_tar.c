@@ -13,9 +13,41 @@
  *  * Does not require libarchive or any other special library.
  *
  * To compile: gcc -o untar untar.c -lm -lssl -lcrypto
- * To compile: gcc -o print_offset_cksum_from_tar print_offset_cksum_from_tar.c -I ~gara/c_programs/NEW.getbaginfo/boringssl/include -L ~gara/c_programs/NEW.getbaginfo/boringssl/build/crypto -L ~gara/c_programs/NEW.getbaginfo/boringssl/build/ssl -lm -lpthread -lssl -lcrypto
+ * To compile: gcc -o print_offset_cksum_from_tar print_offset_cksum_from_tar.c outfmt.c fixity_table.c ledger.c iogov.c cpuplace.c iolat.c blake3.c -I ~gara/c_programs/NEW.getbaginfo/boringssl/include -L ~gara/c_programs/NEW.getbaginfo/boringssl/build/crypto -L ~gara/c_programs/NEW.getbaginfo/boringssl/build/ssl -lm -lpthread -lrt -lssl -lcrypto
  *
  * Usage:  untar <archive>
+ * Usage:  print_offset_cksum_from_tar [-o text|json|bin] [-j workers] [-C cpus] [-R cpus] [-P] [-l] [-L ms] <archive> MD5|SHA1|SHA256|SHA512|BLAKE3 [DISK|TAPE]
+ *         print_offset_cksum_from_tar -x <inventory-rows> [-c 1|2|3] -r <prefix> [-g ledger] <archive> MD5|... [DISK|TAPE]
+ *
+ * The archive is read by one thread and hashed by -j workers (default 4),
+ * a member per worker at a time; the output order is the archive order.
+ * -C pins the workers to a CPU list (see cpuplace.h) and the reader to -R,
+ * by default the CPUs next to the archive's disk adapter; -P reports where
+ * each thread ran, to stderr.
+ *
+ * MD5 and the SHAs hash a member from start to end, so one big member goes
+ * at the speed of one worker. A BLAKE3 member is shared out: whatever
+ * workers are idle hash its 1KB chunks, 256KB at a time, and its own worker
+ * puts the pieces together (blake3.h).
+ *
+ * An archive of "-" is read from stdin (fixity_tape feeds it that way);
+ * -n gives the name to report it under.
+ *
+ * Reads of the archive are held to the limit iogov.h finds for its device
+ * or VSN, if any. -l reports their latencies (iolat.h) to stderr at the
+ * end, and -L also flags the device as SLOW if its p99 is above ms.
+ *
+ * Output (one line per tar member):
+ *   type|offset|size|checksum|filename
+ * -o json uses those names as keys; -o bin writes the fields in that order
+ * as an outfmt.h record stream (checksum as raw digest bytes).
+ *
+ * -x checks each member as soon as its digest is done against the
+ * print_csum_*_from_sls row at the same offset (-c: copy whose offset column
+ * to use, default 1) instead of printing it. Only the exceptions are
+ * written, to <prefix>_bad_checksums.txt etc. (see fixity_table.h), and one
+ * line of counts to stdout at the end. -g also appends the result of each
+ * file to a ledger (ledger.h).
  *
  * In particular, this program should be sufficient to extract the
  * distribution for libarchive, allowing people to bootstrap
@@ -37,6 +69,14 @@
 #include <math.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "outfmt.h"
+#include "fixity_table.h"
+#include "iogov.h"
+#include "cpuplace.h"
+#include "iolat.h"
+#include "blake3.h"
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 #include <openssl/md5.h>
@@ -76,6 +116,7 @@ char MD5_EMPTY[] = "d41d8cd98f00b204e9800998ecf8427e";
 char SHA1_EMPTY[] = "da39a3ee5e6b4b0d3255bfef95601890afd80709";
 char SHA256_EMPTY[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
 char SHA512_EMPTY[] = "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e";
+char BLAKE3_EMPTY[] = "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262";
 char *empty;
 
 char TAR_MAGIC[] = "ustar ";
@@ -88,9 +129,25 @@ size_t WRK_SZ = 8192;
 //size_t WRK_SZ = 32768;
 // Assume tape unless stated otherwise.
 short int isTape = 1;
+// archive is "-": reads return whatever is in the pipe
+short int fromPipe = 0;
+// read limit for the archive's device or VSN (iogov.h); a pipe is limited by its writer
+IoGov *gov = NULL;
+// read latencies of the archive's device (-l)
+IoLat *lat = NULL;
+// CPUs for the hash workers (-C) and the reader (-R)
+CpuList hash_cpus, read_cpus;
 unsigned long int filesize = 0;
 const EVP_MD *md;
 EVP_MD_CTX *ctx;
+// BLAKE3: hashed by blake3.c, members shared out among the workers
+short int tree = 0;
+OutBuf out;
+// -x: inventory rows of this archive file, and what did not match them
+short int verify = 0;
+FixTable expected;
+FixReport report;
+Ledger ledger;
 
 void parseFileSize(const unsigned char *p, size_t n)
 {
@@ -178,6 +235,488 @@ verify_checksum(const char *p)
 	return (u == parseoct(p + 148, 8));
 }
 
+/* The digest of a zero-length member. */
+static void
+empty_digest(Record *rec)
+{
+	Blake3 h;
+
+	if (tree) {
+	    blake3_init(&h);
+	    blake3_final(&h, rec->checksum);
+	    rec->mdLen = BLAKE3_OUT_LEN;
+	    return;
+	}
+	EVP_DigestInit(ctx,md);
+	EVP_DigestFinal(ctx, rec->checksum, &rec->mdLen);
+}
+
+/* -x: check one member against the inventory rows at its offset. */
+static void
+check_rec(Record *rec)
+{
+	FixRow c, *m;
+	char csum[2*EVP_MAX_MD_SIZE+1];
+
+	m = fix_find(&expected, rec->offset);
+	if (m == NULL)
+	    return;
+	c.offset = rec->offset;
+	c.size = rec->filesize;
+	c.type = rec->type;
+	if (rec->type != 0)
+	    csum[0] = '\0';
+	else if (rec->filesize > 0)
+	    out_fmt_hex(csum, rec->checksum, rec->mdLen);
+	else
+	    strcpy(csum, empty);
+	c.csum = csum;
+	c.csum_len = strlen(csum);
+	c.name = rec->filename;
+	c.name_len = strlen(rec->filename);
+
+	/* rows are sorted by offset: any others for this member follow */
+	for (; m < expected.rows + expected.n && m->offset == rec->offset; m++) {
+	    if (m->seen)
+	        continue;
+	    m->seen = 1;
+	    fix_report_row(&report, m, &c);
+	}
+}
+
+/* Write one member's line. */
+static void
+print_rec(Record *rec)
+{
+	if (verify) {
+	    check_rec(rec);
+	    return;
+	}
+	out_begin(&out);
+	out_u64(&out, "type", rec->type);
+	out_u64(&out, "offset", rec->offset);
+	out_u64(&out, "size", rec->filesize);
+	if (rec->type != 0)
+	    out_str(&out, "checksum", "");
+	else if (rec->filesize > 0 || out.format == OUT_BIN)
+	    out_hex(&out, "checksum", rec->checksum, rec->mdLen);
+	else
+	    out_str(&out, "checksum", empty);
+	out_str(&out, "filename", rec->filename);
+	out_end(&out);
+}
+
+/* Fill a whole record from a pipe, as a read of the archive file would. */
+static ssize_t
+read_rec(int fd, unsigned char *buffer, size_t n)
+{
+	size_t got = 0;
+	ssize_t r;
+
+	while (got < n) {
+	    r = read(fd, buffer + got, n - got);
+	    if (r < 0 && errno == EINTR)
+	        continue;
+	    if (r < 0)
+	        return (got > 0) ? (ssize_t)got : r;
+	    if (r == 0)
+	        break;
+	    got += r;
+	}
+	return got;
+}
+
+/*
+ * The archive is read by a reader thread into a ring of record buffers.
+ * untar() walks the headers in them and hands the payload of each regular
+ * file, as pieces of those buffers, to a pool of hash workers (-j); a
+ * member is hashed by one worker, in order, while other workers hash other
+ * members. Members are printed in archive order as their digests are done.
+ * A record buffer is reused once the parser and every piece in it are done.
+ *
+ * A BLAKE3 member's worker cuts each piece at chunk boundaries into
+ * subtrees of up to TREE_JOB_SZ and queues them for any worker with
+ * nothing else to do, helps with them itself, and adds their CVs to the
+ * member's hash in order once they are all done. The bytes either side of
+ * the cuts, and the member's last chunk, it hashes itself.
+ */
+typedef struct
+{
+	unsigned char *data;
+	size_t len;
+	unsigned long int seq;	/* record number in the archive */
+	int full;		/* read, not yet released */
+	int refs;		/* parser + pieces not yet hashed */
+} RecBuf;
+
+typedef struct Piece
+{
+	struct Piece *next;
+	RecBuf *buf;
+	size_t off;
+	size_t len;
+} Piece;
+
+typedef struct Member
+{
+	struct Member *next;	/* archive order */
+	struct Member *next_job;
+	Record rec;
+	Piece *head, *tail;
+	short int complete;	/* all its payload has been handed over */
+	short int truncated;	/* the archive ended first: no digest */
+	short int hashed;
+	short int drop;		/* not printed (the parse stopped on an error) */
+} Member;
+
+typedef struct TreeJob
+{
+	struct TreeJob *next;
+	const unsigned char *data;
+	uint64_t chunk;		/* first chunk of the subtree */
+	uint64_t chunks;
+	uint8_t cv[BLAKE3_OUT_LEN];
+	int *left;		/* the owner's count of jobs not yet done */
+} TreeJob;
+
+#define RING_SZ 8
+#define TREE_JOB_SZ 262144
+
+int jobs = 4;
+RecBuf ring[RING_SZ];
+int ring_eof = 0;
+int ring_stop = 0;
+Member *members, *members_tail;
+Member *job_head, *job_tail;
+TreeJob *tree_head, *tree_tail;
+int workers_done = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t piece_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t tree_cond = PTHREAD_COND_INITIALIZER;
+
+typedef struct
+{
+	int fd;
+	const char *path;
+} Reader;
+
+/* Fill the ring in order; a zero length record marks the end. */
+static void *
+reader(void *arg)
+{
+	Reader *r = arg;
+	unsigned long int total_bytes_read = 0;
+	unsigned long int seq;
+	unsigned long long t_lat;
+	ssize_t n;
+	RecBuf *b;
+	int stop;
+
+	// the ring is first written here, so its pages are on this thread's node
+	cpu_pin(&read_cpus, "reader", 0);
+
+	if (!isTape)
+	    posix_fadvise64(r->fd,0,TAR_REC_SZ*2,POSIX_FADV_WILLNEED);
+
+	for (seq = 0; ; seq++) {
+	    b = &ring[seq % RING_SZ];
+	    pthread_mutex_lock(&lock);
+	    while (b->full && !ring_stop)
+		pthread_cond_wait(&ring_cond, &lock);
+	    stop = ring_stop;
+	    pthread_mutex_unlock(&lock);
+	    if (stop)
+		break;
+
+	    t_lat = iolat_start(lat);
+	    n = fromPipe ? read_rec(r->fd,b->data,TAR_REC_SZ) : read(r->fd,b->data,TAR_REC_SZ);
+	    iolat_end(lat, t_lat, NULL, total_bytes_read, n > 0 ? n : 0);
+	    if (n < 0)
+		n = 0;
+	    iogov_take(gov, n);
+	    cpu_seen();
+	    // a short last record: a header check never runs past its data
+	    if (n % TAR_BLK_SZ)
+		memset(b->data + n, '\0', TAR_BLK_SZ - n % TAR_BLK_SZ);
+	    total_bytes_read += n;
+	    if (!isTape && n > 0) {
+	        posix_fadvise64(r->fd,(total_bytes_read+TAR_REC_SZ),TAR_REC_SZ*2,POSIX_FADV_WILLNEED);
+	        posix_fadvise64(r->fd,(total_bytes_read-TAR_REC_SZ),TAR_REC_SZ,POSIX_FADV_DONTNEED);
+	    }
+
+	    pthread_mutex_lock(&lock);
+	    b->len = n;
+	    b->seq = seq;
+	    b->refs = 1;
+	    b->full = 1;
+	    pthread_cond_broadcast(&ring_cond);
+	    pthread_mutex_unlock(&lock);
+	    if (n == 0)
+		break;
+	}
+	return (NULL);
+}
+
+/* Drop a reference to a record buffer (lock held). */
+static void
+release(RecBuf *b)
+{
+	if (--b->refs == 0) {
+	    b->full = 0;
+	    pthread_cond_broadcast(&ring_cond);
+	}
+}
+
+/* Hash the subtree at the head of the queue (lock held; dropped meanwhile). */
+static void
+tree_job(void)
+{
+	TreeJob *t = tree_head;
+	Blake3 h;
+
+	tree_head = t->next;
+	if (tree_head == NULL)
+	    tree_tail = NULL;
+	pthread_mutex_unlock(&lock);
+	cpu_seen();
+	blake3_init_at(&h, t->chunk);
+	blake3_update(&h, t->data, t->chunks * BLAKE3_CHUNK_LEN);
+	blake3_cv(&h, t->cv);
+	pthread_mutex_lock(&lock);
+	if (--*t->left == 0)
+	    pthread_cond_broadcast(&tree_cond);
+}
+
+/* Add a piece of a BLAKE3 member, done bytes into it, to h. */
+static void
+tree_piece(Blake3 *h, Member *m, Piece *p, unsigned long int done)
+{
+	const unsigned char *data = p->buf->data + p->off;
+	unsigned long int end = done + p->len;
+	unsigned long int from, to;
+	uint64_t c, k, i, n_jobs = 0;
+	TreeJob *jobs;
+	int left;
+
+	// the whole chunks in the piece, but not the member's last one
+	from = (done + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+	to = end / BLAKE3_CHUNK_LEN;
+	if (to > (m->rec.filesize - 1) / BLAKE3_CHUNK_LEN)
+	    to = (m->rec.filesize - 1) / BLAKE3_CHUNK_LEN;
+	for (c = from; c < to; c += k, n_jobs++)
+	    k = blake3_subtree_len(c, (to - c < TREE_JOB_SZ/BLAKE3_CHUNK_LEN) ? to - c : TREE_JOB_SZ/BLAKE3_CHUNK_LEN);
+	if (n_jobs < 2) {
+	    blake3_update(h, data, p->len);
+	    return;
+	}
+	jobs = malloc(sizeof(TreeJob) * n_jobs);
+	if (jobs == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+	blake3_update(h, data, from * BLAKE3_CHUNK_LEN - done);
+
+	pthread_mutex_lock(&lock);
+	for (i = 0, c = from; i < n_jobs; i++, c += k) {
+	    k = blake3_subtree_len(c, (to - c < TREE_JOB_SZ/BLAKE3_CHUNK_LEN) ? to - c : TREE_JOB_SZ/BLAKE3_CHUNK_LEN);
+	    jobs[i].next = NULL;
+	    jobs[i].data = data + (c * BLAKE3_CHUNK_LEN - done);
+	    jobs[i].chunk = c;
+	    jobs[i].chunks = k;
+	    jobs[i].left = &left;
+	    if (tree_tail != NULL)
+		tree_tail->next = &jobs[i];
+	    else
+		tree_head = &jobs[i];
+	    tree_tail = &jobs[i];
+	}
+	left = n_jobs;
+	pthread_cond_broadcast(&job_cond);
+	while (left > 0) {
+	    if (tree_head != NULL)
+		tree_job();
+	    else
+		pthread_cond_wait(&tree_cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < n_jobs; i++)
+	    blake3_push_cv(h, jobs[i].cv, jobs[i].chunks);
+	free(jobs);
+	blake3_update(h, data + (to * BLAKE3_CHUNK_LEN - done), end - to * BLAKE3_CHUNK_LEN);
+}
+
+static void *
+hasher(void *arg)
+{
+	EVP_MD_CTX *hctx = EVP_MD_CTX_create();
+	Blake3 b3;
+	Member *m;
+	Piece *p;
+	size_t off, n;
+	unsigned long int done;
+
+	cpu_pin(&hash_cpus, "hasher", (int)(long)arg);
+	for (;;) {
+	    pthread_mutex_lock(&lock);
+	    while (job_head == NULL && tree_head == NULL && !workers_done)
+		pthread_cond_wait(&job_cond, &lock);
+	    // another worker's BLAKE3 member comes first: it is waiting on it
+	    if (tree_head != NULL) {
+		tree_job();
+		pthread_mutex_unlock(&lock);
+		continue;
+	    }
+	    m = job_head;
+	    if (m == NULL) {
+		pthread_mutex_unlock(&lock);
+		break;
+	    }
+	    job_head = m->next_job;
+	    if (job_head == NULL)
+		job_tail = NULL;
+	    pthread_mutex_unlock(&lock);
+
+	    if (tree)
+		blake3_init(&b3);
+	    else
+		EVP_DigestInit(hctx,md);
+	    done = 0;
+	    for (;;) {
+		pthread_mutex_lock(&lock);
+		while (m->head == NULL && !m->complete)
+		    pthread_cond_wait(&piece_cond, &lock);
+		p = m->head;
+		if (p != NULL) {
+		    m->head = p->next;
+		    if (m->head == NULL)
+			m->tail = NULL;
+		}
+		pthread_mutex_unlock(&lock);
+		if (p == NULL)
+		    break;
+
+		cpu_seen();
+		if (tree)
+		    tree_piece(&b3, m, p, done);
+		else {
+		    for (off = 0; off < p->len; off += n) {
+			n = (p->len - off < WRK_SZ) ? p->len - off : WRK_SZ;
+			EVP_DigestUpdate(hctx, p->buf->data + p->off + off, n);
+		    }
+		}
+		done += p->len;
+		pthread_mutex_lock(&lock);
+		release(p->buf);
+		pthread_mutex_unlock(&lock);
+		free(p);
+	    }
+	    if (!m->truncated && tree) {
+		blake3_final(&b3, m->rec.checksum);
+		m->rec.mdLen = BLAKE3_OUT_LEN;
+	    }
+	    else if (!m->truncated)
+		EVP_DigestFinal(hctx, m->rec.checksum, &m->rec.mdLen);
+
+	    pthread_mutex_lock(&lock);
+	    m->hashed = 1;
+	    pthread_cond_broadcast(&done_cond);
+	    pthread_mutex_unlock(&lock);
+	}
+	EVP_MD_CTX_destroy(hctx);
+	return (NULL);
+}
+
+/* Queue a member for printing; hash it first if it has a payload. */
+static Member *
+add_member(Record *rec, int hash)
+{
+	Member *m = calloc(1, sizeof(Member));
+
+	if (m == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+	m->rec = *rec;
+	m->hashed = !hash;
+	pthread_mutex_lock(&lock);
+	if (members_tail != NULL)
+	    members_tail->next = m;
+	else
+	    members = m;
+	members_tail = m;
+	if (hash) {
+	    if (job_tail != NULL)
+		job_tail->next_job = m;
+	    else
+		job_head = m;
+	    job_tail = m;
+	    pthread_cond_signal(&job_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return (m);
+}
+
+/* Hand a piece of payload to the member's worker. */
+static void
+add_piece(Member *m, RecBuf *b, size_t off, size_t len, int last)
+{
+	Piece *p = NULL;
+
+	if (len > 0) {
+	    p = malloc(sizeof(Piece));
+	    if (p == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	    }
+	    p->next = NULL;
+	    p->buf = b;
+	    p->off = off;
+	    p->len = len;
+	}
+	pthread_mutex_lock(&lock);
+	if (p != NULL) {
+	    b->refs++;
+	    if (m->tail != NULL)
+		m->tail->next = p;
+	    else
+		m->head = p;
+	    m->tail = p;
+	}
+	if (last)
+	    m->complete = 1;
+	pthread_cond_broadcast(&piece_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Print the members whose digests are done, in order; all of them if wait. */
+static void
+print_members(int wait)
+{
+	Member *m;
+
+	for (;;) {
+	    pthread_mutex_lock(&lock);
+	    while (wait && members != NULL && !members->hashed)
+		pthread_cond_wait(&done_cond, &lock);
+	    m = members;
+	    if (m == NULL || !m->hashed) {
+		pthread_mutex_unlock(&lock);
+		return;
+	    }
+	    members = m->next;
+	    if (members == NULL)
+		members_tail = NULL;
+	    pthread_mutex_unlock(&lock);
+	    if (!m->drop)
+		print_rec(&m->rec);
+	    free(m);
+	}
+}
+
 /* Extract a tar archive. */
 static void
 untar(int fd, const char *path)
@@ -188,11 +727,15 @@ untar(int fd, const char *path)
 	unsigned int remaining_bytes = 0;
 	char *fname;
 	size_t bytes_read;
-	size_t blocks_read;
+	size_t n;
 	double blocks_to_advance = 0;
 	short int state = 0;
-	short int tar_end = 0;
 	Record rec;
+	Member *cur = NULL;	/* the regular file whose payload is being handed out */
+	RecBuf *b;
+	unsigned long int seq;
+	pthread_t rd, *hashers;
+	Reader r;
 	int i = 0;
 
 	// initialize Record struct var
@@ -202,23 +745,41 @@ untar(int fd, const char *path)
 	rec.offset = 1;
 	rec.type = 0;
 
+	for (i = 0; i < RING_SZ; i++) {
+	    ring[i].data = (unsigned char *) malloc(TAR_REC_SZ);
+	    if (ring[i].data == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	    }
+	}
+	r.fd = fd;
+	r.path = path;
+	pthread_create(&rd, NULL, reader, &r);
+	hashers = malloc(sizeof(pthread_t) * jobs);
+	for (i = 0; i < jobs; i++)
+	    pthread_create(&hashers[i], NULL, hasher, (void *)(long)i);
 
 	// LOOP 1
-	// Read in 4096 512-byte blocks
-	buffer = (unsigned char *) malloc(TAR_REC_SZ);
-
-	if (!isTape)
-	    posix_fadvise64(fd,0,TAR_REC_SZ*2,POSIX_FADV_WILLNEED);
-
-	while ((bytes_read = read(fd,buffer,TAR_REC_SZ)) > 0)
+	// Take each record from the ring
+	for (seq = 0; ; seq++)
 	{
+	    b = &ring[seq % RING_SZ];
+	    pthread_mutex_lock(&lock);
+	    // (still full with record seq - RING_SZ while its pieces are hashed)
+	    while (!b->full || b->seq != seq)
+		pthread_cond_wait(&ring_cond, &lock);
+	    pthread_mutex_unlock(&lock);
+	    buffer = b->data;
+	    bytes_read = b->len;
+	    if (bytes_read == 0)
+		break;
 
 	    total_bytes_read += bytes_read;
 
 	    if (bytes_read < TAR_BLK_SZ) {
 		fprintf(stderr,
 		    "Short read on %s: expected at least %d, got %d\n", path, (int)TAR_BLK_SZ, (int)bytes_read);
-		return;
+		goto stop;
    	    }
 
 	    current_byte = 0;
@@ -227,20 +788,15 @@ untar(int fd, const char *path)
 	    // LOOP 2
 	    while (current_byte < bytes_read)
 	    {
-//printf("state = %d  rec-type = %d  current_byte = %d  remaining_bytes = %d  filesize = %llu\n",state, rec.type,current_byte, remaining_bytes,filesize);
 		switch (state) {
 		    // expect new file header
 		    case 0:
-			    if ((rec.mdLen > 0) || (rec.type > 0)) {
-			            // We have a record to print
-				    printf("%d|%llu|%llu|",rec.type,rec.offset,rec.filesize);
-				    if (rec.type == 0) {
-					if (rec.filesize > 0)
-				            for (i=0; i<rec.mdLen; i++) printf("%02x", rec.checksum[i]);
-				        else 
-					    printf("%s",empty); //for (i=0; i<rec.mdLen; i++) printf("00");
-				    }
-				    printf("|%s\n",rec.filename);
+			    if ((rec.mdLen > 0) || (rec.type > 0) || (cur != NULL)) {
+			            // We have a record to print (a regular file's
+				    // was queued at its header)
+				    if (cur == NULL)
+				        add_member(&rec, 0);
+				    cur = NULL;
                                     memset(rec.checksum, '\0', EVP_MAX_MD_SIZE);
                                     memset(rec.filename, '\0', 512);
 				    rec.filesize = 0;
@@ -250,32 +806,23 @@ untar(int fd, const char *path)
 			    if (is_end_of_archive(buffer+current_byte)) {
 				current_byte += 512;
 				remaining_bytes -= 512;
-				//printf("end of archive??\n");
 				// if remaining bytes = 0, assume end of archive?
 				if (remaining_bytes == 0) {
-			            //printf("Total bytes read: %llu\n", total_bytes_read);
-				    return;
+				    goto end;
 				}
 				continue;
 			    }
 			    // test for TAR_MAGIC; if no magic, skip -- assume filler
 			    if (memcmp(buffer+(current_byte+257),TAR_MAGIC,5) != 0) {
-				/*
-			        printf("No magic found at byte %lu ; rec.type = %d ; rec.filename = %s\n", current_byte,rec.type,rec.filename);
-				for (i=0;i<6;i++)
-				    printf("%c",buffer+current_byte+257+i);
-				printf("\n");
-				*/
 				current_byte += TAR_BLK_SZ;
 				remaining_bytes -= TAR_BLK_SZ;
 				continue;
 			    }
 		            if (!verify_checksum(buffer + current_byte)) {
 			            fprintf(stderr, "Checksum failure\n");
-			            return;
+			            goto stop;
 		            }
 			    parseFileSize(buffer + current_byte + 124, 12);
-//printf(">>>>> state = %d  rec-type = %d  current_byte = %d  remaining_bytes = %d  filesize = %llu\n",state, rec.type,current_byte, remaining_bytes,filesize);
 			    rec.filesize = filesize;
 			    rec.offset = ((total_bytes_read - bytes_read + current_byte)/TAR_BLK_SZ) + 1;
 			    switch (buffer[current_byte+156]) {
@@ -321,24 +868,20 @@ untar(int fd, const char *path)
 			        	    sprintf(rec.filename,"%s",buffer + current_byte);
 
 					    if (rec.filesize == 0) {
-			    			EVP_DigestInit(ctx,md);
-					        EVP_DigestUpdate(ctx, buffer+current_byte, rec.filesize);
-				  	        EVP_DigestFinal(ctx, rec.checksum, &rec.mdLen);
+			    			empty_digest(&rec);
 						state = 0;
 					    }
 					    else {
 					        state = 3;
-						EVP_DigestInit(ctx,md);
+						cur = add_member(&rec, 1);
 					        current_byte += TAR_BLK_SZ;
 					        remaining_bytes -= TAR_BLK_SZ;
 					    }
-//printf(">>>>> >>>>> state = %d  rec-type = %d  current_byte = %d  remaining_bytes = %d  mdlen = %d  filesize = %llu\n",state, rec.type,current_byte, remaining_bytes,rec.mdLen,filesize);
 			 	   	    break;
 			    }
 			    // state STILL = 0
 			    if (state == 0) {
 			        // not reg file or extended header or zero-length regular file
-				//printf("So, state = 0 and filesize = %llu\n", filesize);
 				// assumes that this file (hardlink) won't span to next record
 				if (filesize == 0)
 				        filesize += TAR_BLK_SZ;
@@ -362,7 +905,6 @@ untar(int fd, const char *path)
 			    parseFileSize(buffer + current_byte + 124, 12);
 			    rec.filesize = filesize;
 			    rec.offset = ((total_bytes_read - bytes_read + current_byte)/TAR_BLK_SZ) + 1;
-//printf(">>>>> STATE 2: state = %d  rec-type = %d  current_byte = %d  bytes_read = %d  remaining_bytes = %d  mdlen = %d  filesize = %llu\n",state, rec.type,current_byte,bytes_read, remaining_bytes,rec.mdLen,filesize);
 			    switch(buffer[current_byte+156]) {
 			        case '1':
 				    rec.type = 1;
@@ -393,54 +935,31 @@ untar(int fd, const char *path)
 			        default:
 				    rec.type = 0;
 				    if (rec.filesize == 0) {
-				        EVP_DigestInit(ctx,md);
-					EVP_DigestUpdate(ctx, buffer+current_byte, rec.filesize);
-					EVP_DigestFinal(ctx, rec.checksum, &rec.mdLen);
+				        empty_digest(&rec);
 					state = 0;
 				    }
 				    else {
 			                state = 3;
-			                EVP_DigestInit(ctx,md);
+					cur = add_member(&rec, 1);
 				    }
 				    break;
 			    }
 			    current_byte += TAR_BLK_SZ;
 			    remaining_bytes -= TAR_BLK_SZ;
-			    //state = 3;
-			    //EVP_DigestInit(ctx,md);
 		            break;
-		    // Processing file payload 
+		    // Processing file payload: hand it to the member's worker
 		    case 3:
-			    if (filesize <= WRK_SZ) {
-			        if (filesize <= remaining_bytes) {
-				    EVP_DigestUpdate(ctx, buffer+current_byte, filesize);
-				    EVP_DigestFinal(ctx, rec.checksum, &rec.mdLen);
-				    blocks_to_advance = ceil((double)filesize/TAR_BLK_SZ);
-			            current_byte += (blocks_to_advance*512);
-			            remaining_bytes -= (blocks_to_advance*512);
-			            state = 0;
-				}
-				else {
-				    EVP_DigestUpdate(ctx, buffer+current_byte, remaining_bytes);
-				    filesize -= remaining_bytes;
-				    current_byte = bytes_read;
-				    state = 3;
-				}
+			    n = (filesize <= remaining_bytes) ? filesize : remaining_bytes;
+			    filesize -= n;
+			    add_piece(cur, b, current_byte, n, filesize == 0);
+			    if (filesize == 0) {
+				blocks_to_advance = ceil((double)n/TAR_BLK_SZ);
+			        current_byte += (blocks_to_advance*512);
+			        remaining_bytes -= (blocks_to_advance*512);
+			        state = 0;
 			    }
 			    else {
-			        if (remaining_bytes >= WRK_SZ) {
-				    EVP_DigestUpdate(ctx, buffer+current_byte, WRK_SZ);
-				    filesize -= WRK_SZ;
-				    current_byte += WRK_SZ;
-				    remaining_bytes -= WRK_SZ;
-				    state = 3;
-				}
-				else {
-				    EVP_DigestUpdate(ctx, buffer+current_byte, remaining_bytes);
-				    filesize -= remaining_bytes;
-				    current_byte = bytes_read;
-				    state = 3;
-				}
+				current_byte = bytes_read;
 			    }
 		            break;
 		    // TAR END
@@ -448,30 +967,50 @@ untar(int fd, const char *path)
 		            break;
 		}
 	    }
-	    //free(buffer);
-	    //buffer = (unsigned char *) malloc(TAR_REC_SZ);
-	    memset(buffer, '\0', TAR_REC_SZ);
-	    current_byte = 0;
-	    if (!isTape) {
-	        posix_fadvise64(fd,(total_bytes_read+TAR_REC_SZ),TAR_REC_SZ*2,POSIX_FADV_WILLNEED);
-	        posix_fadvise64(fd,(total_bytes_read-TAR_REC_SZ),TAR_REC_SZ,POSIX_FADV_DONTNEED);
-	    }
+
+	    pthread_mutex_lock(&lock);
+	    release(b);
+	    pthread_mutex_unlock(&lock);
+	    print_members(0);
 	}
+end:
 	// print final record
-        if (strlen(rec.filename) > 0) {
-	    printf("%d|%llu|%llu|",rec.type,rec.offset,rec.filesize);
-	    if (rec.type == 0) {
-		if (rec.filesize > 0)
-                    for (i=0; i<rec.mdLen; i++) printf("%02x", rec.checksum[i]);
-		else
-		    printf("%s",empty); //for (i=0; i<rec.mdLen; i++) printf("00");
-	    }
-	    printf("|%s\n",rec.filename);
+	if (cur != NULL) {
+	    // the archive ended inside its payload
+	    pthread_mutex_lock(&lock);
+	    cur->truncated = (filesize > 0);
+	    cur->complete = 1;
+	    pthread_cond_broadcast(&piece_cond);
+	    pthread_mutex_unlock(&lock);
 	}
+        else if (strlen(rec.filename) > 0)
+	    add_member(&rec, 0);
+	goto finish;
 
-	free(buffer);
+stop:
+	// as before, a member still open when the parse stops is not printed
+	if (cur != NULL) {
+	    pthread_mutex_lock(&lock);
+	    cur->truncated = 1;
+	    cur->drop = 1;
+	    cur->complete = 1;
+	    pthread_cond_broadcast(&piece_cond);
+	    pthread_mutex_unlock(&lock);
+	}
 
-	//printf("\nTotal Bytes Read: %llu\n",total_bytes_read);
+finish:
+	pthread_mutex_lock(&lock);
+	ring_stop = 1;
+	workers_done = 1;
+	pthread_cond_broadcast(&ring_cond);
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&lock);
+	print_members(1);
+	for (i = 0; i < jobs; i++)
+	    pthread_join(hashers[i], NULL);
+	free(hashers);
+	// the reader may be blocked in read() if the parse stopped early
+	pthread_detach(rd);
 }
 
 int
@@ -480,10 +1019,91 @@ main(int argc, char **argv)
 	int a;
 	char *path;
 	int errnum;
+	int format = OUT_TEXT;
+	int opt;
+	int copy = 1;
+	int x;
+	char *rows = NULL;
+	char *prefix = NULL;
+	char *name = NULL;
+	char *ledger_path = NULL;
+	char *algo = NULL;
+	char *hash_spec = NULL;
+	char *read_spec = NULL;
+	int placement = 0;
+	int latency = 0;
+	double lat_flag = 0;
+	size_t i;
+	static const int kinds[4] = {FIX_DK, FIX_DK, FIX_LI2, FIX_LI3};
 
 	OpenSSL_add_all_algorithms();
 	ERR_load_crypto_strings();
 
+	while ((opt = getopt(argc, argv, "o:x:c:r:n:g:j:C:R:PlL:")) != -1) {
+	    switch (opt) {
+		case 'x':
+		    rows = optarg;
+		    break;
+		case 'c':
+		    copy = atoi(optarg);
+		    if (copy < 1 || copy > 3) {
+		        fprintf(stderr, "Copy \"%s\" is out of range [1-3]\n", optarg);
+		        return (1);
+		    }
+		    break;
+		case 'r':
+		    prefix = optarg;
+		    break;
+		case 'n':
+		    name = optarg;
+		    break;
+		case 'g':
+		    ledger_path = optarg;
+		    break;
+		case 'j':
+		    jobs = atoi(optarg);
+		    if (jobs < 1) {
+		        fprintf(stderr, "Number of hash workers (%s) must be at least 1\n", optarg);
+		        return (1);
+		    }
+		    break;
+		case 'C':
+		    hash_spec = optarg;
+		    break;
+		case 'R':
+		    read_spec = optarg;
+		    break;
+		case 'P':
+		    placement = 1;
+		    break;
+		case 'l':
+		    latency = 1;
+		    break;
+		case 'L':
+		    lat_flag = atof(optarg);
+		    latency = 1;
+		    break;
+		case 'o':
+		    format = out_parse_format(optarg);
+		    if (format < 0) {
+		        fprintf(stderr, "Unknown output format '%s' (text|json|bin)\n", optarg);
+		        return (1);
+		    }
+		    break;
+		default:
+		    return (1);
+	    }
+	}
+	if (rows != NULL && prefix == NULL) {
+	    fprintf(stderr, "-x needs -r <prefix> for the results\n");
+	    return (1);
+	}
+	if (ledger_path != NULL && rows == NULL) {
+	    fprintf(stderr, "-g needs -x: only checked files go in the ledger\n");
+	    return (1);
+	}
+	argv += optind - 1; /* leave argv on the last option, as if it were the program name */
+
 	++argv; /* Skip program name */
 	if (*argv != NULL) { /* expecting tar file path */
 	        path = (char *) malloc(strlen(*argv)+1);
@@ -495,6 +1115,7 @@ main(int argc, char **argv)
 
 	++argv; /* Skip to the checksum algorithm */
 	if (*argv != NULL) {
+	        algo = *argv;
 	        if (strcmp(*argv,"MD5") == 0) {
 		    md = EVP_get_digestbyname("MD5");
 		    empty = MD5_EMPTY;
@@ -511,6 +1132,10 @@ main(int argc, char **argv)
 		    md = EVP_get_digestbyname("SHA512");
 		    empty = SHA512_EMPTY;
 		}
+		else if (strcmp(*argv,"BLAKE3") == 0) {
+		    tree = 1;
+		    empty = BLAKE3_EMPTY;
+		}
 		else {
 		    fprintf(stderr, "Invalid checksum algorithm %s\n", *argv);
 		    return (1);
@@ -530,21 +1155,83 @@ main(int argc, char **argv)
 	        isTape = 0;
 	}
 
-	a = open(path, O_RDONLY);
+	if (name == NULL)
+	    name = path;
+	if (strcmp(path, "-") == 0) {
+	    a = STDIN_FILENO;
+	    fromPipe = 1;
+	}
+	else
+	    a = open(path, O_RDONLY);
 	if (a < 0) {
 	        fprintf(stderr, "Unable to open %s\n", path);
 		return (1);
 	}
+	if (!fromPipe)
+	    gov = iogov_open(a, path);
+	// from a pipe, the time is the feeder's; fixity_tape times the tape
+	if (latency && !fromPipe)
+	    lat = iolat_open(a, path);
+	// pinned workers: the reader goes next to the disk adapter unless told
+	if (hash_spec != NULL && read_spec == NULL && !fromPipe)
+	    read_spec = "hba";
+	if (hash_spec != NULL && cpu_parse(hash_spec, a, &hash_cpus) < 0) {
+	        fprintf(stderr, "Bad CPU list %s\n", hash_spec);
+		return (1);
+	}
+	if (read_spec != NULL && cpu_parse(read_spec, a, &read_cpus) < 0) {
+	        fprintf(stderr, "Bad CPU list %s\n", read_spec);
+		return (1);
+	}
 
 	if (isTape) {
 	    //size_t TAR_REC_SZ = 4194304;
 	    //size_t WRK_SZ = 8192;
 	    WRK_SZ = TAR_REC_SZ;
 	}
+	if (rows != NULL) {
+	    x = open(rows, O_RDONLY);
+	    if (x < 0) {
+	        fprintf(stderr, "Unable to open %s\n", rows);
+		return (1);
+	    }
+	    fix_init(&expected, kinds[copy]);
+	    fix_load(&expected, x, rows);
+	    close(x);
+	    fix_sort(&expected);
+	    fix_index(&expected);
+	    fix_report_open(&report, prefix, name);
+	    if (ledger_path != NULL) {
+	        ledger_open(&ledger, ledger_path);
+	        fix_report_ledger(&report, &ledger, kinds[copy], algo);
+	    }
+	    verify = 1;
+	    format = OUT_TEXT;
+	}
+	out_init(&out, STDOUT_FILENO, format);
 	ctx = EVP_MD_CTX_create();
         untar(a, path);
 	close(a);
+	if (placement)
+	    cpu_report(stderr);
+	iolat_report(stderr, lat_flag);
 	EVP_MD_CTX_destroy(ctx);
 
+	if (verify) {
+	    // whatever was not in the archive file
+	    for (i = 0; i < expected.n; i++)
+	        if (!expected.rows[i].seen)
+		    fix_report_row(&report, &expected.rows[i], NULL);
+	    fix_report_close(&report);
+	    if (ledger_path != NULL)
+	        ledger_close(&ledger);
+	    printf("%s: %lu files, %lu verified, %lu bad checksums, %lu missing, %lu renamed, "
+	           "%lu without checksum, %lu empty, %lu links\n",
+	           name, report.checked, report.ok, report.n[FIX_BAD], report.n[FIX_MISSING],
+	           report.n[FIX_RENAMED], report.n[FIX_NO_CKSUM], report.n[FIX_EMPTY], report.n[FIX_LINKS]);
+	    fix_free(&expected);
+	}
+	out_free(&out);
+
 	return (0);
 }
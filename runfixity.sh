@@ -1,7 +1,9 @@
 #!/bin/bash
 
 DEBUG=0
-DKPATH="/dkarcs"
+DKPATH="${DKPATH:-/dkarcs}"
+# where print_csum_*_from_sls are (a testbed sets FIXITY_BIN)
+bindir=${FIXITY_BIN:-~root/bin}
 cksum_algo="md5sum"
 eq_library=50
 sam="false"
@@ -11,28 +13,65 @@ copy=100
 uservsn="undefined"
 joblimit_dk=6
 joblimit_li=3
-declare rfix_pid_grep
+# jobs at once on one disk device (dk) and, for tape, per VSN
+devlimit_dk=2
+# disk VSNs are split into up to this many jobs (by archive file)
+dk_split=4
+# optional "vsn device" lines, to say which VSNs share a disk array
+devmap="/etc/opt/vsm/fixity_devices"
+# walker threads for print_csum_*_from_sls (sam_lstat/sam_checksum are latency bound)
+walk_threads=8
+# -i: keep a snapshot of the inode inventory and only re-read what changed
+incremental=0
+# -s: leave out archive files the ledger has as checked good in this many days
+skip_days=""
+# -x: also check this tape copy (2 or 3) of the same files, alongside copy 1
+xcopy=""
 
 # Process arguments ; Provide usage instructions
 #
-# runfixity -h|-p <path> -c <copyno> [-v vsn]
+# runfixity -h|-p <path> -c <copyno> [-v vsn] [-i] [-s days] [-x copyno]
 # path = full path name, e.g.: /sam2/aorcollection
 # copyno = 1 or 2 or 3 (4 - not supported / we don't use it anyway)
 
-while getopts ":hp:c:f:v:" opt; do
+while getopts ":hip:c:f:v:s:x:" opt; do
     case ${opt} in
       h )
         echo "Usage:"
         echo "     runfixity -h         Display this message."
-        echo "     runfixity -p <path> -c <copyno> [-v vsn]"
+        echo "     runfixity -p <path> -c <copyno> [-v vsn] [-i] [-s days] [-x copyno]"
         echo " "
         echo "     -p <path> : full VSM path or VSM subdirectory"
         echo "     -c <copyno> : VSM copy - 1, 2, or 3 (4 not used or supported yet)"
         echo "     -v <vsn> : Only applicable for copies 2|3. Instead of calculating fixity"
         echo "                on all relevant VSNs (default), only calculate fixity for files"
         echo "                on given VSN."
+        echo "     -i : incremental inode inventory. Directories unchanged since the"
+        echo "          last -i run of the same path are taken from its snapshot"
+        echo "          (/<fs>/temp/snapshots)."
+        echo "     -s <days> : skip archive files whose every file was checked good in"
+        echo "                 the last <days> days (/<fs>/temp/fixity.ledger), and not"
+        echo "                 found bad since. A file with no inode checksum counts as"
+        echo "                 good if it was read whole; nothing more can be checked."
+        echo "     -x <copyno> : with -c 1, also check copy 2 or 3 in the same run: one"
+        echo "                   inode inventory, the disk and tape jobs side by side,"
+        echo "                   and the two copies of each file compared at the end"
+        echo "                   (cross_copies.txt). Not with -v or -i."
         exit 0
         ;;
+      i )
+        incremental=1
+        ;;
+      s )
+        skip_days=$OPTARG
+        ;;
+      x )
+        xcopy=$OPTARG
+        if [ "$xcopy" != 2 ] && [ "$xcopy" != 3 ]
+            then echo "Copy \"$xcopy\" to cross-check is out of range [2-3]. Exiting."
+            exit 1
+        fi
+        ;;
       p )
         dir=$OPTARG
         if [ ! -d $dir ]
@@ -93,6 +132,13 @@ if [ $copy -lt 1 ] || [ $copy -gt 3 ]
     then echo "Copy is required. Exiting."
     exit 1
 fi
+if [ -n "$xcopy" ]
+then
+    if [ $copy -ne 1 ] || [ $uservsn != "undefined" ] || [ $incremental -eq 1 ]
+        then echo "-x needs -c 1, and cannot be used with -v or -i. Exiting."
+        exit 1
+    fi
+fi
 
 if [[ $dir = "/sam"* ]]
     then sam=$(echo "$dir" | cut -d "/" -f1,2)
@@ -113,6 +159,9 @@ fi
 
 # END ARGUMENT COLLECTION / VALIDATION
 
+# every file checked, by runfixity_vsn.sh, and when (fixity_ledger shows it)
+ledger="/${sam}/temp/fixity.ledger"
+
 # https://www.linuxjournal.com/content/use-date-command-measure-elapsed-time
 # If called with no arguments a new timer is returned.
 # If called with arguments the first is used as a timer
@@ -161,7 +210,11 @@ logmsg "Directory: `pwd`/${dir}"
 if [ $file != "null" ]
     then logmsg "File: $file"
 fi
-logmsg "Copy: ${copy}"
+if [ -n "$xcopy" ]
+    then logmsg "Copies: ${copy} and ${xcopy}, cross-checked"
+else
+    logmsg "Copy: ${copy}"
+fi
 if [ $uservsn != "undefined" ]
     then logmsg "Only considering files on VSN: $uservsn."
 fi
@@ -227,20 +280,54 @@ all_inos_md5="${logdir}/all_inos_md5.txt"
 
 # then sls -ERa $target|~root/bin/print_md5_li_from_sls.pl > ${all_inos_md5} &
 if [ $copy -ne 1 ]
-    then ~root/bin/print_csum_li_from_sls $target > ${all_inos_md5} &
+    then inos_kind="li"
 else
-    ~root/bin/print_csum_dk_from_sls $target > ${all_inos_md5} &
+    inos_kind="dk"
+fi
+# -P: also split the inventory by VSN and position for runfixity_vsn.sh
+mkdir -p ${logdir}/shards
+if [ $incremental -eq 1 ]
+then
+    # The new snapshot only replaces the old one once the walk has finished;
+    # the full inventory is rebuilt from it, the changed rows are kept for the log.
+    snapdir="/${sam}/temp/snapshots"
+    mkdir -p $snapdir
+    snap="${snapdir}/$(echo "${sam}/${target}" | tr '/' '_').${inos_kind}.snap"
+    snap_in=""
+    if [ -f $snap ]
+        then snap_in="-s $snap"
+    fi
+    logmsg "Incremental inode inventory (snapshot: $snap)"
+    ( ${bindir}/print_csum_${inos_kind}_from_sls -t $walk_threads -P ${logdir}/shards $snap_in -S $snap $target > ${logdir}/changed_inos.txt 2>> $log && \
+      grep '^F|' $snap | cut -d'|' -f4- > ${all_inos_md5} ) &
+else
+    # -x: the li rows of the same walk go to their own inventory (runfixity_vsn.sh)
+    xinos=""
+    if [ -n "$xcopy" ]
+        then xinos="-X ${logdir}/all_inos_md5.li.txt"
+    fi
+    ${bindir}/print_csum_${inos_kind}_from_sls -t $walk_threads -P ${logdir}/shards $xinos $target > ${all_inos_md5} &
 fi
 sls_pid=$!
 #logmsg "Compiling list of MD5 (ssum -a md5) checksums from VSMFS inodes (sls -E) in background (pid: ${sls_pid})..."
 
+# -x: both copies from one audit; each VSN holds only one of them
+function audit()
+{
+    if [ -n "$xcopy" ]
+        then archive_audit $dir | awk -v x=$xcopy '$3 == 1 || $3 == x'
+    else
+        archive_audit -c $copy $dir
+    fi
+}
+
 #logmsg "Generating \"archive_audit -c ${copy} `pwd`/${dir}\" data..."
 aa_all="${logdir}/all_archive_audit.txt"
 if [ $file != "null" ]
     then echo "grep string: $sam/$dir/$file"
-    archive_audit -c $copy $dir | egrep "${sam}/${dir}/${file}$" > $aa_all
+    audit | egrep "${sam}/${dir}/${file}$" > $aa_all
 else
-    archive_audit -c $copy $dir > $aa_all
+    audit > $aa_all
 fi
 #logmsg "Complete"
 #logmsg " "
@@ -255,103 +342,78 @@ while ps -p $sls_pid > /dev/null; do sleep 1; done
 # ------------------------------------------------------------ #
 
 #logmsg "Generating list of VSNs..."
+jobs="${logdir}/jobs.txt"
+> $jobs
 
-while read nfiles vsn
-do
-    vsn_instructions="${logdir}/${vsn}-positions.txt"
-    touch $vsn_instructions;
+# One pass over the audit: every VSN's positions file (count hexpos dkpath
+# bytes, in position order) and plan.txt, one line per job, costliest first:
+#   vsn part nfiles narcs bytes cost positions-file
+planopt="-j $dk_split"
+if [ $uservsn != "undefined" ]
+    then planopt="$planopt -v $uservsn"
+fi
+if [ -n "$skip_days" ]
+then
+    logmsg "Leaving out archive files checked good in the last $skip_days days ($ledger)"
+    planopt="$planopt -g $ledger -s $skip_days"
+fi
+fixity_plan -d $logdir $planopt $aa_all
 
-    if [ $uservsn != "undefined" ] && [ $uservsn != $vsn ]
-    then continue
+while read vsn part nfiles narcs bytes cost vsn_instructions
+do
+    size=`awk -v b=$bytes 'BEGIN {print b/1024/1024/1024}'`
+#    logmsg "VSN: $vsn # Files: ${nfiles} (${size} GB). # Archives: ${narcs}. Cost: ${cost}s"
+
+    # With -x the plan has the VSNs of both copies: the disk archives are
+    # copy 1, the rest the tape copy.
+    vcopy=$copy
+    if [ -n "$xcopy" ] && [ ! -d ${DKPATH}/${vsn} ]
+        then vcopy=$xcopy
     fi
 
-    size=0
-    narcs=0
-    if [ $copy -ne 1 ]
-        then size=`egrep "^li ${vsn}" $aa_all | awk '{sum+=$7} END {print sum/1024/1024/1024}'`
-	narcs=`egrep "^li $vsn" ${aa_all} |awk '{print $6}'|sed 's/\..*//'|sort|uniq|wc -l`
+    # Queue the job: "class device cost command".
+    # The device is what the VSN is read from: the disk volume for dk (so
+    # VSNs on one array share its limit), the tape itself for li.
+    if [ $vcopy -ne 1 ]
+    then
+        class="li"
+        device="tape.${vsn}"
     else
-        size=`egrep "^dk ${vsn}" $aa_all | awk '{sum+=$7} END {print sum/1024/1024/1024}'`
-	narcs=`egrep "^dk ${vsn}" ${aa_all} |awk '{print $6}'|sed 's/\..*//'|sort|uniq|wc -l`
+        class="dk"
+        device=`stat -L -c %d ${DKPATH}/${vsn} 2>/dev/null`
     fi
-#    logmsg "VSN: $vsn # Files: ${nfiles} (${size} GB). # Archives: ${narcs}."
-
-    # Get list of sorted positions.
-    vsngrep="undefined"
-    if [ $copy -ne 1 ]
-        then vsngrep="^li ${vsn}"
-    else vsngrep="^dk ${vsn}"
+    if [ -f $devmap ]
+    then
+        mapped=`awk -v v=$vsn '$1 == v {print $2; exit}' $devmap`
+        if [ -n "$mapped" ]
+            then device=$mapped
+        fi
     fi
-
-    egrep "${vsngrep}" $aa_all |awk '{print $6}'|sed 's/\..*//'| sort | uniq -c | while read cnt hexpos
-    do
-	if [ $copy -ne 1 ]
-	    then echo "$cnt $hexpos `echo $((16#${hexpos}))`"
-	else
-	    # dkname is a simple c program that converts hex position (archive_audit output) to a disk-archive filename, e.g. "d3/f120"
-	    echo "$cnt $hexpos `dkname $hexpos`"
-	fi
-    # Note: "dkpath" here is only relevant in disk-archive case. In tape case, ignored.
-    done | sort -n -k3 | awk '{printf "%s %s %s\n", $1,$2,$3}' | while read count pos dkpath
-    do
-        # For each position (or dkpath)...
-	if [ $copy -ne 1 ]
-	then
-	    echo "$count $pos $dkpath" >> $vsn_instructions
-	    arsize=`egrep "^li $vsn" $aa_all | egrep " $pos\." | awk '{sum+=$7} END {print sum/1024/1024/1024}'`
-	    # logmsg "    Creating request for $vsn:$pos -- reading $count files ($arsize GB)"
-	else 
-	    echo "$count $pos $dkpath" >> $vsn_instructions
-	    arsize=`egrep "^dk $vsn" $aa_all | egrep " $pos\." | awk '{sum+=$7} END {print sum/1024/1024/1024}'`
-	    # logmsg "    Checking ${count} files in ${vsn}:${dkpath} -- (${arsize} GB)"
-	fi
-    done
-
-    #
-    # Finished preparing list of archives for this VSN.
-    #
-
-    if [ $copy -ne 1 ]
-    then joblimit=$joblimit_li
-    elif [ $copy -eq 1 ]
-    then joblimit=$joblimit_dk
+    if [ -z "$device" ]
+        then device="vsn.${vsn}"
     fi
 
-    # Kick off a job to process this VSN.
-    # First make sure we don't exceed the number of running jobs ($joblimit)
-    if [ ${#rfix_pid_grep} -gt "0" ]
-    then
-      while [ $(ps -hp $rfix_pid_grep | wc -l) -gt $joblimit ]
-      do
-        sleep 5
-      done
-      # subsequent runs
-      if [ $DEBUG -eq 1 ]
-      then
-          echo "DEBUG:  runfixity_vsn.sh $logdir $vsn $copy $nfiles $narcs $size $vsn_instructions &"
-      fi
-      runfixity_vsn.sh $logdir $vsn $copy $nfiles $narcs $size $vsn_instructions &
-      rfix_pid_grep="$! $rfix_pid_grep"
-        # remove stale pids from list
-      rfix_pid_grep=$(ps -hp $rfix_pid_grep|awk '{print $1}'|xargs echo -n)
-    else
-      # first run
-      if [ $DEBUG -eq 1 ]
-      then
-          echo "DEBUG:  runfixity_vsn.sh $logdir $vsn $copy $nfiles $narcs $size $vsn_instructions &"
-      fi
-      runfixity_vsn.sh $logdir $vsn $copy $nfiles $narcs $size $vsn_instructions &
-      rfix_pid_grep="$!"
+    # A disk VSN with several archive files is split into parts of about
+    # equal bytes (fixity_plan -j); each part is its own job.
+    if [ $part = "-" ]
+        then part=""
     fi
-done < <(awk '{print $2}' $aa_all | sort | uniq -c)
+    echo "$class $device $cost runfixity_vsn.sh $logdir $vsn $vcopy $nfiles $narcs $size $vsn_instructions $part" >> $jobs
+done < ${logdir}/plan.txt
 
+# Run the queued jobs, largest first, within the job limits.
+schedopt=""
+if [ $DEBUG -eq 1 ]
+    then schedopt="-v"
+fi
+fixity_sched $schedopt -c dk=$joblimit_dk -c li=$joblimit_li -p dk=$devlimit_dk -p li=1 $jobs
 
-# Final loop to wait for straggling runfixity_vsn.sh procs?
-
-while [ $(ps -hp $rfix_pid_grep | wc -l) -gt "0" ]
-do
-  sleep 5
-done
+if [ -n "$xcopy" ]
+then
+    # The two copies of each file against each other, from what the jobs
+    # above (and, for archive files left out by -s, earlier runs) put in the ledger.
+    fixity_ledger -X $xcopy -t $tmr $ledger > ${logdir}/cross_copies.txt 2>> $log
+fi
 
 logmsg " ***  runfixity.sh COMPLETE!  ***"
 
@@ -384,3 +446,26 @@ logmsg "$msg"
 # Empty (zero-length) files can be a helpful data point -- esp when it provides reason for bad checksums
 printf -v msg "%17s : %d" "Zero-length files" $t_emptyfiles
 logmsg "$msg"
+
+# -x: the disk and tape copies of a file disagree with each other; both
+# copies agree but not with the inode; a copy (or both) was not found;
+# the copies were checked with different algorithms; one copy was not
+# checked in the window.
+if [ -n "$xcopy" ]
+then
+    t_cross=$(egrep -c '^(copy [0-9] bad|copies differ)\|' ${logdir}/cross_copies.txt)
+    t_inode=$(egrep -c '^inode differs\|' ${logdir}/cross_copies.txt)
+    t_xmissing=$(egrep -c '^(copy [0-9]|copies) missing\|' ${logdir}/cross_copies.txt)
+    t_nocompare=$(egrep -c '^not comparable\|' ${logdir}/cross_copies.txt)
+    t_unchecked=$(egrep -c '^copy [0-9] not checked\|' ${logdir}/cross_copies.txt)
+    printf -v msg "%17s : %d" "Copies Differ" $t_cross
+    logmsg "$msg"
+    printf -v msg "%17s : %d" "Inode Differs" $t_inode
+    logmsg "$msg"
+    printf -v msg "%17s : %d" "Copy Not Found" $t_xmissing
+    logmsg "$msg"
+    printf -v msg "%17s : %d" "Not Comparable" $t_nocompare
+    logmsg "$msg"
+    printf -v msg "%17s : %d" "Copy Not Checked" $t_unchecked
+    logmsg "$msg"
+fi
@@ -0,0 +1,230 @@
+#!/bin/bash
+
+# Rolling fixity: keep checking the VSNs that hold files under a path, one
+# runfixity.sh -i -v <vsn> at a time, so that every one of them is checked
+# once per period, the least recently checked first, within a daily byte
+# budget and (optionally) a time-of-day window. Progress is kept in a state
+# file, so the script can be stopped and started again at any time.
+#
+# runfixity_rolling -p <path> -c <copyno> [-d days] [-b GB] [-w HH-HH] [-s statefile] [-1]
+
+period_days=90
+# GB a day; 0: what it takes to cover every VSN once per period
+budget_gb=0
+# e.g. "20-06": only start a VSN between 20:00 and 06:00
+window=""
+state=""
+once=0
+# seconds to wait before looking again (outside the window, budget spent)
+poll=600
+dir="null"
+copy=100
+
+while getopts ":hp:c:d:b:w:s:1" opt; do
+    case ${opt} in
+      h )
+        echo "Usage:"
+        echo "     runfixity_rolling -h         Display this message."
+        echo "     runfixity_rolling -p <path> -c <copyno> [-d days] [-b GB] [-w HH-HH] [-s statefile] [-1]"
+        echo " "
+        echo "     -p <path> : full VSM path or VSM subdirectory"
+        echo "     -c <copyno> : VSM copy - 1, 2, or 3"
+        echo "     -d <days> : check every VSN once in this many days (default: $period_days)"
+        echo "     -b <GB> : read at most this much a day (default: total / days)"
+        echo "     -w <HH-HH> : only start checks in this window, e.g. 20-06"
+        echo "     -s <statefile> : default /<fs>/temp/rolling/<path>.c<copyno>.state"
+        echo "     -1 : check what is due today, then exit (e.g. from cron)"
+        exit 0
+        ;;
+      p )
+        dir=$OPTARG
+        if [ ! -d $dir ]
+            then echo "Path $dir does not exist. Exiting."
+            exit 1
+        fi
+        ;;
+      c )
+        copy=$OPTARG
+        if [ $copy -lt 1 ] || [ $copy -gt 3 ]
+            then echo "Copy \"$copy\" is out of range [1-3]. Exiting."
+            exit 1
+        fi
+        ;;
+      d )
+        period_days=$OPTARG
+        ;;
+      b )
+        budget_gb=$OPTARG
+        ;;
+      w )
+        window=$OPTARG
+        if [[ ! $window =~ ^[0-9]+-[0-9]+$ ]]
+            then echo "Window must be HH-HH, e.g. 20-06. Exiting."
+            exit 1
+        fi
+        ;;
+      s )
+        state=$OPTARG
+        ;;
+      1 )
+        once=1
+        ;;
+      : )
+        echo "Invalid Option: -$OPTARG requires an argument" 1>&2
+        exit 1
+        ;;
+      \? )
+        echo "Invalid Option: -$OPTARG" 1>&2
+        exit 1
+        ;;
+    esac
+done
+shift $((OPTIND -1))
+
+if [ $copy -lt 1 ] || [ $copy -gt 3 ] || [ $dir = "null" ]
+    then echo "Path and copy are required. Exiting."
+    exit 1
+fi
+
+path=$(cd $dir && pwd)
+if [[ $path != "/sam"* ]]
+    then echo "$path is not in a VSM file-system. Exiting."
+    exit 1
+fi
+sam=$(echo "$path" | cut -d "/" -f1,2)
+if [ -z "$state" ]
+then
+    mkdir -p ${sam}/temp/rolling
+    state="${sam}/temp/rolling/$(echo "$path" | tr '/' '_').c${copy}.state"
+fi
+work="${state%.state}.work"
+mkdir -p $work
+log="${state%.state}.log"
+touch $state
+
+function logmsg()
+{
+    printf "%s: $1\n" "$(date '+%Y-%m-%d %H:%M:%S')" | tee -a $log
+}
+
+# State file lines:
+#   vsn <vsn> <last checked, epoch> <bytes> <result> <logdir>
+#   day <YYYYMMDD> <bytes read that day>
+function set_state()
+{
+    local key=$1
+    shift
+    awk -v k="$key" '!($1 == "vsn" && $2 == k) && !(k == "day" && $1 == "day")' $state > ${state}.tmp
+    if [ $key = "day" ]
+        then echo "day $*" >> ${state}.tmp
+    else
+        echo "vsn $key $*" >> ${state}.tmp
+    fi
+    mv ${state}.tmp $state
+}
+
+function in_window()
+{
+    if [ -z "$window" ]
+        then return 0
+    fi
+    local from=$((10#${window%-*})) to=$((10#${window#*-})) now=$((10#$(date +%H)))
+    if [ $from -le $to ]
+        then [ $now -ge $from ] && [ $now -lt $to ]
+    else
+        [ $now -ge $from ] || [ $now -lt $to ]
+    fi
+}
+
+# Bytes per VSN under the path (fixity_plan over one archive_audit), at most once a day.
+function refresh_vsns()
+{
+    if [ -f ${work}/vsns.txt ] && [ $(( $(date +%s) - $(stat -c %Y ${work}/vsns.txt) )) -lt 86400 ]
+        then return
+    fi
+    archive_audit -c $copy $path > ${work}/all_archive_audit.txt
+    fixity_plan -d $work ${work}/all_archive_audit.txt
+    awk '{bytes[$1] += $5} END {for (v in bytes) printf "%s %.0f\n", v, bytes[v]}' ${work}/plan.txt > ${work}/vsns.txt
+    rm -f ${work}/*-positions.txt*
+    logmsg "$(wc -l < ${work}/vsns.txt) VSNs, $(awk '{sum += $2} END {printf "%.1f", sum/1024/1024/1024}' ${work}/vsns.txt) GB under $path (copy $copy)"
+}
+
+# The VSN most overdue: never checked first, then the longest ago.
+# Prints "vsn bytes last", or nothing if none is due yet.
+function next_vsn()
+{
+    local due=$(( $(date +%s) - period_days * 86400 ))
+    awk -v due=$due 'FILENAME == ARGV[1] { if ($1 == "vsn") last[$2] = $3; next }
+                     { t = ($1 in last) ? last[$1] : 0; if (t <= due) print $1, $2, t }' \
+        $state ${work}/vsns.txt | sort -k3,3n -k1,1 | head -1
+}
+
+logmsg "Rolling fixity of $path, copy $copy: every $period_days days (state: $state)"
+
+while true
+do
+    refresh_vsns
+    today=$(date +%Y%m%d)
+    spent=$(awk -v d=$today '$1 == "day" && $2 == d {print $3}' $state)
+    spent=${spent:-0}
+    if [ $budget_gb = "0" ]
+        then budget=$(awk -v n=$period_days '{sum += $2} END {printf "%.0f", sum/n + 1}' ${work}/vsns.txt)
+    else
+        budget=$(awk -v g=$budget_gb 'BEGIN {printf "%.0f", g*1024*1024*1024}')
+    fi
+
+    set -- $(next_vsn)
+    vsn=$1
+    bytes=$2
+    last=$3
+    wait=""
+    if [ -z "$vsn" ]
+        then wait="nothing due"
+    elif ! in_window
+        then wait="outside window $window"
+    # a VSN larger than the whole budget still gets a day to itself
+    elif [ $spent -gt 0 ] && [ $((spent + bytes)) -gt $budget ]
+        then wait="budget spent ($spent of $budget bytes today)"
+    fi
+    if [ -n "$wait" ]
+    then
+        if [ $once -eq 1 ]
+            then logmsg "Done for now: $wait."
+            exit 0
+        fi
+        sleep $poll
+        continue
+    fi
+
+    if [ "$last" = "0" ]
+        then last="never"
+    else
+        last=$(date -d @$last +%Y-%m-%d)
+    fi
+    logmsg "Checking $vsn ($bytes bytes; last checked: $last)"
+    out=${work}/runfixity.out
+    runfixity.sh -i -p $path -c $copy -v $vsn > $out 2>&1
+    runlog=$(sed -n 's/^Setting up LOG file: //p' $out)
+    runlogdir=$(dirname "${runlog:-none/x}")
+
+    if [ -n "$runlog" ] && grep -q "runfixity.sh COMPLETE" $runlog
+    then
+        bad=$(awk -F: '/Bad Checksums :/ {print $NF+0}' $runlog | tail -1)
+        missing=$(awk -F: '/Missing Copies :/ {print $NF+0}' $runlog | tail -1)
+        result="ok"
+        if [ "${bad:-0}" -gt 0 ] || [ "${missing:-0}" -gt 0 ]
+            then result="bad=${bad:-0},missing=${missing:-0}"
+        fi
+    else
+        result="failed"
+    fi
+    logmsg "    $vsn: $result ($runlogdir)"
+
+    # a failed run is due again, after the VSNs that were already overdue
+    checked=$(date +%s)
+    if [ $result = "failed" ]
+        then checked=$((checked - period_days * 86400))
+    fi
+    set_state $vsn $checked $bytes $result $runlogdir
+    set_state day $today $((spent + bytes))
+done
@@ -1,15 +1,25 @@
 #!/bin/bash
 
-DKROOT="/dkarcs"
+DKROOT="${DKROOT:-/dkarcs}"
 cksum_algo="md5sum"
 eq_library=50
 sam="false"
 dir="null"
 file="null"
 copy=0
+# 1: also keep ${vsn}_data.txt (inode vs. archive table) and ${vsn}_calc.txt
+#    (every member read back), via fixity_compare.
+# 0: print_offset_cksum_from_tar -x checks each member as it is read and
+#    only writes the exception lists.
+keep_tables=0
+# tape: archive files requested ahead of, and checked behind, the one being
+# read (fixity_tape -d); 0 goes back to one position at a time
+tape_depth=2
 
 # This script has no field checks. Meant to be called from "runfixity.sh".
-# runfixity_vsn.sh $logdir $vsn $copy $nfiles $narcs $size $vsn_instructions
+# runfixity_vsn.sh $logdir $vsn $copy $nfiles $narcs $size $vsn_instructions [part]
+# part: set when a disk VSN is checked by several jobs at once; each job
+# writes its own ${vsn}.${part}_*.txt files.
 
 # Process arguments ; Provide usage instructions
 #
@@ -21,10 +31,23 @@ nfiles=$4
 narcs=$5
 size=$6
 vsn_instructions=$7
+part=$8
+out=$vsn
+if [ -n "$part" ]
+    then out="${vsn}.${part}"
+fi
 
 # Assumptions:
 aa_all="${logdir}/all_archive_audit.txt"
 all_inos_md5="${logdir}/all_inos_md5.txt"
+# runfixity.sh -x: the tape copy's rows are in an inventory of their own
+if [ $copy -ne 1 ] && [ -f ${logdir}/all_inos_md5.li.txt ]
+    then all_inos_md5="${logdir}/all_inos_md5.li.txt"
+fi
+# this VSN's rows of the inventory, sorted by position (print_csum_*_from_sls -P)
+shard="${logdir}/shards/${copy}.${vsn}.txt"
+# the result of each file checked is added here (runfixity.sh -s reads it)
+ledger="$(dirname $logdir)/fixity.ledger"
 
 #echo
 #echo "vsn-instructions file: $vsn_instructions"
@@ -69,7 +92,7 @@ tmr=$(timer)
 # --------------------------------#
 
 # Create log 
-log="${logdir}/${vsn}_RUNFIXITY.LOG"
+log="${logdir}/${out}_RUNFIXITY.LOG"
 touch $log
 
 function logmsg()
@@ -81,19 +104,37 @@ function logmsg()
 # ---- END SET UP LOGGING ------- #
 # --------------------------------#
 
+# Inventory rows of the current position ($pos, or $dkpath on disk): read
+# straight from the shard via its index if there is one, else grepped from
+# the whole inventory.
+function inos_rows()
+{
+    if [ -f ${shard}.idx ]
+    then
+        set -- $(awk -v p=$pos '$1 == p {print $2, $3; exit}' ${shard}.idx)
+        if [ $# -eq 2 ]
+            then tail -c +$(($1 + 1)) $shard | head -n $2
+        fi
+    elif [ $copy -ne 1 ]
+        then egrep "\|li.${vsn}\|${pos}\|" $all_inos_md5
+    else
+        egrep "\|${vsn}\/${dkpath}\|" $all_inos_md5
+    fi
+}
+
 # ------------------------------------------------------------ #
 # Now generate checksums for given copy-no and VSN (if applicable).
 # ------------------------------------------------------------ #
 
 # Create output files.
-vsn_symlinks="${logdir}/${vsn}_links.txt"
-vsn_emptyfiles="${logdir}/${vsn}_emptyfiles.txt"
-vsn_data="${logdir}/${vsn}_data.txt"
-calc_data="${logdir}/${vsn}_calc.txt"
-vsn_missing_checksums="${logdir}/${vsn}_missing_checksums.txt"
-vsn_missing_files="${logdir}/${vsn}_missing_files.txt"
-vsn_renamed_files="${logdir}/${vsn}_renamed_files.txt"
-vsn_bad_checksums="${logdir}/${vsn}_bad_checksums.txt"
+vsn_symlinks="${logdir}/${out}_links.txt"
+vsn_emptyfiles="${logdir}/${out}_emptyfiles.txt"
+vsn_data="${logdir}/${out}_data.txt"
+calc_data="${logdir}/${out}_calc.txt"
+vsn_missing_checksums="${logdir}/${out}_missing_checksums.txt"
+vsn_missing_files="${logdir}/${out}_missing_files.txt"
+vsn_renamed_files="${logdir}/${out}_renamed_files.txt"
+vsn_bad_checksums="${logdir}/${out}_bad_checksums.txt"
 touch $vsn_symlinks
 touch $vsn_emptyfiles
 touch $vsn_missing_checksums
@@ -101,16 +142,19 @@ touch $vsn_missing_files
 touch $vsn_renamed_files
 touch $vsn_bad_checksums
 
-echo "master.type master.offset master.md5 calc.md5 master.filename calc.filename" > $vsn_data
-echo "type|offset|size|md5|filename" > $calc_data
+if [ $keep_tables -eq 1 ]
+then
+    echo "master.type master.offset master.md5 calc.md5 master.filename calc.filename" > $vsn_data
+    echo "type|offset|size|md5|filename" > $calc_data
+fi
 
 # #> cat DKARC03-positions.txt 
-# 17 20b d2/f11
-# 2 20c d2/f12
+# 17 20b d2/f11 1932735
+# 2 20c d2/f12 40960
 #
 # #> cat A00039-positions.txt 
-#105 17ef7d 1568637
-#103 1817b1 1578929
+#105 17ef7d 1568637 52428800000
+#103 1817b1 1578929 51170508800
 
 # tape is either 0 (disk) or 1 (yes, tape)
 tape=0
@@ -118,21 +162,18 @@ tape=0
 # archive file (request for tape and dkarc for disk)
 archive="null"
 
-cat $vsn_instructions | while read count pos dkpath
+if [ $copy -ne 1 ] && [ $keep_tables -eq 0 ] && [ $tape_depth -gt 0 ]
+then
+    # request, read and check the positions as a pipeline, so the drive
+    # keeps streaming between them
+    fixity_tape -d $tape_depth -c $copy -r ${logdir}/${out} -g $ledger -s $shard -I $all_inos_md5 \
+        $vsn $vsn_instructions $logdir >> $log
+else
+cat $vsn_instructions | while read count pos dkpath bytes
 do
   # For each position (copy 2 or 3) create request
   if [ $copy -ne 1 ]
   then
-    # MASTER
-    if [ $copy -eq 2 ]
-    then
-        # type, offset (decimal), size, md5, filename
-        master=$(egrep "\|li.${vsn}\|${pos}\|" $all_inos_md5 | awk -F '|' '{printf "%d|%d|%d|%s|%s\n",$1,strtonum("0x"$5),$9,$2,$10}')
-    elif [ $copy -eq 3 ]
-    then
-        master=$(egrep "\|li.${vsn}\|${pos}\|" $all_inos_md5 | awk -F '|' '{printf "%d|%d|%d|%s|%s\n",$1,strtonum("0x"$8),$9,$2,$10}')
-    fi
-
     # CALC
     tape=1
     archive="${logdir}/REQUEST_${vsn}_${pos}"
@@ -140,13 +181,7 @@ do
 
   # For each dkpath (copy 1), build full dkpath
   else 
-    # MASTER
-    # type, offset (decimal), size, md5, filename
-    master=$(egrep "\|${vsn}\/${dkpath}\|" $all_inos_md5 | awk -F '|' '{printf "%d|%d|%d|%s|%s\n",$1,$5,$6,$2,$7}')
-
     # CALC
-    # type (0=file,1=dir,2=link), offset, md5, filename
-    # output: type, offset, size, md5, filename
     tape=0
     archive="${DKROOT}/${vsn}/${dkpath}"
   fi
@@ -155,7 +190,7 @@ do
   # sha1 - 40
   # sha256 - 64
   # sha512 - 128
-  cksum=$(echo "$master"|head -1|cut -d '|' -f4)
+  cksum=$(inos_rows | head -1 | cut -d '|' -f2)
   cksum_length=${#cksum}
   if [ $cksum_length -eq "32" ]
   then algo="MD5"
@@ -173,81 +208,27 @@ do
       tapestring="DISK"
   fi
 
-  # SOFT LINKS
-  egrep "\|${vsn}\/${dkpath}\|" $all_inos_md5 | egrep '^2' >> $vsn_symlinks
-
-  # ZERO LENGTH (EMPTY) FILES (which often show up as bad checksums)
-  if [ $tape -eq "0" ]
+  # CALC
+  # type (0=file,1=dir,2=link), offset, size, md5, filename
+  # checked against the inode rows (MASTER) on offset; the results are
+  # appended to ${vsn}_links/_emptyfiles/_missing_checksums/_missing_files/
+  # _bad_checksums/_renamed_files.txt (and _data/_calc.txt with keep_tables)
+  if [ $keep_tables -eq 1 ]
   then
-      egrep "\|${vsn}\/${dkpath}\|" $all_inos_md5 | awk -F '|' '$6==0' >> $vsn_emptyfiles
-  else 
-      egrep "\|li.${vsn}\|${pos}\|" $all_inos_md5 | awk -F '|' '$9==0' >> $vsn_emptyfiles
+      print_offset_cksum_from_tar $archive $algo $tapestring 2>/dev/null | \
+          fixity_compare -c $copy -a $archive -m $algo -g $ledger ${logdir}/${out} <(inos_rows)
+  else
+      print_offset_cksum_from_tar -x <(inos_rows) -c $copy -r ${logdir}/${out} -g $ledger \
+          $archive $algo $tapestring 2>/dev/null >> $log
   fi
 
-  # CALC
-  # type (0=file,1=dir,2=link), offset, md5, filename
-  # output: type, offset, size, md5, filename
-  echo "------------${archive} ${algo}-----------------" >> $calc_data
-  calc=$(print_offset_cksum_from_tar $archive $algo $tapestring 2>/dev/null)
-  echo "$calc" >> $calc_data
-
   if [ $tape -eq "1" ]
   then
       # remove the request (archive) file
       rm -f $archive
   fi
-
-  # CREATE LOOKUP TABLE OF SORTS, combining inode data and calculated data from disk-archive copy
-  # join output:
-  # 1             2              3        4          5              6
-  # master.type master.offset master.md5 calc.md5 master.filename calc.filename
-  compare=$(join -t '|' --nocheck-order -1 2 -2 2 -o 1.1 1.2 1.4 2.4 1.5 2.5 -a 1 -e NULL <(echo "$master"|sort -t '|' -k2,2) <(echo "$calc"|sort -t '|' -k2,2))
-  # Save this "lookup table" for possible future reference.
-  echo "$compare" | egrep -v "NULL\|NULL\|NULL\|NULL\|NULL" >> $vsn_data
-
-  # MISSING CHECKSUMS
-  # NO_CKSUM_IN_INODE
-  missing_checksums=$(echo "$compare" | egrep '^0' | grep 'NO_CKSUM_IN_INODE' | cut -d '|' -f5)
-  if [ ${#missing_checksums} -gt 0 ]
-  then
-    echo "------------$archive---------------" >> $vsn_missing_checksums
-    echo "$missing_checksums" >> $vsn_missing_checksums
-  fi
-
-
-  # MISSING FILES
-  missing_files=$(echo "$compare" | egrep "\|NULL$" | cut -d '|' -f5)
-  if [ ${#missing_files} -gt 0 ]
-  then
-    echo "------------$archive---------------" >> $vsn_missing_files
-    echo "$missing_files" >> $vsn_missing_files
-  fi
-
-  # BAD CHECKSUMS
-  compare_cksums=$(echo "$compare"|egrep '^0'|grep -v 'NO_CKSUM_IN_INODE')
-  if [ $(echo "$compare_cksums"|egrep '^0'|wc -l) -gt 0 ]
-  then
-      # master.offset
-      cksum_diff=$(diff -y --suppress-common-lines --suppress-blank-empty <(echo "$compare_cksums"|cut -d '|' -f2,3) <(echo "$compare_cksums"|cut -d '|' -f2,4) | cut -d '|' -f1)
-      # filename, stored-md5, calc-md5
-      bad_checksums=$(join -t '|' --nocheck-order -1 1 -2 2 -o 2.5 2.3 2.4 <(echo "$cksum_diff"|sort -k1,1) <(echo "$compare_cksums"|sort -t '|' -k2,2)|grep -v NULL|egrep -v '^\|')
-      if [ ${#bad_checksums} -gt 0 ]
-      then
-        echo "------------$archive---------------" >> $vsn_bad_checksums
-        echo "$bad_checksums" >> $vsn_bad_checksums
-      fi
-  fi
-
-  # RENAMED FILES (does not count renamed symbolic links!)
-  # master.offset
-  fname_diff=$(diff -y --suppress-common-lines --suppress-blank-empty <(echo "$compare"|egrep '^0'|cut -d '|' -f2,5) <(echo "$compare"|cut -d '|' -f2,6)|cut -d '|' -f1)
-  renamed_files=$(join -t '|' --nocheck-order -1 1 -2 2 -o 2.5 2.6 <(echo "$fname_diff"|sort -k1,1) <(echo "$compare"|egrep '^0'|sort -t '|' -k2,2) | grep -v NULL | awk -F '|' '{printf "%s -> %s\n", $1,$2}')
-  if [ ${#renamed_files} -gt 4 ]
-  then
-    echo "------------$archive---------------" >> $vsn_renamed_files
-    echo "$renamed_files" >> $vsn_renamed_files
-  fi
 done
+fi
 
 #
 # Finished reading this VSN. Compare checksums for files from this VSN.
@@ -260,4 +241,4 @@ n_bad=$(egrep -v '\-\-\-\-' $vsn_bad_checksums|wc -l|awk '{print $1}')
 n_links=$(egrep -v '\-\-\-\-' $vsn_symlinks|wc -l|awk '{print $1}')
 n_empty=$(egrep -v '\-\-\-\-' $vsn_emptyfiles|wc -l|awk '{print $1}')
 
-logmsg "Report for $vsn: $nfiles files ($size GB) in $narcs archives. Missing-Checksums: $n_missing_cksums; Missing: $n_missing; Renamed: $n_renamed; Bad Checksums: $n_bad; Symlinks: $n_links; Empty files: $n_empty"
+logmsg "Report for $out: $nfiles files ($size GB) in $narcs archives. Missing-Checksums: $n_missing_cksums; Missing: $n_missing; Renamed: $n_renamed; Bad Checksums: $n_bad; Symlinks: $n_links; Empty files: $n_empty"
@@ -0,0 +1,72 @@
+/*
+ * catalog -- mapping and searching the testbed catalog. See catalog.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "catalog.h"
+
+const char *cat_dir(void)
+{
+    const char *dir = getenv("FIXITY_TESTBED");
+
+    if (dir == NULL || *dir == '\0') {
+        fprintf(stderr, "FIXITY_TESTBED is not set (the directory mkbed made the catalog in)\n");
+        exit(1);
+    }
+    return dir;
+}
+
+void cat_open(Catalog *c)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void *p;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/catalog", cat_dir());
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    c->head = p;
+    c->len = st.st_size;
+    if ((size_t)st.st_size < sizeof(CatHead) || memcmp(c->head->magic, CAT_MAGIC, 8) != 0 ||
+            c->head->rec_size != sizeof(CatRec) ||
+            sizeof(CatHead) + c->head->n_vsns * sizeof(CatVsn) + c->head->n * sizeof(CatRec) > c->len) {
+        fprintf(stderr, "%s is not a catalog (or is from another version of mkbed)\n", path);
+        exit(1);
+    }
+    c->vsns = (const CatVsn *)(c->head + 1);
+    c->recs = (const CatRec *)(c->vsns + c->head->n_vsns);
+}
+
+const CatRec *cat_find(const Catalog *c, uint64_t ino)
+{
+    size_t lo = 0, hi = c->head->n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (c->recs[mid].ino < ino)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < c->head->n && c->recs[lo].ino == ino)
+        return &c->recs[lo];
+    return NULL;
+}
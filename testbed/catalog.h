@@ -0,0 +1,62 @@
+/*
+ * catalog -- the testbed's stand-in for the VSM inode data that the real
+ * filesystem under a fake /samN cannot hold: each file's archive copies
+ * and the checksum kept in its inode, keyed by inode number.
+ *
+ * Written by mkbed, read (mmap'd) by libsam and the stub commands. It is
+ * $FIXITY_TESTBED/catalog:
+ *   CatHead, n_vsns CatVsn, then n CatRec sorted by ino.
+ * A file that is not in it (made after mkbed ran) has no copies and no
+ * checksum, as a file not yet archived would.
+ */
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAT_MAGIC "FIXCAT1"
+#define CAT_COPIES 3            /* copy 1 (dk), 2 and 3 (li) */
+
+typedef struct
+{
+    char magic[8];
+    uint32_t n_vsns;
+    uint32_t rec_size;          /* sizeof(CatRec), to catch a stale catalog */
+    uint64_t n;
+} CatHead;
+
+typedef struct
+{
+    char media[8];              /* 8, to keep the records aligned */
+    char vsn[32];
+} CatVsn;
+
+typedef struct
+{
+    uint64_t ino;
+    uint64_t position[CAT_COPIES];
+    uint64_t offset[CAT_COPIES];        /* bytes into the archive file */
+    int32_t vsn[CAT_COPIES];            /* index into the VSNs; -1 no copy */
+    uint32_t cs_nchars;                 /* 0: no checksum in the inode */
+    unsigned char csum[16];             /* MD5 */
+} CatRec;
+
+typedef struct
+{
+    const CatHead *head;
+    const CatVsn *vsns;
+    const CatRec *recs;
+    size_t len;
+} Catalog;
+
+/* $FIXITY_TESTBED; exits if it is not set. */
+const char *cat_dir(void);
+
+/* Map $FIXITY_TESTBED/catalog; exits if it cannot. */
+void cat_open(Catalog *c);
+
+/* The record of inode ino, or NULL. */
+const CatRec *cat_find(const Catalog *c, uint64_t ino);
+
+#endif
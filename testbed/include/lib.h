@@ -0,0 +1,5 @@
+/*
+ * Stand-in for /opt/vsm/include/lib.h (see testbed/include/vsm/stat.h).
+ * The tools include it by that path; testbed/setup.sh puts this there
+ * if there is none.
+ */
@@ -0,0 +1,13 @@
+/*
+ * Stand-in for VSM's <vsm/diskvols.h> (see testbed/include/vsm/stat.h).
+ */
+#ifndef TESTBED_VSM_DISKVOLS_H
+#define TESTBED_VSM_DISKVOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Disk archive file of a position, relative to the VSN: "d2/f11" for 0x20b. */
+void DiskVolsGenFileName(uint64_t position, char *name, size_t size);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Stand-in for VSM's <vsm/stat.h>, for building the tools against the
+ * testbed's libsam (testbed/libsam.c) off the VSM host. Only what the
+ * tools use: the copy fields of struct sam_stat and sam_checksum.
+ */
+#ifndef TESTBED_VSM_STAT_H
+#define TESTBED_VSM_STAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* sam_stat has plain time fields; use st_mtim etc. for struct stat */
+#undef st_atime
+#undef st_mtime
+#undef st_ctime
+
+#define MAX_ARCHIVE 4
+
+#define CF_ARCHIVED 0x1         /* copy.flags: the copy exists */
+
+struct sam_copy_s
+{
+    char media[4];              /* "dk", "li" */
+    char vsn[32];
+    uint64_t position;          /* dk: archive file number; li: block */
+    uint64_t offset;            /* bytes into the archive file */
+    uint32_t flags;
+};
+
+struct sam_stat
+{
+    mode_t st_mode;
+    ino_t st_ino;
+    dev_t st_dev;
+    nlink_t st_nlink;
+    uid_t st_uid;
+    gid_t st_gid;
+    off_t st_size;
+    time_t st_atime;
+    time_t st_mtime;
+    time_t st_ctime;
+    struct sam_copy_s copy[MAX_ARCHIVE];
+};
+
+struct sam_checksum
+{
+    int cs_algo;
+    int cs_nchars;              /* 0: no checksum */
+    unsigned char cs_csum[64];
+};
+
+int sam_stat(const char *path, struct sam_stat *sb, size_t size);
+int sam_lstat(const char *path, struct sam_stat *sb, size_t size);
+int sam_checksum(const char *path, struct sam_checksum *cs, size_t size);
+
+#endif
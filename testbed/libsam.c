@@ -0,0 +1,116 @@
+/*
+ * libsam -- stand-in for VSM's libsam and libvsm, so the tools run off the
+ * VSM host against a testbed made by mkbed.
+ *
+ * gcc -shared -fPIC -O2 -I include -Wl,-soname,libsam.so -o lib/libsam.so libsam.c catalog.c -lpthread
+ * ln -s libsam.so lib/libvsm.so
+ *
+ * sam_stat/sam_lstat stat the real file and add its archive copies from the
+ * catalog (catalog.h); sam_checksum gives the MD5 the catalog has for it.
+ * DiskVolsGenFileName is VSM's: the archive file number split into a
+ * directory and a file, 256 to a directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "vsm/stat.h"
+#include "vsm/diskvols.h"
+#include "catalog.h"
+
+static Catalog cat;
+static pthread_once_t cat_once = PTHREAD_ONCE_INIT;
+
+static void load(void)
+{
+    cat_open(&cat);
+}
+
+static int fill(const char *path, struct sam_stat *sb, size_t size, int follow)
+{
+    struct stat st;
+    const CatRec *r;
+    int i;
+
+    if (size < sizeof(*sb)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((follow ? stat(path, &st) : lstat(path, &st)) < 0)
+        return -1;
+    pthread_once(&cat_once, load);
+
+    memset(sb, 0, sizeof(*sb));
+    sb->st_mode = st.st_mode;
+    sb->st_ino = st.st_ino;
+    sb->st_dev = st.st_dev;
+    sb->st_nlink = st.st_nlink;
+    sb->st_uid = st.st_uid;
+    sb->st_gid = st.st_gid;
+    sb->st_size = st.st_size;
+    sb->st_atime = st.st_atim.tv_sec;
+    sb->st_mtime = st.st_mtim.tv_sec;
+    sb->st_ctime = st.st_ctim.tv_sec;
+
+    r = cat_find(&cat, st.st_ino);
+    if (r == NULL)
+        return 0;
+    for (i = 0; i < CAT_COPIES; i++) {
+        if (r->vsn[i] < 0 || (uint32_t)r->vsn[i] >= cat.head->n_vsns)
+            continue;
+        /* a catalog media or VSN name that does not fit is a bad catalog */
+        if (snprintf(sb->copy[i].media, sizeof(sb->copy[i].media), "%s", cat.vsns[r->vsn[i]].media)
+                >= (int)sizeof(sb->copy[i].media)
+            || snprintf(sb->copy[i].vsn, sizeof(sb->copy[i].vsn), "%s", cat.vsns[r->vsn[i]].vsn)
+                >= (int)sizeof(sb->copy[i].vsn)) {
+            errno = EINVAL;
+            return -1;
+        }
+        sb->copy[i].position = r->position[i];
+        sb->copy[i].offset = r->offset[i];
+        sb->copy[i].flags = CF_ARCHIVED;
+    }
+    return 0;
+}
+
+int sam_stat(const char *path, struct sam_stat *sb, size_t size)
+{
+    return fill(path, sb, size, 1);
+}
+
+int sam_lstat(const char *path, struct sam_stat *sb, size_t size)
+{
+    return fill(path, sb, size, 0);
+}
+
+int sam_checksum(const char *path, struct sam_checksum *cs, size_t size)
+{
+    struct stat st;
+    const CatRec *r;
+
+    if (size < sizeof(*cs)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (lstat(path, &st) < 0)
+        return -1;
+    pthread_once(&cat_once, load);
+
+    memset(cs, 0, sizeof(*cs));
+    r = cat_find(&cat, st.st_ino);
+    if (r != NULL && r->cs_nchars > 0) {
+        cs->cs_algo = 1;
+        cs->cs_nchars = r->cs_nchars;
+        memcpy(cs->cs_csum, r->csum, r->cs_nchars);
+    }
+    return 0;
+}
+
+void DiskVolsGenFileName(uint64_t position, char *name, size_t size)
+{
+    snprintf(name, size, "d%llu/f%llu", (unsigned long long)(position >> 8),
+             (unsigned long long)(position & 0xff));
+}
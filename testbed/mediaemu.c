@@ -0,0 +1,501 @@
+/*
+ * mediaemu -- make reads of chosen files behave like a disk archive array
+ * or a tape drive, so the TAPE and DISK read paths and getbaginfo's pread
+ * pattern can be benchmarked on a machine with only an SSD. An LD_PRELOAD
+ * library; nothing is mounted.
+ *
+ * gcc -shared -fPIC -O2 -o lib/mediaemu.so mediaemu.c -ldl -lpthread -lrt
+ *
+ *   MEDIAEMU=emu.conf LD_PRELOAD=/var/tmp/bed/lib/mediaemu.so runfixity.sh ...
+ *
+ * emu.conf has one emulated device per line:
+ *   <path-prefix> disk|tape [bw=MB/s] [seek=ms] [block=bytes] [locate=s] [wind=MB/s] [load=s]
+ * e.g.
+ *   /dkarcs/DKARC01           disk bw=180 seek=8 block=65536
+ *   /var/tmp/bed/tape/A00001  tape bw=250 block=262144 locate=20 wind=4000 load=60
+ * A file opened (with open/openat) whose real path starts with a prefix is
+ * on that device; the first prefix that matches wins.
+ *
+ * Each device has one head, shared by every thread and process that reads
+ * it (the state is in the POSIX shared memory segment /mediaemu), and
+ * serves one read at a time in the order they come: a read returns once the
+ * reads ahead of it and its own service time are done. Its service time is
+ *   disk: seek ms if it does not start where the device's last read ended
+ *         (in any file), then its bytes at bw;
+ *   tape: load s for the first read since the segment was made, locate s
+ *         plus the distance at wind for one that does not start where the
+ *         last ended, then its bytes at bw. Going on from the end of one
+ *         file to the start of another is taken to be streaming on to the
+ *         next archive file; to anywhere else in another file costs locate.
+ * With block, a read is charged for every whole block it touches, and on
+ * tape a read returns at most one block, as the st driver gives one record
+ * per read. Unset values cost nothing. Reads through mmap are not emulated.
+ *
+ * $MEDIAEMU_REPORT names a file each process appends one line per device
+ * it read to at exit: reads, MB, seeks (or locates), seconds queued behind
+ * other reads, and seconds of service. Remove /dev/shm/mediaemu to start
+ * again with the heads at rest and the tapes unloaded.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define EMU_SHM "/mediaemu"
+#define EMU_MAGIC 0x656d7531
+#define EMU_DEVS 64
+#define EMU_FDS 65536
+
+typedef struct
+{
+    char prefix[256];
+    int tape;
+    double bw;              /* bytes per second; 0 unlimited */
+    double seek;            /* s */
+    double locate;          /* s */
+    double wind;            /* bytes per second of tape moved while locating */
+    double load;            /* s */
+    size_t block;
+    /* this process's reads, for the report */
+    unsigned long long reads, bytes, seeks;
+    double queued, service;
+} Dev;
+
+typedef struct
+{
+    char key[256];
+    double free_at;         /* when the reads queued so far are done */
+    ino_t ino;              /* where the last read ended */
+    off_t end;
+    int eof;                /* it ended at the end of its file */
+    int loaded;
+} Head;
+
+typedef struct
+{
+    volatile unsigned magic;
+    pthread_mutex_t mutex;
+    int n;
+    Head h[EMU_DEVS];
+} Shared;
+
+static Dev devs[EMU_DEVS];
+static int n_devs;
+static Shared *shared;
+static Head *heads[EMU_DEVS];
+static struct
+{
+    short dev;              /* index + 1; 0 not emulated */
+    ino_t ino;
+    off_t size;
+} fds[EMU_FDS];
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void until(double t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void resolve(void)
+{
+    if (real_read != NULL)
+        return;
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_openat = dlsym(RTLD_NEXT, "openat");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_pread = dlsym(RTLD_NEXT, "pread");
+    __sync_synchronize();
+    real_read = dlsym(RTLD_NEXT, "read");
+}
+
+static void shm_lock(Shared *s)
+{
+    if (pthread_mutex_lock(&s->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&s->mutex);
+}
+
+/* The segment, made by the first process; the heads are per process if it
+ * cannot be had. */
+static Shared *shm_attach(void)
+{
+    pthread_mutexattr_t attr;
+    Shared *s = MAP_FAILED;
+    struct stat st;
+    int fd, created = 0, i;
+
+    fd = shm_open(EMU_SHM, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+        created = 1;
+    else if (errno == EEXIST)
+        fd = shm_open(EMU_SHM, O_RDWR, 0600);
+    if (fd >= 0 && created && ftruncate(fd, sizeof(Shared)) < 0) {
+        real_close(fd);
+        shm_unlink(EMU_SHM);
+        fd = -1;
+    }
+    for (i = 0; fd >= 0 && !created && i < 100; i++) {
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Shared))
+            break;
+        usleep(10000);
+    }
+    if (fd >= 0) {
+        s = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        real_close(fd);
+    }
+    if (s == MAP_FAILED) {
+        fprintf(stderr, "mediaemu: cannot map %s; heads are per process\n", EMU_SHM);
+        s = calloc(1, sizeof(Shared));
+        if (s == NULL)
+            return NULL;
+        created = 1;
+    }
+    if (created) {
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&s->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __sync_synchronize();
+        s->magic = EMU_MAGIC;
+    }
+    for (i = 0; s->magic != EMU_MAGIC && i < 100; i++)
+        usleep(10000);
+    if (s->magic != EMU_MAGIC) {
+        fprintf(stderr, "mediaemu: %s was never set up; remove it\n", EMU_SHM);
+        return NULL;
+    }
+    return s;
+}
+
+static Head *head(const char *key)
+{
+    Head *h = NULL;
+    int i;
+
+    shm_lock(shared);
+    for (i = 0; i < shared->n; i++) {
+        if (strcmp(shared->h[i].key, key) == 0) {
+            h = &shared->h[i];
+            break;
+        }
+    }
+    if (h == NULL && shared->n < EMU_DEVS) {
+        h = &shared->h[shared->n++];
+        memset(h, 0, sizeof(*h));
+        snprintf(h->key, sizeof(h->key), "%.255s", key);
+    }
+    pthread_mutex_unlock(&shared->mutex);
+    return h;
+}
+
+static int set(Dev *d, const char *kv)
+{
+    char key[16];
+    double v;
+
+    if (sscanf(kv, "%15[^=]=%lf", key, &v) != 2 || v < 0)
+        return 0;
+    if (strcmp(key, "bw") == 0)
+        d->bw = v * 1048576;
+    else if (strcmp(key, "seek") == 0)
+        d->seek = v / 1000;
+    else if (strcmp(key, "block") == 0)
+        d->block = (size_t)v;
+    else if (strcmp(key, "locate") == 0)
+        d->locate = v;
+    else if (strcmp(key, "wind") == 0)
+        d->wind = v * 1048576;
+    else if (strcmp(key, "load") == 0)
+        d->load = v;
+    else
+        return 0;
+    return 1;
+}
+
+__attribute__((constructor))
+static void init(void)
+{
+    const char *conf = getenv("MEDIAEMU");
+    char line[PATH_MAX + 256], *tok, *save;
+    FILE *f;
+    Dev *d;
+    int i, ok;
+
+    resolve();
+    if (conf == NULL || *conf == '\0')
+        return;
+    f = fopen(conf, "r");
+    if (f == NULL) {
+        fprintf(stderr, "mediaemu: cannot open %s: %s\n", conf, strerror(errno));
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL && n_devs < EMU_DEVS) {
+        tok = strtok_r(line, " \t\n", &save);
+        if (tok == NULL || tok[0] == '#')
+            continue;
+        d = &devs[n_devs];
+        memset(d, 0, sizeof(*d));
+        snprintf(d->prefix, sizeof(d->prefix), "%s", tok);
+        tok = strtok_r(NULL, " \t\n", &save);
+        ok = tok != NULL && (strcmp(tok, "disk") == 0 || strcmp(tok, "tape") == 0);
+        if (ok)
+            d->tape = strcmp(tok, "tape") == 0;
+        while (ok && (tok = strtok_r(NULL, " \t\n", &save)) != NULL)
+            ok = set(d, tok);
+        if (!ok) {
+            fprintf(stderr, "mediaemu: bad line for %s in %s\n", d->prefix, conf);
+            continue;
+        }
+        n_devs++;
+    }
+    fclose(f);
+    if (n_devs == 0)
+        return;
+    shared = shm_attach();
+    if (shared == NULL) {
+        n_devs = 0;
+        return;
+    }
+    for (i = 0; i < n_devs; i++)
+        heads[i] = head(devs[i].prefix);
+}
+
+__attribute__((destructor))
+static void report(void)
+{
+    const char *name = getenv("MEDIAEMU_REPORT");
+    FILE *f;
+    Dev *d;
+    int i;
+
+    if (name == NULL || *name == '\0' || n_devs == 0)
+        return;
+    f = fopen(name, "a");
+    if (f == NULL)
+        return;
+    for (i = 0; i < n_devs; i++) {
+        d = &devs[i];
+        if (d->reads == 0)
+            continue;
+        fprintf(f, "mediaemu: pid %d %s: %llu reads, %.1f MB, %llu %s, %.3f s queued, %.3f s service\n",
+                (int)getpid(), d->prefix, d->reads, d->bytes / 1048576.0, d->seeks,
+                d->tape ? "locates" : "seeks", d->queued, d->service);
+    }
+    fclose(f);
+}
+
+/* Note fd as on a device if its path is under one. */
+static void opened(int fd, const char *path)
+{
+    char real[PATH_MAX];
+    struct stat st;
+    int i;
+
+    if (fd < 0 || fd >= EMU_FDS || n_devs == 0)
+        return;
+    fds[fd].dev = 0;
+    if (realpath(path, real) == NULL || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+    for (i = 0; i < n_devs; i++) {
+        if (heads[i] != NULL && strncmp(real, devs[i].prefix, strlen(devs[i].prefix)) == 0) {
+            fds[fd].dev = i + 1;
+            fds[fd].ino = st.st_ino;
+            fds[fd].size = st.st_size;
+            return;
+        }
+    }
+}
+
+/* The bytes a read of n at off may return: at most a block on tape. */
+static size_t clamp(int fd, size_t n)
+{
+    Dev *d;
+
+    if (fd < 0 || fd >= EMU_FDS || fds[fd].dev == 0)
+        return n;
+    d = &devs[fds[fd].dev - 1];
+    return (d->tape && d->block > 0 && n > d->block) ? d->block : n;
+}
+
+/* Queue a read of n bytes at off of fd behind the device's others, and
+ * wait until it would be done. */
+static void serve(int fd, off_t off, ssize_t n)
+{
+    Dev *d;
+    Head *h;
+    double t, start, cost = 0, bytes;
+    off_t lo, hi;
+
+    if (n <= 0 || fd < 0 || fd >= EMU_FDS || fds[fd].dev == 0)
+        return;
+    d = &devs[fds[fd].dev - 1];
+    h = heads[fds[fd].dev - 1];
+    lo = off;
+    hi = off + n;
+    if (d->block > 0) {
+        lo -= lo % d->block;
+        hi += (hi % d->block) ? d->block - hi % d->block : 0;
+    }
+    bytes = hi - lo;
+
+    t = now();
+    shm_lock(shared);
+    if (d->tape && !h->loaded) {
+        cost += d->load;
+        h->loaded = 1;
+    }
+    if ((h->ino != fds[fd].ino || h->end != lo) && !(d->tape && h->eof && lo == 0)) {
+        if (d->tape) {
+            cost += d->locate;
+            if (h->ino == fds[fd].ino && d->wind > 0)
+                cost += (h->end > lo ? h->end - lo : lo - h->end) / d->wind;
+        }
+        else
+            cost += d->seek;
+        if (h->ino != 0)
+            d->seeks++;
+    }
+    if (d->bw > 0)
+        cost += bytes / d->bw;
+    start = h->free_at > t ? h->free_at : t;
+    h->free_at = start + cost;
+    h->ino = fds[fd].ino;
+    h->end = hi;
+    h->eof = hi >= fds[fd].size;
+    d->reads++;
+    d->bytes += n;
+    d->queued += start - t;
+    d->service += cost;
+    pthread_mutex_unlock(&shared->mutex);
+
+    until(start + cost);
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list ap;
+    int fd;
+
+    resolve();
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    fd = real_open(path, flags, mode);
+    if ((flags & O_ACCMODE) != O_WRONLY)
+        opened(fd, path);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    char full[PATH_MAX];
+    mode_t mode = 0;
+    va_list ap;
+    int fd;
+
+    resolve();
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    fd = real_openat(dirfd, path, flags, mode);
+    if (fd >= 0 && n_devs > 0 && (flags & O_ACCMODE) != O_WRONLY) {
+        // the path the fd has, whatever dirfd was
+        snprintf(full, sizeof(full), "/proc/self/fd/%d", fd);
+        opened(fd, full);
+    }
+    return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+
+int close(int fd)
+{
+    resolve();
+    if (fd >= 0 && fd < EMU_FDS)
+        fds[fd].dev = 0;
+    return real_close(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t n)
+{
+    off_t off = 0;
+    ssize_t r;
+
+    resolve();
+    if (fd >= 0 && fd < EMU_FDS && fds[fd].dev != 0) {
+        off = lseek(fd, 0, SEEK_CUR);
+        n = clamp(fd, n);
+    }
+    r = real_read(fd, buf, n);
+    serve(fd, off, r);
+    return r;
+}
+
+ssize_t pread(int fd, void *buf, size_t n, off_t off)
+{
+    ssize_t r;
+
+    resolve();
+    n = clamp(fd, n);
+    r = real_pread(fd, buf, n, off);
+    serve(fd, off, r);
+    return r;
+}
+
+ssize_t pread64(int fd, void *buf, size_t n, off_t off) __attribute__((alias("pread")));
+
+/* what read/pread become with _FORTIFY_SOURCE; an overflow aborts, as glibc's does */
+ssize_t __read_chk(int fd, void *buf, size_t n, size_t buflen)
+{
+    if (n > buflen)
+        abort();
+    return read(fd, buf, n);
+}
+
+ssize_t __pread_chk(int fd, void *buf, size_t n, off_t off, size_t buflen)
+{
+    if (n > buflen)
+        abort();
+    return pread(fd, buf, n, off);
+}
+
+ssize_t __pread64_chk(int fd, void *buf, size_t n, off_t off, size_t buflen) __attribute__((alias("__pread_chk")));
@@ -0,0 +1,473 @@
+/*
+ * mkbed -- make a testbed for running the fixity pipeline off the VSM host:
+ * a fake VSM filesystem, real tar archives of its files on disk (copy 1,
+ * under $DKROOT, default /dkarcs) and "tape" (copies 2 and 3, under
+ * $FIXITY_TESTBED/tape), and the catalog (catalog.h) that libsam and the
+ * stub commands read the archive copies and inode checksums from.
+ *
+ * gcc -O2 -I include -o bin/mkbed mkbed.c catalog.c -lm -lcrypto
+ *
+ * Usage: mkbed [-n files] [-f files-per-dir] [-s mean-size] [-c copies]
+ *              [-a files-per-archive] [-k dk-vsns] [-t tape-vsns]
+ *              [-p collection] [-S seed] [-B bad%] [-N no-checksum%]
+ *              [-R renamed%] [-L links%] [-E empty%] <fsroot>
+ *
+ * <fsroot> plays the VSM mount point; runfixity.sh wants it to be /sam-
+ * something, with a temp directory (made here). The files are made under
+ * <fsroot>/<collection> (default coll), -f to a directory (default 1000),
+ * as sparse files of their size; their contents only exist in the
+ * archives. Sizes are exponential with mean -s bytes (default 4096;
+ * -s 0 makes them all empty, for runs of 10M inodes that only exercise
+ * the walk and the bookkeeping).
+ *
+ * -c lists the copies to make (default 1,2): copy 1 goes to -k disk VSNs
+ * DKARC01.. (default 2), copies 2 and 3 to -t tapes each, A00001.. and
+ * B00001.. (default 2), -a files to an archive file (default 1000), dealt
+ * out to the VSNs in turn.
+ *
+ * So that a run has something to find, -B% of the files get a wrong
+ * checksum in the catalog, -N% none, -R% are archived under another name,
+ * -L% get a symbolic link next to them and -E% are empty (all default 0).
+ * The same -S seed (default 1) makes the same testbed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "catalog.h"
+
+#define CHUNK 65536
+#define TAPE_BLOCK 262144
+#define MAX_SIZE (8ULL << 30)   /* what an 11-digit octal size holds */
+
+typedef struct
+{
+    int copy;                   /* 0-2 */
+    int first_vsn, n_vsns;      /* its VSNs in vsns[] */
+    uint64_t *next_pos;         /* per VSN */
+    unsigned long arcs;         /* archive files so far */
+    FILE *f;                    /* the one being written, or NULL */
+    int vsn;
+    uint64_t pos, off;
+    unsigned members;
+} Stream;
+
+CatVsn vsns[3 * 100];
+int n_vsns;
+Stream streams[CAT_COPIES];
+int n_streams;
+const char *dkroot, *testbed;
+unsigned per_archive = 1000;
+unsigned long long n_arcs, arc_bytes;
+uint64_t rng;
+
+static uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+/* A number in [0,1). */
+static double frnd(void)
+{
+    return (rnd(&rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Exit unless a snprintf() of a path, returning n, fit in size bytes. */
+static void path_fits(int n, size_t size, const char *path)
+{
+    if (n < 0 || (size_t)n >= size) {
+        fprintf(stderr, "Path too long: %s...\n", path);
+        exit(1);
+    }
+}
+
+static void mkdirs(const char *path)
+{
+    char p[PATH_MAX], *s;
+
+    snprintf(p, sizeof(p), "%s", path);
+    for (s = p + 1; *s; s++) {
+        if (*s != '/')
+            continue;
+        *s = '\0';
+        mkdir(p, 0755);
+        *s = '/';
+    }
+    if (mkdir(p, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", p, strerror(errno));
+        exit(1);
+    }
+}
+
+static void add_stream(int copy, const char *media, const char *fmt, int n)
+{
+    Stream *s = &streams[n_streams++];
+    char dir[PATH_MAX];
+    int i;
+
+    s->copy = copy;
+    s->first_vsn = n_vsns;
+    s->n_vsns = n;
+    s->next_pos = calloc(n, sizeof(uint64_t));
+    if (s->next_pos == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(vsns[n_vsns].media, sizeof(vsns[0].media), "%s", media);
+        snprintf(vsns[n_vsns].vsn, sizeof(vsns[0].vsn), fmt, i + 1);
+        if (copy == 0) {
+            snprintf(dir, sizeof(dir), "%s/%s", dkroot, vsns[n_vsns].vsn);
+            s->next_pos[i] = 0x200;     /* d2/f0, as VSM starts */
+        }
+        else {
+            snprintf(dir, sizeof(dir), "%s/tape/%s", testbed, vsns[n_vsns].vsn);
+            s->next_pos[i] = 0x1000;
+        }
+        mkdirs(dir);
+        n_vsns++;
+    }
+}
+
+static void close_archive(Stream *s)
+{
+    static const char zeros[1024];
+
+    if (s->f == NULL)
+        return;
+    fwrite(zeros, 1, sizeof(zeros), s->f);
+    s->off += sizeof(zeros);
+    if (fclose(s->f) != 0) {
+        fprintf(stderr, "Cannot write archive file: %s\n", strerror(errno));
+        exit(1);
+    }
+    s->f = NULL;
+    // a tape's next archive file starts past this one and its file mark
+    if (s->copy > 0)
+        s->next_pos[s->vsn - s->first_vsn] += (s->off + TAPE_BLOCK - 1) / TAPE_BLOCK + 1;
+    n_arcs++;
+    arc_bytes += s->off;
+}
+
+static void open_archive(Stream *s)
+{
+    char path[PATH_MAX];
+    int v;
+
+    close_archive(s);
+    v = s->arcs++ % s->n_vsns;
+    s->vsn = s->first_vsn + v;
+    s->pos = s->next_pos[v];
+    if (s->copy == 0) {
+        s->next_pos[v]++;
+        snprintf(path, sizeof(path), "%s/%s/d%" PRIu64, dkroot, vsns[s->vsn].vsn, s->pos >> 8);
+        mkdirs(path);
+        snprintf(path, sizeof(path), "%s/%s/d%" PRIu64 "/f%" PRIu64,
+                 dkroot, vsns[s->vsn].vsn, s->pos >> 8, s->pos & 0xff);
+    }
+    else
+        snprintf(path, sizeof(path), "%s/tape/%s/%" PRIx64, testbed, vsns[s->vsn].vsn, s->pos);
+    s->f = fopen(path, "w");
+    if (s->f == NULL) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    setvbuf(s->f, NULL, _IOFBF, 1 << 20);
+    s->off = 0;
+    s->members = 0;
+}
+
+/* A ustar header; names are kept under 100 bytes, so no prefix. */
+static void tar_header(unsigned char *h, const char *name, const char *link, char type, uint64_t size)
+{
+    unsigned sum = 0;
+    int i;
+
+    memset(h, 0, 512);
+    snprintf((char *)h, 100, "%s", name);
+    snprintf((char *)h + 100, 8, "%07o", type == '2' ? 0777 : 0644);
+    snprintf((char *)h + 108, 8, "%07o", 0);
+    snprintf((char *)h + 116, 8, "%07o", 0);
+    snprintf((char *)h + 124, 12, "%011" PRIo64, size);
+    snprintf((char *)h + 136, 12, "%011lo", (unsigned long)time(NULL));
+    memset(h + 148, ' ', 8);
+    h[156] = type;
+    if (link != NULL)
+        snprintf((char *)h + 157, 100, "%s", link);
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    snprintf((char *)h + 265, 32, "root");
+    snprintf((char *)h + 297, 32, "root");
+    for (i = 0; i < 512; i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+}
+
+/* Start a member in every copy, noting where it goes in the record. */
+static void begin_member(CatRec *r, const char *name, const char *link, char type, uint64_t size)
+{
+    unsigned char h[512];
+    Stream *s;
+    int i;
+
+    tar_header(h, name, link, type, size);
+    for (i = 0; i < n_streams; i++) {
+        s = &streams[i];
+        if (s->f == NULL || s->members >= per_archive)
+            open_archive(s);
+        r->vsn[s->copy] = s->vsn;
+        r->position[s->copy] = s->pos;
+        r->offset[s->copy] = s->off + 512;     /* VSM's offset is of the data */
+        fwrite(h, 1, 512, s->f);
+        s->off += 512;
+        s->members++;
+    }
+}
+
+static void write_all(const void *buf, size_t n)
+{
+    int i;
+
+    for (i = 0; i < n_streams; i++) {
+        fwrite(buf, 1, n, streams[i].f);
+        streams[i].off += n;
+    }
+}
+
+/* The file's contents, from its own seed, into every copy; returns its MD5. */
+static void write_contents(uint64_t seed, uint64_t size, unsigned char *md5)
+{
+    static uint64_t buf[CHUNK / 8];
+    static const char zeros[512];
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    uint64_t left = size;
+    size_t n, i;
+
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    while (left > 0) {
+        n = left < CHUNK ? left : CHUNK;
+        for (i = 0; i < (n + 7) / 8; i++)
+            buf[i] = rnd(&seed);
+        EVP_DigestUpdate(ctx, buf, n);
+        write_all(buf, n);
+        left -= n;
+    }
+    EVP_DigestFinal_ex(ctx, md5, NULL);
+    EVP_MD_CTX_free(ctx);
+    if (size % 512)
+        write_all(zeros, 512 - size % 512);
+}
+
+static int rec_compare(const void *a, const void *b)
+{
+    const CatRec *x = a, *y = b;
+
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+/* Sort the catalog's records by inode and set their count. */
+static void sort_catalog(const char *path, uint64_t n)
+{
+    struct stat st;
+    CatHead *h;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    h = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    qsort((char *)(h + 1) + h->n_vsns * sizeof(CatVsn), n, sizeof(CatRec), rec_compare);
+    h->n = n;
+    munmap(h, st.st_size);
+    close(fd);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n files] [-f files-per-dir] [-s mean-size] [-c copies] [-a files-per-archive]\n"
+                    "       [-k dk-vsns] [-t tape-vsns] [-p collection] [-S seed]\n"
+                    "       [-B bad%%] [-N no-checksum%%] [-R renamed%%] [-L links%%] [-E empty%%] <fsroot>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long n_files = 1000, per_dir = 1000, i, n_recs = 0, n_links = 0;
+    double mean = 4096, bad = 0, nocsum = 0, renamed = 0, links = 0, empty = 0;
+    int opt, k = 2, t = 2, fd;
+    const char *copies = "1,2", *coll = "coll", *fsroot, *c;
+    char path[PATH_MAX], name[PATH_MAX], tarname[PATH_MAX], link[64], catpath[PATH_MAX];
+    uint64_t seed = 1, size;
+    struct stat st;
+    CatHead head;
+    CatRec r;
+    FILE *cat;
+
+    while ((opt = getopt(argc, argv, "n:f:s:c:a:k:t:p:S:B:N:R:L:E:")) != -1) {
+        switch (opt) {
+            case 'n': n_files = strtoull(optarg, NULL, 10); break;
+            case 'f': per_dir = strtoull(optarg, NULL, 10); break;
+            case 's': mean = atof(optarg); break;
+            case 'c': copies = optarg; break;
+            case 'a': per_archive = atoi(optarg); break;
+            case 'k': k = atoi(optarg); break;
+            case 't': t = atoi(optarg); break;
+            case 'p': coll = optarg; break;
+            case 'S': seed = strtoull(optarg, NULL, 10); break;
+            case 'B': bad = atof(optarg) / 100; break;
+            case 'N': nocsum = atof(optarg) / 100; break;
+            case 'R': renamed = atof(optarg) / 100; break;
+            case 'L': links = atof(optarg) / 100; break;
+            case 'E': empty = atof(optarg) / 100; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    fsroot = argv[optind];
+    if (per_dir < 1 || per_archive < 1 || k < 1 || k > 99 || t < 1 || t > 99 || mean < 0) {
+        fprintf(stderr, "Files per directory and archive must be at least 1, and 1-99 VSNs of each kind\n");
+        exit(1);
+    }
+    if (strlen(coll) > 60) {
+        fprintf(stderr, "Collection name %s is too long (names must fit a ustar header)\n", coll);
+        exit(1);
+    }
+    testbed = cat_dir();
+    dkroot = getenv("DKROOT");
+    if (dkroot == NULL || *dkroot == '\0')
+        dkroot = "/dkarcs";
+    rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    snprintf(path, sizeof(path), "%s/%s", fsroot, coll);
+    if (mkdir(fsroot, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", fsroot, strerror(errno));
+        exit(1);
+    }
+    if (mkdir(path, 0755) < 0) {
+        fprintf(stderr, "Cannot create %s: %s (mkbed will not add to an old testbed)\n", path, strerror(errno));
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/temp", fsroot);
+    mkdir(path, 0755);
+    mkdirs(testbed);
+
+    for (c = copies; *c; c++) {
+        if (*c == '1')
+            add_stream(0, "dk", "DKARC%02d", k);
+        else if (*c == '2')
+            add_stream(1, "li", "A%05d", t);
+        else if (*c == '3')
+            add_stream(2, "li", "B%05d", t);
+        else if (*c != ',') {
+            fprintf(stderr, "Copies must be a list of 1, 2 and 3, not %s\n", copies);
+            exit(1);
+        }
+    }
+    if (n_streams == 0) {
+        fprintf(stderr, "No copies to make\n");
+        exit(1);
+    }
+
+    snprintf(catpath, sizeof(catpath), "%s/catalog", testbed);
+    cat = fopen(catpath, "w");
+    if (cat == NULL) {
+        fprintf(stderr, "Cannot create %s: %s\n", catpath, strerror(errno));
+        exit(1);
+    }
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CAT_MAGIC, 8);
+    head.n_vsns = n_vsns;
+    head.rec_size = sizeof(CatRec);
+    fwrite(&head, sizeof(head), 1, cat);
+    fwrite(vsns, sizeof(CatVsn), n_vsns, cat);
+
+    for (i = 0; i < n_files; i++) {
+        if (i % per_dir == 0) {
+            snprintf(path, sizeof(path), "%s/%s/d%06llu", fsroot, coll, i / per_dir);
+            mkdirs(path);
+        }
+        snprintf(name, sizeof(name), "%s/d%06llu/f%08llu", coll, i / per_dir, i);
+        path_fits(snprintf(path, sizeof(path), "%s/%s", fsroot, name), sizeof(path), path);
+        if (mean == 0 || frnd() < empty)
+            size = 0;
+        else {
+            size = (uint64_t)(-mean * log(1 - frnd()));
+            if (size >= MAX_SIZE)
+                size = MAX_SIZE - 1;
+        }
+
+        fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, size) < 0 || fstat(fd, &st) < 0) {
+            fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+
+        memset(&r, 0, sizeof(r));
+        r.ino = st.st_ino;
+        r.vsn[0] = r.vsn[1] = r.vsn[2] = -1;
+        path_fits(snprintf(tarname, sizeof(tarname), "%s%s", name, frnd() < renamed ? ".orig" : ""),
+                  sizeof(tarname), tarname);
+        begin_member(&r, tarname, NULL, '0', size);
+        write_contents(seed ^ (i * 0xD1B54A32D192ED03ULL), size, r.csum);
+        r.cs_nchars = 16;
+        if (frnd() < nocsum)
+            r.cs_nchars = 0;
+        else if (frnd() < bad)
+            r.csum[0] ^= 0xff;
+        fwrite(&r, sizeof(r), 1, cat);
+        n_recs++;
+
+        if (frnd() < links) {
+            snprintf(link, sizeof(link), "f%08llu", i);
+            snprintf(name, sizeof(name), "%s/d%06llu/l%08llu", coll, i / per_dir, i);
+            path_fits(snprintf(path, sizeof(path), "%s/%s", fsroot, name), sizeof(path), path);
+            if (symlink(link, path) < 0 || lstat(path, &st) < 0) {
+                fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+                exit(1);
+            }
+            memset(&r, 0, sizeof(r));
+            r.ino = st.st_ino;
+            r.vsn[0] = r.vsn[1] = r.vsn[2] = -1;
+            begin_member(&r, name, link, '2', 0);
+            fwrite(&r, sizeof(r), 1, cat);
+            n_recs++;
+            n_links++;
+        }
+        if ((i + 1) % 1000000 == 0)
+            fprintf(stderr, "mkbed: %llu files\n", i + 1);
+    }
+    for (i = 0; i < (unsigned long long)n_streams; i++)
+        close_archive(&streams[i]);
+    if (fclose(cat) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", catpath, strerror(errno));
+        exit(1);
+    }
+    sort_catalog(catpath, n_recs);
+
+    fprintf(stderr, "mkbed: %llu files and %llu links under %s/%s; %llu archive files, %.1f MB\n",
+            n_files, n_links, fsroot, coll, n_arcs, arc_bytes / 1048576.0);
+    return 0;
+}
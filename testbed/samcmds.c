@@ -0,0 +1,284 @@
+/*
+ * samcmds -- stand-ins for the VSM commands runfixity.sh and fixity_tape
+ * run, over a testbed made by mkbed. One program; it acts as the command
+ * it is run as (link it to each name):
+ *
+ * gcc -O2 -I include -o bin/samcmds samcmds.c catalog.c
+ * for c in archive_audit sfind sdu samfsdump request samcmd; do ln -s samcmds bin/$c; done
+ *
+ *   archive_audit [-c copy] [-v vsn] <path>
+ *       one line per archived file or link under path:
+ *         media vsn copy 0 0 hexpos.hexoffset size path
+ *       (offset in 512-byte blocks; only fields 1, 2, 6 and 7 are read)
+ *   sfind <path> [-type f|d|l] [-copy n] [-vsn vsn]
+ *   sdu -sk <path>           apparent size in KB
+ *   samfsdump -T -f /dev/null <path>
+ *                            the counts runfixity.sh reads, to stderr
+ *   request -m li -v vsn -p 0xpos <file>
+ *                            links file to the testbed's tape file
+ *                            $FIXITY_TESTBED/tape/<vsn>/<hexpos>
+ *   samcmd v [eq]            the tape VSNs, one per line
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include "catalog.h"
+
+Catalog cat;
+
+/* what the walk is for */
+enum {AUDIT, FIND, DU, DUMP} mode;
+int want_copy = -1;             /* 0-2; -1 any */
+const char *want_vsn;
+int want_type;                  /* 'f', 'd', 'l' or 0 */
+char cwd[PATH_MAX];
+
+unsigned long long n_files, n_dirs, n_links, n_csums, bytes;
+
+static int has_copy(const CatRec *r, int i)
+{
+    if (r == NULL || r->vsn[i] < 0)
+        return 0;
+    return want_vsn == NULL || strcmp(cat.vsns[r->vsn[i]].vsn, want_vsn) == 0;
+}
+
+static void audit(const char *path, const struct stat *st, const CatRec *r)
+{
+    int i;
+
+    for (i = 0; i < CAT_COPIES; i++) {
+        if ((want_copy >= 0 && i != want_copy) || !has_copy(r, i))
+            continue;
+        printf("%s %s %d 0 0 %" PRIx64 ".%" PRIx64 " %llu %s%s%s\n",
+               cat.vsns[r->vsn[i]].media, cat.vsns[r->vsn[i]].vsn, i + 1,
+               r->position[i], r->offset[i] / 512, (unsigned long long)st->st_size,
+               *path == '/' ? "" : cwd, *path == '/' ? "" : "/", path);
+    }
+}
+
+static int visit(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    const CatRec *r = NULL;
+    int type, i, any;
+
+    (void)ftw;
+    if (flag == FTW_NS || flag == FTW_DNR)
+        return 0;
+    type = S_ISDIR(st->st_mode) ? 'd' : S_ISLNK(st->st_mode) ? 'l' : 'f';
+    if (type != 'd')
+        r = cat_find(&cat, st->st_ino);
+
+    switch (mode) {
+        case AUDIT:
+            if (type != 'd')
+                audit(path, st, r);
+            break;
+        case FIND:
+            if (want_type && type != want_type)
+                break;
+            if (want_copy >= 0 || want_vsn != NULL) {
+                for (i = 0, any = 0; i < CAT_COPIES; i++)
+                    if ((want_copy < 0 || i == want_copy) && has_copy(r, i))
+                        any = 1;
+                if (!any)
+                    break;
+            }
+            printf("%s\n", path);
+            break;
+        case DU:
+            bytes += st->st_size;
+            break;
+        case DUMP:
+            if (type == 'd')
+                n_dirs++;
+            else if (type == 'l')
+                n_links++;
+            else
+                n_files++;
+            if (r != NULL && r->cs_nchars > 0)
+                n_csums++;
+            break;
+    }
+    return 0;
+}
+
+static void walk(const char *path)
+{
+    cat_open(&cat);
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+    if (nftw(path, visit, 64, FTW_PHYS) < 0) {
+        fprintf(stderr, "Cannot walk %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static int archive_audit(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:v:")) != -1) {
+        switch (opt) {
+            case 'c':
+                want_copy = atoi(optarg) - 1;
+                break;
+            case 'v':
+                want_vsn = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: archive_audit [-c copy] [-v vsn] <path>\n");
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: archive_audit [-c copy] [-v vsn] <path>\n");
+        return 1;
+    }
+    mode = AUDIT;
+    walk(argv[optind]);
+    return 0;
+}
+
+static int sfind(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: sfind <path> [-type f|d|l] [-copy n] [-vsn vsn]\n");
+        return 1;
+    }
+    for (i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-type") == 0)
+            want_type = argv[i+1][0];
+        else if (strcmp(argv[i], "-copy") == 0)
+            want_copy = atoi(argv[i+1]) - 1;
+        else if (strcmp(argv[i], "-vsn") == 0)
+            want_vsn = argv[i+1];
+        else {
+            fprintf(stderr, "sfind: %s is not supported in the testbed\n", argv[i]);
+            return 1;
+        }
+    }
+    mode = FIND;
+    walk(argv[1]);
+    return 0;
+}
+
+static int sdu(int argc, char **argv)
+{
+    if (argc != 3 || strcmp(argv[1], "-sk") != 0) {
+        fprintf(stderr, "Usage: sdu -sk <path>\n");
+        return 1;
+    }
+    mode = DU;
+    walk(argv[2]);
+    printf("%llu\t%s\n", (bytes + 1023) / 1024, argv[2]);
+    return 0;
+}
+
+static int samfsdump(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: samfsdump -T -f /dev/null <path>\n");
+        return 1;
+    }
+    mode = DUMP;
+    walk(argv[argc-1]);
+    fprintf(stderr, "Files:              %llu\n", n_files);
+    fprintf(stderr, "Directories:        %llu\n", n_dirs);
+    fprintf(stderr, "Symbolic links:     %llu\n", n_links);
+    fprintf(stderr, "Files w/checksums:  %llu\n", n_csums);
+    return 0;
+}
+
+static int request(int argc, char **argv)
+{
+    const char *vsn = NULL, *pos = NULL;
+    char tape[PATH_MAX];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:v:p:")) != -1) {
+        switch (opt) {
+            case 'm':
+                break;
+            case 'v':
+                vsn = optarg;
+                break;
+            case 'p':
+                pos = optarg;
+                break;
+            default:
+                vsn = NULL;
+                break;
+        }
+    }
+    if (vsn == NULL || pos == NULL || optind >= argc) {
+        fprintf(stderr, "Usage: request -m li -v vsn -p 0xpos <file>\n");
+        return 1;
+    }
+    snprintf(tape, sizeof(tape), "%s/tape/%s/%" PRIx64, cat_dir(), vsn, (uint64_t)strtoull(pos, NULL, 16));
+    if (access(tape, R_OK) < 0) {
+        fprintf(stderr, "request: no position %s on %s (%s)\n", pos, vsn, tape);
+        return 1;
+    }
+    unlink(argv[optind]);
+    if (symlink(tape, argv[optind]) < 0) {
+        fprintf(stderr, "request: cannot create %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int samcmd(int argc, char **argv)
+{
+    char dir[PATH_MAX];
+    struct dirent *d;
+    DIR *dp;
+    int slot = 0;
+
+    if (argc < 2 || strcmp(argv[1], "v") != 0) {
+        fprintf(stderr, "samcmd: only \"samcmd v\" is supported in the testbed\n");
+        return 1;
+    }
+    snprintf(dir, sizeof(dir), "%s/tape", cat_dir());
+    dp = opendir(dir);
+    if (dp == NULL)
+        return 0;
+    while ((d = readdir(dp)) != NULL)
+        if (d->d_name[0] != '.')
+            printf("%4d  --------  li  %s\n", slot++, d->d_name);
+    closedir(dp);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *cmd = basename(argv[0]);
+
+    if (strcmp(cmd, "archive_audit") == 0)
+        return archive_audit(argc, argv);
+    if (strcmp(cmd, "sfind") == 0)
+        return sfind(argc, argv);
+    if (strcmp(cmd, "sdu") == 0)
+        return sdu(argc, argv);
+    if (strcmp(cmd, "samfsdump") == 0)
+        return samfsdump(argc, argv);
+    if (strcmp(cmd, "request") == 0)
+        return request(argc, argv);
+    if (strcmp(cmd, "samcmd") == 0)
+        return samcmd(argc, argv);
+    fprintf(stderr, "samcmds: run as archive_audit, sfind, sdu, samfsdump, request or samcmd\n");
+    return 1;
+}
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Build the testbed and the fixity tools against it, and make a testbed.
+#
+# testbed/setup.sh <testbed-dir> <fsroot> [mkbed options]
+#
+# e.g. (as root, for /dkarcs and /sam9)
+#   testbed/setup.sh /var/tmp/bed /sam9 -n 100000 -c 1,2,3 -B 0.1 -L 1
+#   . /var/tmp/bed/env.sh
+#   runfixity.sh -p /sam9/coll -c 1
+#
+# <testbed-dir> gets bin/ (the tools, the stub commands, the runfixity
+# scripts), lib/ (libsam.so, libvsm.so and mediaemu.so), the catalog,
+# tape/, and env.sh, which sets FIXITY_TESTBED, FIXITY_BIN, PATH and
+# LD_LIBRARY_PATH for a run.
+# Set DKROOT first to keep the disk archives somewhere other than /dkarcs.
+#
+# The tools are built with system OpenSSL rather than boringssl. They
+# include /opt/vsm/include/lib.h by that path, so the stand-in is put there
+# if there is none.
+
+if [ $# -lt 2 ]
+    then echo "Usage: setup.sh <testbed-dir> <fsroot> [mkbed options]"
+    exit 1
+fi
+bed=$1
+fsroot=$2
+shift 2
+src=$(cd $(dirname $0)/.. && pwd)
+export FIXITY_TESTBED=$bed
+export DKROOT=${DKROOT:-/dkarcs}
+
+set -e
+mkdir -p $bed/bin $bed/lib
+if [ ! -f /opt/vsm/include/lib.h ]
+then
+    mkdir -p /opt/vsm/include
+    cp $src/testbed/include/lib.h /opt/vsm/include/lib.h
+fi
+
+cd $src/testbed
+gcc -shared -fPIC -O2 -I include -Wl,-soname,libsam.so -o $bed/lib/libsam.so libsam.c catalog.c -lpthread
+ln -sf libsam.so $bed/lib/libvsm.so
+gcc -shared -fPIC -O2 -o $bed/lib/mediaemu.so mediaemu.c -ldl -lpthread -lrt
+gcc -O2 -I include -o $bed/bin/samcmds samcmds.c catalog.c
+for c in archive_audit sfind sdu samfsdump request samcmd
+do
+    ln -sf samcmds $bed/bin/$c
+done
+gcc -O2 -I include -o $bed/bin/mkbed mkbed.c catalog.c -lm -lcrypto
+
+cd $src
+CF="-O2 -D_GNU_SOURCE -I $src/testbed/include -include openssl/err.h"
+LF="-L $bed/lib -lsam -lvsm"
+gcc $CF -o $bed/bin/print_csum_dk_from_sls print_csum_from_sls.c outfmt.c -lpthread $LF
+ln -sf print_csum_dk_from_sls $bed/bin/print_csum_li_from_sls
+gcc $CF -o $bed/bin/print_offset_cksum_from_tar print_offset_cksum_from_tar.c outfmt.c fixity_table.c ledger.c iogov.c cpuplace.c iolat.c blake3.c -lm -lpthread -lrt -lssl -lcrypto
+gcc $CF -o $bed/bin/fixity_plan fixity_plan.c ledger.c $LF
+gcc $CF -o $bed/bin/fixity_compare fixity_compare.c fixity_table.c ledger.c outfmt.c
+gcc $CF -o $bed/bin/fixity_sched fixity_sched.c
+gcc $CF -o $bed/bin/fixity_ledger fixity_ledger.c ledger.c
+gcc $CF -o $bed/bin/fixity_tape fixity_tape.c fixity_table.c ledger.c outfmt.c iogov.c iolat.c -lpthread -lrt
+# getbaginfo needs boringssl, built in getbaginfo.src/boringssl (boringssl.txt)
+if [ -d getbaginfo.src/boringssl/include ]
+then
+    (cd getbaginfo.src && gcc $CF -o $bed/bin/getbaginfo getbaginfo.c argparsing.c spill.c fprint.c ../outfmt.c ../iogov.c ../cpuplace.c ../trace.c ../iolat.c ../blake3.c -I ./boringssl/include -L ./boringssl/build/crypto -L ./boringssl/build/ssl -lm -lpthread -lrt -lssl -lcrypto $LF)
+else
+    echo "No getbaginfo.src/boringssl: getbaginfo not built"
+fi
+cp runfixity.sh runfixity_vsn.sh runfixity_rolling.sh $bed/bin/
+
+cat > $bed/env.sh <<EOF
+export FIXITY_TESTBED=$bed
+export FIXITY_BIN=$bed/bin
+export DKROOT=$DKROOT
+export DKPATH=$DKROOT
+export PATH=$bed/bin:\$PATH
+export LD_LIBRARY_PATH=$bed/lib\${LD_LIBRARY_PATH:+:\$LD_LIBRARY_PATH}
+EOF
+
+$bed/bin/mkbed "$@" $fsroot
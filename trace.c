@@ -0,0 +1,146 @@
+/*
+ * trace -- per-thread span rings and their dump. See trace.h.
+ */
+
+#ifdef FIXITY_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#define TRACE_RING 65536    /* spans kept per thread */
+
+typedef struct
+{
+    const char *name;
+    unsigned long long ts, dur;
+} Span;
+
+typedef struct Ring
+{
+    struct Ring *next;
+    long tid;
+    char name[32];
+    unsigned long long n;   /* spans recorded; the ring has the last TRACE_RING */
+    Span span[TRACE_RING];
+} Ring;
+
+static int on;
+static const char *path;
+static unsigned long long start;
+static Ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Ring *mine;
+
+static unsigned long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The calling thread's ring, made on its first span. */
+static Ring *ring(void)
+{
+    Ring *r = mine;
+
+    if (r != NULL)
+        return r;
+    r = calloc(1, sizeof(Ring));
+    if (r == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    r->tid = syscall(SYS_gettid);
+    snprintf(r->name, sizeof(r->name), "thread %ld", r->tid);
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    mine = r;
+    return r;
+}
+
+void trace_init(void)
+{
+    path = getenv("FIXITY_TRACE");
+    if (path == NULL || *path == '\0')
+        return;
+    start = now();
+    on = 1;
+    trace_thread("main", -1);
+}
+
+void trace_thread(const char *role, int i)
+{
+    if (!on)
+        return;
+    if (i < 0)
+        snprintf(ring()->name, sizeof(mine->name), "%s", role);
+    else
+        snprintf(ring()->name, sizeof(mine->name), "%s %d", role, i);
+}
+
+unsigned long long trace_begin(void)
+{
+    return on ? now() : 0;
+}
+
+void trace_end(const char *name, unsigned long long t0)
+{
+    Ring *r;
+    Span *s;
+
+    if (t0 == 0)
+        return;
+    r = ring();
+    s = &r->span[r->n % TRACE_RING];
+    s->name = name;
+    s->ts = t0;
+    s->dur = now() - t0;
+    r->n++;
+}
+
+void trace_dump(void)
+{
+    unsigned long long i, first, lost = 0;
+    int pid = getpid(), sep = 0;
+    Ring *r;
+    Span *s;
+    FILE *f;
+
+    if (!on)
+        return;
+    f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write trace %s\n", path);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+                sep++ ? ",\n" : "", pid, r->tid, r->name);
+        first = (r->n > TRACE_RING) ? r->n - TRACE_RING : 0;
+        lost += first;
+        for (i = first; i < r->n; i++) {
+            s = &r->span[i % TRACE_RING];
+            // microseconds, as the format has it
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+                    s->name, pid, r->tid, (s->ts - start) / 1e3, s->dur / 1e3);
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    if (lost > 0)
+        fprintf(stderr, "trace: %llu early spans were overwritten (%d kept per thread)\n", lost, TRACE_RING);
+}
+
+#endif
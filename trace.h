@@ -0,0 +1,55 @@
+/*
+ * trace -- spans of where the time goes, for chrome://tracing or Perfetto.
+ *
+ * Built in only with -DFIXITY_TRACE; without it the TRACE_* macros are
+ * empty and trace.c compiles to nothing. Built in, it is still off unless
+ * $FIXITY_TRACE names the file to write, e.g.
+ *   FIXITY_TRACE=/tmp/gbi.json ./getbaginfo -m bag -t 4 <archive>
+ * Each thread records its spans into its own ring buffer (the last
+ * TRACE_RING of them; no locks and no allocation after its first span),
+ * and trace_dump() writes them all as Chrome trace JSON at the end.
+ *
+ *   TRACE_BEGIN(t);
+ *   ...
+ *   TRACE_END(t, "pread");
+ *
+ * Span names must be string literals (only the pointer is kept).
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef FIXITY_TRACE
+
+/* Turn tracing on if $FIXITY_TRACE is set. */
+void trace_init(void);
+
+/* Name the calling thread in the trace ("md_calc", 3 -> "md_calc 3"; no
+ * number if i < 0). */
+void trace_thread(const char *role, int i);
+
+/* Now, in ns; 0 when tracing is off. */
+unsigned long long trace_begin(void);
+
+/* Record the span name from t0 to now on the calling thread. */
+void trace_end(const char *name, unsigned long long t0);
+
+/* Write the trace file. Call once the other threads are done. */
+void trace_dump(void);
+
+#define TRACE_INIT() trace_init()
+#define TRACE_THREAD(role, i) trace_thread(role, i)
+#define TRACE_BEGIN(t) unsigned long long t = trace_begin()
+#define TRACE_END(t, name) trace_end(name, t)
+#define TRACE_DUMP() trace_dump()
+
+#else
+
+#define TRACE_INIT()
+#define TRACE_THREAD(role, i)
+#define TRACE_BEGIN(t)
+#define TRACE_END(t, name)
+#define TRACE_DUMP()
+
+#endif
+
+#endif